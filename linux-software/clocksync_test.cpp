@@ -0,0 +1,166 @@
+//-----------------------------------------------------------------------------------------------
+// clocksync_test.cpp -- checks dipswitch::ClockSync against synthetic reports
+//
+// usage: clocksync_test [runs [seed]]
+//
+// Plays a stick whose frame clock runs SKEW_PPM fast against CLOCK_MONOTONIC, starting at an
+// arbitrary frame number, with changes a few hundred ms apart and now and then an idle gap
+// several times the 2.048 s range of the 11-bit frame number. Each report reaches read()
+// after a fixed shortest path plus random jitter, and one in twenty is held up as if it had
+// waited in a queue, along with any report behind it. Once the fit has seen SKEW_SPAN_MS and
+// a full window of reports, SkewPpm() must stay within SKEW_TOLERANCE_PPM of the real skew
+// and ChangeTime() must put every change at its frame's start plus one constant offset, to
+// within OFFSET_TOLERANCE_MS. Each run has its own seed. Needs no stick.
+//
+
+//-----------------------------------------------------------------------------------------------
+// includes
+//
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "dipswitch.h"
+
+
+//-----------------------------------------------------------------------------------------------
+// defines
+//
+
+#define DEFAULT_RUNS            20
+#define DEFAULT_SEED            1
+#define CHANGES                 2000
+
+#define SKEW_PPM                120.0
+#define START_FRAME             1500
+#define PATH_MS                 0.4         // shortest path from the stick to read()
+#define JITTER_MS               0.3         // mean of the exponential jitter on top
+#define HELD_MS                 20.0        // extra wait of a held-up report
+#define HELD_ONE_IN             20
+#define MIN_GAP_MS              20.0
+#define MAX_GAP_MS              400.0
+#define IDLE_ONE_IN             100         // changes followed by an idle gap
+#define IDLE_MS                 7000.0
+
+#define SKEW_TOLERANCE_PPM      25.0
+#define OFFSET_TOLERANCE_MS     0.3
+
+
+//-----------------------------------------------------------------------------------------------
+// functions
+//
+
+static timespec At (double ms)
+{
+    timespec t;
+    double s = std::floor (ms / 1000.0);
+
+    t.tv_sec = (time_t)s;
+    t.tv_nsec = (long)((ms - s * 1000.0) * 1e6);
+    return t;
+}
+
+
+static double Ms (const timespec &t)
+{
+    return t.tv_sec * 1000.0 + t.tv_nsec / 1e6;
+}
+
+
+// one run of CHANGES changes, true if it passed
+static bool Run (unsigned seed)
+{
+    std::mt19937 random (seed);
+    std::uniform_real_distribution<double> uniform (0.0, 1.0);
+    std::exponential_distribution<double> jitter (1.0 / JITTER_MS);
+
+    const double frameMs = 1.0 / (1.0 + SKEW_PPM * 1e-6);
+    const double originMs = 12345678.0;     // CLOCK_MONOTONIC of the first frame start
+
+    dipswitch::ClockSync sync;
+    std::vector<double> errors;
+    double changeMs = 0.0, lastReadMs = 0.0, firstMs = -1.0, offset, worst = 0.0, skew = 0.0;
+    int used = 0, failed = 0;
+
+    for (int i = 0; i < CHANGES; i++) {
+        changeMs += MIN_GAP_MS + uniform (random) * (MAX_GAP_MS - MIN_GAP_MS);
+        if (i % IDLE_ONE_IN == IDLE_ONE_IN - 1) {
+            changeMs += IDLE_MS;
+        }
+
+        // the change is debounced in some frame; the report goes out after that frame's SOF
+        int64_t frame = (int64_t)(changeMs / frameMs);
+        double frameStartMs = originMs + frame * frameMs;
+        double readMs = frameStartMs + PATH_MS + jitter (random);
+        if ((int)(uniform (random) * HELD_ONE_IN) == 0) {
+            readMs += HELD_MS * uniform (random);
+        }
+        // reports come out of the stick's queue in order
+        readMs = std::max (readMs, lastReadMs);
+        lastReadMs = readMs;
+
+        dipswitch::SwitchReport report = {};
+        report.switches = (uint8_t)i;
+        report.sequence = (uint8_t)i;
+        report.frame = (uint16_t)((START_FRAME + frame) % dipswitch::FRAME_NUMBERS);
+        report.received = At (readMs);
+
+        if (!sync.Feed (report)) {
+            failed++;
+            continue;
+        }
+        if (firstMs < 0.0) {
+            firstMs = frameStartMs;
+        }
+
+        // judge the fit once it has had SKEW_SPAN_MS and a full window of samples
+        timespec when;
+        if (frameStartMs - firstMs < dipswitch::ClockSync::SKEW_SPAN_MS ||
+                used++ < dipswitch::ClockSync::SAMPLES) {
+            continue;
+        }
+        if (!sync.ChangeTime (report, when)) {
+            failed++;
+            continue;
+        }
+        errors.push_back (Ms (when) - frameStartMs);
+        skew = std::max (skew, std::fabs (sync.SkewPpm () - SKEW_PPM));
+    }
+
+    if (errors.empty ()) {
+        printf ("seed %u: no change was mapped\n", seed);
+        return false;
+    }
+
+    std::vector<double> sorted (errors);
+    std::sort (sorted.begin (), sorted.end ());
+    offset = sorted[sorted.size () / 2];
+    for (double error : errors) {
+        worst = std::max (worst, std::fabs (error - offset));
+    }
+
+    printf ("seed %u: %d changes, %zu mapped: offset %.3f ms, worst %.3f ms from it, skew "
+            "%.1f ppm off by up to %.2f ppm, %d not taken\n", seed, CHANGES, errors.size (),
+            offset, worst, sync.SkewPpm (), skew, failed);
+
+    return !failed && worst <= OFFSET_TOLERANCE_MS && skew <= SKEW_TOLERANCE_PPM;
+}
+
+
+int main (int argc, char *argv[])
+{
+    unsigned runs = (argc > 1) ? strtoul (argv[1], NULL, 0) : DEFAULT_RUNS;
+    unsigned seed = (argc > 2) ? strtoul (argv[2], NULL, 0) : DEFAULT_SEED;
+    unsigned i, failures = 0;
+
+    for (i = 0; i < runs; i++) {
+        failures += !Run (seed + i);
+    }
+
+    printf ("%s\n", failures ? "FAIL" : "PASS");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,386 @@
+//-----------------------------------------------------------------------------------------------
+// dipswitch-evbench.cpp -- evdev against hidraw wakeup latency
+//
+// usage: dipswitch-evbench [-n reports] [-r rate]
+//
+// Creates a virtual stick through /dev/uhid with the SWITCH_DESCRIPTOR_EVDEV report
+// descriptor, so the kernel gives it both a hidraw node and, through hid-input, an evdev
+// node. One thread blocks in read() on each. The main thread then sends report ID 1 changes
+// and takes CLOCK_MONOTONIC right before each write to /dev/uhid; every reader takes it
+// again when read() returns. Prints min/p50/p99/max per path:
+//
+//   hidraw wakeup      report written until the hidraw reader has it
+//   evdev wakeup       report written until the evdev reader has the SYN_REPORT after the
+//                      switch keys, i.e. the whole change as one event frame
+//   evdev timestamp    report written until the kernel's input_event time (EVIOCSCLOCKID
+//                      CLOCK_MONOTONIC), the in-kernel part of the evdev path
+//
+// The two readers compete for the CPU, run it on an otherwise idle machine and pin it with
+// taskset to compare like with like. Needs read/write access to /dev/uhid and the new
+// /dev/input/eventN node (usually root).
+//
+//   -n reports  changes to send, default 10000
+//   -r rate     changes per second, default 500
+//
+
+//-----------------------------------------------------------------------------------------------
+// includes
+//
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <linux/input.h>
+#include <linux/uhid.h>
+
+#include "dipswitch.h"
+
+
+//-----------------------------------------------------------------------------------------------
+// defines
+//
+
+#define UHID_PATH "/dev/uhid"
+
+// how long to wait for udev to create the hidraw and evdev nodes, and for late reports
+#define SETTLE_MS 2000
+#define DRAIN_MS  200
+
+
+//-----------------------------------------------------------------------------------------------
+// globals
+//
+
+// hid_rpt01 with SWITCH_DESCRIPTOR_EVDEV, generated from usb_descriptors.c by the Makefile
+static const uint8_t reportDescriptor[] = {
+#include "hid_rpt01_evdev.inc"
+};
+
+static std::atomic<bool> stop;
+
+// per report, indexed by the order the reports were sent
+static std::vector<int64_t> sentNs;
+static std::vector<int64_t> hidrawNs;
+static std::vector<int64_t> evdevNs;
+static std::vector<int64_t> evdevKernelNs;
+
+
+//-----------------------------------------------------------------------------------------------
+// functions
+//
+
+static void Usage (void)
+{
+    fprintf (stderr, "usage: dipswitch-evbench [-n reports] [-r rate]\n");
+}
+
+
+static std::system_error SystemError (const std::string &what)
+{
+    return std::system_error (errno, std::generic_category (), what);
+}
+
+
+static int64_t NowNs (void)
+{
+    timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+
+static void WriteEvent (int fd, const uhid_event &event)
+{
+    if (write (fd, &event, sizeof (event)) != (ssize_t)sizeof (event)) {
+        throw SystemError ("write " UHID_PATH);
+    }
+}
+
+
+static void Create (int fd)
+{
+    uhid_event event;
+
+    memset (&event, 0, sizeof (event));
+    event.type = UHID_CREATE2;
+    strncpy ((char *)event.u.create2.name, "bikerglen.com DIP Switch USB Stick (evbench)",
+             sizeof (event.u.create2.name) - 1);
+    strncpy ((char *)event.u.create2.phys, "dipswitch-evbench", sizeof (event.u.create2.phys) - 1);
+    strncpy ((char *)event.u.create2.uniq, "0000-0000-0003", sizeof (event.u.create2.uniq) - 1);
+    event.u.create2.rd_size = sizeof (reportDescriptor);
+    event.u.create2.bus = BUS_USB;
+    event.u.create2.vendor = dipswitch::VENDOR_ID;
+    event.u.create2.product = dipswitch::PRODUCT_ID;
+    memcpy (event.u.create2.rd_data, reportDescriptor, sizeof (reportDescriptor));
+
+    WriteEvent (fd, event);
+}
+
+
+// handle whatever the kernel sent; GET_REPORT and SET_REPORT fail at once so nothing waits
+// on them. Returns true once the device has been started
+static bool HandleEvents (int fd)
+{
+    uhid_event event, reply;
+    bool started = false;
+
+    while (read (fd, &event, sizeof (event)) > 0) {
+        memset (&reply, 0, sizeof (reply));
+        if (event.type == UHID_START) {
+            started = true;
+        } else if (event.type == UHID_GET_REPORT) {
+            reply.type = UHID_GET_REPORT_REPLY;
+            reply.u.get_report_reply.id = event.u.get_report.id;
+            reply.u.get_report_reply.err = EIO;
+            WriteEvent (fd, reply);
+        } else if (event.type == UHID_SET_REPORT) {
+            reply.type = UHID_SET_REPORT_REPLY;
+            reply.u.set_report_reply.id = event.u.set_report.id;
+            reply.u.set_report_reply.err = EIO;
+            WriteEvent (fd, reply);
+        }
+    }
+
+    return started;
+}
+
+
+static void SendSwitches (int fd, uint8_t switches, uint8_t sequence)
+{
+    uhid_event event;
+    uint64_t ms = NowNs () / 1000000;
+
+    memset (&event, 0, sizeof (event));
+    event.type = UHID_INPUT2;
+    event.u.input2.size = dipswitch::SWITCH_REPORT_SIZE;
+    event.u.input2.data[0] = dipswitch::REPORT_ID_SWITCHES;
+    event.u.input2.data[1] = switches;
+    event.u.input2.data[2] = (uint8_t)ms;
+    event.u.input2.data[3] = (uint8_t)(ms >> 8);
+    event.u.input2.data[4] = sequence;
+    event.u.input2.data[5] = (uint8_t)ms;
+    event.u.input2.data[6] = (uint8_t)(ms >> 8) & 0x07;
+
+    WriteEvent (fd, event);
+}
+
+
+// true once fd is readable, false after timeoutMs or on stop
+static bool WaitReadable (int fd, int timeoutMs)
+{
+    pollfd pfd = { fd, POLLIN, 0 };
+    return poll (&pfd, 1, timeoutMs) > 0 && (pfd.revents & POLLIN);
+}
+
+
+// the report's sequence number says which one it is
+static void HidrawReader (int fd)
+{
+    uint8_t report[dipswitch::MAX_REPORT_SIZE];
+    uint32_t n = 0;
+    ssize_t length;
+
+    while (!stop) {
+        if (!WaitReadable (fd, 10)) {
+            continue;
+        }
+        length = read (fd, report, sizeof (report));
+        if (length == (ssize_t)dipswitch::SWITCH_REPORT_SIZE && report[0] == dipswitch::REPORT_ID_SWITCHES) {
+            // sequence numbers wrap at 256, the reports arrive in order
+            while ((uint8_t)n != report[4]) {
+                n++;
+            }
+            if (n < hidrawNs.size ()) {
+                hidrawNs[n] = NowNs ();
+            }
+            n++;
+        }
+    }
+}
+
+
+// every change toggles at least one switch, so each report ends in exactly one SYN_REPORT
+static void EvdevReader (int fd)
+{
+    input_event events[64];
+    uint32_t n = 0;
+    ssize_t length;
+    size_t i;
+    bool keys = false;
+
+    while (!stop) {
+        if (!WaitReadable (fd, 10)) {
+            continue;
+        }
+        length = read (fd, events, sizeof (events));
+        for (i = 0; length > 0 && i < length / sizeof (input_event); i++) {
+            if (events[i].type == EV_KEY) {
+                keys = true;
+            } else if (events[i].type == EV_SYN && events[i].code == SYN_REPORT && keys) {
+                keys = false;
+                if (n < evdevNs.size ()) {
+                    evdevNs[n] = NowNs ();
+                    evdevKernelNs[n] = (int64_t)events[i].input_event_sec * 1000000000 +
+                                       (int64_t)events[i].input_event_usec * 1000;
+                }
+                n++;
+            }
+        }
+    }
+}
+
+
+static void PrintStats (const char *name, const std::vector<int64_t> &times)
+{
+    std::vector<double> us;
+    size_t i;
+
+    for (i = 0; i < times.size (); i++) {
+        if (times[i]) {
+            us.push_back ((times[i] - sentNs[i]) / 1000.0);
+        }
+    }
+    if (us.empty ()) {
+        printf ("%-18s no reports\n", name);
+        return;
+    }
+    std::sort (us.begin (), us.end ());
+    printf ("%-18s %8zu %9.1f %9.1f %9.1f %9.1f\n", name, us.size (), us.front (),
+            us[us.size () / 2], us[us.size () * 99 / 100], us.back ());
+}
+
+
+int main (int argc, char *argv[])
+{
+    unsigned long reports = 10000;
+    double rate = 500.0;
+    std::vector<std::string> before, after;
+    std::string hidrawPath, eventPath;
+    timespec next;
+    int64_t periodNs, start;
+    int uhidFd, hidrawFd, eventFd, clockId = CLOCK_MONOTONIC;
+    unsigned long i;
+    uint8_t switches = 0;
+    int opt;
+
+    while ((opt = getopt (argc, argv, "n:r:")) != -1) {
+        switch (opt) {
+        case 'n':
+            reports = strtoul (optarg, nullptr, 0);
+            break;
+        case 'r':
+            rate = strtod (optarg, nullptr);
+            break;
+        default:
+            Usage ();
+            return 1;
+        }
+    }
+    if (reports == 0 || rate <= 0.0 || argc > optind) {
+        Usage ();
+        return 1;
+    }
+
+    try {
+        before = dipswitch::FindDevices ();
+        uhidFd = open (UHID_PATH, O_RDWR | O_CLOEXEC | O_NONBLOCK);
+        if (uhidFd < 0) {
+            throw SystemError ("open " UHID_PATH);
+        }
+        Create (uhidFd);
+
+        // the new hidraw node is the one that was not there before, hid-input adds the evdev
+        // node next to it
+        start = NowNs ();
+        while (eventPath.empty () && NowNs () - start < SETTLE_MS * 1000000LL) {
+            HandleEvents (uhidFd);
+            after = dipswitch::FindDevices ();
+            for (const std::string &node : after) {
+                if (std::find (before.begin (), before.end (), node) == before.end ()) {
+                    hidrawPath = node;
+                }
+            }
+            if (!hidrawPath.empty ()) {
+                eventPath = dipswitch::FindEventDevice (hidrawPath);
+            }
+            usleep (10000);
+        }
+        if (eventPath.empty ()) {
+            fprintf (stderr, "dipswitch-evbench: no %s node for the virtual stick\n",
+                     hidrawPath.empty () ? "hidraw" : "evdev");
+            return 1;
+        }
+        // let udev finish with the new nodes' permissions
+        usleep (DRAIN_MS * 1000);
+
+        hidrawFd = open (hidrawPath.c_str (), O_RDONLY | O_CLOEXEC);
+        if (hidrawFd < 0) {
+            throw SystemError ("open " + hidrawPath);
+        }
+        eventFd = open (eventPath.c_str (), O_RDONLY | O_CLOEXEC);
+        if (eventFd < 0) {
+            throw SystemError ("open " + eventPath);
+        }
+        if (ioctl (eventFd, EVIOCSCLOCKID, &clockId) < 0) {
+            throw SystemError ("EVIOCSCLOCKID");
+        }
+        HandleEvents (uhidFd);
+
+        sentNs.assign (reports, 0);
+        hidrawNs.assign (reports, 0);
+        evdevNs.assign (reports, 0);
+        evdevKernelNs.assign (reports, 0);
+        std::thread hidrawThread (HidrawReader, hidrawFd);
+        std::thread evdevThread (EvdevReader, eventFd);
+
+        // changes on an absolute schedule, one switch at a time
+        periodNs = (int64_t)(1e9 / rate);
+        clock_gettime (CLOCK_MONOTONIC, &next);
+        for (i = 0; i < reports; i++) {
+            next.tv_nsec += periodNs;
+            while (next.tv_nsec >= 1000000000) {
+                next.tv_nsec -= 1000000000;
+                next.tv_sec++;
+            }
+            clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &next, nullptr);
+
+            switches ^= 0x80 >> (i & 7);
+            sentNs[i] = NowNs ();
+            SendSwitches (uhidFd, switches, (uint8_t)i);
+            HandleEvents (uhidFd);
+        }
+
+        usleep (DRAIN_MS * 1000);
+        stop = true;
+        hidrawThread.join ();
+        evdevThread.join ();
+
+        printf ("%lu changes at %g/s through %s and %s\n\n", reports, rate, hidrawPath.c_str (),
+                eventPath.c_str ());
+        printf ("%-18s %8s %9s %9s %9s %9s\n", "us from write", "reports", "min", "p50", "p99", "max");
+        PrintStats ("hidraw wakeup", hidrawNs);
+        PrintStats ("evdev wakeup", evdevNs);
+        PrintStats ("evdev timestamp", evdevKernelNs);
+
+        close (eventFd);
+        close (hidrawFd);
+        close (uhidFd);
+    } catch (const std::system_error &e) {
+        fprintf (stderr, "dipswitch-evbench: %s\n", e.what ());
+        return 1;
+    }
+
+    return 0;
+}
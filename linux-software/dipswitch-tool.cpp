@@ -0,0 +1,400 @@
+//-----------------------------------------------------------------------------------------------
+// dipswitch-tool.cpp -- command line front end to libdipswitch
+//
+// usage: dipswitch list
+//        dipswitch read [/dev/hidrawN]
+//        dipswitch watch [/dev/hidrawN]
+//        dipswitch isr [/dev/hidrawN]
+//        dipswitch loop [/dev/hidrawN]
+//        dipswitch settings [/dev/hidrawN]
+//        dipswitch sample us samples [/dev/hidrawN]
+//        dipswitch bounce [/dev/hidrawN]
+//        dipswitch shm
+//
+// read prints the current switch byte (bit 7 = SW1), or all of them on a stick with an
+// expansion chain, and exits, watch prints every report as it arrives, with the change's time
+// on CLOCK_MONOTONIC from its frame number once dipswitch::ClockSync has a sample. isr reads
+// the stick's interrupt accounting twice, a second apart, and prints the rate, mean and worst
+// case of each source in between; loop does the same for the main loop timing, overruns, lost
+// ticks and both histograms. settings prints what the stick is set to, the settle window and
+// on current firmware the sampling tick and debounce depth. sample sets both in one flash
+// write, kept over a power cycle, and prints the settings back; samples 0 is adaptive
+// debounce. bounce prints the bounce histogram since power on and each switch's learned
+// bounce and debounce depth. Without a device node the first stick found in sysfs is used.
+// shm prints the state dipswitchd publishes without touching the device.
+//
+
+//-----------------------------------------------------------------------------------------------
+// includes
+//
+
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <system_error>
+
+#include <unistd.h>
+
+#include "dipswitch.h"
+#include "shared_state.h"
+
+
+//-----------------------------------------------------------------------------------------------
+// globals
+//
+
+static dipswitch::Monitor *activeMonitor;
+
+
+//-----------------------------------------------------------------------------------------------
+// functions
+//
+
+static void Usage (void)
+{
+    fprintf (stderr, "usage: dipswitch list\n"
+                     "       dipswitch read [/dev/hidrawN]\n"
+                     "       dipswitch watch [/dev/hidrawN]\n"
+                     "       dipswitch isr [/dev/hidrawN]\n"
+                     "       dipswitch loop [/dev/hidrawN]\n"
+                     "       dipswitch settings [/dev/hidrawN]\n"
+                     "       dipswitch sample us samples [/dev/hidrawN]\n"
+                     "       dipswitch bounce [/dev/hidrawN]\n"
+                     "       dipswitch shm\n");
+}
+
+
+static void StopMonitor (int signal)
+{
+    if (activeMonitor) {
+        activeMonitor->Stop ();
+    }
+}
+
+
+// the device node at argv[arg] if given, else the first stick found
+static std::string PickDevice (int argc, char *argv[], int arg)
+{
+    std::vector<std::string> devices;
+
+    if (argc > arg) {
+        return argv[arg];
+    }
+    devices = dipswitch::FindDevices ();
+    return devices.empty () ? std::string () : devices[0];
+}
+
+
+// the switch bytes in hex, then each byte's switches from its bit 7
+static void PrintSwitches (const uint8_t *bytes, int width)
+{
+    int b, i;
+
+    for (b = 0; b < width; b++) {
+        printf ("%02X", bytes[b]);
+    }
+    for (b = 0; b < width; b++) {
+        putchar (' ');
+        for (i = 0; i < 8; i++) {
+            putchar ((bytes[b] & (0x80 >> i)) ? '1' : '0');
+        }
+    }
+    putchar ('\n');
+}
+
+
+static int List (void)
+{
+    for (const std::string &device : dipswitch::FindDevices ()) {
+        printf ("%s\n", device.c_str ());
+    }
+    return 0;
+}
+
+
+static int Shm (void)
+{
+    dipswitch::SharedStateReader reader;
+    dipswitch::SharedSnapshot state = reader.Read ();
+
+    if (!state.connected) {
+        fprintf (stderr, "dipswitch: dipswitchd has no stick\n");
+        return 1;
+    }
+    printf ("seq %llu at %ld.%06ld: ", (unsigned long long)state.sequence,
+            (long)state.updated.tv_sec, state.updated.tv_nsec / 1000);
+    PrintSwitches (state.bytes, state.width);
+    return 0;
+}
+
+
+static int Read (const std::string &path)
+{
+    dipswitch::Device device (path);
+    dipswitch::SwitchReport report;
+
+    if (!device.Query (report)) {
+        fprintf (stderr, "dipswitch: no answer from %s\n", path.c_str ());
+        return 1;
+    }
+    PrintSwitches (report.bytes, report.width);
+    return 0;
+}
+
+
+static void PrintIsrSource (const char *name, const dipswitch::IsrSourceStats &before,
+                            const dipswitch::IsrSourceStats &after)
+{
+    uint32_t count = after.count - before.count;
+    double mean = count ? (double)(after.cycles - before.cycles) / count : 0.0;
+
+    printf ("%-14s %8u/s  mean %7.1f cycles %7.2f us  max %5u cycles %7.2f us\n", name, count,
+            mean, mean * dipswitch::CYCLE_NS / 1000.0, after.maxCycles,
+            after.maxCycles * dipswitch::CYCLE_NS / 1000.0);
+}
+
+
+static int Isr (const std::string &path)
+{
+    dipswitch::Device device (path);
+    dipswitch::IsrStats before, after;
+
+    // the first read also clears the maxima, so the second shows the worst case over the second
+    if (!device.GetIsrStats (before)) {
+        fprintf (stderr, "dipswitch: %s has no interrupt accounting\n", path.c_str ());
+        return 1;
+    }
+    sleep (1);
+    if (!device.GetIsrStats (after)) {
+        fprintf (stderr, "dipswitch: no answer from %s\n", path.c_str ());
+        return 1;
+    }
+
+    PrintIsrSource ("usb", before.usb, after.usb);
+    PrintIsrSource ("usb, tick only", before.usbIdle, after.usbIdle);
+    PrintIsrSource ("tick handler", before.tick, after.tick);
+    PrintIsrSource ("tick latency", before.tickLatency, after.tickLatency);
+    return 0;
+}
+
+
+static void PrintLoopHistogram (const char *name, const uint16_t *before, const uint16_t *after,
+                                uint16_t max)
+{
+    int i;
+
+    printf ("%-8s", name);
+    for (i = 0; i < dipswitch::LOOP_HIST_BINS; i++) {
+        printf (" %7u", (uint16_t)(after[i] - before[i]));
+    }
+    printf ("   max %5u cycles %7.2f us\n", max, max * dipswitch::CYCLE_NS / 1000.0);
+}
+
+
+static int Loop (const std::string &path)
+{
+    dipswitch::Device device (path);
+    dipswitch::LoopStats before, after;
+    char label[16];
+    int i;
+
+    if (!device.GetLoopStats (before)) {
+        fprintf (stderr, "dipswitch: %s has no main loop timing\n", path.c_str ());
+        return 1;
+    }
+    sleep (1);
+    if (!device.GetLoopStats (after)) {
+        fprintf (stderr, "dipswitch: no answer from %s\n", path.c_str ());
+        return 1;
+    }
+
+    printf ("overruns %u  lost ticks %u\n\n", (uint16_t)(after.overruns - before.overruns),
+            (uint16_t)(after.lostTicks - before.lostTicks));
+    printf ("%-8s", "us");
+    for (i = 0; i < dipswitch::LOOP_HIST_BINS; i++) {
+        snprintf (label, sizeof (label), "%s%.0f", (i < dipswitch::LOOP_HIST_BINS - 1) ? "<" : ">=",
+                  ((1 << dipswitch::LOOP_HIST_SHIFT) << (i < dipswitch::LOOP_HIST_BINS - 1 ? i : i - 1)) *
+                  dipswitch::CYCLE_NS / 1000.0);
+        printf (" %7s", label);
+    }
+    putchar ('\n');
+    PrintLoopHistogram ("pickup", before.pickup, after.pickup, after.pickupMax);
+    PrintLoopHistogram ("pass", before.pass, after.pass, after.passMax);
+    return 0;
+}
+
+
+static int Settings (const std::string &path)
+{
+    dipswitch::Device device (path);
+    dipswitch::Settings settings;
+
+    if (!device.GetSettings (settings)) {
+        fprintf (stderr, "dipswitch: %s has no settings report\n", path.c_str ());
+        return 1;
+    }
+    printf ("settle window %d ms\n", settings.settleMs);
+    if (settings.tickUs && settings.debounceSamples == dipswitch::DEBOUNCE_ADAPTIVE) {
+        printf ("sampled every %d us, adaptive debounce\n", settings.tickUs);
+    } else if (settings.tickUs) {
+        printf ("sampled every %d us, %d samples to debounce\n", settings.tickUs,
+                settings.debounceSamples);
+    }
+    return 0;
+}
+
+
+static int Bounce (const std::string &path)
+{
+    dipswitch::Device device (path);
+    dipswitch::Settings settings;
+    dipswitch::BounceStats stats;
+    char label[16];
+    int i;
+
+    if (!device.GetSettings (settings) || !device.GetBounceStats (stats)) {
+        fprintf (stderr, "dipswitch: %s has no bounce learning\n", path.c_str ());
+        return 1;
+    }
+
+    printf ("%-8s", "bounce");
+    for (i = 0; i < dipswitch::BOUNCE_HIST_BINS; i++) {
+        if (i == 0) {
+            snprintf (label, sizeof (label), "none");
+        } else {
+            snprintf (label, sizeof (label), "%s%.1fms", (i < dipswitch::BOUNCE_HIST_BINS - 1) ? "<" : ">=",
+                      (dipswitch::BOUNCE_HIST_UNIT_US << (i < dipswitch::BOUNCE_HIST_BINS - 1 ? i : i - 1)) / 1000.0);
+        }
+        printf (" %8s", label);
+    }
+    printf ("\n%-8s", "changes");
+    for (i = 0; i < dipswitch::BOUNCE_HIST_BINS; i++) {
+        printf (" %8u", stats.histogram[i]);
+    }
+    printf ("\n\n");
+
+    for (i = 0; i < stats.switches; i++) {
+        printf ("SW%-3d %d samples, bounce %2d ticks %6.1f ms\n", i + 1, stats.depth[i],
+                stats.bounceTicks[i], stats.bounceTicks[i] * settings.tickUs / 1000.0);
+    }
+    return 0;
+}
+
+
+static int Sample (const std::string &path, int tickUs, int samples)
+{
+    dipswitch::Device device (path);
+
+    // one command and one flash write, which the stick makes from its main loop after
+    // SetSampling() returns
+    if (!device.SetSampling (tickUs, samples)) {
+        fprintf (stderr, "dipswitch: %s: cannot send the settings\n", path.c_str ());
+        return 1;
+    }
+    usleep (dipswitch::SAMPLING_APPLY_MS * 1000);
+    return Settings (path);
+}
+
+
+static int Watch (const std::string &path)
+{
+    dipswitch::Device device (path);
+    dipswitch::Monitor monitor;
+    dipswitch::ClockSync clock;
+
+    monitor.OnReport ([&clock] (dipswitch::Device &, const dipswitch::SwitchReport &report) {
+        timespec change;
+
+        printf ("%ld.%06ld ", (long)report.received.tv_sec, report.received.tv_nsec / 1000);
+        printf ("dev %5u ms seq %3u ", report.deviceMs, report.sequence);
+        if (report.missed) {
+            printf ("(%u missed) ", report.missed);
+        }
+        clock.Feed (report);
+        if (clock.ChangeTime (report, change)) {
+            printf ("frame %4u change %ld.%06ld ", report.frame, (long)change.tv_sec, change.tv_nsec / 1000);
+        }
+        PrintSwitches (report.bytes, report.width);
+        fflush (stdout);
+    });
+    monitor.OnDisconnect ([&monitor] (dipswitch::Device &device) {
+        fprintf (stderr, "dipswitch: %s disconnected\n", device.Path ().c_str ());
+        monitor.Stop ();
+    });
+    monitor.Add (device);
+
+    activeMonitor = &monitor;
+    signal (SIGINT, StopMonitor);
+    signal (SIGTERM, StopMonitor);
+
+    device.RequestRefresh ();
+    monitor.Run ();
+
+    activeMonitor = nullptr;
+    return device.Connected () ? 0 : 1;
+}
+
+
+int main (int argc, char *argv[])
+{
+    std::string path;
+    bool sample;
+
+    if (argc < 2) {
+        Usage ();
+        return 2;
+    }
+    if (strcmp (argv[1], "list") == 0) {
+        return List ();
+    }
+    if (strcmp (argv[1], "shm") == 0) {
+        try {
+            return Shm ();
+        } catch (const std::system_error &e) {
+            fprintf (stderr, "dipswitch: %s\n", e.what ());
+            return 1;
+        }
+    }
+
+    sample = strcmp (argv[1], "sample") == 0;
+    if (sample && argc < 4) {
+        Usage ();
+        return 2;
+    }
+    path = PickDevice (argc, argv, sample ? 4 : 2);
+    if (path.empty ()) {
+        fprintf (stderr, "dipswitch: no DIP switch stick found\n");
+        return 1;
+    }
+
+    try {
+        if (strcmp (argv[1], "read") == 0) {
+            return Read (path);
+        }
+        if (strcmp (argv[1], "watch") == 0) {
+            return Watch (path);
+        }
+        if (strcmp (argv[1], "isr") == 0) {
+            return Isr (path);
+        }
+        if (strcmp (argv[1], "loop") == 0) {
+            return Loop (path);
+        }
+        if (strcmp (argv[1], "settings") == 0) {
+            return Settings (path);
+        }
+        if (strcmp (argv[1], "bounce") == 0) {
+            return Bounce (path);
+        }
+        if (sample) {
+            return Sample (path, atoi (argv[2]), atoi (argv[3]));
+        }
+    } catch (const std::system_error &e) {
+        fprintf (stderr, "dipswitch: %s\n", e.what ());
+        return 1;
+    }
+
+    Usage ();
+    return 2;
+}
@@ -0,0 +1,684 @@
+//-----------------------------------------------------------------------------------------------
+// dipswitch-uhid.cpp -- virtual DIP Switch USB Stick through /dev/uhid
+//
+// usage: dipswitch-uhid [-e] [-r rate] [-b burst] [-n changes] [-s start] [pattern]
+//
+// Creates a HID device with the stick's VID/PID and the hid_rpt01 report descriptor taken
+// from usb_descriptors.c at build time, so hidraw, FindDevices() and everything above them
+// see a stick. The emulator then steps through a switch pattern and sends each change as
+// report ID 1 with the firmware's timestamp, sequence number and frame number, the last one
+// taken from CLOCK_MONOTONIC like a host controller's frame counter, and answers the report ID
+// 2 / 0x55 refresh request with the current state like the firmware does. GET_REPORT for
+// input report 1 and feature report 3 is answered the same way, and the report ID 2 / 0x49
+// heartbeat command repeats the current report whenever none has gone out for the period.
+// The 0x53 command sets a settle window like the firmware's: pattern steps are held until
+// the switches have been still for the window and only the last state goes out, 0x46 lets a
+// held change out at once, and feature report 6 has the window. The 0x54 tick, 0x44
+// debounce depth and 0x50 sampling commands are checked like the firmware checks them and
+// kept for feature report 6, though the pattern is not sampled. Feature reports 4, 5 and 7
+// have no firmware behind them and are made up, well formed but with fixed costs, so host
+// decoders can be run without a stick. SIGSTOP the emulator to see a host's stall
+// detection.
+//
+//   -e          use the SWITCH_DESCRIPTOR_EVDEV descriptor, so hid-input also creates an
+//               evdev node with one key per switch
+//   -r rate     pattern steps per second, default 10; anything up to the kernel's timer
+//               resolution, far beyond the one change per debounce period a stick can send
+//   -b burst    changes sent back to back per step, default 1
+//   -n changes  exit after this many changes, default 0 = run until SIGINT / SIGTERM
+//   -s start    switch byte before the first change, default 00
+//
+//   pattern     walk (one switch on at a time, SW1 first), count (binary counter), random,
+//               or a comma separated list of switch bytes in hex, e.g. 80,C0,E0; default walk
+//
+// Needs read/write access to /dev/uhid (modprobe uhid, usually root only).
+//
+
+//-----------------------------------------------------------------------------------------------
+// includes
+//
+
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <linux/uhid.h>
+
+#include "dipswitch.h"
+
+
+//-----------------------------------------------------------------------------------------------
+// defines
+//
+
+#define UHID_PATH "/dev/uhid"
+
+// the firmware's built-in TICK_UNITS and DEBOUNCE_SAMPLES
+#define DEFAULT_TICK_UNITS          (1000 / dipswitch::TICK_UNIT_US)
+#define DEFAULT_DEBOUNCE_SAMPLES    4
+
+// made-up costs for feature reports 4 and 5, in instruction cycles, each a typical value and
+// the worst case: USB servicing once per 1 ms frame, the tick handler and its latency once
+// per tick, and the main loop's pickup and pass once per tick
+#define EMU_USB_CYCLES              310
+#define EMU_USB_MAX_CYCLES          920
+#define EMU_TICK_CYCLES             140
+#define EMU_TICK_MAX_CYCLES         190
+#define EMU_LATENCY_CYCLES          12
+#define EMU_LATENCY_MAX_CYCLES      48
+#define EMU_PICKUP_CYCLES           150
+#define EMU_PASS_CYCLES             420
+
+// the depth the firmware's adaptive debounce gives a switch that has not bounced,
+// DEBOUNCE_ADAPT_MIN
+#define EMU_ADAPT_MIN_SAMPLES       2
+
+
+//-----------------------------------------------------------------------------------------------
+// typedefs
+//
+
+enum Pattern {
+    PATTERN_WALK,
+    PATTERN_COUNT,
+    PATTERN_RANDOM,
+    PATTERN_LIST
+};
+
+
+//-----------------------------------------------------------------------------------------------
+// globals
+//
+
+// hid_rpt01 for either SWITCH_DESCRIPTOR_EVDEV setting, generated from usb_descriptors.c by
+// the Makefile
+static const uint8_t vendorDescriptor[] = {
+#include "hid_rpt01.inc"
+};
+
+static const uint8_t evdevDescriptor[] = {
+#include "hid_rpt01_evdev.inc"
+};
+
+static volatile sig_atomic_t quit;
+
+// switch state the host has been sent and the firmware's report fields for it, and the state
+// the pattern has set, which differs while the settle window holds a change
+static uint8_t switches;
+static uint8_t pending;
+static uint8_t sequence;
+static uint16_t deviceMs;
+static uint16_t frame;
+static timespec startTime;
+
+// heartbeat period from the 0x49 command, 0 = off, and its one-shot timer
+static int heartbeatMs;
+static int heartbeatFd = -1;
+
+// settle window from the 0x53 command, 0 = off as the firmware's default SETTLE_MS, the time
+// of the last pattern change and the one-shot timer for the end of its window
+static int settleMs;
+static timespec lastChange;
+static int settleFd = -1;
+
+// sampling settings from the 0x54, 0x44 and 0x50 commands, the tick in TICK_UNIT_US
+static uint8_t tickUnits = DEFAULT_TICK_UNITS;
+static uint8_t debounceSamples = DEFAULT_DEBOUNCE_SAMPLES;
+
+// changes sent as report ID 1
+static unsigned long sent;
+
+
+//-----------------------------------------------------------------------------------------------
+// functions
+//
+
+static void Usage (void)
+{
+    fprintf (stderr, "usage: dipswitch-uhid [-e] [-r rate] [-b burst] [-n changes] [-s start] "
+                     "[walk | count | random | xx,xx,...]\n");
+}
+
+
+static void Quit (int signal)
+{
+    quit = 1;
+}
+
+
+static std::system_error SystemError (const std::string &what)
+{
+    return std::system_error (errno, std::generic_category (), what);
+}
+
+
+static void WriteEvent (int fd, const uhid_event &event)
+{
+    if (write (fd, &event, sizeof (event)) != (ssize_t)sizeof (event)) {
+        throw SystemError ("write " UHID_PATH);
+    }
+}
+
+
+static void Create (int fd, const uint8_t *descriptor, size_t size)
+{
+    uhid_event event;
+
+    memset (&event, 0, sizeof (event));
+    event.type = UHID_CREATE2;
+    strncpy ((char *)event.u.create2.name, "bikerglen.com DIP Switch USB Stick (uhid)",
+             sizeof (event.u.create2.name) - 1);
+    strncpy ((char *)event.u.create2.phys, "dipswitch-uhid", sizeof (event.u.create2.phys) - 1);
+    strncpy ((char *)event.u.create2.uniq, "0000-0000-0002", sizeof (event.u.create2.uniq) - 1);
+    event.u.create2.rd_size = size;
+    event.u.create2.bus = BUS_USB;     // linux/input.h, the HID_ID bus type FindDevices() matches
+    event.u.create2.vendor = dipswitch::VENDOR_ID;
+    event.u.create2.product = dipswitch::PRODUCT_ID;
+    memcpy (event.u.create2.rd_data, descriptor, size);
+
+    WriteEvent (fd, event);
+}
+
+
+// report ID 1 as the firmware sends it: switches, timestamp (little endian), sequence, frame
+// (little endian). Feature report 3 has the report queue drop count, always 0 here, in place
+// of the frame number and the frame number after it.
+static void FillSwitches (uint8_t *data, uint8_t reportId)
+{
+    data[0] = reportId;
+    data[1] = switches;
+    data[2] = (uint8_t)deviceMs;
+    data[3] = (uint8_t)(deviceMs >> 8);
+    data[4] = sequence;
+    if (reportId == dipswitch::REPORT_ID_SWITCHES) {
+        data[5] = (uint8_t)frame;
+        data[6] = (uint8_t)(frame >> 8);
+    } else {
+        data[5] = 0;
+        data[6] = (uint8_t)frame;
+        data[7] = (uint8_t)(frame >> 8);
+    }
+}
+
+
+static void PutLittleEndian (uint8_t *p, uint32_t value, int bytes)
+{
+    int i;
+
+    for (i = 0; i < bytes; i++) {
+        p[i] = (uint8_t)(value >> (i * 8));
+    }
+}
+
+
+// the firmware's LOOP_HIST_SHIFT bins: bin n below 128 << n cycles, the last everything longer
+static int LoopHistBin (uint32_t cycles)
+{
+    int bin = 0;
+
+    while (bin < dipswitch::LOOP_HIST_BINS - 1 && cycles >= (128u << bin)) {
+        bin++;
+    }
+    return bin;
+}
+
+
+// feature report 4 laid out like ISR_STATS, counts advancing with CLOCK_MONOTONIC at the
+// frame rate and the tick rate; the USB_IDLE source stays at 0
+static void FillIsrStats (uint8_t *data)
+{
+    const uint32_t costs[4][2] = {
+        { EMU_USB_CYCLES, EMU_USB_MAX_CYCLES },
+        { 0, 0 },
+        { EMU_TICK_CYCLES, EMU_TICK_MAX_CYCLES },
+        { EMU_LATENCY_CYCLES, EMU_LATENCY_MAX_CYCLES },
+    };
+    timespec now;
+    uint64_t us;
+    uint32_t counts[4];
+    int i;
+
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    us = (now.tv_sec - startTime.tv_sec) * 1000000ULL + (now.tv_nsec - startTime.tv_nsec) / 1000;
+    counts[0] = (uint32_t)(us / 1000);
+    counts[1] = 0;
+    counts[2] = (uint32_t)(us / (tickUnits * dipswitch::TICK_UNIT_US));
+    counts[3] = counts[2];
+
+    data[0] = dipswitch::REPORT_ID_ISR_STATS;
+    for (i = 0; i < 4; i++) {
+        PutLittleEndian (&data[1 + i * 10], counts[i], 4);
+        PutLittleEndian (&data[5 + i * 10], counts[i] * costs[i][0], 4);
+        PutLittleEndian (&data[9 + i * 10], counts[i] ? costs[i][1] : 0, 2);
+    }
+}
+
+
+// feature report 5 laid out like LOOP_STATS: no overruns or lost ticks and every tick's
+// pickup and pass in the bin of its fixed cost
+static void FillLoopStats (uint8_t *data)
+{
+    timespec now;
+    uint64_t us;
+    uint16_t ticks;
+
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    us = (now.tv_sec - startTime.tv_sec) * 1000000ULL + (now.tv_nsec - startTime.tv_nsec) / 1000;
+    ticks = (uint16_t)(us / (tickUnits * dipswitch::TICK_UNIT_US));
+
+    memset (data, 0, dipswitch::LOOP_STATS_REPORT_SIZE);
+    data[0] = dipswitch::REPORT_ID_LOOP_STATS;
+    PutLittleEndian (&data[5], EMU_PICKUP_CYCLES, 2);
+    PutLittleEndian (&data[7], EMU_PASS_CYCLES, 2);
+    PutLittleEndian (&data[9 + LoopHistBin (EMU_PICKUP_CYCLES) * 2], ticks, 2);
+    PutLittleEndian (&data[9 + (dipswitch::LOOP_HIST_BINS + LoopHistBin (EMU_PASS_CYCLES)) * 2], ticks, 2);
+}
+
+
+// feature report 7 laid out like BOUNCE_STATS for the one switch byte: every change sent
+// counted as no bounce, and each switch as clean, at the depth the settings give it
+static void FillBounceStats (uint8_t *data)
+{
+    uint8_t depth = debounceSamples ? debounceSamples : EMU_ADAPT_MIN_SAMPLES;
+
+    memset (data, 0, dipswitch::BOUNCE_STATS_REPORT_SIZE);
+    data[0] = dipswitch::REPORT_ID_BOUNCE_STATS;
+    PutLittleEndian (&data[1], (uint16_t)sent, 2);
+    memset (&data[1 + dipswitch::BOUNCE_HIST_BINS * 2], depth << 4, 8);
+}
+
+
+// (re)start the heartbeat period, or stop the timer with the heartbeat off
+static void ArmHeartbeat (void)
+{
+    itimerspec period = {};
+
+    period.it_value.tv_sec = heartbeatMs / 1000;
+    period.it_value.tv_nsec = (heartbeatMs % 1000) * 1000000L;
+    if (timerfd_settime (heartbeatFd, 0, &period, nullptr) < 0) {
+        throw SystemError ("timerfd_settime");
+    }
+}
+
+
+// any report 1 restarts the heartbeat period, like the firmware
+static void SendSwitches (int fd)
+{
+    uhid_event event;
+
+    memset (&event, 0, sizeof (event));
+    event.type = UHID_INPUT2;
+    event.u.input2.size = dipswitch::SWITCH_REPORT_SIZE;
+    FillSwitches (event.u.input2.data, dipswitch::REPORT_ID_SWITCHES);
+
+    WriteEvent (fd, event);
+    ArmHeartbeat ();
+}
+
+
+// the change the settle window is holding becomes the state and is stamped and sent; a
+// pattern that came back to the state the host has sends nothing, like the firmware
+static void Settle (int fd)
+{
+    timespec now;
+
+    if (pending == switches) {
+        return;
+    }
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    switches = pending;
+    sequence++;
+    deviceMs = (uint16_t)((now.tv_sec - startTime.tv_sec) * 1000 + (now.tv_nsec - startTime.tv_nsec) / 1000000);
+    frame = (uint16_t)((now.tv_sec * 1000 + now.tv_nsec / 1000000) % dipswitch::FRAME_NUMBERS);
+    SendSwitches (fd);
+    sent++;
+}
+
+
+// end the settle window settleMs after the last change, at once if that has passed
+static void ArmSettle (void)
+{
+    itimerspec end = {};
+
+    end.it_value.tv_sec = lastChange.tv_sec + settleMs / 1000;
+    end.it_value.tv_nsec = lastChange.tv_nsec + (settleMs % 1000) * 1000000L;
+    if (end.it_value.tv_nsec >= 1000000000L) {
+        end.it_value.tv_sec++;
+        end.it_value.tv_nsec -= 1000000000L;
+    }
+    if (timerfd_settime (settleFd, TFD_TIMER_ABSTIME, &end, nullptr) < 0) {
+        throw SystemError ("timerfd_settime");
+    }
+}
+
+
+// one pattern step. With no settle window it goes out at once, otherwise each change restarts
+// the window; a step that leaves the switches as they are changes nothing
+static void Change (int fd, uint8_t state)
+{
+    if (state == pending) {
+        return;
+    }
+    pending = state;
+    if (settleMs == 0) {
+        Settle (fd);
+        return;
+    }
+    clock_gettime (CLOCK_MONOTONIC, &lastChange);
+    ArmSettle ();
+}
+
+
+// GET_REPORT for input report 1, feature report 3 or feature report 6 is answered from the
+// current state like the firmware does on EP0, feature reports 4, 5 and 7 with made-up
+// statistics; anything else, and every SET_REPORT, fails at once instead of letting the
+// kernel time out
+static void AnswerReport (int fd, const uhid_event &request)
+{
+    uhid_event event;
+
+    memset (&event, 0, sizeof (event));
+    if (request.type == UHID_GET_REPORT) {
+        event.type = UHID_GET_REPORT_REPLY;
+        event.u.get_report_reply.id = request.u.get_report.id;
+        if (request.u.get_report.rtype == UHID_INPUT_REPORT &&
+                request.u.get_report.rnum == dipswitch::REPORT_ID_SWITCHES) {
+            FillSwitches (event.u.get_report_reply.data, dipswitch::REPORT_ID_SWITCHES);
+            event.u.get_report_reply.size = dipswitch::SWITCH_REPORT_SIZE;
+        } else if (request.u.get_report.rtype == UHID_FEATURE_REPORT &&
+                request.u.get_report.rnum == dipswitch::REPORT_ID_STATE) {
+            FillSwitches (event.u.get_report_reply.data, dipswitch::REPORT_ID_STATE);
+            event.u.get_report_reply.size = dipswitch::STATE_REPORT_SIZE;
+        } else if (request.u.get_report.rtype == UHID_FEATURE_REPORT &&
+                request.u.get_report.rnum == dipswitch::REPORT_ID_SETTINGS) {
+            event.u.get_report_reply.data[0] = dipswitch::REPORT_ID_SETTINGS;
+            event.u.get_report_reply.data[1] = (uint8_t)settleMs;
+            event.u.get_report_reply.data[2] = tickUnits;
+            event.u.get_report_reply.data[3] = debounceSamples;
+            event.u.get_report_reply.size = dipswitch::SAMPLING_SETTINGS_REPORT_SIZE;
+        } else if (request.u.get_report.rtype == UHID_FEATURE_REPORT &&
+                request.u.get_report.rnum == dipswitch::REPORT_ID_ISR_STATS) {
+            FillIsrStats (event.u.get_report_reply.data);
+            event.u.get_report_reply.size = dipswitch::ISR_STATS_REPORT_SIZE;
+        } else if (request.u.get_report.rtype == UHID_FEATURE_REPORT &&
+                request.u.get_report.rnum == dipswitch::REPORT_ID_LOOP_STATS) {
+            FillLoopStats (event.u.get_report_reply.data);
+            event.u.get_report_reply.size = dipswitch::LOOP_STATS_REPORT_SIZE;
+        } else if (request.u.get_report.rtype == UHID_FEATURE_REPORT &&
+                request.u.get_report.rnum == dipswitch::REPORT_ID_BOUNCE_STATS) {
+            FillBounceStats (event.u.get_report_reply.data);
+            event.u.get_report_reply.size = dipswitch::BOUNCE_STATS_REPORT_SIZE;
+        } else {
+            event.u.get_report_reply.err = EIO;
+        }
+    } else {
+        event.type = UHID_SET_REPORT_REPLY;
+        event.u.set_report_reply.id = request.u.set_report.id;
+        event.u.set_report_reply.err = EIO;
+    }
+
+    WriteEvent (fd, event);
+}
+
+
+// one event from the kernel; returns true once the device has been started
+static bool HandleEvent (int fd)
+{
+    uhid_event event;
+    ssize_t length;
+
+    length = read (fd, &event, sizeof (event));
+    if (length < 0) {
+        if (errno == EINTR || errno == EAGAIN) {
+            return false;
+        }
+        throw SystemError ("read " UHID_PATH);
+    }
+
+    switch (event.type) {
+    case UHID_START:
+        return true;
+    case UHID_OUTPUT:
+        // hidraw write() of report ID 2 arrives with the report ID byte first
+        if (event.u.output.size >= 2 && event.u.output.data[0] == dipswitch::REPORT_ID_COMMAND) {
+            if (event.u.output.data[1] == dipswitch::COMMAND_REFRESH) {
+                SendSwitches (fd);
+            } else if (event.u.output.data[1] == dipswitch::COMMAND_HEARTBEAT && event.u.output.size >= 3) {
+                heartbeatMs = event.u.output.data[2] * dipswitch::HEARTBEAT_UNIT_MS;
+                ArmHeartbeat ();
+            } else if (event.u.output.data[1] == dipswitch::COMMAND_SETTLE && event.u.output.size >= 3) {
+                // a held change gets the new window, measured from when it was made
+                settleMs = event.u.output.data[2];
+                if (pending != switches) {
+                    ArmSettle ();
+                }
+            } else if (event.u.output.data[1] == dipswitch::COMMAND_SETTLE_NOW) {
+                Settle (fd);
+            } else if (event.u.output.data[1] == dipswitch::COMMAND_TICK && event.u.output.size >= 3) {
+                // out of range is ignored, like SetSampleSettings() in the firmware
+                if (event.u.output.data[2] >= dipswitch::MIN_TICK_US / dipswitch::TICK_UNIT_US &&
+                        event.u.output.data[2] <= dipswitch::MAX_TICK_US / dipswitch::TICK_UNIT_US) {
+                    tickUnits = event.u.output.data[2];
+                }
+            } else if (event.u.output.data[1] == dipswitch::COMMAND_DEBOUNCE && event.u.output.size >= 3) {
+                if (event.u.output.data[2] <= dipswitch::MAX_DEBOUNCE_SAMPLES) {
+                    debounceSamples = event.u.output.data[2];
+                }
+            } else if (event.u.output.data[1] == dipswitch::COMMAND_SAMPLING && event.u.output.size >= 3) {
+                // tick << 4 | samples, both taken or neither
+                if ((event.u.output.data[2] >> 4) >= dipswitch::MIN_TICK_US / dipswitch::TICK_UNIT_US &&
+                        (event.u.output.data[2] >> 4) <= dipswitch::MAX_TICK_US / dipswitch::TICK_UNIT_US &&
+                        (event.u.output.data[2] & 0x0F) <= dipswitch::MAX_DEBOUNCE_SAMPLES) {
+                    tickUnits = event.u.output.data[2] >> 4;
+                    debounceSamples = event.u.output.data[2] & 0x0F;
+                }
+            }
+        }
+        break;
+    case UHID_GET_REPORT:
+    case UHID_SET_REPORT:
+        AnswerReport (fd, event);
+        break;
+    default:
+        break;
+    }
+
+    return false;
+}
+
+
+static bool ParsePattern (const char *arg, Pattern &pattern, std::vector<uint8_t> &list)
+{
+    char *end;
+    unsigned long value;
+
+    if (strcmp (arg, "walk") == 0) {
+        pattern = PATTERN_WALK;
+    } else if (strcmp (arg, "count") == 0) {
+        pattern = PATTERN_COUNT;
+    } else if (strcmp (arg, "random") == 0) {
+        pattern = PATTERN_RANDOM;
+    } else {
+        pattern = PATTERN_LIST;
+        while (*arg) {
+            value = strtoul (arg, &end, 16);
+            if (end == arg || value > 0xFF || (*end && *end != ',')) {
+                return false;
+            }
+            list.push_back ((uint8_t)value);
+            arg = *end ? end + 1 : end;
+        }
+        if (list.empty ()) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+// next switch byte of the pattern; step counts from 0
+static uint8_t NextState (Pattern pattern, const std::vector<uint8_t> &list, uint32_t step)
+{
+    static uint32_t random = 0x2545F491;
+
+    switch (pattern) {
+    case PATTERN_WALK:
+        return 0x80 >> (step & 7);
+    case PATTERN_COUNT:
+        return (uint8_t)(step + 1);
+    case PATTERN_RANDOM:
+        // xorshift32, never repeating the current state so every step is a change
+        do {
+            random ^= random << 13;
+            random ^= random >> 17;
+            random ^= random << 5;
+        } while ((uint8_t)random == pending);
+        return (uint8_t)random;
+    default:
+        return list[step % list.size ()];
+    }
+}
+
+
+int main (int argc, char *argv[])
+{
+    double rate = 10.0;
+    unsigned long burst = 1, changes = 0;
+    Pattern pattern = PATTERN_WALK;
+    std::vector<uint8_t> list;
+    itimerspec period;
+    pollfd fds[4];
+    uint64_t expirations;
+    uint32_t step = 0;
+    bool started = false;
+    bool evdev = false;
+    unsigned long i;
+    int uhidFd, timerFd;
+    int opt;
+
+    while ((opt = getopt (argc, argv, "er:b:n:s:")) != -1) {
+        switch (opt) {
+        case 'e':
+            evdev = true;
+            break;
+        case 'r':
+            rate = strtod (optarg, nullptr);
+            break;
+        case 'b':
+            burst = strtoul (optarg, nullptr, 0);
+            break;
+        case 'n':
+            changes = strtoul (optarg, nullptr, 0);
+            break;
+        case 's':
+            switches = (uint8_t)strtoul (optarg, nullptr, 16);
+            pending = switches;
+            break;
+        default:
+            Usage ();
+            return 1;
+        }
+    }
+    if (rate <= 0.0 || burst == 0 || argc > optind + 1 ||
+            (argc == optind + 1 && !ParsePattern (argv[optind], pattern, list))) {
+        Usage ();
+        return 1;
+    }
+
+    signal (SIGINT, Quit);
+    signal (SIGTERM, Quit);
+
+    try {
+        uhidFd = open (UHID_PATH, O_RDWR | O_CLOEXEC);
+        if (uhidFd < 0) {
+            throw SystemError ("open " UHID_PATH);
+        }
+        timerFd = timerfd_create (CLOCK_MONOTONIC, TFD_CLOEXEC);
+        heartbeatFd = timerfd_create (CLOCK_MONOTONIC, TFD_CLOEXEC);
+        settleFd = timerfd_create (CLOCK_MONOTONIC, TFD_CLOEXEC);
+        if (timerFd < 0 || heartbeatFd < 0 || settleFd < 0) {
+            throw SystemError ("timerfd_create");
+        }
+
+        if (evdev) {
+            Create (uhidFd, evdevDescriptor, sizeof (evdevDescriptor));
+        } else {
+            Create (uhidFd, vendorDescriptor, sizeof (vendorDescriptor));
+        }
+        clock_gettime (CLOCK_MONOTONIC, &startTime);
+
+        fds[0].fd = uhidFd;
+        fds[0].events = POLLIN;
+        fds[1].fd = timerFd;
+        fds[1].events = POLLIN;
+        fds[2].fd = heartbeatFd;
+        fds[2].events = POLLIN;
+        fds[3].fd = settleFd;
+        fds[3].events = POLLIN;
+
+        while (!quit && (changes == 0 || sent < changes)) {
+            if (poll (fds, 4, -1) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw SystemError ("poll");
+            }
+
+            if (fds[0].revents & POLLIN) {
+                // the pattern starts once the kernel has bound the HID drivers
+                if (HandleEvent (uhidFd) && !started) {
+                    started = true;
+                    period.it_interval.tv_sec = (time_t)(1.0 / rate);
+                    period.it_interval.tv_nsec = (long)((1.0 / rate - period.it_interval.tv_sec) * 1e9);
+                    if (period.it_interval.tv_sec == 0 && period.it_interval.tv_nsec == 0) {
+                        period.it_interval.tv_nsec = 1;
+                    }
+                    period.it_value = period.it_interval;
+                    if (timerfd_settime (timerFd, 0, &period, nullptr) < 0) {
+                        throw SystemError ("timerfd_settime");
+                    }
+                    fprintf (stderr, "dipswitch-uhid: %04X:%04X created, %g steps/s, %lu per step\n",
+                             dipswitch::VENDOR_ID, dipswitch::PRODUCT_ID, rate, burst);
+                }
+            }
+
+            // a late wakeup runs the missed steps too, so the average rate holds
+            if ((fds[1].revents & POLLIN) && read (timerFd, &expirations, sizeof (expirations)) > 0) {
+                while (expirations-- && (changes == 0 || sent < changes)) {
+                    for (i = 0; i < burst && (changes == 0 || sent < changes); i++) {
+                        Change (uhidFd, NextState (pattern, list, step++));
+                    }
+                }
+            }
+
+            if ((fds[2].revents & POLLIN) && read (heartbeatFd, &expirations, sizeof (expirations)) > 0) {
+                SendSwitches (uhidFd);
+            }
+
+            if ((fds[3].revents & POLLIN) && read (settleFd, &expirations, sizeof (expirations)) > 0) {
+                Settle (uhidFd);
+            }
+        }
+    } catch (const std::system_error &e) {
+        fprintf (stderr, "dipswitch-uhid: %s\n", e.what ());
+        return 1;
+    }
+
+    // closing /dev/uhid destroys the device
+    fprintf (stderr, "dipswitch-uhid: %lu changes sent\n", sent);
+    close (settleFd);
+    close (heartbeatFd);
+    close (timerFd);
+    close (uhidFd);
+    return 0;
+}
@@ -0,0 +1,844 @@
+//-----------------------------------------------------------------------------------------------
+// dipswitch.cpp -- Linux host library for the DIP Switch USB Stick
+//
+
+//-----------------------------------------------------------------------------------------------
+// includes
+//
+
+#include "dipswitch.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <system_error>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <linux/hidraw.h>
+
+
+namespace dipswitch {
+
+//-----------------------------------------------------------------------------------------------
+// defines
+//
+
+#define SYSFS_HIDRAW "/sys/class/hidraw"
+
+// HID_ID bus type in the hid device uevent
+#define BUS_USB 0x0003
+
+// nominal USB full-speed frame period and the most a fitted one may differ from it, the USB
+// spec's 500 ppm for the host's frame clock with room for CLOCK_MONOTONIC's own error
+#define FRAME_NS        1000000.0
+#define MAX_SKEW        0.001
+
+// a change read this far before the fitted line means the frame counter jumped, e.g. the
+// host controller was reset, and the fit starts over
+#define FRAME_JUMP_NS   2000000.0
+
+// frames a read may come before the fitted line and still unwrap to the right frame count,
+// so it can lower the line or, past FRAME_JUMP_NS, restart the fit: the first samples may
+// all have waited in a queue
+#define UNWRAP_AHEAD    256
+
+
+//-----------------------------------------------------------------------------------------------
+// local functions
+//
+
+static std::system_error SystemError (const std::string &what)
+{
+    return std::system_error (errno, std::generic_category (), what);
+}
+
+
+static int64_t NsBetween (const timespec &a, const timespec &b)
+{
+    return (int64_t)(b.tv_sec - a.tv_sec) * 1000000000 + (b.tv_nsec - a.tv_nsec);
+}
+
+
+static int64_t ElapsedMs (const timespec &start)
+{
+    timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+}
+
+
+// the tick as the stick's TICK_UNIT_US count, rounded and limited to what it can sample at
+static int TickUnits (int tickUs)
+{
+    tickUs = std::min (std::max (tickUs, MIN_TICK_US), MAX_TICK_US);
+    return (tickUs + TICK_UNIT_US / 2) / TICK_UNIT_US;
+}
+
+
+// the parent hid device's uevent carries HID_ID=<bus>:<vendor>:<product>
+static bool MatchesId (const std::string &node, uint16_t vendorId, uint16_t productId)
+{
+    std::string uevent = std::string (SYSFS_HIDRAW "/") + node + "/device/uevent";
+    char line[256];
+    unsigned bus, vendor, product;
+    bool match = false;
+    FILE *f;
+
+    f = fopen (uevent.c_str (), "r");
+    if (!f) {
+        return false;
+    }
+    while (fgets (line, sizeof (line), f)) {
+        if (sscanf (line, "HID_ID=%x:%x:%x", &bus, &vendor, &product) == 3) {
+            match = (bus == BUS_USB) && (vendor == vendorId) && (product == productId);
+            break;
+        }
+    }
+    fclose (f);
+
+    return match;
+}
+
+
+//-----------------------------------------------------------------------------------------------
+// device discovery
+//
+
+std::vector<std::string> FindDevices (uint16_t vendorId, uint16_t productId)
+{
+    std::vector<std::string> nodes;
+    struct dirent *entry;
+    DIR *dir;
+
+    dir = opendir (SYSFS_HIDRAW);
+    if (!dir) {
+        return nodes;
+    }
+    while ((entry = readdir (dir)) != nullptr) {
+        if (strncmp (entry->d_name, "hidraw", 6) == 0 && MatchesId (entry->d_name, vendorId, productId)) {
+            nodes.push_back (std::string ("/dev/") + entry->d_name);
+        }
+    }
+    closedir (dir);
+
+    // readdir order is arbitrary; hidraw0 before hidraw10 before hidraw2 is good enough to
+    // make the choice stable across calls
+    std::sort (nodes.begin (), nodes.end ());
+    return nodes;
+}
+
+
+std::string FindEventDevice (const std::string &hidrawPath)
+{
+    std::string node = hidrawPath.substr (hidrawPath.rfind ('/') + 1);
+    std::string inputs = std::string (SYSFS_HIDRAW "/") + node + "/device/input";
+    std::string event;
+    struct dirent *entry, *child;
+    DIR *dir, *inputDir;
+
+    // hid device -> input/inputM -> eventN
+    dir = opendir (inputs.c_str ());
+    if (!dir) {
+        return event;
+    }
+    while (event.empty () && (entry = readdir (dir)) != nullptr) {
+        if (strncmp (entry->d_name, "input", 5) != 0) {
+            continue;
+        }
+        inputDir = opendir ((inputs + "/" + entry->d_name).c_str ());
+        if (!inputDir) {
+            continue;
+        }
+        while ((child = readdir (inputDir)) != nullptr) {
+            if (strncmp (child->d_name, "event", 5) == 0) {
+                event = std::string ("/dev/input/") + child->d_name;
+                break;
+            }
+        }
+        closedir (inputDir);
+    }
+    closedir (dir);
+
+    return event;
+}
+
+
+//-----------------------------------------------------------------------------------------------
+// report decoding
+//
+
+// the switch bytes of a report ID 1 or feature report 3 whose one-byte size is given; the
+// width follows from the length
+static const uint8_t *DecodeSwitchBytes (const uint8_t *data, size_t length, size_t size,
+                                         SwitchReport &report)
+{
+    size_t width = length - size + 1;
+
+    report.width = (uint8_t)std::min (width, MAX_SWITCH_BYTES);
+    memset (report.bytes, 0, sizeof (report.bytes));
+    memcpy (report.bytes, &data[1], report.width);
+    report.switches = report.bytes[0];
+
+    // what follows the switches, laid out as on the one-byte stick from the timestamp on
+    return data + width - 1;
+}
+
+
+bool DecodeSwitchReport (const uint8_t *data, size_t length, SwitchReport &report)
+{
+    const uint8_t *p;
+
+    if (length < SWITCH_REPORT_SIZE || data[0] != REPORT_ID_SWITCHES) {
+        return false;
+    }
+
+    p = DecodeSwitchBytes (data, length, SWITCH_REPORT_SIZE, report);
+    report.deviceMs = p[2] | (p[3] << 8);
+    report.sequence = p[4];
+    report.frame = (p[5] | (p[6] << 8)) & (FRAME_NUMBERS - 1);
+    report.missed = 0;
+
+    return true;
+}
+
+
+//-----------------------------------------------------------------------------------------------
+// Device
+//
+
+Device::Device (const std::string &path) : path (path), lastSequence (-1)
+{
+    fd = open (path.c_str (), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        throw SystemError ("open " + path);
+    }
+}
+
+
+Device::~Device ()
+{
+    Close ();
+}
+
+
+void Device::Close ()
+{
+    if (fd >= 0) {
+        close (fd);
+        fd = -1;
+    }
+}
+
+
+bool Device::RequestRefresh ()
+{
+    const uint8_t request[2] = { REPORT_ID_COMMAND, COMMAND_REFRESH };
+
+    if (fd < 0) {
+        return false;
+    }
+    return write (fd, request, sizeof (request)) == (ssize_t)sizeof (request);
+}
+
+
+bool Device::SetHeartbeat (int periodMs)
+{
+    uint8_t request[3] = { REPORT_ID_COMMAND, COMMAND_HEARTBEAT, 0 };
+
+    if (fd < 0) {
+        return false;
+    }
+    periodMs = std::min (std::max (periodMs, 0), MAX_HEARTBEAT_MS);
+    request[2] = (uint8_t)((periodMs + HEARTBEAT_UNIT_MS - 1) / HEARTBEAT_UNIT_MS);
+    return write (fd, request, sizeof (request)) == (ssize_t)sizeof (request);
+}
+
+
+bool Device::SetSettleWindow (int windowMs)
+{
+    uint8_t request[3] = { REPORT_ID_COMMAND, COMMAND_SETTLE, 0 };
+
+    if (fd < 0) {
+        return false;
+    }
+    request[2] = (uint8_t)std::min (std::max (windowMs, 0), MAX_SETTLE_MS);
+    return write (fd, request, sizeof (request)) == (ssize_t)sizeof (request);
+}
+
+
+bool Device::SettleNow ()
+{
+    const uint8_t request[2] = { REPORT_ID_COMMAND, COMMAND_SETTLE_NOW };
+
+    if (fd < 0) {
+        return false;
+    }
+    return write (fd, request, sizeof (request)) == (ssize_t)sizeof (request);
+}
+
+
+bool Device::SetSampleTick (int tickUs)
+{
+    uint8_t request[3] = { REPORT_ID_COMMAND, COMMAND_TICK, 0 };
+
+    if (fd < 0) {
+        return false;
+    }
+    request[2] = (uint8_t)TickUnits (tickUs);
+    return write (fd, request, sizeof (request)) == (ssize_t)sizeof (request);
+}
+
+
+bool Device::SetDebounceSamples (int samples)
+{
+    uint8_t request[3] = { REPORT_ID_COMMAND, COMMAND_DEBOUNCE, 0 };
+
+    if (fd < 0) {
+        return false;
+    }
+    request[2] = (uint8_t)std::min (std::max (samples, DEBOUNCE_ADAPTIVE), MAX_DEBOUNCE_SAMPLES);
+    return write (fd, request, sizeof (request)) == (ssize_t)sizeof (request);
+}
+
+
+bool Device::SetSampling (int tickUs, int samples)
+{
+    uint8_t request[3] = { REPORT_ID_COMMAND, COMMAND_SAMPLING, 0 };
+
+    if (fd < 0) {
+        return false;
+    }
+    samples = std::min (std::max (samples, DEBOUNCE_ADAPTIVE), MAX_DEBOUNCE_SAMPLES);
+    request[2] = (uint8_t)((TickUnits (tickUs) << 4) | samples);
+    return write (fd, request, sizeof (request)) == (ssize_t)sizeof (request);
+}
+
+
+bool Device::ReadReport (SwitchReport &report)
+{
+    ssize_t length;
+
+    while (fd >= 0) {
+        length = read (fd, buffer, sizeof (buffer));
+        if (length < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN) {
+                // ENODEV / EIO once the stick is unplugged
+                Close ();
+            }
+            return false;
+        }
+
+        if (DecodeSwitchReport (buffer, length, report)) {
+            clock_gettime (CLOCK_MONOTONIC, &report.received);
+
+            // a gap in the sequence is changes the stick's full report queue turned away; a
+            // repeated number is a refresh answer with nothing new
+            if (lastSequence >= 0 && report.sequence != lastSequence) {
+                report.missed = (uint8_t)(report.sequence - lastSequence - 1);
+            }
+            lastSequence = report.sequence;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+bool Device::GetState (SwitchReport &report, uint8_t *queueDrops)
+{
+    uint8_t state[STATE_REPORT_SIZE + MAX_SWITCH_BYTES - 1];
+    const uint8_t *p;
+    int length;
+
+    if (fd < 0) {
+        return false;
+    }
+
+    // the kernel sends the report ID in byte 0 as the GET_REPORT wValue low byte
+    state[0] = REPORT_ID_STATE;
+    length = ioctl (fd, HIDIOCGFEATURE (sizeof (state)), state);
+    if (length < (int)STATE_REPORT_SIZE || state[0] != REPORT_ID_STATE) {
+        return false;
+    }
+    clock_gettime (CLOCK_MONOTONIC, &report.received);
+
+    // laid out as report ID 1 with the queue drop count before the frame number
+    p = DecodeSwitchBytes (state, length, STATE_REPORT_SIZE, report);
+    report.deviceMs = p[2] | (p[3] << 8);
+    report.sequence = p[4];
+    report.frame = (p[6] | (p[7] << 8)) & (FRAME_NUMBERS - 1);
+    report.missed = 0;
+    if (queueDrops) {
+        *queueDrops = p[5];
+    }
+
+    return true;
+}
+
+
+bool Device::GetIsrStats (IsrStats &stats)
+{
+    uint8_t data[ISR_STATS_REPORT_SIZE];
+    IsrSourceStats *sources[4] = { &stats.usb, &stats.usbIdle, &stats.tick, &stats.tickLatency };
+    const uint8_t *p;
+    int length, i;
+
+    if (fd < 0) {
+        return false;
+    }
+
+    data[0] = REPORT_ID_ISR_STATS;
+    length = ioctl (fd, HIDIOCGFEATURE (sizeof (data)), data);
+    if (length < (int)sizeof (data) || data[0] != REPORT_ID_ISR_STATS) {
+        return false;
+    }
+
+    for (i = 0; i < 4; i++) {
+        p = &data[1 + i * 10];
+        sources[i]->count = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+        sources[i]->cycles = p[4] | (p[5] << 8) | (p[6] << 16) | ((uint32_t)p[7] << 24);
+        sources[i]->maxCycles = p[8] | (p[9] << 8);
+    }
+
+    return true;
+}
+
+
+bool Device::GetLoopStats (LoopStats &stats)
+{
+    uint8_t data[LOOP_STATS_REPORT_SIZE];
+    int length, i;
+
+    if (fd < 0) {
+        return false;
+    }
+
+    data[0] = REPORT_ID_LOOP_STATS;
+    length = ioctl (fd, HIDIOCGFEATURE (sizeof (data)), data);
+    if (length < (int)sizeof (data) || data[0] != REPORT_ID_LOOP_STATS) {
+        return false;
+    }
+
+    stats.overruns = data[1] | (data[2] << 8);
+    stats.lostTicks = data[3] | (data[4] << 8);
+    stats.pickupMax = data[5] | (data[6] << 8);
+    stats.passMax = data[7] | (data[8] << 8);
+    for (i = 0; i < LOOP_HIST_BINS; i++) {
+        stats.pickup[i] = data[9 + i * 2] | (data[10 + i * 2] << 8);
+        stats.pass[i] = data[9 + LOOP_HIST_BINS * 2 + i * 2] | (data[10 + LOOP_HIST_BINS * 2 + i * 2] << 8);
+    }
+
+    return true;
+}
+
+
+bool Device::GetSettings (Settings &settings)
+{
+    uint8_t data[SAMPLING_SETTINGS_REPORT_SIZE];
+    int length;
+
+    if (fd < 0) {
+        return false;
+    }
+
+    data[0] = REPORT_ID_SETTINGS;
+    length = ioctl (fd, HIDIOCGFEATURE (sizeof (data)), data);
+    if (length < (int)SETTINGS_REPORT_SIZE || data[0] != REPORT_ID_SETTINGS) {
+        return false;
+    }
+
+    settings.settleMs = data[1];
+    if (length >= (int)SAMPLING_SETTINGS_REPORT_SIZE) {
+        settings.tickUs = data[2] * TICK_UNIT_US;
+        settings.debounceSamples = data[3];
+    } else {
+        settings.tickUs = 0;
+        settings.debounceSamples = 0;
+    }
+    return true;
+}
+
+
+bool Device::GetBounceStats (BounceStats &stats)
+{
+    uint8_t data[BOUNCE_STATS_REPORT_SIZE + MAX_SWITCHES - 8];
+    int length, i;
+
+    if (fd < 0) {
+        return false;
+    }
+
+    data[0] = REPORT_ID_BOUNCE_STATS;
+    length = ioctl (fd, HIDIOCGFEATURE (sizeof (data)), data);
+    if (length < (int)BOUNCE_STATS_REPORT_SIZE || data[0] != REPORT_ID_BOUNCE_STATS) {
+        return false;
+    }
+
+    for (i = 0; i < BOUNCE_HIST_BINS; i++) {
+        stats.histogram[i] = data[1 + i * 2] | (data[2 + i * 2] << 8);
+    }
+    stats.switches = (length - 1 - BOUNCE_HIST_BINS * 2) & ~7;
+    for (i = 0; i < stats.switches; i++) {
+        stats.depth[i] = data[1 + BOUNCE_HIST_BINS * 2 + i] >> 4;
+        stats.bounceTicks[i] = data[1 + BOUNCE_HIST_BINS * 2 + i] & 0x0F;
+    }
+    return true;
+}
+
+
+bool Device::Query (SwitchReport &report, int timeoutMs)
+{
+    timespec start;
+    struct pollfd pfd;
+    int64_t left;
+
+    if (GetState (report)) {
+        return true;
+    }
+
+    // stale reports queued before the request do not answer it
+    while (ReadReport (report)) {
+    }
+
+    if (!RequestRefresh ()) {
+        return false;
+    }
+
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    while (fd >= 0 && (left = timeoutMs - ElapsedMs (start)) > 0) {
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        if (poll (&pfd, 1, (int)left) < 0 && errno != EINTR) {
+            return false;
+        }
+        if (ReadReport (report)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+bool Device::Query (uint8_t &switches, int timeoutMs)
+{
+    SwitchReport report;
+
+    if (!Query (report, timeoutMs)) {
+        return false;
+    }
+    switches = report.switches;
+    return true;
+}
+
+
+//-----------------------------------------------------------------------------------------------
+// StallDetector
+//
+
+StallDetector::StallDetector (int periodMs, int periods) : timeoutMs (periodMs * periods)
+{
+    Reset ();
+}
+
+
+void StallDetector::Reset ()
+{
+    clock_gettime (CLOCK_MONOTONIC, &last);
+}
+
+
+void StallDetector::Feed (const SwitchReport &report)
+{
+    last = report.received;
+}
+
+
+int StallDetector::RemainingMs () const
+{
+    return (int)std::max<int64_t> (timeoutMs - ElapsedMs (last), 0);
+}
+
+
+//-----------------------------------------------------------------------------------------------
+// ClockSync
+//
+
+ClockSync::ClockSync ()
+{
+    Reset ();
+}
+
+
+void ClockSync::Reset ()
+{
+    count = 0;
+    next = 0;
+    frameOrigin = 0;
+    timeOrigin = {};
+    frameNs = FRAME_NS;
+    offsetNs = 0.0;
+    lastSequence = -1;
+    lastFrame = 0;
+}
+
+
+// the frame count of an 11-bit frame number read at received: the latest one with that number
+// at or before the frame the fit puts the read in, give or take UNWRAP_AHEAD frames for a read
+// faster than any before it
+int64_t ClockSync::Unwrap (uint16_t frame, const timespec &received) const
+{
+    int64_t latest = (int64_t)((NsBetween (timeOrigin, received) - offsetNs) / frameNs) + 1 +
+                     UNWRAP_AHEAD;
+    int64_t back = (frameOrigin + latest - frame) % FRAME_NUMBERS;
+
+    if (back < 0) {
+        back += FRAME_NUMBERS;
+    }
+    return latest - back;
+}
+
+
+bool ClockSync::Feed (const SwitchReport &report)
+{
+    Sample sample;
+
+    if (report.sequence == lastSequence) {
+        return false;
+    }
+
+    if (count == 0) {
+        frameOrigin = report.frame;
+        timeOrigin = report.received;
+        sample.frame = 0;
+        sample.ns = 0;
+    } else {
+        sample.frame = Unwrap (report.frame, report.received);
+        sample.ns = NsBetween (timeOrigin, report.received);
+        if (sample.ns < Line (sample.frame) - FRAME_JUMP_NS) {
+            Reset ();
+            return Feed (report);
+        }
+    }
+
+    samples[next] = sample;
+    next = (next + 1) % SAMPLES;
+    count = std::min (count + 1, SAMPLES);
+    lastSequence = report.sequence;
+    lastFrame = sample.frame;
+    Fit ();
+
+    return true;
+}
+
+
+// lower edge of the samples: below every sample, with the least total distance to them. That
+// line runs along the edge of the samples' lower convex hull that spans their mean frame, so
+// it rests on the fastest reports on either side of the middle of the window rather than on
+// any single one. Until the samples span SKEW_SPAN_MS the period is taken as nominal and the
+// line rests on the fastest sample.
+void ClockSync::Fit ()
+{
+    Sample sorted[SAMPLES];
+    int hull[SAMPLES];
+    int i, h = 0;
+    double meanFrame = 0.0;
+    const Sample *a, *b;
+
+    std::copy (samples, samples + count, sorted);
+    std::sort (sorted, sorted + count, [] (const Sample &x, const Sample &y) { return x.frame < y.frame; });
+
+    frameNs = FRAME_NS;
+    if (sorted[count - 1].frame - sorted[0].frame >= SKEW_SPAN_MS) {
+        for (i = 0; i < count; i++) {
+            meanFrame += (double)sorted[i].frame / count;
+
+            // drop hull points that lie on or above the chord to the new point
+            while (h >= 2) {
+                a = &sorted[hull[h - 2]];
+                b = &sorted[hull[h - 1]];
+                if ((double)(b->ns - a->ns) * (sorted[i].frame - a->frame) <
+                        (double)(sorted[i].ns - a->ns) * (b->frame - a->frame)) {
+                    break;
+                }
+                h--;
+            }
+            hull[h++] = i;
+        }
+        for (i = 1; i < h; i++) {
+            a = &sorted[hull[i - 1]];
+            b = &sorted[hull[i]];
+            if (b->frame >= meanFrame && b->frame > a->frame) {
+                frameNs = (double)(b->ns - a->ns) / (b->frame - a->frame);
+                break;
+            }
+        }
+        frameNs = std::min (std::max (frameNs, FRAME_NS * (1.0 - MAX_SKEW)), FRAME_NS * (1.0 + MAX_SKEW));
+    }
+
+    offsetNs = sorted[0].ns - sorted[0].frame * frameNs;
+    for (i = 1; i < count; i++) {
+        offsetNs = std::min (offsetNs, sorted[i].ns - sorted[i].frame * frameNs);
+    }
+}
+
+
+bool ClockSync::ChangeTime (const SwitchReport &report, timespec &when) const
+{
+    int64_t frame, ns;
+
+    if (count == 0) {
+        return false;
+    }
+
+    if (report.sequence == lastSequence && ((frameOrigin + lastFrame) & (FRAME_NUMBERS - 1)) == report.frame) {
+        frame = lastFrame;
+    } else {
+        frame = Unwrap (report.frame, report.received);
+    }
+
+    ns = (int64_t)Line (frame);
+    when.tv_sec = timeOrigin.tv_sec + ns / 1000000000;
+    when.tv_nsec = timeOrigin.tv_nsec + ns % 1000000000;
+    if (when.tv_nsec < 0) {
+        when.tv_sec--;
+        when.tv_nsec += 1000000000;
+    } else if (when.tv_nsec >= 1000000000) {
+        when.tv_sec++;
+        when.tv_nsec -= 1000000000;
+    }
+    return true;
+}
+
+
+double ClockSync::SkewPpm () const
+{
+    return (FRAME_NS / frameNs - 1.0) * 1e6;
+}
+
+
+//-----------------------------------------------------------------------------------------------
+// Monitor
+//
+
+Monitor::Monitor () : running (false)
+{
+    epoll_event event = {};
+
+    epollFd = epoll_create1 (EPOLL_CLOEXEC);
+    if (epollFd < 0) {
+        throw SystemError ("epoll_create1");
+    }
+
+    stopFd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (stopFd < 0) {
+        int error = errno;
+        close (epollFd);
+        errno = error;
+        throw SystemError ("eventfd");
+    }
+
+    event.events = EPOLLIN;
+    event.data.ptr = nullptr;
+    epoll_ctl (epollFd, EPOLL_CTL_ADD, stopFd, &event);
+}
+
+
+Monitor::~Monitor ()
+{
+    close (stopFd);
+    close (epollFd);
+}
+
+
+void Monitor::Add (Device &device)
+{
+    epoll_event event = {};
+
+    event.events = EPOLLIN;
+    event.data.ptr = &device;
+    if (epoll_ctl (epollFd, EPOLL_CTL_ADD, device.Fd (), &event) < 0) {
+        throw SystemError ("epoll_ctl add " + device.Path ());
+    }
+}
+
+
+void Monitor::Remove (Device &device)
+{
+    if (device.Connected ()) {
+        epoll_ctl (epollFd, EPOLL_CTL_DEL, device.Fd (), nullptr);
+    }
+}
+
+
+int Monitor::Poll (int timeoutMs)
+{
+    SwitchReport report;
+    uint64_t value;
+    int n, i, handled = 0;
+
+    n = epoll_wait (epollFd, events, MAX_EVENTS, timeoutMs);
+    if (n < 0) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        throw SystemError ("epoll_wait");
+    }
+
+    for (i = 0; i < n; i++) {
+        Device *device = static_cast<Device *> (events[i].data.ptr);
+
+        if (!device) {
+            if (read (stopFd, &value, sizeof (value)) == sizeof (value)) {
+                running = false;
+            }
+            continue;
+        }
+
+        while (device->ReadReport (report)) {
+            handled++;
+            if (reportHandler) {
+                reportHandler (*device, report);
+            }
+        }
+
+        // closing the fd also drops it from the epoll set
+        if (!device->Connected () && disconnectHandler) {
+            disconnectHandler (*device);
+        }
+    }
+
+    return handled;
+}
+
+
+void Monitor::Run ()
+{
+    running = true;
+    while (running) {
+        Poll (-1);
+    }
+}
+
+
+void Monitor::Stop ()
+{
+    uint64_t one = 1;
+    ssize_t result;
+
+    // write() to an eventfd is async-signal-safe
+    result = write (stopFd, &one, sizeof (one));
+    (void)result;
+}
+
+} // namespace dipswitch
@@ -0,0 +1,421 @@
+//-----------------------------------------------------------------------------------------------
+// dipswitch.h -- Linux host library for the DIP Switch USB Stick
+//
+// Finds sticks through sysfs, talks to them through hidraw and delivers report ID 1 from an
+// epoll loop. Reports are read into buffers owned by the Device, so the receive path does no
+// heap allocation. Setup errors (open, epoll) throw std::system_error; the per-report calls
+// return false instead.
+//
+
+#ifndef DIPSWITCH_H
+#define DIPSWITCH_H
+
+//-----------------------------------------------------------------------------------------------
+// includes
+//
+
+#include <cstdint>
+#include <ctime>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <sys/epoll.h>
+
+
+namespace dipswitch {
+
+//-----------------------------------------------------------------------------------------------
+// defines
+//
+
+constexpr uint16_t VENDOR_ID = 0x4247;
+constexpr uint16_t PRODUCT_ID = 0x0019;
+
+// hid_rpt01 in usb_descriptors.c
+constexpr uint8_t REPORT_ID_SWITCHES = 0x01;
+constexpr uint8_t REPORT_ID_COMMAND = 0x02;
+constexpr uint8_t REPORT_ID_STATE = 0x03;      // feature report, read with GET_REPORT on EP0
+constexpr uint8_t REPORT_ID_ISR_STATS = 0x04;  // feature report, interrupt accounting
+constexpr uint8_t REPORT_ID_LOOP_STATS = 0x05; // feature report, main loop timing
+constexpr uint8_t REPORT_ID_SETTINGS = 0x06;   // feature report, settle window and sampling
+constexpr uint8_t REPORT_ID_BOUNCE_STATS = 0x07; // feature report, bounce learning
+constexpr uint8_t COMMAND_REFRESH = 0x55;
+constexpr uint8_t COMMAND_HEARTBEAT = 0x49;    // argument: SET_IDLE duration, 4 ms units
+constexpr uint8_t COMMAND_SETTLE = 0x53;       // argument: settle window, ms
+constexpr uint8_t COMMAND_SETTLE_NOW = 0x46;   // let a change in its settle window out now
+constexpr uint8_t COMMAND_TICK = 0x54;         // argument: sampling tick, TICK_UNIT_US units
+constexpr uint8_t COMMAND_DEBOUNCE = 0x44;     // argument: consecutive samples to debounce, 0 adaptive
+constexpr uint8_t COMMAND_SAMPLING = 0x50;     // argument: tick << 4 | samples, one flash write
+
+// heartbeat period resolution and the longest period the stick can time
+constexpr int HEARTBEAT_UNIT_MS = 4;
+constexpr int MAX_HEARTBEAT_MS = 255 * HEARTBEAT_UNIT_MS;
+
+// report ID 1: the switch byte, the little-endian 1 ms timestamp, the sequence number and
+// the little-endian USB frame number
+constexpr size_t SWITCH_REPORT_SIZE = 7;
+
+// feature report 3: the switch report with the stick's report queue drop count between the
+// sequence number and the frame number
+constexpr size_t STATE_REPORT_SIZE = 8;
+
+// firmware built with SWITCH_BYTES > 1 has that many switch bytes where the one was, the
+// stick's own and one per 74HC165 on its expansion chain: report ID 1 and feature report 3
+// grow by a byte each per extra switch byte
+constexpr size_t MAX_SWITCH_BYTES = 8;
+
+// the host's USB frame counter, 11 bits at 1 ms per frame
+constexpr int FRAME_NUMBERS = 2048;
+
+// feature report 4: ten bytes per IsrStats source after the report ID
+constexpr size_t ISR_STATS_REPORT_SIZE = 41;
+
+// feature report 5: the LoopStats counters and maxima, then the two histograms, 16 bits each
+constexpr size_t LOOP_STATS_REPORT_SIZE = 41;
+constexpr int LOOP_HIST_BINS = 8;
+constexpr int LOOP_HIST_SHIFT = 7;      // bin n counts times below 128 << n cycles
+
+// feature report 6: the settle window, and on current firmware the sampling tick and the
+// debounce depth after it; the longest the stick can hold a change, and the sampling the
+// stick can be set to
+constexpr size_t SETTINGS_REPORT_SIZE = 2;
+constexpr size_t SAMPLING_SETTINGS_REPORT_SIZE = 4;
+constexpr int MAX_SETTLE_MS = 255;
+constexpr int TICK_UNIT_US = 200;
+constexpr int MIN_TICK_US = TICK_UNIT_US;
+constexpr int MAX_TICK_US = 10 * TICK_UNIT_US;
+constexpr int MAX_DEBOUNCE_SAMPLES = 8;
+constexpr int DEBOUNCE_ADAPTIVE = 0;    // each switch its own depth, learned from its bounce
+constexpr int SAMPLING_APPLY_MS = 50;   // the stick takes new settings within this, flash write included
+
+// feature report 7: the bounce histogram, 16 bits a bin, then a byte per switch with its
+// debounce depth in the high nibble and its learned bounce in ticks in the low nibble, a
+// switch byte's worth of switches more per expansion byte. Bin 0 counts changes with no
+// bounce, bin n bounces below BOUNCE_HIST_UNIT_US << n, the last bin everything longer
+constexpr size_t BOUNCE_STATS_REPORT_SIZE = 1 + 8 * 2 + 8;
+constexpr int BOUNCE_HIST_BINS = 8;
+constexpr int BOUNCE_HIST_UNIT_US = TICK_UNIT_US;
+constexpr size_t MAX_SWITCHES = MAX_SWITCH_BYTES * 8;
+
+// the stick's instruction cycle, Fosc/4 at 48 MHz, the unit of the interrupt accounting
+constexpr double CYCLE_NS = 1000.0 / 12.0;
+
+// interrupt endpoint size, the largest report hidraw can hand us
+constexpr size_t MAX_REPORT_SIZE = 64;
+
+// firmware built with SWITCH_DESCRIPTOR_EVDEV also shows up as an evdev node, one EV_KEY per
+// switch: BTN_0 = SW1 ... BTN_7 = SW8, value 1 = on
+constexpr uint16_t SWITCH_KEY_FIRST = 0x100;    // BTN_0
+
+
+//-----------------------------------------------------------------------------------------------
+// typedefs
+//
+
+// one decoded report ID 1; bit 7 = SW1 ... bit 0 = SW8, a set bit is a switch in the on position
+struct SwitchReport {
+    uint8_t switches;       // the stick's own eight, bytes[0]
+    uint8_t width;          // switch bytes the stick reports, 1 but on an expansion build
+    uint8_t bytes[MAX_SWITCH_BYTES];    // bytes[n] bit 7 = SW(8n+1) ... bit 0 = SW(8n+8)
+    uint16_t deviceMs;      // the stick's USB 1 ms tick count when the change was debounced
+    uint8_t sequence;       // counts debounced changes; a refresh answer repeats the last one
+    uint16_t frame;         // the host's USB frame number when the change was debounced
+    uint8_t missed;         // changes the stick could not queue since its previous report
+    timespec received;      // CLOCK_MONOTONIC right after read() returned
+};
+
+
+// one source in the stick's interrupt accounting. count and cycles wrap, difference two reads;
+// maxCycles is the most since the previous read, which clears it
+struct IsrSourceStats {
+    uint32_t count;
+    uint32_t cycles;
+    uint16_t maxCycles;
+};
+
+// feature report 4, ISR_STATS in the firmware's system.h
+struct IsrStats {
+    IsrSourceStats usb;         // USB servicing on interrupts with a USB event
+    IsrSourceStats usbIdle;     // the same call on interrupts only the 1 ms tick caused
+    IsrSourceStats tick;        // the tick's own handler
+    IsrSourceStats tickLatency; // per tick, cycles from the timer match to its handler
+};
+
+// feature report 5, LOOP_STATS in the firmware's system.h. The counts wrap at 16 bits,
+// difference two reads; the maxima are the most since the previous read, which clears them
+struct LoopStats {
+    uint16_t overruns;      // ticks that came while the main loop still had the one before
+    uint16_t lostTicks;     // ticks whose interrupt was held off past the next one
+    uint16_t pickupMax;     // cycles
+    uint16_t passMax;
+    uint16_t pickup[LOOP_HIST_BINS];    // from each tick's interrupt to the main loop taking it
+    uint16_t pass[LOOP_HIST_BINS];      // each main loop pass, not counting its wait
+};
+
+// feature report 6, what the stick is set to
+struct Settings {
+    int settleMs;           // changes are reported once the switches have been still this long
+    int tickUs;             // the switches are sampled this often, 0 on older firmware
+    int debounceSamples;    // consecutive equal samples that change a switch, DEBOUNCE_ADAPTIVE
+                            // or, with tickUs 0, older firmware
+};
+
+// feature report 7, BOUNCE_STATS in the firmware's system.h: how long each debounced change
+// bounced, from the first sample that disagreed with the old state to the start of the run
+// that was taken, and what each switch has learned. The histogram wraps at 16 bits and
+// counts from power on, difference two reads. The stick learns at any depth but only uses
+// the learned depths when set to DEBOUNCE_ADAPTIVE
+struct BounceStats {
+    uint16_t histogram[BOUNCE_HIST_BINS];
+    int switches;                       // SW1 first, 8 per switch byte the stick reports
+    uint8_t depth[MAX_SWITCHES];        // samples that change the switch
+    uint8_t bounceTicks[MAX_SWITCHES];  // its longest recent bounce, in ticks, saturating at 15
+};
+
+
+//-----------------------------------------------------------------------------------------------
+// device discovery
+//
+
+// hidraw device nodes (/dev/hidrawN) of every attached stick, in sysfs order
+std::vector<std::string> FindDevices (uint16_t vendorId = VENDOR_ID, uint16_t productId = PRODUCT_ID);
+
+// the evdev node (/dev/input/eventN) hid-input created for the same stick as a hidraw node,
+// empty if there is none, e.g. for firmware with the vendor page report descriptor
+std::string FindEventDevice (const std::string &hidrawPath);
+
+
+//-----------------------------------------------------------------------------------------------
+// report decoding
+//
+
+// decode one report ID 1 as read from hidraw, report ID byte first; false for anything
+// else. Leaves missed at 0 and received alone, Device fills those in.
+bool DecodeSwitchReport (const uint8_t *data, size_t length, SwitchReport &report);
+
+// milliseconds from device timestamp a to b, for timestamps less than 32 s apart
+inline int DeviceMsBetween (uint16_t a, uint16_t b) { return (int16_t)(uint16_t)(b - a); }
+
+
+//-----------------------------------------------------------------------------------------------
+// one stick
+//
+
+class Device {
+public:
+    explicit Device (const std::string &path);
+    ~Device ();
+
+    Device (const Device &) = delete;
+    Device &operator= (const Device &) = delete;
+
+    int Fd () const { return fd; }
+    const std::string &Path () const { return path; }
+    bool Connected () const { return fd >= 0; }
+
+    // ask the stick to send its current state as report ID 1
+    bool RequestRefresh ();
+
+    // have the stick repeat its current report whenever it has sent none for periodMs, 0 =
+    // only on changes. The same as HID SET_IDLE, which hidraw has no way to send; rounded up
+    // to 4 ms and limited to MAX_HEARTBEAT_MS. Older firmware ignores it.
+    bool SetHeartbeat (int periodMs);
+
+    // have the stick hold each change until no switch has moved for windowMs, so switches
+    // flipped together make one report, 0 = report every change at once. Limited to
+    // MAX_SETTLE_MS; a new USB configuration goes back to the firmware's built-in window.
+    // SettleNow() lets a change the window is holding out straight away. Older firmware
+    // ignores both.
+    bool SetSettleWindow (int windowMs);
+    bool SettleNow ();
+
+    // set how often the stick samples its switches, rounded to TICK_UNIT_US and limited to
+    // MIN_TICK_US to MAX_TICK_US, and how many consecutive equal samples change a switch, 1
+    // to MAX_DEBOUNCE_SAMPLES. A change is reported between samples - 1 and samples ticks
+    // after its edge. DEBOUNCE_ADAPTIVE gives each switch one sample more than the bounce it
+    // has shown lately, 2 to MAX_DEBOUNCE_SAMPLES, see GetBounceStats(). The stick keeps both
+    // in flash over a power cycle; it only rewrites the flash when they change and stops for
+    // about 4 ms while it does. A new tick restarts the learning. Older firmware ignores both,
+    // firmware before the bounce learning takes at most 4 samples and ignores 0.
+    bool SetSampleTick (int tickUs);
+    bool SetDebounceSamples (int samples);
+
+    // both of the above in one command, so changing both costs the stick one flash
+    // erase/write cycle instead of two. The stick takes them from its main loop, within
+    // SAMPLING_APPLY_MS.
+    bool SetSampling (int tickUs, int samples);
+
+    // non-blocking; true if a switch report was read. Other report IDs are skipped. Returns
+    // false once the queue is empty or the stick has gone away (Connected() turns false).
+    bool ReadReport (SwitchReport &report);
+
+    // read feature report 3 with GET_REPORT on the control pipe, one synchronous round trip
+    // answered from the stick's debounced state. queueDrops, if given, gets the number of
+    // changes the stick's report queue dropped. False on firmware without the feature report.
+    bool GetState (SwitchReport &report, uint8_t *queueDrops = nullptr);
+
+    // read feature report 4, the stick's interrupt accounting; clears its maxima. False on
+    // firmware without it
+    bool GetIsrStats (IsrStats &stats);
+
+    // read feature report 5, the stick's main loop timing; clears its maxima. False on
+    // firmware without it
+    bool GetLoopStats (LoopStats &stats);
+
+    // read feature report 6, the stick's settings. False on firmware without it
+    bool GetSettings (Settings &settings);
+
+    // read feature report 7, the stick's bounce learning. False on firmware without it
+    bool GetBounceStats (BounceStats &stats);
+
+    // the current switches for use at process start: GetState(), or on older firmware
+    // RequestRefresh() and wait for the answer. The report form has every switch byte
+    bool Query (SwitchReport &report, int timeoutMs = 100);
+    bool Query (uint8_t &switches, int timeoutMs = 100);
+
+    void Close ();
+
+private:
+    std::string path;
+    int fd;
+    int lastSequence;       // -1 until the first report
+    uint8_t buffer[MAX_REPORT_SIZE];
+};
+
+
+//-----------------------------------------------------------------------------------------------
+// liveness check on top of the heartbeat
+//
+
+// with SetHeartbeat() on, a working stick sends a report at least once per period, so a gap
+// of several periods means it has stopped answering even though its hidraw node is still
+// there, e.g. hung firmware or a wedged hub. Feed() every report; use RemainingMs() as the
+// Poll() timeout and check Stalled() after it.
+class StallDetector {
+public:
+    // stalled after periods heartbeat periods with no report
+    explicit StallDetector (int periodMs, int periods = 3);
+
+    // restart the wait, e.g. after (re)connecting and calling SetHeartbeat()
+    void Reset ();
+
+    // any report from the stick, heartbeat or change
+    void Feed (const SwitchReport &report);
+
+    // milliseconds left before the stick counts as stalled, 0 once it has
+    int RemainingMs () const;
+    bool Stalled () const { return RemainingMs () == 0; }
+
+    int TimeoutMs () const { return timeoutMs; }
+
+private:
+    int timeoutMs;
+    timespec last;
+};
+
+
+//-----------------------------------------------------------------------------------------------
+// host clock correlation
+//
+
+// places changes on CLOCK_MONOTONIC from their frame numbers. The frame number comes from the
+// host controller's own 1 ms frame counter, so unlike deviceMs it keeps counting through a
+// suspend and never misses a frame. Every report is read some time after its frame, the
+// fastest ones just after it, so the fit follows the lower edge of the (frame, read time)
+// samples and a report held up in a queue only ever lands above it. The mapped time is the
+// change's frame plus the shortest path from the stick to read() seen so far, the same for
+// every report, to within about a frame; read() times alone carry each report's own wait.
+// Feed() every report and use ChangeTime() for the ones to log. The frame clock's rate
+// against CLOCK_MONOTONIC is fitted once the samples span SKEW_SPAN_MS.
+class ClockSync {
+public:
+    static constexpr int SAMPLES = 64;
+    static constexpr int64_t SKEW_SPAN_MS = 10000;
+
+    ClockSync ();
+
+    // forget the fit, e.g. after reconnecting the stick
+    void Reset ();
+
+    // take a report's frame and read time as a sample; only new changes from firmware with
+    // frame numbers count, refresh answers and heartbeats repeat an old frame. True if the
+    // report was used
+    bool Feed (const SwitchReport &report);
+
+    // CLOCK_MONOTONIC estimate of when the report's change was debounced; false before the
+    // first sample. A repeat of the change Feed() took last maps to the same time, any other
+    // report must arrive within about two seconds of its change, the frame number's range
+    bool ChangeTime (const SwitchReport &report, timespec &when) const;
+
+    bool Synced () const { return count > 0; }
+
+    // how far the frame clock runs fast (+) or slow (-) against CLOCK_MONOTONIC, 0 until the
+    // samples span SKEW_SPAN_MS
+    double SkewPpm () const;
+
+private:
+    struct Sample {
+        int64_t frame;      // frames since frameOrigin
+        int64_t ns;         // read time, ns since timeOrigin
+    };
+
+    int64_t Unwrap (uint16_t frame, const timespec &received) const;
+    double Line (int64_t frame) const { return offsetNs + frame * frameNs; }
+    void Fit ();
+
+    Sample samples[SAMPLES];
+    int count;
+    int next;
+    int64_t frameOrigin;    // absolute frame count of the first sample
+    timespec timeOrigin;    // its read time
+    double frameNs;         // fitted frame period
+    double offsetNs;        // fitted read time of frame 0
+    int lastSequence;       // change of the last sample, -1 for none
+    int64_t lastFrame;
+};
+
+
+//-----------------------------------------------------------------------------------------------
+// epoll loop over any number of sticks
+//
+
+class Monitor {
+public:
+    using ReportHandler = std::function<void (Device &, const SwitchReport &)>;
+    using DisconnectHandler = std::function<void (Device &)>;
+
+    Monitor ();
+    ~Monitor ();
+
+    Monitor (const Monitor &) = delete;
+    Monitor &operator= (const Monitor &) = delete;
+
+    void OnReport (ReportHandler handler) { reportHandler = std::move (handler); }
+    void OnDisconnect (DisconnectHandler handler) { disconnectHandler = std::move (handler); }
+
+    void Add (Device &device);
+    void Remove (Device &device);
+
+    // wait up to timeoutMs (-1 forever) and dispatch every report that is ready; returns the
+    // number of reports handled
+    int Poll (int timeoutMs);
+
+    // Poll() until Stop(); Stop() is safe to call from another thread or a signal handler
+    void Run ();
+    void Stop ();
+
+private:
+    static constexpr int MAX_EVENTS = 16;
+
+    int epollFd;
+    int stopFd;
+    bool running;
+    epoll_event events[MAX_EVENTS];
+    ReportHandler reportHandler;
+    DisconnectHandler disconnectHandler;
+};
+
+} // namespace dipswitch
+
+#endif //DIPSWITCH_H
@@ -0,0 +1,220 @@
+//-----------------------------------------------------------------------------------------------
+// dipswitchd.cpp -- owns the stick and publishes its switch state in shared memory
+//
+// usage: dipswitchd [-i ms] [-s ms] [-t us] [-d samples] [/dev/hidrawN]
+//
+// Opens the stick (the first one found in sysfs unless a node is given), sends the single
+// 0x55 refresh request and then publishes every report ID 1 through SharedStateWriter.
+// When the stick goes away the segment is marked disconnected and the daemon looks for it
+// again once a second. Workers read the state with SharedStateReader instead of opening the
+// device themselves.
+//
+//   -i ms   have the stick send a heartbeat report every ms milliseconds and treat it as
+//           gone after STALL_PERIODS heartbeats with no report, even if its hidraw node is
+//           still there; default 0 = off, for firmware without the heartbeat
+//   -s ms   have the stick hold each change until the switches have been still for ms
+//           milliseconds, so several switches flipped together publish once; default the
+//           firmware's own window
+//   -t us   have the stick sample its switches every us microseconds, 200 to 2000 in steps
+//           of 200; default whatever the stick was last set to
+//   -d n    have the stick change a switch after n consecutive equal samples, 1 to 8, or
+//           with 0 give each switch a depth learned from its own bounce; default whatever
+//           the stick was last set to. The stick keeps -t and -d in flash, and setting them
+//           again to what they already are does not rewrite it
+//
+
+//-----------------------------------------------------------------------------------------------
+// includes
+//
+
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <system_error>
+
+#include <unistd.h>
+
+#include "dipswitch.h"
+#include "shared_state.h"
+
+
+//-----------------------------------------------------------------------------------------------
+// defines
+//
+
+#define RECONNECT_MS    1000
+#define STALL_PERIODS   3
+
+
+//-----------------------------------------------------------------------------------------------
+// globals
+//
+
+static dipswitch::Monitor *activeMonitor;
+static volatile sig_atomic_t quit;
+
+
+//-----------------------------------------------------------------------------------------------
+// functions
+//
+
+static void Quit (int signal)
+{
+    quit = 1;
+    if (activeMonitor) {
+        activeMonitor->Stop ();
+    }
+}
+
+
+static std::unique_ptr<dipswitch::Device> Connect (const std::string &path)
+{
+    std::vector<std::string> devices;
+    std::string node = path;
+
+    if (node.empty ()) {
+        devices = dipswitch::FindDevices ();
+        if (devices.empty ()) {
+            return nullptr;
+        }
+        node = devices[0];
+    }
+
+    try {
+        return std::unique_ptr<dipswitch::Device> (new dipswitch::Device (node));
+    } catch (const std::system_error &e) {
+        fprintf (stderr, "dipswitchd: %s\n", e.what ());
+        return nullptr;
+    }
+}
+
+
+int main (int argc, char *argv[])
+{
+    std::string path;
+    std::unique_ptr<dipswitch::Device> device;
+    bool disconnected = false;
+    int heartbeatMs = 0;
+    int settleMs = -1;
+    int tickUs = 0;
+    int debounceSamples = -1;
+    int opt;
+
+    while ((opt = getopt (argc, argv, "i:s:t:d:")) != -1) {
+        switch (opt) {
+        case 'i':
+            heartbeatMs = atoi (optarg);
+            break;
+        case 's':
+            settleMs = atoi (optarg);
+            if (settleMs < 0) {
+                settleMs = dipswitch::MAX_SETTLE_MS + 1;
+            }
+            break;
+        case 't':
+            tickUs = atoi (optarg);
+            if (tickUs <= 0) {
+                tickUs = -1;
+            }
+            break;
+        case 'd':
+            debounceSamples = atoi (optarg);
+            if (debounceSamples < 0) {
+                debounceSamples = dipswitch::MAX_DEBOUNCE_SAMPLES + 1;
+            }
+            break;
+        default:
+            fprintf (stderr, "usage: dipswitchd [-i ms] [-s ms] [-t us] [-d samples] [/dev/hidrawN]\n");
+            return 1;
+        }
+    }
+    if (heartbeatMs < 0 || heartbeatMs > dipswitch::MAX_HEARTBEAT_MS ||
+            settleMs > dipswitch::MAX_SETTLE_MS ||
+            (tickUs != 0 && (tickUs < dipswitch::MIN_TICK_US || tickUs > dipswitch::MAX_TICK_US ||
+                             tickUs % dipswitch::TICK_UNIT_US != 0)) ||
+            debounceSamples > dipswitch::MAX_DEBOUNCE_SAMPLES ||
+            argc > optind + 1) {
+        fprintf (stderr, "usage: dipswitchd [-i ms] [-s ms] [-t us] [-d samples] [/dev/hidrawN], "
+                 "-i up to %d ms, -s up to %d ms, -t %d to %d us in steps of %d, -d 0 to %d\n",
+                 dipswitch::MAX_HEARTBEAT_MS, dipswitch::MAX_SETTLE_MS, dipswitch::MIN_TICK_US,
+                 dipswitch::MAX_TICK_US, dipswitch::TICK_UNIT_US, dipswitch::MAX_DEBOUNCE_SAMPLES);
+        return 1;
+    }
+    if (argc == optind + 1) {
+        path = argv[optind];
+    }
+
+    try {
+        dipswitch::SharedStateWriter state;
+        dipswitch::Monitor monitor;
+        dipswitch::StallDetector stall (heartbeatMs, STALL_PERIODS);
+
+        monitor.OnReport ([&state, &stall] (dipswitch::Device &, const dipswitch::SwitchReport &report) {
+            stall.Feed (report);
+            state.Publish (report.bytes, report.width, report.received);
+        });
+        monitor.OnDisconnect ([&state, &disconnected] (dipswitch::Device &device) {
+            fprintf (stderr, "dipswitchd: %s disconnected\n", device.Path ().c_str ());
+            state.SetConnected (false);
+            disconnected = true;
+        });
+
+        activeMonitor = &monitor;
+        signal (SIGINT, Quit);
+        signal (SIGTERM, Quit);
+
+        while (!quit) {
+            if (!device) {
+                device = Connect (path);
+                if (!device) {
+                    monitor.Poll (RECONNECT_MS);
+                    continue;
+                }
+                fprintf (stderr, "dipswitchd: publishing %s\n", device->Path ().c_str ());
+                monitor.Add (*device);
+                if (heartbeatMs) {
+                    device->SetHeartbeat (heartbeatMs);
+                    stall.Reset ();
+                }
+                if (settleMs >= 0) {
+                    device->SetSettleWindow (settleMs);
+                }
+                // both at once is a single flash write on the stick
+                if (tickUs && debounceSamples >= 0) {
+                    device->SetSampling (tickUs, debounceSamples);
+                } else if (tickUs) {
+                    device->SetSampleTick (tickUs);
+                } else if (debounceSamples >= 0) {
+                    device->SetDebounceSamples (debounceSamples);
+                }
+                device->RequestRefresh ();
+            }
+
+            monitor.Poll (heartbeatMs ? stall.RemainingMs () : -1);
+
+            // no report, not even a heartbeat, for several periods: publish the stick as
+            // gone and open it afresh, which also sends the heartbeat request again
+            if (heartbeatMs && !disconnected && stall.Stalled ()) {
+                fprintf (stderr, "dipswitchd: %s stalled, no report for %d ms\n",
+                         device->Path ().c_str (), stall.TimeoutMs ());
+                state.SetConnected (false);
+                monitor.Remove (*device);
+                device.reset ();
+                monitor.Poll (RECONNECT_MS);
+            }
+
+            if (disconnected) {
+                disconnected = false;
+                device.reset ();
+            }
+        }
+
+        activeMonitor = nullptr;
+    } catch (const std::system_error &e) {
+        fprintf (stderr, "dipswitchd: %s\n", e.what ());
+        return 1;
+    }
+
+    return 0;
+}
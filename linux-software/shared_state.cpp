@@ -0,0 +1,196 @@
+//-----------------------------------------------------------------------------------------------
+// shared_state.cpp -- switch state published in POSIX shared memory
+//
+
+//-----------------------------------------------------------------------------------------------
+// includes
+//
+
+#include "shared_state.h"
+
+#include <cerrno>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+namespace dipswitch {
+
+static_assert (std::atomic<uint64_t>::is_always_lock_free, "shared atomics must be lock free");
+static_assert (std::atomic<int64_t>::is_always_lock_free, "shared atomics must be lock free");
+static_assert (std::atomic<uint8_t>::is_always_lock_free, "shared atomics must be lock free");
+
+
+//-----------------------------------------------------------------------------------------------
+// local functions
+//
+
+static std::system_error SystemError (const std::string &what)
+{
+    return std::system_error (errno, std::generic_category (), what);
+}
+
+
+static void *MapSegment (const std::string &name, bool writer)
+{
+    int fd, error;
+    void *p;
+
+    fd = shm_open (name.c_str (), writer ? (O_RDWR | O_CREAT) : O_RDONLY, 0644);
+    if (fd < 0) {
+        throw SystemError ("shm_open " + name);
+    }
+    if (writer && ftruncate (fd, sizeof (SharedSegment)) < 0) {
+        error = errno;
+        close (fd);
+        errno = error;
+        throw SystemError ("ftruncate " + name);
+    }
+
+    p = mmap (nullptr, sizeof (SharedSegment), writer ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, fd, 0);
+    error = errno;
+    close (fd);
+    if (p == MAP_FAILED) {
+        errno = error;
+        throw SystemError ("mmap " + name);
+    }
+
+    return p;
+}
+
+
+//-----------------------------------------------------------------------------------------------
+// SharedStateWriter
+//
+
+SharedStateWriter::SharedStateWriter (const std::string &name)
+{
+    segment = static_cast<SharedSegment *> (MapSegment (name, true));
+
+    // a segment left by an earlier daemon keeps its seqlock value so readers that still have
+    // it mapped never see the counter go backwards
+    if (segment->magic != SHARED_STATE_MAGIC || segment->version != SHARED_STATE_VERSION) {
+        segment->seqlock.store (0, std::memory_order_relaxed);
+    }
+    Begin ();
+    segment->connected.store (0, std::memory_order_relaxed);
+    segment->width.store (1, std::memory_order_relaxed);
+    for (std::atomic<uint8_t> &b : segment->bytes) {
+        b.store (0, std::memory_order_relaxed);
+    }
+    segment->sequence.store (0, std::memory_order_relaxed);
+    segment->updatedNs.store (0, std::memory_order_relaxed);
+    End ();
+
+    segment->version = SHARED_STATE_VERSION;
+    std::atomic_thread_fence (std::memory_order_release);
+    segment->magic = SHARED_STATE_MAGIC;
+}
+
+
+SharedStateWriter::~SharedStateWriter ()
+{
+    // leave the segment behind marked disconnected so readers can tell the daemon is gone
+    SetConnected (false);
+    munmap (segment, sizeof (SharedSegment));
+}
+
+
+void SharedStateWriter::Begin ()
+{
+    uint32_t s = segment->seqlock.load (std::memory_order_relaxed);
+
+    segment->seqlock.store (s + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence (std::memory_order_release);
+}
+
+
+void SharedStateWriter::End ()
+{
+    uint32_t s = segment->seqlock.load (std::memory_order_relaxed);
+
+    segment->seqlock.store (s + 1, std::memory_order_release);
+}
+
+
+void SharedStateWriter::Publish (const uint8_t *bytes, uint8_t width, const timespec &received)
+{
+    size_t b;
+
+    if (width > MAX_SWITCH_BYTES) {
+        width = MAX_SWITCH_BYTES;
+    }
+
+    Begin ();
+    segment->connected.store (1, std::memory_order_relaxed);
+    segment->width.store (width, std::memory_order_relaxed);
+    for (b = 0; b < MAX_SWITCH_BYTES; b++) {
+        segment->bytes[b].store (b < width ? bytes[b] : 0, std::memory_order_relaxed);
+    }
+    segment->sequence.store (segment->sequence.load (std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    segment->updatedNs.store ((int64_t)received.tv_sec * 1000000000 + received.tv_nsec, std::memory_order_relaxed);
+    End ();
+}
+
+
+void SharedStateWriter::SetConnected (bool connected)
+{
+    Begin ();
+    segment->connected.store (connected ? 1 : 0, std::memory_order_relaxed);
+    End ();
+}
+
+
+//-----------------------------------------------------------------------------------------------
+// SharedStateReader
+//
+
+SharedStateReader::SharedStateReader (const std::string &name)
+{
+    segment = static_cast<const SharedSegment *> (MapSegment (name, false));
+
+    if (segment->magic != SHARED_STATE_MAGIC || segment->version != SHARED_STATE_VERSION) {
+        munmap (const_cast<SharedSegment *> (segment), sizeof (SharedSegment));
+        errno = EPROTO;
+        throw SystemError ("shared state " + name + " has an unknown layout");
+    }
+}
+
+
+SharedStateReader::~SharedStateReader ()
+{
+    munmap (const_cast<SharedSegment *> (segment), sizeof (SharedSegment));
+}
+
+
+SharedSnapshot SharedStateReader::Read () const
+{
+    SharedSnapshot snapshot;
+    uint32_t before, after;
+    int64_t ns;
+    size_t b;
+
+    do {
+        before = segment->seqlock.load (std::memory_order_acquire);
+        snapshot.connected = segment->connected.load (std::memory_order_relaxed) != 0;
+        snapshot.width = (uint8_t)segment->width.load (std::memory_order_relaxed);
+        for (b = 0; b < MAX_SWITCH_BYTES; b++) {
+            snapshot.bytes[b] = segment->bytes[b].load (std::memory_order_relaxed);
+        }
+        snapshot.sequence = segment->sequence.load (std::memory_order_relaxed);
+        ns = segment->updatedNs.load (std::memory_order_relaxed);
+        std::atomic_thread_fence (std::memory_order_acquire);
+        after = segment->seqlock.load (std::memory_order_relaxed);
+    } while ((before & 1) || before != after);
+
+    snapshot.switches = snapshot.bytes[0];
+
+    snapshot.updated.tv_sec = ns / 1000000000;
+    snapshot.updated.tv_nsec = ns % 1000000000;
+    return snapshot;
+}
+
+} // namespace dipswitch
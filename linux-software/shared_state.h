@@ -0,0 +1,109 @@
+//-----------------------------------------------------------------------------------------------
+// shared_state.h -- switch state published in POSIX shared memory
+//
+// dipswitchd owns the hidraw handle and writes every report into a small shared memory
+// segment guarded by a seqlock. Readers map the segment once; after that a read is a handful
+// of loads with no system call, so any number of worker processes can poll it.
+//
+
+#ifndef DIPSWITCH_SHARED_STATE_H
+#define DIPSWITCH_SHARED_STATE_H
+
+//-----------------------------------------------------------------------------------------------
+// includes
+//
+
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <string>
+
+#include "dipswitch.h"
+
+
+namespace dipswitch {
+
+//-----------------------------------------------------------------------------------------------
+// defines
+//
+
+// shm_open() name, the segment shows up as /dev/shm/dipswitch
+#define DIPSWITCH_SHM_NAME "/dipswitch"
+
+constexpr uint32_t SHARED_STATE_MAGIC = 0x44495053;    // "DIPS"
+constexpr uint32_t SHARED_STATE_VERSION = 2;    // 2: every switch byte, not just the first
+
+
+//-----------------------------------------------------------------------------------------------
+// typedefs
+//
+
+// segment layout. seqlock is odd while the writer is updating the fields below it; all fields
+// are atomics so the racy reads a seqlock relies on are well defined
+struct SharedSegment {
+    uint32_t magic;
+    uint32_t version;
+    alignas (64) std::atomic<uint32_t> seqlock;
+    std::atomic<uint32_t> connected;
+    std::atomic<uint32_t> width;            // switch bytes in bytes[], 1 but on an expansion build
+    std::atomic<uint8_t> bytes[MAX_SWITCH_BYTES];   // as SwitchReport::bytes
+    std::atomic<uint64_t> sequence;         // reports published since the daemon started
+    std::atomic<int64_t> updatedNs;         // CLOCK_MONOTONIC of the last report
+};
+
+struct SharedSnapshot {
+    uint8_t switches;       // the stick's own eight, bytes[0]
+    uint8_t width;
+    uint8_t bytes[MAX_SWITCH_BYTES];
+    bool connected;
+    uint64_t sequence;
+    timespec updated;
+};
+
+
+//-----------------------------------------------------------------------------------------------
+// writer, one per segment
+//
+
+class SharedStateWriter {
+public:
+    explicit SharedStateWriter (const std::string &name = DIPSWITCH_SHM_NAME);
+    ~SharedStateWriter ();
+
+    SharedStateWriter (const SharedStateWriter &) = delete;
+    SharedStateWriter &operator= (const SharedStateWriter &) = delete;
+
+    // the report's first width switch bytes, width at most MAX_SWITCH_BYTES
+    void Publish (const uint8_t *bytes, uint8_t width, const timespec &received);
+    void SetConnected (bool connected);
+
+private:
+    void Begin ();
+    void End ();
+
+    SharedSegment *segment;
+};
+
+
+//-----------------------------------------------------------------------------------------------
+// reader
+//
+
+class SharedStateReader {
+public:
+    explicit SharedStateReader (const std::string &name = DIPSWITCH_SHM_NAME);
+    ~SharedStateReader ();
+
+    SharedStateReader (const SharedStateReader &) = delete;
+    SharedStateReader &operator= (const SharedStateReader &) = delete;
+
+    // consistent copy of the segment, retries while the writer is mid-update
+    SharedSnapshot Read () const;
+
+private:
+    const SharedSegment *segment;
+};
+
+} // namespace dipswitch
+
+#endif //DIPSWITCH_SHARED_STATE_H
@@ -0,0 +1,334 @@
+//-----------------------------------------------------------------------------------------------
+// bounce_test.c -- checks the adaptive per-switch debounce and its bounce learning
+//
+// usage: bounce_test [flips [seed]]
+//
+// Three switches are flipped over and over at random phases against the tick: SW1 clean,
+// SW2 with a short bounce and SW3 like a worn contact, whose bounce has stretches back at
+// the old level long enough to be taken for a change at a depth of 2. At a fixed depth of
+// 2 SW3 must chatter. Feature report 7 must start every switch at DEBOUNCE_ADAPT_START at
+// power on, and the bounce is learned at a fixed depth too. With the depth set to 0,
+// adaptive, and the switches flipped for a while, it must hold a depth of DEBOUNCE_ADAPT_MIN
+// for SW1, little more for SW2 and more than its longest stretch of bounce for SW3. Flipped
+// again, every switch must then change exactly once per flip, SW1 must be reported at least
+// a tick sooner than at the fixed default of 4 samples, and the histogram must have counted
+// every change, SW1's as no bounce. After a power cycle the stick must still be adaptive
+// but start learning afresh.
+//
+// Compiled with the firmware flags so it sees BOUNCE_STATS and the limits from system.h.
+//
+
+//-----------------------------------------------------------------------------------------------
+// includes
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "system.h"
+
+#include "sim.h"
+
+
+//-----------------------------------------------------------------------------------------------
+// defines
+//
+
+#define DEFAULT_FLIPS       48
+#define DEFAULT_SEED        1
+
+#define REPORT_ID_SWITCHES  0x01
+#define REPORT_ID_COMMAND   0x02
+#define REPORT_ID_SETTINGS  0x06
+#define REPORT_ID_BOUNCE    0x07
+
+#define COMMAND_DEBOUNCE    0x44
+
+#define SETTLE              SIM_MS(60)
+
+#define SWITCHES            3
+
+// SW3's longest stretch at the new level during its bounce, in ticks at the default 1 ms
+#define WORN_RUN_TICKS      3
+
+
+//-----------------------------------------------------------------------------------------------
+// typedefs
+//
+
+typedef struct {
+    uint32_t changes[SWITCHES];
+    uint32_t chatters[SWITCHES];
+    double latency[SWITCHES];
+} RESULT;
+
+
+//-----------------------------------------------------------------------------------------------
+// globals
+//
+
+// time at the new level, then back at the old, and so on, in us; the switch settles at the
+// new level after the last entry
+static const uint16_t bounceClean[] = { 0 };
+static const uint16_t bounceLight[] = { 400, 500, 300, 600, 0 };
+static const uint16_t bounceWorn[] = { 1500, 1600, 2500, 2100, 0 };
+
+static const uint16_t *const bounces[SWITCHES] = { bounceClean, bounceLight, bounceWorn };
+
+static uint8_t hostSwitches;
+static uint64_t changeTime[SWITCHES];
+static uint32_t changeCount[SWITCHES];
+
+
+//-----------------------------------------------------------------------------------------------
+// functions
+//
+
+static void ReportReceived (const uint8_t *report, uint8_t length, uint64_t when, void *context)
+{
+    uint8_t changed, s;
+
+    if (length != SWITCH_REPORT_SIZE || report[0] != REPORT_ID_SWITCHES) {
+        return;
+    }
+    changed = report[1] ^ hostSwitches;
+    hostSwitches = report[1];
+    for (s = 0; s < SWITCHES; s++) {
+        if (changed & SIM_SWITCH(s + 1)) {
+            if (changeCount[s]++ == 0) {
+                changeTime[s] = when;
+            }
+        }
+    }
+}
+
+
+static void Command (uint8_t command, uint8_t argument)
+{
+    const uint8_t report[3] = { REPORT_ID_COMMAND, command, argument };
+
+    SIM_HostSendReport (report, sizeof (report));
+    SIM_Run (SETTLE);
+}
+
+
+static bool Start (void)
+{
+    static const uint8_t refresh[2] = { 0x02, 0x55 };
+
+    SIM_PowerOn ();
+    SIM_HostAttach ();
+    if (!SIM_HostWaitConfigured (SIM_MS(1000))) {
+        return false;
+    }
+    SIM_HostSetReportCallback (ReportReceived, NULL);
+    SIM_HostSendReport (refresh, sizeof (refresh));
+    SIM_Run (SETTLE);
+    return true;
+}
+
+
+static bool GetFeature (uint8_t id, uint8_t *data, uint8_t size)
+{
+    const uint8_t setup[8] = { 0xA1, 0x01, id, 0x03, 0x00, 0x00, size, 0x00 };
+    uint16_t length = size;
+
+    if (!SIM_HostControlTransfer (setup, data, &length, SIM_MS(100)) || length != size || data[0] != id) {
+        printf ("GET_REPORT for feature report %u failed\n", id);
+        return false;
+    }
+    return true;
+}
+
+
+static bool GetBounceStats (BOUNCE_STATS *stats)
+{
+    uint8_t data[BOUNCE_REPORT_SIZE];
+
+    if (!GetFeature (REPORT_ID_BOUNCE, data, sizeof (data))) {
+        return false;
+    }
+    memcpy (stats, &data[1], sizeof (*stats));
+    return true;
+}
+
+
+// one switch from its edge through its bounce to still; the number of reported changes of
+// it and the time from its edge to the first
+static void Flip (uint8_t s, uint32_t *changes, uint64_t *latency)
+{
+    const uint16_t *bounce = bounces[s];
+    uint8_t target;
+    uint64_t edge;
+    uint8_t i;
+
+    SIM_Run (SIM_RandomCycles (0, SIM_MS(1)));
+    target = SIM_GetSwitches () ^ SIM_SWITCH(s + 1);
+    changeCount[s] = 0;
+    edge = SIM_Now ();
+    for (i = 0; bounce[i] != 0; i++) {
+        SIM_SetSwitches (SIM_GetSwitches () ^ SIM_SWITCH(s + 1));
+        SIM_Run (SIM_US(bounce[i]));
+    }
+    SIM_SetSwitches (target);
+    SIM_Run (SETTLE);
+
+    *changes = changeCount[s];
+    *latency = changeCount[s] ? changeTime[s] - edge : 0;
+}
+
+
+// flips rounds of every switch in turn; the changes reported, flips that changed more than
+// once, and the mean time to the first change
+static void Run (uint32_t rounds, RESULT *result)
+{
+    uint32_t r, changes;
+    uint64_t latency;
+    uint8_t s;
+
+    memset (result, 0, sizeof (*result));
+    for (r = 0; r < rounds; r++) {
+        for (s = 0; s < SWITCHES; s++) {
+            Flip (s, &changes, &latency);
+            result->changes[s] += changes;
+            if (changes > 1) {
+                result->chatters[s]++;
+            }
+            result->latency[s] += (double)latency / SIM_MS(1) / rounds;
+        }
+    }
+}
+
+
+static void Print (const char *name, const RESULT *result, const BOUNCE_STATS *stats)
+{
+    uint8_t s;
+
+    printf ("%s:", name);
+    for (s = 0; s < SWITCHES; s++) {
+        printf ("  SW%u %u changes %u chattered %.3f ms", s + 1, result->changes[s],
+                result->chatters[s], result->latency[s]);
+        if (stats) {
+            printf (" depth %u bounce %u", stats->switches[s] >> 4, stats->switches[s] & 0x0F);
+        }
+    }
+    putchar ('\n');
+}
+
+
+int main (int argc, char *argv[])
+{
+    uint32_t flips = (argc > 1) ? strtoul (argv[1], NULL, 0) : DEFAULT_FLIPS;
+    uint32_t seed = (argc > 2) ? strtoul (argv[2], NULL, 0) : DEFAULT_SEED;
+    BOUNCE_STATS before, after;
+    uint8_t settings[SETTINGS_REPORT_SIZE];
+    RESULT fixed, worn, adaptive;
+    uint32_t counted, expected;
+    uint8_t s, bin;
+    int errors = 0;
+
+    SIM_Seed (seed);
+    if (!Start ()) {
+        fprintf (stderr, "bounce_test: enumeration failed\n");
+        return 1;
+    }
+
+    if (!GetBounceStats (&before)) {
+        return 1;
+    }
+    for (s = 0; s < SWITCHES; s++) {
+        if (before.switches[s] != ((DEBOUNCE_ADAPT_START << 4) | (DEBOUNCE_ADAPT_START - 1))) {
+            printf ("SW%u starts with depth %u bounce %u\n", s + 1, before.switches[s] >> 4,
+                    before.switches[s] & 0x0F);
+            errors++;
+        }
+    }
+
+    // the default fixed depth for comparison, then a fixed depth too short for SW3
+    Run (flips / 4, &fixed);
+    Print ("fixed 4", &fixed, NULL);
+    Command (COMMAND_DEBOUNCE, 2);
+    Run (flips / 4, &worn);
+    Print ("fixed 2", &worn, NULL);
+    if (worn.chatters[2] == 0) {
+        printf ("SW3 never chattered at a depth of 2, its bounce is too short for the test\n");
+        errors++;
+    }
+
+    // adaptive, from what was learned so far
+    Command (COMMAND_DEBOUNCE, DEBOUNCE_ADAPTIVE);
+    Run (flips, &adaptive);
+    Print ("learning", &adaptive, NULL);
+
+    if (!GetBounceStats (&before)) {
+        return 1;
+    }
+    Run (flips, &adaptive);
+    if (!GetBounceStats (&after)) {
+        return 1;
+    }
+    Print ("adaptive", &adaptive, &after);
+
+    if ((after.switches[0] >> 4) != DEBOUNCE_ADAPT_MIN) {
+        printf ("clean SW1 debounced with %u samples, expected %u\n", after.switches[0] >> 4,
+                DEBOUNCE_ADAPT_MIN);
+        errors++;
+    }
+    if ((after.switches[1] >> 4) > DEBOUNCE_ADAPT_START) {
+        printf ("lightly bouncing SW2 debounced with %u samples\n", after.switches[1] >> 4);
+        errors++;
+    }
+    if ((after.switches[2] >> 4) <= WORN_RUN_TICKS + 1 || (after.switches[2] >> 4) > DEBOUNCE_SAMPLES_MAX) {
+        printf ("worn SW3 debounced with %u samples\n", after.switches[2] >> 4);
+        errors++;
+    }
+    for (s = 0; s < SWITCHES; s++) {
+        if (adaptive.changes[s] != flips || adaptive.chatters[s] != 0) {
+            printf ("SW%u: %u changes for %u flips\n", s + 1, adaptive.changes[s], flips);
+            errors++;
+        }
+    }
+    if (adaptive.latency[0] + 1.0 > fixed.latency[0]) {
+        printf ("clean SW1 reported after %.3f ms, %.3f ms at the fixed depth\n", adaptive.latency[0],
+                fixed.latency[0]);
+        errors++;
+    }
+
+    // every change counted once, the clean switch's as no bounce
+    counted = 0;
+    printf ("histogram:");
+    for (bin = 0; bin < BOUNCE_HIST_BINS; bin++) {
+        printf (" %u", (uint16_t)(after.histogram[bin] - before.histogram[bin]));
+        counted += (uint16_t)(after.histogram[bin] - before.histogram[bin]);
+    }
+    putchar ('\n');
+    expected = flips * SWITCHES;
+    if (counted != expected || (uint16_t)(after.histogram[0] - before.histogram[0]) < flips) {
+        printf ("histogram counted %u changes, expected %u, %u of them with no bounce\n", counted,
+                expected, flips);
+        errors++;
+    }
+
+    // still adaptive after a power cycle, the learning starts over
+    if (!Start ()) {
+        fprintf (stderr, "bounce_test: enumeration after the power cycle failed\n");
+        return 1;
+    }
+    if (!GetFeature (REPORT_ID_SETTINGS, settings, sizeof (settings)) || !GetBounceStats (&after)) {
+        return 1;
+    }
+    if (settings[3] != DEBOUNCE_ADAPTIVE) {
+        printf ("after the power cycle the debounce depth is %u\n", settings[3]);
+        errors++;
+    }
+    if (after.switches[0] != ((DEBOUNCE_ADAPT_START << 4) | (DEBOUNCE_ADAPT_START - 1))) {
+        printf ("after the power cycle SW1 has depth %u bounce %u\n", after.switches[0] >> 4,
+                after.switches[0] & 0x0F);
+        errors++;
+    }
+    Command (COMMAND_DEBOUNCE, DEBOUNCE_SAMPLES);
+
+    printf ("%s\n", errors ? "FAIL" : "PASS");
+    return errors ? 1 : 0;
+}
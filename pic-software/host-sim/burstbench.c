@@ -0,0 +1,167 @@
+//-----------------------------------------------------------------------------------------------
+// burstbench.c -- report queue burst drain benchmark
+//
+// usage: burstbench [runs [seed]]
+//
+// Fills the report queue with REPORT_QUEUE_SIZE changes while the host's interrupt IN
+// polling is held off, resumes polling at a random phase and measures until the host has
+// the last report. The host polls once per 1 ms frame, so the best case is one report per
+// frame.
+//
+// Each run is repeated with the firmware's main loop held up by a long task for part of
+// every 2 ms, interrupts still running, to show how far a slow main loop delays the drain:
+// the IN endpoint can only be re-armed when the main loop comes round.
+//
+// Compiled with the firmware flags so it sees REPORT_QUEUE_SIZE from system.h.
+//
+
+//-----------------------------------------------------------------------------------------------
+// includes
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "system.h"
+
+#include "sim.h"
+
+
+//-----------------------------------------------------------------------------------------------
+// defines
+//
+
+#define DEFAULT_RUNS        500
+#define DEFAULT_SEED        1
+
+#define REPORT_ID_SWITCHES  0x01
+
+#define BURST               REPORT_QUEUE_SIZE
+
+// long enough for every change to pass the debounce
+#define HOLD                SIM_MS(6)
+
+// main loop busy period and the busy times per period that are measured
+#define BUSY_PERIOD         SIM_MS(2)
+#define BUSY_SETTINGS       5
+
+#define DRAIN_TIMEOUT       SIM_MS(100)
+
+
+//-----------------------------------------------------------------------------------------------
+// globals
+//
+
+static const uint64_t busyTimes[BUSY_SETTINGS] = {
+    0, SIM_US(500), SIM_US(900), SIM_US(1200), SIM_US(1500)
+};
+
+static uint32_t reports;
+static uint64_t lastReportTime;
+
+
+//-----------------------------------------------------------------------------------------------
+// functions
+//
+
+static void ReportReceived (const uint8_t *report, uint8_t length, uint64_t when, void *context)
+{
+    if (length >= 2 && report[0] == REPORT_ID_SWITCHES) {
+        lastReportTime = when;
+        reports++;
+    }
+}
+
+
+// queue a burst with polling held off, then drain it with the main loop busy for busy
+// cycles of every BUSY_PERIOD; returns false if the burst never fully arrived
+static bool RunBurst (uint64_t busy, uint64_t *drain)
+{
+    uint64_t resumed, nextBusy;
+    uint32_t seen;
+    uint8_t i, switches = SIM_GetSwitches ();
+
+    SIM_HostPauseIn (true);
+    for (i = 0; i < BURST; i++) {
+        switches ^= 1 << (SIM_Random () & 7);
+        SIM_SetSwitches (switches);
+        SIM_Run (HOLD);
+    }
+
+    SIM_Run (SIM_RandomCycles (0, SIM_MS(1)));
+    seen = reports;
+    SIM_HostPauseIn (false);
+    resumed = SIM_Now ();
+    nextBusy = resumed + SIM_RandomCycles (0, BUSY_PERIOD);
+
+    while (reports - seen < BURST && SIM_Now () - resumed < DRAIN_TIMEOUT) {
+        if (busy && SIM_Now () >= nextBusy) {
+            SIM_MainLoopBusy (busy);
+            nextBusy += BUSY_PERIOD;
+        }
+        SIM_Step ();
+    }
+    SIM_MainLoopBusy (0);
+
+    if (reports - seen != BURST) {
+        return false;
+    }
+    *drain = lastReportTime - resumed;
+    return true;
+}
+
+
+int main (int argc, char *argv[])
+{
+    static const uint8_t refresh[2] = { 0x02, 0x55 };
+    static char names[BUSY_SETTINGS][32];
+    SIM_STATS stats[BUSY_SETTINGS];
+    uint32_t runs = (argc > 1) ? strtoul (argv[1], NULL, 0) : DEFAULT_RUNS;
+    uint32_t seed = (argc > 2) ? strtoul (argv[2], NULL, 0) : DEFAULT_SEED;
+    uint32_t i, lost = 0;
+    uint64_t drain;
+    uint8_t b;
+
+    SIM_Seed (seed);
+    for (b = 0; b < BUSY_SETTINGS; b++) {
+        snprintf (names[b], sizeof (names[b]), "main loop busy %4.2f / %.0f ms",
+                  (double)busyTimes[b] / SIM_MS(1), (double)BUSY_PERIOD / SIM_MS(1));
+        SIM_StatsInit (&stats[b], names[b], runs);
+    }
+
+    SIM_PowerOn ();
+    SIM_HostAttach ();
+    if (!SIM_HostWaitConfigured (SIM_MS(1000))) {
+        fprintf (stderr, "burstbench: enumeration failed\n");
+        return 1;
+    }
+    SIM_HostSetReportCallback (ReportReceived, NULL);
+    SIM_HostSendReport (refresh, sizeof (refresh));
+    SIM_Run (SIM_MS(20));
+
+    for (b = 0; b < BUSY_SETTINGS; b++) {
+        for (i = 0; i < runs; i++) {
+            SIM_Run (SIM_MS(10));
+            if (RunBurst (busyTimes[b], &drain)) {
+                SIM_StatsAdd (&stats[b], drain);
+            } else {
+                lost++;
+            }
+        }
+    }
+
+    printf ("%u bursts of %u reports per setting, seed %u, %.1f s simulated\n", runs, BURST, seed,
+            (double)SIM_Now () / SIM_MS(1000));
+    printf ("time from resuming IN polling until the host has the last report, %u ms at best\n\n",
+            BURST - 1);
+    SIM_StatsPrintHeader ();
+    for (b = 0; b < BUSY_SETTINGS; b++) {
+        SIM_StatsPrint (&stats[b]);
+        SIM_StatsFree (&stats[b]);
+    }
+    if (lost) {
+        printf ("\n%u bursts never fully reached the host\n", lost);
+    }
+
+    return lost ? 1 : 0;
+}
@@ -0,0 +1,215 @@
+//-----------------------------------------------------------------------------------------------
+// debounce_test.c -- checks the firmware's switch debounce against a reference model
+//
+// usage: debounce_test [ticks [seed]]
+//
+// Runs the firmware in the simulator and, right before every sampling pass of the main loop,
+// drives the switch pins with a new random pattern full of bounce-length glitches. After the
+// pass the firmware's debounced state must match the reference fed with the same samples.
+// The host sets the debounce depth with the report ID 2 / 0x44 command before each run of
+// ticks. The first run is at 2 samples against the original per-switch 4-state
+// ProcessButton() machine, copied below unchanged; then every depth from 1 to
+// DEBOUNCE_SAMPLES_MAX runs against a per-switch counter that changes state after that many
+// consecutive disagreeing samples.
+//
+// Compiled with the firmware flags so it sees sampleSettings and DEBOUNCE_SAMPLES_MAX from
+// system.h.
+//
+
+//-----------------------------------------------------------------------------------------------
+// includes
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "system.h"
+
+#include "sim.h"
+
+
+//-----------------------------------------------------------------------------------------------
+// defines
+//
+
+#define DEFAULT_TICKS   200000      // per depth
+#define DEFAULT_SEED    1
+
+#define REPORT_ID_COMMAND   0x02
+#define COMMAND_DEBOUNCE    0x44
+
+// long enough for the command, its flash write and the switches to settle
+#define SETTLE          SIM_MS(30)
+
+
+//-----------------------------------------------------------------------------------------------
+// globals
+//
+
+// main.c
+extern volatile uint8_t flagTick;
+extern uint8_t debounceStates[];
+
+// reference state
+static bool processButton;
+static uint8_t depth;
+static uint8_t buttonStates[8];
+static uint8_t referenceCounts[8];
+static uint8_t referenceState;
+
+
+//-----------------------------------------------------------------------------------------------
+// reference models
+//
+
+// main.c before the vertical counter
+static uint8_t ProcessButton (uint8_t which, uint8_t sw)
+{
+	uint8_t state;
+
+	state = buttonStates[which];
+
+	switch (state) {
+		case 0: state = sw ? 1 : 0; break;
+		case 1: state = sw ? 2 : 0; break;
+		case 2: state = sw ? 2 : 3; break;
+		case 3: state = sw ? 2 : 0; break;
+	}
+
+	buttonStates[which] = state;
+
+	return (state & 2) ? (1 << which) : 0;
+}
+
+
+static uint8_t Reference (uint8_t sample)
+{
+    uint8_t i, mask, state = 0;
+
+    for (i = 0; i < 8; i++) {
+        mask = 1 << i;
+        if (processButton) {
+            state |= ProcessButton (i, (sample & mask) ? 1 : 0);
+        } else {
+            if (((sample ^ referenceState) & mask) == 0) {
+                referenceCounts[i] = 0;
+            } else if (++referenceCounts[i] == depth) {
+                referenceCounts[i] = 0;
+                referenceState ^= mask;
+            }
+            state |= referenceState & mask;
+        }
+    }
+
+    return state;
+}
+
+
+//-----------------------------------------------------------------------------------------------
+// test
+//
+
+// each switch keeps its level or, now and then, moves to a random one; runs shorter than the
+// debounce depth are common so both the filtering and the accepting paths get exercised
+static uint8_t NextSample (uint8_t sample)
+{
+    uint8_t i;
+
+    for (i = 0; i < 8; i++) {
+        if ((SIM_Random () & 3) == 0) {
+            sample = (sample & ~(1 << i)) | ((SIM_Random () & 1) << i);
+        }
+    }
+    return sample;
+}
+
+
+// holds the pins still, sets the depth and starts the reference from the settled state;
+// false if the firmware did not take the depth
+static bool SetDepth (uint8_t samples, bool reference, uint8_t sample)
+{
+    const uint8_t report[3] = { REPORT_ID_COMMAND, COMMAND_DEBOUNCE, samples };
+    uint8_t i;
+
+    SIM_SetSwitches (sample);
+    SIM_Run (SETTLE);
+    SIM_HostSendReport (report, sizeof (report));
+    SIM_Run (SETTLE);
+
+    processButton = reference;
+    depth = samples;
+    referenceState = debounceStates[0];
+    for (i = 0; i < 8; i++) {
+        buttonStates[i] = (referenceState & (1 << i)) ? 2 : 0;
+        referenceCounts[i] = 0;
+    }
+
+    return sampleSettings.debounceSamples == samples && referenceState == sample;
+}
+
+
+// ticks sampling passes at the given depth against ProcessButton() or the counter, returns
+// the mismatches
+static uint32_t Run (uint8_t samples, bool reference, uint32_t ticks, uint8_t *sample)
+{
+    uint32_t i, changes = 0, mismatches = 0;
+    uint8_t expected, last;
+
+    if (!SetDepth (samples, reference, *sample)) {
+        printf ("%u samples not taken\n", samples);
+        return 1;
+    }
+    last = referenceState;
+
+    for (i = 0; i < ticks; i++) {
+        while (!flagTick) {
+            SIM_Step ();
+        }
+
+        // the next slice runs the sampling pass on these pin levels
+        *sample = NextSample (*sample);
+        SIM_SetSwitches (*sample);
+        SIM_Step ();
+
+        expected = Reference (*sample);
+        if (debounceStates[0] != expected) {
+            if (mismatches++ < 10) {
+                printf ("tick %u: sample %02X, firmware %02X, reference %02X\n", i, *sample,
+                        debounceStates[0], expected);
+            }
+        }
+        changes += (expected != last);
+        last = expected;
+    }
+
+    printf ("%u ticks, %u debounced changes, %u samples, reference %s: %u mismatches\n", ticks,
+            changes, samples, reference ? "ProcessButton" : "counter", mismatches);
+
+    return mismatches;
+}
+
+
+int main (int argc, char *argv[])
+{
+    uint32_t ticks = (argc > 1) ? strtoul (argv[1], NULL, 0) : DEFAULT_TICKS;
+    uint32_t seed = (argc > 2) ? strtoul (argv[2], NULL, 0) : DEFAULT_SEED;
+    uint32_t mismatches;
+    uint8_t sample = 0, samples;
+
+    SIM_Seed (seed);
+    SIM_PowerOn ();
+
+    // keep the bus out of suspend, a suspended stick sleeps while its switches are still
+    SIM_HostAttach ();
+    if (!SIM_HostWaitConfigured (SIM_MS(1000))) {
+        fprintf (stderr, "debounce_test: enumeration failed\n");
+        return 1;
+    }
+
+    mismatches = Run (2, true, ticks, &sample);
+    for (samples = 1; samples <= DEBOUNCE_SAMPLES_MAX; samples++) {
+        mismatches += Run (samples, false, ticks, &sample);
+    }
+
+    return mismatches ? 1 : 0;
+}
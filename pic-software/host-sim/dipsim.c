@@ -0,0 +1,75 @@
+//-----------------------------------------------------------------------------------------------
+// dipsim.c -- boot the firmware in the simulator, enumerate it and replay a switch script
+//
+// usage: dipsim [switches[@ms] ...]
+//
+// Each argument sets the eight switches (report bit order, e.g. 0x80 = SW1 on) and holds them
+// for the given number of milliseconds (default 50). Every report the host receives is
+// printed with its simulated arrival time.
+//
+
+//-----------------------------------------------------------------------------------------------
+// includes
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "sim.h"
+
+
+//-----------------------------------------------------------------------------------------------
+// functions
+//
+
+static void PrintReport (const uint8_t *report, uint8_t length, uint64_t when, void *context)
+{
+    uint8_t i;
+
+    printf ("%10.3f ms  report", (double)when / SIM_MS(1));
+    for (i = 0; i < length; i++) {
+        printf (" %02X", report[i]);
+    }
+    printf ("\n");
+}
+
+
+int main (int argc, char *argv[])
+{
+    static const uint8_t refresh[2] = { 0x02, 0x55 };
+    const uint8_t *dsc;
+    uint16_t length;
+    int i;
+
+    SIM_PowerOn ();
+    SIM_HostAttach ();
+
+    if (!SIM_HostWaitConfigured (SIM_MS(1000))) {
+        fprintf (stderr, "dipsim: enumeration failed at %.3f ms\n", (double)SIM_Now () / SIM_MS(1));
+        return 1;
+    }
+
+    dsc = SIM_HostDescriptor (1, &length);
+    printf ("%10.3f ms  configured, VID %04X PID %04X\n", (double)SIM_Now () / SIM_MS(1),
+            dsc[8] | (dsc[9] << 8), dsc[10] | (dsc[11] << 8));
+    SIM_HostDescriptor (0x22, &length);
+    printf ("%10.3f ms  report descriptor, %u bytes\n", (double)SIM_Now () / SIM_MS(1), length);
+
+    SIM_HostSetReportCallback (PrintReport, NULL);
+
+    // ask for the current state the same way Form1.cs does
+    SIM_HostSendReport (refresh, sizeof (refresh));
+    SIM_Run (SIM_MS(20));
+
+    for (i = 1; i < argc; i++) {
+        char *end;
+        unsigned long value = strtoul (argv[i], &end, 0);
+        unsigned long hold = (*end == '@') ? strtoul (end + 1, NULL, 0) : 50;
+
+        printf ("%10.3f ms  switches %02lX\n", (double)SIM_Now () / SIM_MS(1), value & 0xFF);
+        SIM_SetSwitches (value & 0xFF);
+        SIM_Run (SIM_MS(hold));
+    }
+
+    return 0;
+}
@@ -0,0 +1,205 @@
+//-----------------------------------------------------------------------------------------------
+// getreport_test.c -- checks that GET_REPORT never answers with a half-updated switch state
+//
+// usage: getreport_test [changes [seed]]
+//
+// Flips the switches to random patterns while the host reads feature report 3 back to back.
+// The firmware answers GET_REPORT from the USB interrupt, and masks it while the tick updates
+// the switch states, sequence number and timestamp. With SIM_SetPreemption() the simulator
+// interrupts the main loop in the middle of that update, where it stamps the change, lets
+// time pass and lets the host send its next packet, so a SETUP regularly arrives while the
+// update is under way. Every answer must carry switches, timestamp and sequence number that
+// went out together in one report ID 1 on the interrupt endpoint, or the power-on state.
+//
+// Compiled with the firmware flags so it sees SWITCH_REPORT_SIZE and STATE_REPORT_SIZE from
+// system.h.
+//
+
+//-----------------------------------------------------------------------------------------------
+// includes
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "system.h"
+
+#include "sim.h"
+
+
+//-----------------------------------------------------------------------------------------------
+// defines
+//
+
+#define DEFAULT_CHANGES     400
+#define DEFAULT_SEED        1
+
+#define REPORT_ID_SWITCHES  0x01
+#define REPORT_ID_STATE     0x03
+
+// longer than a tick, so a TMR2 interrupt falls into the masked update as well
+#define PREEMPT             SIM_US(1100)
+
+// each pattern is held long enough to pass the debounce
+#define MIN_HOLD            SIM_MS(6)
+#define MAX_HOLD            SIM_MS(12)
+
+#define TRANSFER_TIMEOUT    SIM_MS(50)
+
+#define MAX_ANSWERS         100000
+
+
+//-----------------------------------------------------------------------------------------------
+// typedefs
+//
+
+typedef struct {
+    uint8_t switches;
+    uint16_t timestamp;
+    uint8_t sequence;
+} STAMP;
+
+
+//-----------------------------------------------------------------------------------------------
+// globals
+//
+
+// reports from the interrupt endpoint, the first is the power-on state
+static STAMP *reports;
+static uint32_t reportCount;
+
+static STAMP *answers;
+static uint32_t answerCount;
+
+
+//-----------------------------------------------------------------------------------------------
+// functions
+//
+
+static void Unpack (STAMP *stamp, const uint8_t *report)
+{
+    stamp->switches = report[1];
+    stamp->timestamp = report[2] | (report[3] << 8);
+    stamp->sequence = report[4];
+}
+
+
+static void ReportReceived (const uint8_t *report, uint8_t length, uint64_t when, void *context)
+{
+    uint32_t *size = context;
+
+    if (length == SWITCH_REPORT_SIZE && report[0] == REPORT_ID_SWITCHES && reportCount < *size) {
+        Unpack (&reports[reportCount++], report);
+    }
+}
+
+
+// one GET_REPORT for feature report 3, returns false if it failed
+static bool GetState (STAMP *stamp)
+{
+    static const uint8_t setup[8] = { 0xA1, 0x01, REPORT_ID_STATE, 0x03, 0x00, 0x00,
+                                      STATE_REPORT_SIZE, 0x00 };
+    uint8_t data[STATE_REPORT_SIZE];
+    uint16_t length = sizeof (data);
+
+    if (!SIM_HostControlTransfer (setup, data, &length, TRANSFER_TIMEOUT) ||
+            length != sizeof (data) || data[0] != REPORT_ID_STATE) {
+        return false;
+    }
+    Unpack (stamp, data);
+    return true;
+}
+
+
+static bool Reported (const STAMP *stamp)
+{
+    uint32_t i;
+
+    for (i = 0; i < reportCount; i++) {
+        if (reports[i].switches == stamp->switches && reports[i].timestamp == stamp->timestamp &&
+                reports[i].sequence == stamp->sequence) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+int main (int argc, char *argv[])
+{
+    uint32_t changes = (argc > 1) ? strtoul (argv[1], NULL, 0) : DEFAULT_CHANGES;
+    uint32_t seed = (argc > 2) ? strtoul (argv[2], NULL, 0) : DEFAULT_SEED;
+    uint32_t size = changes + 1;
+    uint32_t i, failed = 0, torn = 0, masked;
+    uint64_t end;
+    uint8_t switches = 0;
+#if DEBOUNCE_SAMPLES == DEBOUNCE_ADAPTIVE
+    static const uint8_t fixedDepth[3] = { 0x02, 0x44, DEBOUNCE_ADAPT_START };
+#endif
+
+    reports = calloc (size, sizeof (STAMP));
+    answers = calloc (MAX_ANSWERS, sizeof (STAMP));
+    if (!reports || !answers) {
+        fprintf (stderr, "getreport_test: out of memory\n");
+        return 1;
+    }
+
+    SIM_Seed (seed);
+    SIM_PowerOn ();
+    SIM_HostAttach ();
+    if (!SIM_HostWaitConfigured (SIM_MS(1000))) {
+        fprintf (stderr, "getreport_test: enumeration failed\n");
+        return 1;
+    }
+#if DEBOUNCE_SAMPLES == DEBOUNCE_ADAPTIVE
+    // learned depths differ from switch to switch and would let a change of several switches
+    // out over several reports; these checks want one depth for all
+    SIM_HostSendReport (fixedDepth, sizeof (fixedDepth));
+    SIM_Run (SIM_MS(30));
+#endif
+    SIM_HostSetReportCallback (ReportReceived, &size);
+    reportCount = 1;
+    SIM_Run (SIM_MS(20));
+
+    SIM_SetPreemption (PREEMPT);
+    for (i = 0; i < changes; i++) {
+        do {
+            switches = (uint8_t)SIM_Random ();
+        } while (switches == SIM_GetSwitches ());
+        SIM_SetSwitches (switches);
+
+        end = SIM_Now () + SIM_RandomCycles (MIN_HOLD, MAX_HOLD);
+        while (SIM_Now () < end && answerCount < MAX_ANSWERS) {
+            if (!GetState (&answers[answerCount])) {
+                failed++;
+                continue;
+            }
+            answerCount++;
+        }
+    }
+    masked = SIM_PreemptsMasked ();
+    SIM_SetPreemption (0);
+    SIM_Run (SIM_MS(50));
+
+    for (i = 0; i < answerCount; i++) {
+        if (!Reported (&answers[i])) {
+            if (torn++ < 10) {
+                printf ("answer %u: switches %02X, timestamp %u, sequence %u never reported\n", i,
+                        answers[i].switches, answers[i].timestamp, answers[i].sequence);
+            }
+        }
+    }
+
+    printf ("%u changes, %u reports, %u GET_REPORTs, %u USB transactions held off by an "
+            "update: %u torn, %u failed\n", changes, reportCount - 1, answerCount, masked, torn,
+            failed);
+
+    if (reportCount != size) {
+        printf ("expected %u reports\n", changes);
+    }
+    if (masked == 0) {
+        printf ("no USB transaction arrived during an update\n");
+    }
+
+    return (torn || failed || reportCount != size || masked == 0) ? 1 : 0;
+}
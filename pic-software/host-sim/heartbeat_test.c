@@ -0,0 +1,186 @@
+//-----------------------------------------------------------------------------------------------
+// heartbeat_test.c -- checks the SET_IDLE heartbeat
+//
+// usage: heartbeat_test
+//
+// With the switches left alone the stick must stay silent until the host sets an idle
+// duration, then repeat the current report once per duration: same switches, same sequence
+// number, no earlier than the duration and at most a tick and a frame later. A switch change
+// restarts the duration. SET_IDLE for another report ID must be ignored, the report ID 2 /
+// 0x49 command must set the duration like SET_IDLE does, and SET_IDLE 0 must stop it again.
+//
+// Compiled with the firmware flags so it sees SWITCH_REPORT_SIZE from system.h.
+//
+
+//-----------------------------------------------------------------------------------------------
+// includes
+//
+
+#include <stdio.h>
+
+#include "system.h"
+
+#include "sim.h"
+
+
+//-----------------------------------------------------------------------------------------------
+// defines
+//
+
+#define REPORT_ID_SWITCHES  0x01
+#define REPORT_ID_STATE     0x03
+
+#define MAX_REPORTS         64
+
+// the firmware checks once per 1 ms tick and the host polls once per frame
+#define LATE_MS             2
+
+
+//-----------------------------------------------------------------------------------------------
+// globals
+//
+
+// main.c
+extern uint8_t switchSequence;
+
+static uint8_t received[MAX_REPORTS];
+static uint8_t receivedSequence[MAX_REPORTS];
+static uint64_t receivedTime[MAX_REPORTS];
+static uint8_t receivedCount;
+
+
+//-----------------------------------------------------------------------------------------------
+// functions
+//
+
+static void ReportReceived (const uint8_t *report, uint8_t length, uint64_t when, void *context)
+{
+    if (length == SWITCH_REPORT_SIZE && report[0] == REPORT_ID_SWITCHES && receivedCount < MAX_REPORTS) {
+        received[receivedCount] = report[1];
+        receivedSequence[receivedCount] = report[4];
+        receivedTime[receivedCount] = when;
+        receivedCount++;
+    }
+}
+
+
+// HID SET_IDLE to the interface, duration in 4 ms units
+static bool SetIdle (uint8_t reportId, uint8_t duration)
+{
+    const uint8_t setup[8] = { 0x21, 0x0A, reportId, duration, 0x00, 0x00, 0x00, 0x00 };
+    uint16_t length = 0;
+
+    return SIM_HostControlTransfer (setup, NULL, &length, SIM_MS(100));
+}
+
+
+// run for ms and check that the reports that arrive are heartbeats for the given switches,
+// periodMs apart, 0 = none at all; the first interval is timed from start. Returns the
+// number of errors
+static int CheckHeartbeat (const char *name, uint64_t start, uint32_t ms, uint32_t periodMs,
+                           uint8_t switches)
+{
+    uint64_t previous = start, interval;
+    uint8_t i, errors = 0;
+    uint32_t most = periodMs ? ms / periodMs : 0;
+    uint32_t fewest = periodMs ? ms / (periodMs + LATE_MS) : 0;
+
+    receivedCount = 0;
+    SIM_Run (SIM_MS(ms) - (SIM_Now () - start));
+
+    // each heartbeat may be a little late and the lateness adds up over the window
+    if (receivedCount < fewest || receivedCount > most) {
+        printf ("%s: %u reports in %u ms, expected %u to %u\n", name, receivedCount, ms, fewest, most);
+        errors++;
+    }
+    for (i = 0; i < receivedCount; i++) {
+        interval = receivedTime[i] - previous;
+        previous = receivedTime[i];
+        if (interval < SIM_MS(periodMs) || interval > SIM_MS(periodMs + LATE_MS)) {
+            printf ("%s: report %u %.3f ms after the one before, expected %u ms\n", name, i,
+                    (double)interval / SIM_MS(1), periodMs);
+            errors++;
+        }
+        if (received[i] != switches || receivedSequence[i] != switchSequence) {
+            printf ("%s: report %u is %02X sequence %u, expected %02X sequence %u\n", name, i,
+                    received[i], receivedSequence[i], switches, switchSequence);
+            errors++;
+        }
+    }
+
+    printf ("%s: %u reports in %u ms\n", name, receivedCount, ms);
+    return errors;
+}
+
+
+int main (int argc, char *argv[])
+{
+    static const uint8_t refresh[2] = { 0x02, 0x55 };
+    static const uint8_t heartbeat20[3] = { 0x02, 0x49, 5 };
+    uint64_t start;
+    int errors = 0;
+
+    SIM_PowerOn ();
+    SIM_HostAttach ();
+    if (!SIM_HostWaitConfigured (SIM_MS(1000))) {
+        fprintf (stderr, "heartbeat_test: enumeration failed\n");
+        return 1;
+    }
+    SIM_HostSetReportCallback (ReportReceived, NULL);
+    SIM_SetSwitches (0x5A);
+    SIM_Run (SIM_MS(20));
+    SIM_HostSendReport (refresh, sizeof (refresh));
+    SIM_Run (SIM_MS(20));
+
+    errors += CheckHeartbeat ("no SET_IDLE", SIM_Now (), 500, 0, 0x5A);
+
+    // the duration runs from the refresh answer
+    receivedCount = 0;
+    SIM_HostSendReport (refresh, sizeof (refresh));
+    while (receivedCount == 0) {
+        SIM_Step ();
+    }
+    start = receivedTime[0];
+    if (!SetIdle (0, 25)) {
+        printf ("SET_IDLE failed\n");
+        errors++;
+    }
+    errors += CheckHeartbeat ("SET_IDLE 100 ms", start, 1000, 100, 0x5A);
+
+    // a change restarts the duration and the heartbeat then repeats its sequence number
+    SIM_Run (SIM_MS(37));
+    receivedCount = 0;
+    SIM_SetSwitches (0xA5);
+    while (receivedCount == 0) {
+        SIM_Step ();
+    }
+    if (received[0] != 0xA5) {
+        printf ("change: report is %02X, expected A5\n", received[0]);
+        errors++;
+    }
+    errors += CheckHeartbeat ("after a change", receivedTime[0], 1000, 100, 0xA5);
+
+    if (!SetIdle (REPORT_ID_STATE, 0)) {
+        printf ("SET_IDLE for report 3 failed\n");
+        errors++;
+    }
+    errors += CheckHeartbeat ("SET_IDLE 0 for report 3", receivedTime[receivedCount - 1], 500, 100, 0xA5);
+
+    // the command takes effect on the next tick, the running duration is already past 20 ms
+    SIM_HostSendReport (heartbeat20, sizeof (heartbeat20));
+    receivedCount = 0;
+    while (receivedCount == 0) {
+        SIM_Step ();
+    }
+    errors += CheckHeartbeat ("report 2 / 0x49 20 ms", receivedTime[0], 500, 20, 0xA5);
+
+    if (!SetIdle (0, 0)) {
+        printf ("SET_IDLE 0 failed\n");
+        errors++;
+    }
+    SIM_Run (SIM_MS(LATE_MS));
+    errors += CheckHeartbeat ("SET_IDLE 0", SIM_Now (), 500, 0, 0xA5);
+
+    printf ("%s\n", errors ? "FAIL" : "PASS");
+    return errors ? 1 : 0;
+}
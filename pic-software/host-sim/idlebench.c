@@ -0,0 +1,147 @@
+//-----------------------------------------------------------------------------------------------
+// idlebench.c -- main loop duty cycle and wake benchmark
+//
+// usage: idlebench [seconds [seed]]
+//
+// The main loop waits for the TMR2 tick or a USB interrupt before each pass. For a few
+// typical loads this measures the share of time the firmware runs instead of waiting, how
+// often the tick and the USB interrupt end the wait, and the time from the interrupt that
+// ends a wait to the pass that takes its work, which is the interrupt service time: the
+// simulator resumes the firmware as soon as the pending interrupts have run. A main loop
+// that spins without waiting is busy all the time.
+//
+
+//-----------------------------------------------------------------------------------------------
+// includes
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "sim.h"
+
+
+//-----------------------------------------------------------------------------------------------
+// defines
+//
+
+#define DEFAULT_SECONDS     2
+#define DEFAULT_SEED        1
+
+#define LOADS               4
+
+// switch change interval of the busy load
+#define CHANGE_INTERVAL     SIM_MS(10)
+
+
+//-----------------------------------------------------------------------------------------------
+// typedefs
+//
+
+typedef struct {
+    const char *name;
+    uint8_t idleRate;       // SET_IDLE duration in 4 ms units
+    bool changes;           // flip a random switch every CHANGE_INTERVAL
+    bool inPaused;          // host not polling the interrupt IN endpoint
+} LOAD;
+
+
+//-----------------------------------------------------------------------------------------------
+// globals
+//
+
+static const LOAD loads[LOADS] = {
+    { "switches still",         0, false, false },
+    { "change every 10 ms",     0, true,  false },
+    { "SET_IDLE 4 ms",          1, false, false },
+    { "IN polling held off",    0, true,  true  },
+};
+
+
+//-----------------------------------------------------------------------------------------------
+// functions
+//
+
+static bool SetIdle (uint8_t duration)
+{
+    const uint8_t setup[8] = { 0x21, 0x0A, 0x00, duration, 0x00, 0x00, 0x00, 0x00 };
+    uint16_t length = 0;
+
+    return SIM_HostControlTransfer (setup, NULL, &length, SIM_MS(100));
+}
+
+
+// run one load for the given time and print its line; wake latencies go to latency
+static void RunLoad (const LOAD *load, uint64_t cycles, SIM_STATS *latency)
+{
+    uint64_t start, busy, end, nextChange;
+    uint32_t tmr2, usb;
+    double seconds = (double)cycles / SIM_MS(1000);
+
+    SetIdle (load->idleRate);
+    SIM_HostPauseIn (load->inPaused);
+    SIM_Run (SIM_MS(20));
+
+    start = SIM_Now ();
+    busy = SIM_BusyCycles ();
+    tmr2 = SIM_IdleWakes (SIM_SOURCE_TMR2);
+    usb = SIM_IdleWakes (SIM_SOURCE_USB);
+    end = start + cycles;
+    nextChange = start + SIM_RandomCycles (0, CHANGE_INTERVAL);
+
+    SIM_SetWakeLatencyStats (latency);
+    while (SIM_Now () < end) {
+        if (load->changes && SIM_Now () >= nextChange) {
+            SIM_SetSwitches (SIM_GetSwitches () ^ (1 << (SIM_Random () & 7)));
+            nextChange += CHANGE_INTERVAL;
+        }
+        SIM_Step ();
+    }
+    SIM_SetWakeLatencyStats (NULL);
+
+    printf ("%-22s %8.2f %% %12.0f %12.0f\n", load->name,
+            100.0 * (SIM_BusyCycles () - busy) / (SIM_Now () - start),
+            (SIM_IdleWakes (SIM_SOURCE_TMR2) - tmr2) / seconds,
+            (SIM_IdleWakes (SIM_SOURCE_USB) - usb) / seconds);
+
+    SIM_HostPauseIn (false);
+    SetIdle (0);
+    SIM_Run (SIM_MS(50));
+}
+
+
+int main (int argc, char *argv[])
+{
+    static const uint8_t refresh[2] = { 0x02, 0x55 };
+    SIM_STATS latency[LOADS];
+    uint32_t seconds = (argc > 1) ? strtoul (argv[1], NULL, 0) : DEFAULT_SECONDS;
+    uint32_t seed = (argc > 2) ? strtoul (argv[2], NULL, 0) : DEFAULT_SEED;
+    uint8_t l;
+
+    SIM_Seed (seed);
+    SIM_PowerOn ();
+    SIM_HostAttach ();
+    if (!SIM_HostWaitConfigured (SIM_MS(1000))) {
+        fprintf (stderr, "idlebench: enumeration failed\n");
+        return 1;
+    }
+    SIM_HostSendReport (refresh, sizeof (refresh));
+    SIM_Run (SIM_MS(20));
+
+    printf ("%u s per load, seed %u, %u cycles per main loop pass, %u per interrupt\n\n",
+            seconds, seed, SIM_loopCycles, SIM_isrCycles);
+    printf ("%-22s %10s %12s %12s\n", "load", "busy", "TMR2 wakes/s", "USB wakes/s");
+    for (l = 0; l < LOADS; l++) {
+        SIM_StatsInit (&latency[l], loads[l].name, seconds * 8000);
+        RunLoad (&loads[l], SIM_MS(1000) * seconds, &latency[l]);
+    }
+
+    printf ("\ninterrupt that ends a wait to the main loop pass\n\n");
+    SIM_StatsPrintHeader ();
+    for (l = 0; l < LOADS; l++) {
+        SIM_StatsPrint (&latency[l]);
+        SIM_StatsFree (&latency[l]);
+    }
+
+    return 0;
+}
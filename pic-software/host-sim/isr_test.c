@@ -0,0 +1,231 @@
+//-----------------------------------------------------------------------------------------------
+// isr_test.c -- checks the interrupt accounting in feature report 4
+//
+// usage: isr_test [seconds]
+//
+// Runs the stick with a switch change every 10 ms and reads feature report 4 with GET_REPORT
+// before and after. Over the run the TMR2 handler must have run once per tick, every tick
+// must have its latency accounted, USB must have been serviced at least once per SOF, and
+// each tick's wait from the TMR2 match must stay within what the simulator can delay it: one
+// step before the interrupt is taken and one other interrupt ahead of it. A second read
+// straight after the first must find the maxima cleared.
+//
+// A second run interrupts the main loop in the middle of every switch state update, see
+// SIM_SetPreemption(), so a tick falls into the time the USB interrupt is masked. Those
+// entries must leave USB alone, and every other entry must service it exactly once.
+//
+// The simulator does not time the firmware's own code, so the cycles spent in each source
+// read 0 here; only the counts and the tick latency mean anything. On the part all of them do.
+//
+// Compiled with the firmware flags so it sees ISR_STATS from system.h.
+//
+
+//-----------------------------------------------------------------------------------------------
+// includes
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "system.h"
+
+#include "sim.h"
+
+
+//-----------------------------------------------------------------------------------------------
+// defines
+//
+
+#define DEFAULT_SECONDS     2
+
+#define REPORT_ID_ISR_STATS 0x04
+
+#define CHANGE_INTERVAL     SIM_MS(10)
+
+// the masked run, more than a tick per interruption
+#define MASKED_CHANGES      200
+#define PREEMPT             SIM_US(1100)
+
+// entries the GET_REPORT reads on either side of a run may leave out or take in
+#define ENTRY_SLACK         4
+
+// the most a tick can wait in the simulator, in cycles: a step, an interrupt taken ahead of
+// it and the TMR2 prescaler's 16 cycle count
+#define MAX_TICK_LATENCY    (SIM_loopCycles + SIM_isrCycles + 16)
+
+
+//-----------------------------------------------------------------------------------------------
+// functions
+//
+
+static const char *sourceNames[ISR_STATS_COUNT] = {
+    "USB",
+    "USB, tick only entry",
+    "TMR2 handler",
+    "tick latency"
+};
+
+
+static uint32_t Get32 (const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+
+// GET_REPORT for feature report 4, false if it failed
+static bool ReadStats (ISR_STATS stats[ISR_STATS_COUNT])
+{
+    static const uint8_t setup[8] = { 0xA1, 0x01, REPORT_ID_ISR_STATS, 0x03, 0x00, 0x00, ISR_REPORT_SIZE, 0x00 };
+    uint8_t data[ISR_REPORT_SIZE];
+    uint16_t length = sizeof (data);
+    const uint8_t *p;
+    uint8_t i;
+
+    if (!SIM_HostControlTransfer (setup, data, &length, SIM_MS(100)) || length != sizeof (data) ||
+            data[0] != REPORT_ID_ISR_STATS) {
+        return false;
+    }
+
+    for (i = 0; i < ISR_STATS_COUNT; i++) {
+        p = &data[1 + i * 10];
+        stats[i].count = Get32 (p);
+        stats[i].cycles = Get32 (p + 4);
+        stats[i].maxCycles = p[8] | (p[9] << 8);
+    }
+    return true;
+}
+
+
+// the masked run, returns the number of errors
+static int MaskedRun (void)
+{
+    ISR_STATS before[ISR_STATS_COUNT], after[ISR_STATS_COUNT];
+    uint32_t enabled, masked, serviced;
+    uint16_t i;
+    int errors = 0;
+
+    SIM_SetPreemption (PREEMPT);
+    if (!ReadStats (before)) {
+        printf ("GET_REPORT for feature report 4 failed\n");
+        return 1;
+    }
+    enabled = SIM_IsrEntries (false);
+    masked = SIM_IsrEntries (true);
+
+    for (i = 0; i < MASKED_CHANGES; i++) {
+        SIM_SetSwitches (SIM_GetSwitches () ^ SIM_SWITCH(1 + (SIM_Random () & 7)));
+        SIM_Run (CHANGE_INTERVAL);
+    }
+
+    enabled = SIM_IsrEntries (false) - enabled;
+    masked = SIM_IsrEntries (true) - masked;
+    if (!ReadStats (after)) {
+        printf ("GET_REPORT for feature report 4 failed\n");
+        return 1;
+    }
+    SIM_SetPreemption (0);
+
+    serviced = (after[ISR_STATS_USB].count - before[ISR_STATS_USB].count) +
+               (after[ISR_STATS_USB_IDLE].count - before[ISR_STATS_USB_IDLE].count);
+    printf ("%u changes interrupted mid-update: %u entries with USB masked, %u with it enabled, "
+            "USB serviced on %u\n", MASKED_CHANGES, masked, enabled, serviced);
+
+    if (masked < MASKED_CHANGES) {
+        printf ("expected a tick with USB masked for every change\n");
+        errors++;
+    }
+    if (serviced + ENTRY_SLACK < enabled || serviced > enabled + ENTRY_SLACK) {
+        printf ("USB serviced on %u entries, %u were taken with it enabled\n", serviced, enabled);
+        errors++;
+    }
+    return errors;
+}
+
+
+int main (int argc, char *argv[])
+{
+    static const uint8_t refresh[2] = { 0x02, 0x55 };
+    ISR_STATS before[ISR_STATS_COUNT], after[ISR_STATS_COUNT], again[ISR_STATS_COUNT];
+    uint32_t seconds = (argc > 1) ? strtoul (argv[1], NULL, 0) : DEFAULT_SECONDS;
+    uint32_t ticks, count;
+    uint64_t end, nextChange;
+    int errors = 0;
+    uint8_t i;
+
+    SIM_PowerOn ();
+    SIM_HostAttach ();
+    if (!SIM_HostWaitConfigured (SIM_MS(1000))) {
+        fprintf (stderr, "isr_test: enumeration failed\n");
+        return 1;
+    }
+    SIM_HostSendReport (refresh, sizeof (refresh));
+    SIM_Run (SIM_MS(20));
+
+    if (!ReadStats (before)) {
+        printf ("GET_REPORT for feature report 4 failed\n");
+        return 1;
+    }
+
+    end = SIM_Now () + SIM_MS(1000) * seconds;
+    nextChange = SIM_Now ();
+    while (SIM_Now () < end) {
+        if (SIM_Now () >= nextChange) {
+            SIM_SetSwitches (SIM_GetSwitches () ^ SIM_SWITCH(1 + (SIM_Random () & 7)));
+            nextChange += CHANGE_INTERVAL;
+        }
+        SIM_Step ();
+    }
+
+    if (!ReadStats (after) || !ReadStats (again)) {
+        printf ("GET_REPORT for feature report 4 failed\n");
+        return 1;
+    }
+
+    printf ("%u s, a change every %u ms\n\n", seconds, (unsigned)(CHANGE_INTERVAL / SIM_MS(1)));
+    printf ("%-22s %10s %12s %12s\n", "source", "per s", "mean cycles", "max cycles");
+    for (i = 0; i < ISR_STATS_COUNT; i++) {
+        count = after[i].count - before[i].count;
+        printf ("%-22s %10.1f %12.1f %12u\n", sourceNames[i], (double)count / seconds,
+                count ? (double)(after[i].cycles - before[i].cycles) / count : 0.0, after[i].maxCycles);
+    }
+    printf ("\n");
+
+    // the run plus the GET_REPORT round trip on either side of it, give or take a tick
+    ticks = after[ISR_STATS_TMR2].count - before[ISR_STATS_TMR2].count;
+    if (ticks < seconds * TICK_HZ || ticks > seconds * TICK_HZ + 2) {
+        printf ("%u TMR2 interrupts in %u s\n", ticks, seconds);
+        errors++;
+    }
+    if (after[ISR_STATS_TICK_LATENCY].count - before[ISR_STATS_TICK_LATENCY].count != ticks) {
+        printf ("%u tick latencies for %u ticks\n",
+                after[ISR_STATS_TICK_LATENCY].count - before[ISR_STATS_TICK_LATENCY].count, ticks);
+        errors++;
+    }
+    if (after[ISR_STATS_USB].count - before[ISR_STATS_USB].count < seconds * 1000) {
+        printf ("USB serviced %u times in %u s, fewer than the SOFs\n",
+                after[ISR_STATS_USB].count - before[ISR_STATS_USB].count, seconds);
+        errors++;
+    }
+    if (after[ISR_STATS_TICK_LATENCY].maxCycles > MAX_TICK_LATENCY) {
+        printf ("a tick waited %u cycles, expected at most %u\n",
+                after[ISR_STATS_TICK_LATENCY].maxCycles, MAX_TICK_LATENCY);
+        errors++;
+    }
+
+    // the read straight after sees at most the tick or two of its own round trip
+    for (i = 0; i < ISR_STATS_COUNT; i++) {
+        if (again[i].count == after[i].count && again[i].maxCycles != 0) {
+            printf ("%s: maximum %u not cleared by the read\n", sourceNames[i], again[i].maxCycles);
+            errors++;
+        }
+    }
+    if (again[ISR_STATS_TICK_LATENCY].maxCycles > MAX_TICK_LATENCY) {
+        printf ("tick latency maximum %u after the read\n", again[ISR_STATS_TICK_LATENCY].maxCycles);
+        errors++;
+    }
+
+    errors += MaskedRun ();
+
+    printf ("%s\n", errors ? "FAIL" : "PASS");
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,364 @@
+//-----------------------------------------------------------------------------------------------
+// latbench.c -- switch-to-host latency benchmark
+//
+// usage: latbench [edges [seed [ppm]]]
+//
+// Flips one random switch at a random phase relative to the TMR2 tick and the USB frame,
+// then follows the edge through the firmware until the host has report ID 1 with the new
+// state. Each edge is split into the stages below and p50/p99/max are printed per stage.
+// The report must carry the number of the host's last SOF before the sampling pass that
+// debounced the change.
+//
+//   edge to tick        switch edge until the main loop takes its first sample, i.e. the next
+//                       TMR2 interrupt setting flagTick plus the wait for the main loop
+//   tick to debounced   first sample of the new level until DebounceSwitches() reports it and
+//                       the main loop queues the change record
+//   debounced to armed  queued until APP_DeviceCustomHIDTasks() has the report in the IN
+//                       endpoint via HIDTxPacket()
+//   armed to host       IN buffer owned by the SIE until the host's interrupt IN poll,
+//                       bInterval 1 ms
+//
+// It then sends as many report ID 2 / 0x55 refresh requests, again at random phases, and
+// measures from queueing the request on the host until the answering report arrives, and
+// as many GET_REPORT requests for feature report 3 on EP0, from queueing the SETUP until
+// the status stage completes.
+//
+// Last, it fills the report queue with the host's interrupt IN polling held off, resumes
+// polling and measures the time between consecutive reports while the queue drains. With
+// every report carrying the 7-byte switches, timestamp, sequence and frame layout this must
+// stay at one report per 1 ms frame.
+//
+// The host's frames run ppm off the device's clock, 100 by default, so the phase of the
+// TMR2 tick against the frame sweeps over the run as it does between two real crystals.
+// latbench-sof is the same benchmark against firmware built with SWITCH_SAMPLE_SOF=1,
+// where the tick is locked to the frame instead.
+//
+// Compiled with the firmware flags so it sees the report queue layout from system.h.
+//
+
+//-----------------------------------------------------------------------------------------------
+// includes
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "system.h"
+
+#include "sim.h"
+
+
+//-----------------------------------------------------------------------------------------------
+// defines
+//
+
+#define DEFAULT_EDGES       2000
+#define DEFAULT_SEED        1
+#define DEFAULT_PPM         100
+
+#define HID_EP              1
+#define REPORT_ID_SWITCHES  0x01
+
+// an edge that has not reached the host after this long is counted as lost
+#define EDGE_TIMEOUT        SIM_MS(100)
+
+// queue drain runs: changes per run, held long enough to pass the debounce
+#define DRAIN_RUNS          100
+#define DRAIN_CHANGES       REPORT_QUEUE_SIZE
+#define DRAIN_HOLD          SIM_MS(6)
+
+enum {
+    STAGE_TICK = 0,
+    STAGE_DEBOUNCE,
+    STAGE_HANDOFF,
+    STAGE_BUS,
+    STAGE_TOTAL,
+    STAGES
+};
+
+
+//-----------------------------------------------------------------------------------------------
+// globals
+//
+
+// TMR2 to main loop and main loop to USB task handoffs in main.c
+extern volatile uint8_t flagTick;
+extern volatile SWITCH_RECORD reportQueue[REPORT_QUEUE_SIZE];
+extern volatile uint8_t reportQueueHead;
+
+static const char *stageNames[STAGES] = {
+    "edge to tick",
+    "tick to debounced",
+    "debounced to armed",
+    "armed to host",
+    "edge to host (total)"
+};
+
+static uint8_t lastReport;
+static uint64_t lastReportTime;
+static uint32_t reports;
+static uint16_t lastReportFrame;
+static uint32_t shortReports;
+static uint32_t frameErrors;
+
+// report to report intervals while the queue drains, NULL otherwise
+static SIM_STATS *drainStats;
+
+
+//-----------------------------------------------------------------------------------------------
+// functions
+//
+
+static void ReportReceived (const uint8_t *report, uint8_t length, uint64_t when, void *context)
+{
+    if (length >= 2 && report[0] == REPORT_ID_SWITCHES) {
+        if (length != SWITCH_REPORT_SIZE) {
+            shortReports++;
+        }
+        if (drainStats && reports) {
+            SIM_StatsAdd (drainStats, when - lastReportTime);
+        }
+        if (length >= 7) {
+            lastReportFrame = report[5] | (report[6] << 8);
+        }
+        lastReport = report[1];
+        lastReportTime = when;
+        reports++;
+    }
+}
+
+
+// run one edge to completion, returns false if the host never saw it
+static bool RunEdge (uint8_t target, uint64_t stage[STAGES])
+{
+    uint64_t edge, tick = 0, debounced = 0, armed = 0;
+    uint32_t seen = reports;
+    uint8_t head = reportQueueHead;
+    uint16_t frame = 0, debouncedFrame = 0;
+    bool sampling;
+    const uint8_t *data;
+    uint8_t length;
+
+    SIM_SetSwitches (target);
+    edge = SIM_Now ();
+
+    while (SIM_Now () - edge < EDGE_TIMEOUT) {
+        // flagTick set going into a slice means the slice runs the sampling block
+        sampling = flagTick;
+        if (sampling) {
+            frame = SIM_HostFrameNumber ();
+        }
+        SIM_Step ();
+
+        if (!tick && sampling) {
+            tick = SIM_Now ();
+        }
+        if (!debounced && reportQueueHead != head &&
+                reportQueue[(uint8_t)(reportQueueHead - 1) & REPORT_QUEUE_MASK].switches[0] == target) {
+            debounced = SIM_Now ();
+            debouncedFrame = frame;
+        }
+        if (!armed && SIM_SIE_InArmed (HID_EP, &data, &length) && length >= 2 &&
+                data[0] == REPORT_ID_SWITCHES && data[1] == target) {
+            armed = SIM_Now ();
+        }
+        if (reports != seen && lastReport == target) {
+            // armed in the same slice the host polled it
+            if (!armed) {
+                armed = lastReportTime;
+            }
+            break;
+        }
+    }
+
+    if (reports == seen || lastReport != target || !tick || !debounced || !armed) {
+        return false;
+    }
+
+    // the firmware may move a stage on within the slice that also finished the one before it
+    if (lastReportFrame != debouncedFrame) {
+        frameErrors++;
+    }
+    if (debounced < tick) debounced = tick;
+    if (armed < debounced) armed = debounced;
+
+    stage[STAGE_TICK] = tick - edge;
+    stage[STAGE_DEBOUNCE] = debounced - tick;
+    stage[STAGE_HANDOFF] = armed - debounced;
+    stage[STAGE_BUS] = lastReportTime - armed;
+    stage[STAGE_TOTAL] = lastReportTime - edge;
+    return true;
+}
+
+
+// one GET_REPORT for feature report 3, returns false if it failed or the answer does not
+// match the switches
+static bool RunGetReport (uint8_t switches, uint64_t *latency)
+{
+    static const uint8_t setup[8] = { 0xA1, 0x01, 0x03, 0x03, 0x00, 0x00, STATE_REPORT_SIZE, 0x00 };
+    uint8_t data[STATE_REPORT_SIZE];
+    uint16_t length = sizeof (data);
+    uint64_t sent = SIM_Now ();
+
+    if (!SIM_HostControlTransfer (setup, data, &length, EDGE_TIMEOUT) || length != sizeof (data) ||
+            data[0] != 0x03 || data[1] != switches) {
+        return false;
+    }
+
+    *latency = SIM_Now () - sent;
+    return true;
+}
+
+
+// one refresh request, returns false if it was never answered
+static bool RunRefresh (uint64_t *latency)
+{
+    static const uint8_t refresh[2] = { 0x02, 0x55 };
+    uint32_t seen = reports;
+    uint64_t sent;
+
+    if (!SIM_HostSendReport (refresh, sizeof (refresh))) {
+        return false;
+    }
+    sent = SIM_Now ();
+
+    while (reports == seen && SIM_Now () - sent < EDGE_TIMEOUT) {
+        SIM_Step ();
+    }
+    if (reports == seen) {
+        return false;
+    }
+
+    *latency = lastReportTime - sent;
+    return true;
+}
+
+
+// queue DRAIN_CHANGES changes with IN polling held off, then let the host drain them
+static bool RunDrain (SIM_STATS *stats, uint8_t *switches)
+{
+    uint64_t resumed;
+    uint32_t seen;
+    uint8_t i;
+
+    SIM_HostPauseIn (true);
+    for (i = 0; i < DRAIN_CHANGES; i++) {
+        *switches ^= 1 << (SIM_Random () & 7);
+        SIM_SetSwitches (*switches);
+        SIM_Run (DRAIN_HOLD);
+    }
+
+    // the first report only marks where draining starts
+    seen = reports;
+    SIM_HostPauseIn (false);
+    resumed = SIM_Now ();
+    while (reports == seen && SIM_Now () - resumed < EDGE_TIMEOUT) {
+        SIM_Step ();
+    }
+    drainStats = stats;
+    SIM_Run (SIM_MS(DRAIN_CHANGES + 5));
+    drainStats = NULL;
+
+    return reports - seen == DRAIN_CHANGES && lastReport == *switches;
+}
+
+
+int main (int argc, char *argv[])
+{
+    static const uint8_t refresh[2] = { 0x02, 0x55 };
+    SIM_STATS stats[STAGES], refreshStats, getReportStats, drainIntervals;
+    uint64_t stage[STAGES], latency;
+    uint32_t edges = (argc > 1) ? strtoul (argv[1], NULL, 0) : DEFAULT_EDGES;
+    uint32_t seed = (argc > 2) ? strtoul (argv[2], NULL, 0) : DEFAULT_SEED;
+    int32_t ppm = (argc > 3) ? strtol (argv[3], NULL, 0) : DEFAULT_PPM;
+    uint32_t i, lost = 0;
+    uint8_t s, switches = 0;
+
+    SIM_Seed (seed);
+    for (s = 0; s < STAGES; s++) {
+        SIM_StatsInit (&stats[s], stageNames[s], edges);
+    }
+    SIM_StatsInit (&refreshStats, "refresh request to host", edges);
+    SIM_StatsInit (&getReportStats, "GET_REPORT feature 3", edges);
+    SIM_StatsInit (&drainIntervals, "report interval, draining", DRAIN_RUNS * DRAIN_CHANGES);
+
+    SIM_PowerOn ();
+    SIM_HostAttach ();
+    if (!SIM_HostWaitConfigured (SIM_MS(1000))) {
+        fprintf (stderr, "latbench: enumeration failed\n");
+        return 1;
+    }
+    SIM_HostSetReportCallback (ReportReceived, NULL);
+    SIM_HostSetFrameOffset (ppm);
+    SIM_HostSendReport (refresh, sizeof (refresh));
+    SIM_Run (SIM_MS(20));
+
+    for (i = 0; i < edges; i++) {
+        // settle for at least two debounce periods, then a random phase against TMR2 and SOF
+        SIM_Run (SIM_MS(10) + SIM_RandomCycles (0, SIM_MS(8)));
+
+        switches ^= 1 << (SIM_Random () & 7);
+        if (!RunEdge (switches, stage)) {
+            lost++;
+            continue;
+        }
+        for (s = 0; s < STAGES; s++) {
+            SIM_StatsAdd (&stats[s], stage[s]);
+        }
+    }
+
+    for (i = 0; i < edges; i++) {
+        SIM_Run (SIM_MS(2) + SIM_RandomCycles (0, SIM_MS(8)));
+        if (RunRefresh (&latency)) {
+            SIM_StatsAdd (&refreshStats, latency);
+        } else {
+            lost++;
+        }
+    }
+
+    for (i = 0; i < edges; i++) {
+        SIM_Run (SIM_MS(2) + SIM_RandomCycles (0, SIM_MS(8)));
+        if (RunGetReport (switches, &latency)) {
+            SIM_StatsAdd (&getReportStats, latency);
+        } else {
+            lost++;
+        }
+    }
+
+    for (i = 0; i < DRAIN_RUNS; i++) {
+        SIM_Run (SIM_MS(10) + SIM_RandomCycles (0, SIM_MS(8)));
+        if (!RunDrain (&drainIntervals, &switches)) {
+            lost++;
+        }
+    }
+
+    printf ("%u edges and refresh requests, %u queue drains, seed %u, %.1f s simulated\n",
+            edges, DRAIN_RUNS, seed,
+            (double)SIM_Now () / SIM_MS(1000));
+    printf ("sampling tick %s, host frames %+d ppm\n\n",
+            SWITCH_SAMPLE_SOF ? "locked to SOF" : "free running on TMR2", ppm);
+    SIM_StatsPrintHeader ();
+    for (s = 0; s < STAGES; s++) {
+        SIM_StatsPrint (&stats[s]);
+        SIM_StatsFree (&stats[s]);
+    }
+    printf ("\n");
+    SIM_StatsPrint (&refreshStats);
+    SIM_StatsFree (&refreshStats);
+    SIM_StatsPrint (&getReportStats);
+    SIM_StatsFree (&getReportStats);
+    SIM_StatsPrint (&drainIntervals);
+    SIM_StatsFree (&drainIntervals);
+    if (lost) {
+        printf ("\n%u edges, refresh or GET_REPORT requests or queue drains never reached the host\n", lost);
+    }
+    if (shortReports) {
+        printf ("\n%u switch reports were not %u bytes\n", shortReports, SWITCH_REPORT_SIZE);
+    }
+
+    if (frameErrors) {
+        printf ("\n%u switch reports did not carry the frame number of their change\n", frameErrors);
+    }
+
+    return (lost || shortReports || frameErrors) ? 1 : 0;
+}
@@ -0,0 +1,254 @@
+//-----------------------------------------------------------------------------------------------
+// loop_test.c -- checks the main loop timing in feature report 5
+//
+// usage: loop_test [seconds]
+//
+// Runs the stick with a switch change every 10 ms and reads feature report 5 with GET_REPORT
+// before and after. Over the run the main loop must have taken every tick, no tick may be
+// overrun or lost, and each tick must be picked up within what the simulator can delay it:
+// the interrupts ahead of the pass and the step the pass waits for. Then holds the main loop
+// up for a few ticks, which must count as overruns and nothing else, and keeps interrupts
+// off for a few ticks, which must count the TMR2 matches that raised no interrupt as lost
+// and nothing else. A read straight after another must find the maxima cleared.
+//
+// The simulator does not time the firmware's own code: a pass takes the step it yields in,
+// or nothing if an interrupt ended its wait, so only the counts and the pickup times mean
+// much here. On the part all of them do.
+//
+// Compiled with the firmware flags so it sees LOOP_STATS from system.h.
+//
+
+//-----------------------------------------------------------------------------------------------
+// includes
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "system.h"
+
+#include "sim.h"
+
+
+//-----------------------------------------------------------------------------------------------
+// defines
+//
+
+#define DEFAULT_SECONDS     2
+
+#define REPORT_ID_LOOP_STATS 0x05
+
+#define CHANGE_INTERVAL     SIM_MS(10)
+
+// the longest a tick can wait for the main loop in the simulator, in cycles: the tick and a
+// USB interrupt taken in the step it comes in, then the step the waiting pass runs in
+#define MAX_PICKUP          (2 * SIM_isrCycles + SIM_loopCycles)
+
+// main loop held up, and interrupts held off, for this many ticks and a half of the
+// built-in tick
+#define HOLD_TICKS          4
+#define TICK_US             (TICK_UNIT_US * TICK_UNITS)
+
+
+//-----------------------------------------------------------------------------------------------
+// functions
+//
+
+static uint16_t Get16 (const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+
+// GET_REPORT for feature report 5, false if it failed
+static bool ReadStats (LOOP_STATS *stats)
+{
+    static const uint8_t setup[8] = { 0xA1, 0x01, REPORT_ID_LOOP_STATS, 0x03, 0x00, 0x00, LOOP_REPORT_SIZE, 0x00 };
+    uint8_t data[LOOP_REPORT_SIZE];
+    uint16_t length = sizeof (data);
+    uint8_t i;
+
+    if (!SIM_HostControlTransfer (setup, data, &length, SIM_MS(100)) || length != sizeof (data) ||
+            data[0] != REPORT_ID_LOOP_STATS) {
+        return false;
+    }
+
+    stats->overruns = Get16 (&data[1]);
+    stats->lostTicks = Get16 (&data[3]);
+    stats->pickupMax = Get16 (&data[5]);
+    stats->passMax = Get16 (&data[7]);
+    for (i = 0; i < LOOP_HIST_BINS; i++) {
+        stats->pickup[i] = Get16 (&data[9 + i * 2]);
+        stats->pass[i] = Get16 (&data[9 + LOOP_HIST_BINS * 2 + i * 2]);
+    }
+    return true;
+}
+
+
+static uint16_t Total (const uint16_t before[LOOP_HIST_BINS], const uint16_t after[LOOP_HIST_BINS])
+{
+    uint16_t n = 0;
+    uint8_t i;
+
+    for (i = 0; i < LOOP_HIST_BINS; i++) {
+        n += (uint16_t)(after[i] - before[i]);
+    }
+    return n;
+}
+
+
+static void PrintHistogram (const char *name, const uint16_t before[LOOP_HIST_BINS],
+                            const uint16_t after[LOOP_HIST_BINS], uint16_t max)
+{
+    uint8_t i;
+
+    printf ("%-8s", name);
+    for (i = 0; i < LOOP_HIST_BINS; i++) {
+        printf (" %7u", (uint16_t)(after[i] - before[i]));
+    }
+    printf ("   max %u\n", max);
+}
+
+
+// hold something up for HOLD_TICKS and a half ticks, then let the stick settle and check
+// that only the expected counter moved, by fewest to most. Returns the number of errors
+static int Hold (const char *name, bool interrupts, uint16_t fewest, uint16_t most)
+{
+    LOOP_STATS before, after;
+    uint16_t overruns, lost, expected, other;
+    int errors = 0;
+
+    if (!ReadStats (&before)) {
+        printf ("%s: GET_REPORT for feature report 5 failed\n", name);
+        return 1;
+    }
+
+    if (interrupts) {
+        INTCONbits.GIE = 0;
+        SIM_Run (SIM_US(HOLD_TICKS * TICK_US + TICK_US / 2));
+        INTCONbits.GIE = 1;
+    } else {
+        SIM_MainLoopBusy (SIM_US(HOLD_TICKS * TICK_US + TICK_US / 2));
+    }
+    SIM_Run (SIM_MS(20));
+
+    if (!ReadStats (&after)) {
+        printf ("%s: GET_REPORT for feature report 5 failed\n", name);
+        return 1;
+    }
+
+    overruns = after.overruns - before.overruns;
+    lost = after.lostTicks - before.lostTicks;
+    expected = interrupts ? lost : overruns;
+    other = interrupts ? overruns : lost;
+    printf ("%s: %u overruns, %u lost ticks\n", name, overruns, lost);
+    if (expected < fewest || expected > most || other != 0) {
+        printf ("%s: expected %u to %u %s and no %s\n", name, fewest, most,
+                interrupts ? "lost ticks" : "overruns", interrupts ? "overruns" : "lost ticks");
+        errors++;
+    }
+    return errors;
+}
+
+
+int main (int argc, char *argv[])
+{
+    static const uint8_t refresh[2] = { 0x02, 0x55 };
+    LOOP_STATS before, after, again;
+    uint32_t seconds = (argc > 1) ? strtoul (argv[1], NULL, 0) : DEFAULT_SECONDS;
+    uint32_t ticks;
+    uint64_t end, nextChange;
+    char label[8];
+    int errors = 0;
+    uint8_t i;
+
+    // the 16-bit counts must not wrap between the reads, passes come about 2000 a second
+    if (seconds > 30) {
+        seconds = 30;
+    }
+
+    SIM_PowerOn ();
+    SIM_HostAttach ();
+    if (!SIM_HostWaitConfigured (SIM_MS(1000))) {
+        fprintf (stderr, "loop_test: enumeration failed\n");
+        return 1;
+    }
+    SIM_HostSendReport (refresh, sizeof (refresh));
+    SIM_Run (SIM_MS(20));
+
+    if (!ReadStats (&before)) {
+        printf ("GET_REPORT for feature report 5 failed\n");
+        return 1;
+    }
+
+    end = SIM_Now () + SIM_MS(1000) * seconds;
+    nextChange = SIM_Now ();
+    while (SIM_Now () < end) {
+        if (SIM_Now () >= nextChange) {
+            SIM_SetSwitches (SIM_GetSwitches () ^ SIM_SWITCH(1 + (SIM_Random () & 7)));
+            nextChange += CHANGE_INTERVAL;
+        }
+        SIM_Step ();
+    }
+
+    if (!ReadStats (&after) || !ReadStats (&again)) {
+        printf ("GET_REPORT for feature report 5 failed\n");
+        return 1;
+    }
+
+    printf ("%u s, a change every %u ms\n\n", seconds, (unsigned)(CHANGE_INTERVAL / SIM_MS(1)));
+    printf ("%-8s", "cycles");
+    for (i = 0; i < LOOP_HIST_BINS; i++) {
+        snprintf (label, sizeof (label), "%s%u", (i < LOOP_HIST_BINS - 1) ? "<" : ">=",
+                  (1u << LOOP_HIST_SHIFT) << (i < LOOP_HIST_BINS - 1 ? i : i - 1));
+        printf (" %7s", label);
+    }
+    printf ("\n");
+    PrintHistogram ("pickup", before.pickup, after.pickup, after.pickupMax);
+    PrintHistogram ("pass", before.pass, after.pass, after.passMax);
+    printf ("\n");
+
+    // the run plus the GET_REPORT round trip on either side of it, give or take a tick
+    ticks = Total (before.pickup, after.pickup);
+    if (ticks < seconds * TICK_HZ || ticks > seconds * TICK_HZ + 2) {
+        printf ("%u ticks taken by the main loop in %u s\n", ticks, seconds);
+        errors++;
+    }
+    if (Total (before.pass, after.pass) < ticks) {
+        printf ("%u main loop passes for %u ticks\n", Total (before.pass, after.pass), ticks);
+        errors++;
+    }
+    if (after.overruns != before.overruns || after.lostTicks != before.lostTicks) {
+        printf ("%u overruns and %u lost ticks with nothing holding the main loop up\n",
+                (uint16_t)(after.overruns - before.overruns), (uint16_t)(after.lostTicks - before.lostTicks));
+        errors++;
+    }
+    if (after.pickupMax > MAX_PICKUP) {
+        printf ("a tick waited %u cycles for the main loop, expected at most %u\n",
+                after.pickupMax, MAX_PICKUP);
+        errors++;
+    }
+
+    // the read straight after sees at most the tick or two of its own round trip
+    if (Total (after.pickup, again.pickup) == 0 && again.pickupMax != 0) {
+        printf ("pickup maximum %u not cleared by the read\n", again.pickupMax);
+        errors++;
+    }
+    if (Total (after.pass, again.pass) == 0 && again.passMax != 0) {
+        printf ("pass maximum %u not cleared by the read\n", again.passMax);
+        errors++;
+    }
+    if (again.pickupMax > MAX_PICKUP) {
+        printf ("pickup maximum %u after the read\n", again.pickupMax);
+        errors++;
+    }
+
+    // four or five ticks come while either is held up. Every one but the first is overrun
+    // while the main loop is held up; with interrupts off only the first raises an
+    // interrupt and the rest are lost
+    errors += Hold ("main loop held up", false, HOLD_TICKS - 1, HOLD_TICKS);
+    errors += Hold ("interrupts off", true, HOLD_TICKS - 1, HOLD_TICKS);
+
+    printf ("%s\n", errors ? "FAIL" : "PASS");
+    return errors ? 1 : 0;
+}
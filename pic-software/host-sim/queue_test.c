@@ -0,0 +1,168 @@
+//-----------------------------------------------------------------------------------------------
+// queue_test.c -- checks that no switch transition is lost between the sampler and the host
+//
+// usage: queue_test
+//
+// Holds off the host's interrupt IN polling while the switches change, then lets it drain
+// the report queue. Every debounced transition must arrive in order. A second run makes more
+// changes than the queue holds: the overflow must show up in reportQueueDrops and as a gap
+// in the reports' sequence numbers, and the final state must still reach the host. Report
+// timestamps must step by the time each state was held.
+//
+// Compiled with the firmware flags so it sees REPORT_QUEUE_SIZE from system.h.
+//
+
+//-----------------------------------------------------------------------------------------------
+// includes
+//
+
+#include <stdio.h>
+
+#include "system.h"
+
+#include "sim.h"
+
+
+//-----------------------------------------------------------------------------------------------
+// defines
+//
+
+#define REPORT_ID_SWITCHES  0x01
+#define HOLD_MS             8
+
+// long enough for every change to pass the debounce
+#define HOLD                SIM_MS(HOLD_MS)
+
+#define MAX_REPORTS         64
+
+// reports armed in the IN BDs are sent from their queue slots, so they count against it
+#define CAPACITY            REPORT_QUEUE_SIZE
+
+
+//-----------------------------------------------------------------------------------------------
+// globals
+//
+
+// main.c
+extern volatile uint8_t reportQueueDrops;
+extern uint8_t switchSequence;
+
+static uint8_t received[MAX_REPORTS];
+static uint16_t receivedTimestamp[MAX_REPORTS];
+static uint8_t receivedSequence[MAX_REPORTS];
+static uint8_t receivedCount;
+
+
+//-----------------------------------------------------------------------------------------------
+// functions
+//
+
+static void ReportReceived (const uint8_t *report, uint8_t length, uint64_t when, void *context)
+{
+    if (length == SWITCH_REPORT_SIZE && report[0] == REPORT_ID_SWITCHES && receivedCount < MAX_REPORTS) {
+        received[receivedCount] = report[1];
+        receivedTimestamp[receivedCount] = report[2] | (report[3] << 8);
+        receivedSequence[receivedCount] = report[4];
+        receivedCount++;
+    }
+}
+
+
+// make the given number of changes with IN polling held off, then drain; returns the number
+// of errors
+static int Burst (uint8_t changes, uint8_t first)
+{
+    uint8_t expected[MAX_REPORTS];
+    uint8_t i, errors = 0, drops = reportQueueDrops, skipped = 0;
+    uint8_t sequence = switchSequence;
+    uint8_t queued = (changes < CAPACITY) ? changes : CAPACITY;
+    uint8_t dropped = changes - queued;
+
+    receivedCount = 0;
+    SIM_HostPauseIn (true);
+    for (i = 0; i < changes; i++) {
+        expected[i] = first + i;
+        SIM_SetSwitches (expected[i]);
+        SIM_Run (HOLD);
+    }
+    SIM_HostPauseIn (false);
+    SIM_Run (SIM_MS(50));
+
+    // with an overflow the queue keeps the oldest changes and the final state follows once
+    // there is room again
+    if (dropped) {
+        expected[queued] = expected[changes - 1];
+        queued++;
+    }
+
+    if (receivedCount != queued) {
+        printf ("%u changes: host got %u reports, expected %u\n", changes, receivedCount, queued);
+        errors++;
+    }
+    for (i = 0; i < receivedCount && i < queued; i++) {
+        if (received[i] != expected[i]) {
+            printf ("%u changes: report %u is %02X, expected %02X\n", changes, i, received[i], expected[i]);
+            errors++;
+        }
+    }
+
+    // consecutive changes are numbered consecutively, a dropped change leaves a gap; every
+    // change but the catch-up after an overflow was held for HOLD_MS
+    for (i = 0; i < receivedCount; i++) {
+        skipped += (uint8_t)(receivedSequence[i] - sequence - 1);
+        sequence = receivedSequence[i];
+        if (i > 0 && !(dropped && i == receivedCount - 1) &&
+                (uint16_t)(receivedTimestamp[i] - receivedTimestamp[i - 1]) != HOLD_MS) {
+            printf ("%u changes: report %u timestamp %u ms after the one before\n", changes, i,
+                    (uint16_t)(receivedTimestamp[i] - receivedTimestamp[i - 1]));
+            errors++;
+        }
+    }
+    // reportQueueDrops also counts the final state, turned away once before its retry
+    if (skipped != changes - receivedCount) {
+        printf ("%u changes: sequence numbers skip %u, expected %u\n", changes, skipped,
+                changes - receivedCount);
+        errors++;
+    }
+    if ((uint8_t)(reportQueueDrops - drops) != dropped) {
+        printf ("%u changes: %u drops counted, expected %u\n", changes,
+                (uint8_t)(reportQueueDrops - drops), dropped);
+        errors++;
+    }
+
+    printf ("%u changes while the host was not polling: %u reports, %u drops\n", changes,
+            receivedCount, (uint8_t)(reportQueueDrops - drops));
+    return errors;
+}
+
+
+int main (int argc, char *argv[])
+{
+    static const uint8_t refresh[2] = { 0x02, 0x55 };
+#if DEBOUNCE_SAMPLES == DEBOUNCE_ADAPTIVE
+    static const uint8_t fixedDepth[3] = { 0x02, 0x44, DEBOUNCE_ADAPT_START };
+#endif
+    int errors = 0;
+
+    SIM_PowerOn ();
+    SIM_HostAttach ();
+    if (!SIM_HostWaitConfigured (SIM_MS(1000))) {
+        fprintf (stderr, "queue_test: enumeration failed\n");
+        return 1;
+    }
+#if DEBOUNCE_SAMPLES == DEBOUNCE_ADAPTIVE
+    // learned depths differ from switch to switch and would let a change of several switches
+    // out over several reports; these checks want one depth for all
+    SIM_HostSendReport (fixedDepth, sizeof (fixedDepth));
+    SIM_Run (SIM_MS(30));
+#endif
+    SIM_HostSetReportCallback (ReportReceived, NULL);
+    SIM_HostSendReport (refresh, sizeof (refresh));
+    SIM_Run (SIM_MS(20));
+
+    errors += Burst (CAPACITY, 0x01);
+    errors += Burst (CAPACITY + 4, 0x40);
+
+    printf ("%s\n", errors ? "FAIL" : "PASS");
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,265 @@
+//-----------------------------------------------------------------------------------------------
+// settings_test.c -- checks the host-set tick and debounce depth and their keeping in flash
+//
+// usage: settings_test
+//
+// With the flash erased, feature report 6 must read the built-in tick and debounce depth.
+// The report ID 2 / 0x54 command must change the tick rate, counted from the tick
+// interrupts, and 0x44 the debounce depth, both read back in feature report 6. At each
+// setting a change must be reported no sooner than the depth less one tick after its edge
+// and no later than the depth and a frame or two, and a glitch half a tick shorter than
+// that must not be reported at all. 0x50 must change both with a single flash write. Values
+// out of range must change nothing, and setting what is already set must not write the
+// flash; depth 0, adaptive, has bounce_test. After a power cycle the stick must come up
+// with what was set last, and with the built-in values again once the flash is erased.
+//
+// Compiled with the firmware flags so it sees the settings and isrStats from system.h.
+//
+
+//-----------------------------------------------------------------------------------------------
+// includes
+//
+
+#include <stdio.h>
+
+#include "system.h"
+
+#include "sim.h"
+
+
+//-----------------------------------------------------------------------------------------------
+// defines
+//
+
+#define REPORT_ID_SWITCHES  0x01
+#define REPORT_ID_COMMAND   0x02
+#define REPORT_ID_SETTINGS  0x06
+
+#define COMMAND_TICK        0x54
+#define COMMAND_DEBOUNCE    0x44
+#define COMMAND_SAMPLING    0x50
+
+// tick interrupts are counted over this long
+#define RATE_TIME           SIM_MS(200)
+
+// a debounced change goes out on the host's next poll, a frame later at most, and is
+// seen by the host in the frame after that
+#define LATE                SIM_MS(2)
+
+#define SETTLE              SIM_MS(30)
+
+#define SETTINGS_COUNT      7
+
+// 0x50's argument
+#define SAMPLING(tickUnits, debounceSamples) (uint8_t)(((tickUnits) << 4) | (debounceSamples))
+
+
+//-----------------------------------------------------------------------------------------------
+// typedefs
+//
+
+typedef struct {
+    uint8_t tickUnits;
+    uint8_t debounceSamples;
+} SETTING;
+
+
+//-----------------------------------------------------------------------------------------------
+// globals
+//
+
+static const SETTING settings[SETTINGS_COUNT] = {
+    { 1, 1 },
+    { 1, 4 },
+    { 3, 2 },
+    { 10, 3 },
+    { 5, 4 },
+    { 7, 2 },
+    { 2, 8 },
+};
+
+// differs from the last of settings[] in both
+static const SETTING both = { 4, 6 };
+
+static uint32_t reports;
+static uint64_t lastReportTime;
+
+
+//-----------------------------------------------------------------------------------------------
+// functions
+//
+
+static void ReportReceived (const uint8_t *report, uint8_t length, uint64_t when, void *context)
+{
+    if (length == SWITCH_REPORT_SIZE && report[0] == REPORT_ID_SWITCHES) {
+        lastReportTime = when;
+        reports++;
+    }
+}
+
+
+static void Command (uint8_t command, uint8_t argument)
+{
+    const uint8_t report[3] = { REPORT_ID_COMMAND, command, argument };
+
+    SIM_HostSendReport (report, sizeof (report));
+    SIM_Run (SETTLE);
+}
+
+
+static bool Start (void)
+{
+    static const uint8_t refresh[2] = { 0x02, 0x55 };
+
+    SIM_PowerOn ();
+    SIM_HostAttach ();
+    if (!SIM_HostWaitConfigured (SIM_MS(1000))) {
+        return false;
+    }
+    SIM_HostSetReportCallback (ReportReceived, NULL);
+    SIM_HostSendReport (refresh, sizeof (refresh));
+    SIM_Run (SETTLE);
+    return true;
+}
+
+
+// feature report 6 and the tick rate against the expected settings; returns the number of
+// errors
+static int Check (const char *name, uint8_t tickUnits, uint8_t debounceSamples)
+{
+    const uint8_t setup[8] = { 0xA1, 0x01, REPORT_ID_SETTINGS, 0x03, 0x00, 0x00, SETTINGS_REPORT_SIZE, 0x00 };
+    uint8_t data[SETTINGS_REPORT_SIZE];
+    uint16_t length = sizeof (data);
+    uint32_t ticks, expected;
+    int errors = 0;
+
+    if (!SIM_HostControlTransfer (setup, data, &length, SIM_MS(100)) || length != sizeof (data) ||
+            data[0] != REPORT_ID_SETTINGS) {
+        printf ("%s: GET_REPORT for feature report 6 failed\n", name);
+        return 1;
+    }
+    if (data[2] != tickUnits || data[3] != debounceSamples) {
+        printf ("%s: feature report 6 reads tick %u depth %u, expected %u and %u\n", name,
+                data[2], data[3], tickUnits, debounceSamples);
+        errors++;
+    }
+
+    ticks = isrStats[ISR_STATS_TMR2].count;
+    SIM_Run (RATE_TIME);
+    ticks = isrStats[ISR_STATS_TMR2].count - ticks;
+    expected = RATE_TIME / SIM_US(tickUnits * TICK_UNIT_US);
+    if (ticks + 1 < expected || ticks > expected + 1) {
+        printf ("%s: %u ticks in %u ms, expected %u\n", name, ticks,
+                (unsigned)(RATE_TIME / SIM_MS(1)), expected);
+        errors++;
+    }
+    return errors;
+}
+
+
+// a change and a glitch at the current settings; returns the number of errors
+static int Debounce (uint8_t tickUnits, uint8_t debounceSamples)
+{
+    uint64_t tick = SIM_US(tickUnits * TICK_UNIT_US);
+    uint64_t earliest = (debounceSamples - 1) * tick, latest = debounceSamples * tick + LATE;
+    uint64_t edge, delay;
+    uint32_t seen;
+    int errors = 0;
+
+    // start off the tick's phase by a little more each time
+    SIM_Run (SIM_RandomCycles (0, tick));
+    seen = reports;
+    SIM_SetSwitches (SIM_GetSwitches () ^ SIM_SWITCH(1));
+    edge = SIM_Now ();
+    SIM_Run (latest + SETTLE);
+    delay = lastReportTime - edge;
+    printf ("tick %4u us, %u samples: reported %.3f ms after the edge\n", tickUnits * TICK_UNIT_US,
+            debounceSamples, (double)delay / SIM_MS(1));
+    if (reports != seen + 1 || delay < earliest || delay > latest) {
+        printf ("expected one report %.3f to %.3f ms after the edge\n",
+                (double)earliest / SIM_MS(1), (double)latest / SIM_MS(1));
+        errors++;
+    }
+
+    if (debounceSamples > 1) {
+        seen = reports;
+        SIM_SetSwitches (SIM_GetSwitches () ^ SIM_SWITCH(2));
+        SIM_Run (earliest - tick / 2);
+        SIM_SetSwitches (SIM_GetSwitches () ^ SIM_SWITCH(2));
+        SIM_Run (latest + SETTLE);
+        if (reports != seen) {
+            printf ("a %.3f ms glitch was reported\n", (double)(earliest - tick / 2) / SIM_MS(1));
+            errors++;
+        }
+    }
+    return errors;
+}
+
+
+int main (int argc, char *argv[])
+{
+    const SETTING *last = NULL;
+    uint32_t writes;
+    int errors = 0;
+    uint8_t s;
+
+    if (!Start ()) {
+        fprintf (stderr, "settings_test: enumeration failed\n");
+        return 1;
+    }
+    errors += Check ("built-in", TICK_UNITS, DEBOUNCE_SAMPLES);
+
+    for (s = 0; s < SETTINGS_COUNT; s++) {
+        last = &settings[s];
+        Command (COMMAND_TICK, last->tickUnits);
+        Command (COMMAND_DEBOUNCE, last->debounceSamples);
+        errors += Check ("set", last->tickUnits, last->debounceSamples);
+        errors += Debounce (last->tickUnits, last->debounceSamples);
+    }
+
+    // both in one command, one flash write
+    writes = SIM_FlashWrites ();
+    last = &both;
+    Command (COMMAND_SAMPLING, SAMPLING (last->tickUnits, last->debounceSamples));
+    errors += Check ("both", last->tickUnits, last->debounceSamples);
+    errors += Debounce (last->tickUnits, last->debounceSamples);
+    if (SIM_FlashWrites () != writes + 1) {
+        printf ("%u flash writes for one 0x50 command\n", SIM_FlashWrites () - writes);
+        errors++;
+    }
+
+    // out of range, and what is already set
+    writes = SIM_FlashWrites ();
+    Command (COMMAND_TICK, 0);
+    Command (COMMAND_TICK, TICK_UNITS_MAX + 1);
+    Command (COMMAND_DEBOUNCE, DEBOUNCE_SAMPLES_MAX + 1);
+    Command (COMMAND_SAMPLING, SAMPLING (0, last->debounceSamples));
+    Command (COMMAND_SAMPLING, SAMPLING (last->tickUnits, DEBOUNCE_SAMPLES_MAX + 1));
+    Command (COMMAND_TICK, last->tickUnits);
+    Command (COMMAND_DEBOUNCE, last->debounceSamples);
+    Command (COMMAND_SAMPLING, SAMPLING (last->tickUnits, last->debounceSamples));
+    errors += Check ("out of range", last->tickUnits, last->debounceSamples);
+    if (SIM_FlashWrites () != writes) {
+        printf ("%u flash writes for settings that changed nothing\n", SIM_FlashWrites () - writes);
+        errors++;
+    }
+    printf ("%u flash writes\n", SIM_FlashWrites ());
+
+    // kept over a power cycle, gone with the flash erased
+    if (!Start ()) {
+        fprintf (stderr, "settings_test: enumeration after the power cycle failed\n");
+        return 1;
+    }
+    errors += Check ("power cycle", last->tickUnits, last->debounceSamples);
+    errors += Debounce (last->tickUnits, last->debounceSamples);
+
+    SIM_FlashErase ();
+    if (!Start ()) {
+        fprintf (stderr, "settings_test: enumeration after the erase failed\n");
+        return 1;
+    }
+    errors += Check ("erased", TICK_UNITS, DEBOUNCE_SAMPLES);
+
+    printf ("%s\n", errors ? "FAIL" : "PASS");
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,270 @@
+//-----------------------------------------------------------------------------------------------
+// settle_test.c -- checks the settle window that merges switches flipped together
+//
+// usage: settle_test
+//
+// Without a window three switches flipped a few ms apart must make three reports. With the
+// report ID 2 / 0x53 command setting a window, feature report 6 must read it back and the
+// same flips must make one report with all three, the window after the last one and one
+// sequence number on from the report before. GET_REPORT must not see the change before it
+// has settled. A switch flipped and flipped back inside the window must make no report and
+// no gap in the sequence. The 0x46 command must let a held change out at once, and a change
+// made while the bus is suspended must still wake the host once it has settled.
+//
+// Compiled with the firmware flags so it sees the report sizes from system.h.
+//
+
+//-----------------------------------------------------------------------------------------------
+// includes
+//
+
+#include <stdio.h>
+
+#include "system.h"
+
+#include "sim.h"
+
+
+//-----------------------------------------------------------------------------------------------
+// defines
+//
+
+#define REPORT_ID_SWITCHES  0x01
+#define REPORT_ID_COMMAND   0x02
+#define REPORT_ID_SETTINGS  0x06
+
+#define COMMAND_SETTLE      0x53
+#define COMMAND_SETTLE_NOW  0x46
+
+#define WINDOW_MS           30
+
+// switches flipped this far apart, well inside the window
+#define FLIP_GAP            SIM_MS(5)
+
+// a change is debounced DEPTH ticks after its edge at most, then goes out on the next frame's
+// poll; the tick runs on its own clock, so allow a tick either way
+#if DEBOUNCE_SAMPLES == DEBOUNCE_ADAPTIVE
+#define DEPTH               DEBOUNCE_ADAPT_START
+#else
+#define DEPTH               DEBOUNCE_SAMPLES
+#endif
+#define TICK_MS             (TICK_UNITS * TICK_UNIT_US / 1000)
+#define DEBOUNCE_MS         (DEPTH * TICK_MS)
+#define LATE_MS             (1 + 2 * TICK_MS)
+
+#define WAKE_TIMEOUT        SIM_MS(200)
+
+
+//-----------------------------------------------------------------------------------------------
+// globals
+//
+
+static uint32_t reports;
+static uint8_t lastSwitches, lastSequence;
+static uint64_t lastReportTime;
+
+
+//-----------------------------------------------------------------------------------------------
+// functions
+//
+
+static void ReportReceived (const uint8_t *report, uint8_t length, uint64_t when, void *context)
+{
+    if (length == SWITCH_REPORT_SIZE && report[0] == REPORT_ID_SWITCHES) {
+        lastSwitches = report[1];
+        lastSequence = report[SWITCH_BYTES + 3];
+        lastReportTime = when;
+        reports++;
+    }
+}
+
+
+static void Command (uint8_t command, uint8_t argument)
+{
+    const uint8_t report[3] = { REPORT_ID_COMMAND, command, argument };
+
+    SIM_HostSendReport (report, sizeof (report));
+    SIM_Run (SIM_MS(5));
+}
+
+
+// GET_REPORT for an input or feature report into data, false if it failed
+static bool GetReport (uint8_t type, uint8_t reportId, uint8_t *data, uint16_t size)
+{
+    const uint8_t setup[8] = { 0xA1, 0x01, reportId, type, 0x00, 0x00, (uint8_t)size, 0x00 };
+    uint16_t length = size;
+
+    return SIM_HostControlTransfer (setup, data, &length, SIM_MS(100)) && length == size &&
+           data[0] == reportId;
+}
+
+
+// flip SW1, SW2 and SW3 FLIP_GAP apart and return the time of the last edge
+static uint64_t FlipThree (void)
+{
+    uint8_t n;
+
+    for (n = 1; n <= 3; n++) {
+        if (n > 1) {
+            SIM_Run (FLIP_GAP);
+        }
+        SIM_SetSwitches (SIM_GetSwitches () ^ SIM_SWITCH(n));
+    }
+    return SIM_Now ();
+}
+
+
+// flip three switches and check the reports and when the last one came; returns the number
+// of errors
+static int CheckFlips (const char *name, uint32_t expected, uint32_t windowMs)
+{
+    uint32_t seen = reports;
+    uint8_t sequence = lastSequence;
+    uint64_t edge, delay;
+    uint64_t earliest = SIM_MS(windowMs + 1), latest = SIM_MS(windowMs + DEBOUNCE_MS + LATE_MS);
+    uint8_t state[STATE_REPORT_SIZE];
+    int errors = 0;
+
+    edge = FlipThree ();
+
+    // the state the host can read must not move before the change has settled
+    if (windowMs > DEBOUNCE_MS + LATE_MS) {
+        SIM_Run (SIM_MS(DEBOUNCE_MS + LATE_MS));
+        if (!GetReport (0x03, 0x03, state, sizeof (state))) {
+            printf ("%s: GET_REPORT for feature report 3 failed\n", name);
+            errors++;
+        } else if (state[SWITCH_BYTES + 3] != sequence || reports != seen) {
+            printf ("%s: the change showed before the window was over\n", name);
+            errors++;
+        }
+    }
+
+    SIM_Run (SIM_MS(windowMs + 50));
+    delay = lastReportTime - edge;
+    printf ("%s: %u reports, the last %.3f ms after the last edge\n", name, reports - seen,
+            (double)delay / SIM_MS(1));
+    if (reports - seen != expected || lastSwitches != SIM_GetSwitches () ||
+            lastSequence != (uint8_t)(sequence + expected)) {
+        printf ("%s: expected %u reports ending in %02X sequence %u, got %02X sequence %u\n", name,
+                expected, SIM_GetSwitches (), (uint8_t)(sequence + expected), lastSwitches, lastSequence);
+        errors++;
+    }
+    if (delay < earliest || delay > latest) {
+        printf ("%s: expected the last report %u to %u ms after the last edge\n", name,
+                (unsigned)(earliest / SIM_MS(1)), (unsigned)(latest / SIM_MS(1)));
+        errors++;
+    }
+    return errors;
+}
+
+
+// suspend with remote wakeup enabled, flip a switch and check the host is woken with it after
+// the window; returns the number of errors
+static int SuspendedChange (void)
+{
+    uint32_t seen, wakeups;
+    uint64_t edge;
+
+    if (!SIM_HostSuspend (true)) {
+        printf ("suspended: suspend failed\n");
+        return 1;
+    }
+    SIM_Run (SIM_MS(50));
+
+    seen = reports;
+    wakeups = SIM_HostRemoteWakeups ();
+    SIM_SetSwitches (SIM_GetSwitches () ^ SIM_SWITCH(1));
+    edge = SIM_Now ();
+    while (reports == seen && SIM_Now () - edge < WAKE_TIMEOUT) {
+        SIM_Step ();
+    }
+
+    if (SIM_HostRemoteWakeups () == wakeups || reports == seen || lastSwitches != SIM_GetSwitches ()) {
+        printf ("suspended: a settled change did not wake the host with its report\n");
+        return 1;
+    }
+    printf ("suspended: change reported %.3f ms after the edge\n",
+            (double)(lastReportTime - edge) / SIM_MS(1));
+    SIM_Run (SIM_MS(20));
+    return 0;
+}
+
+
+int main (int argc, char *argv[])
+{
+    static const uint8_t refresh[2] = { 0x02, 0x55 };
+#if DEBOUNCE_SAMPLES == DEBOUNCE_ADAPTIVE
+    static const uint8_t fixedDepth[3] = { 0x02, 0x44, DEPTH };
+#endif
+    uint8_t settings[SETTINGS_REPORT_SIZE];
+    uint32_t seen;
+    uint8_t sequence;
+    uint64_t edge;
+    int errors = 0;
+
+    SIM_PowerOn ();
+    SIM_HostAttach ();
+    if (!SIM_HostWaitConfigured (SIM_MS(1000))) {
+        fprintf (stderr, "settle_test: enumeration failed\n");
+        return 1;
+    }
+#if DEBOUNCE_SAMPLES == DEBOUNCE_ADAPTIVE
+    // learned depths differ from switch to switch and would let a change of several switches
+    // out over several reports; these checks want one depth for all
+    SIM_HostSendReport (fixedDepth, sizeof (fixedDepth));
+    SIM_Run (SIM_MS(30));
+#endif
+    SIM_HostSetReportCallback (ReportReceived, NULL);
+    SIM_HostSendReport (refresh, sizeof (refresh));
+    SIM_Run (SIM_MS(20));
+
+    if (!GetReport (0x03, REPORT_ID_SETTINGS, settings, sizeof (settings)) || settings[1] != SETTLE_MS) {
+        printf ("feature report 6 does not read the built-in window of %u ms\n", SETTLE_MS);
+        errors++;
+    }
+    Command (COMMAND_SETTLE, 0);
+    errors += CheckFlips ("no window", 3, 0);
+
+    Command (COMMAND_SETTLE, WINDOW_MS);
+    if (!GetReport (0x03, REPORT_ID_SETTINGS, settings, sizeof (settings)) || settings[1] != WINDOW_MS) {
+        printf ("feature report 6 does not read the %u ms window back\n", WINDOW_MS);
+        errors++;
+    }
+    errors += CheckFlips ("window", 1, WINDOW_MS);
+
+    // there and back again inside the window
+    seen = reports;
+    sequence = lastSequence;
+    SIM_SetSwitches (SIM_GetSwitches () ^ SIM_SWITCH(8));
+    SIM_Run (SIM_MS(10));
+    SIM_SetSwitches (SIM_GetSwitches () ^ SIM_SWITCH(8));
+    SIM_Run (SIM_MS(WINDOW_MS + 50));
+    SIM_SetSwitches (SIM_GetSwitches () ^ SIM_SWITCH(4));
+    SIM_Run (SIM_MS(WINDOW_MS + 50));
+    if (reports != seen + 1 || lastSequence != (uint8_t)(sequence + 1)) {
+        printf ("flipped back: %u reports to sequence %u, expected 1 to %u\n", reports - seen,
+                lastSequence, (uint8_t)(sequence + 1));
+        errors++;
+    }
+
+    // the host lets a held change out early
+    Command (COMMAND_SETTLE, 200);
+    seen = reports;
+    SIM_SetSwitches (SIM_GetSwitches () ^ SIM_SWITCH(5));
+    edge = SIM_Now ();
+    SIM_Run (SIM_MS(20));
+    Command (COMMAND_SETTLE_NOW, 0);
+    if (reports != seen + 1 || lastSwitches != SIM_GetSwitches () || lastReportTime - edge > SIM_MS(30)) {
+        printf ("settle now: the held change did not go out straight away\n");
+        errors++;
+    } else {
+        printf ("settle now: change reported %.3f ms after the edge\n",
+                (double)(lastReportTime - edge) / SIM_MS(1));
+    }
+
+    Command (COMMAND_SETTLE, WINDOW_MS);
+    errors += SuspendedChange ();
+
+    printf ("%s\n", errors ? "FAIL" : "PASS");
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,174 @@
+//-----------------------------------------------------------------------------------------------
+// sim.h -- host-native PIC16F1459 simulator for the usb-dip-switch firmware
+//
+// The firmware sources in ../usb-dip-switch.X are compiled unmodified against xc.h in this
+// directory. main() runs as a coroutine that yields to the simulator once per main loop pass
+// (from SYSTEM_Tasks()); between passes the simulator advances simulated time, runs TMR2 and
+// the USB SIE model, plays the USB host and calls SYS_InterruptHigh() when an enabled
+// interrupt is pending. Simulated time is counted in instruction cycles (Fosc/4 = 12 MHz).
+// SIM_SetPreemption() adds interrupt points inside a pass, see sim_core.c.
+//
+
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+//-----------------------------------------------------------------------------------------------
+// defines
+//
+
+// instruction clock, 48 MHz Fosc from HFINTOSC with the 3x PLL
+#define SIM_FCY                 12000000UL
+
+#define SIM_US(us)              ((uint64_t)(us) * (SIM_FCY / 1000000UL))
+#define SIM_MS(ms)              ((uint64_t)(ms) * (SIM_FCY / 1000UL))
+
+// dual-port RAM address to host pointer, SIM_DPRAM_HOST_BASE comes from xc.h
+#define SIM_DPRAM(adr)          ((uint8_t *)(uintptr_t)(SIM_DPRAM_HOST_BASE | (uint16_t)(adr)))
+
+// switch positions in report bit order, bit 7 = SW1 ... bit 0 = SW8
+#define SIM_SWITCH(n)           (0x80 >> ((n) - 1))
+
+// switch banks: 0 is the stick's own eight, 1 and up are on the 74HC165 chain on RC0-RC2
+#define SIM_SWITCH_BANKS        8
+
+// USB handshake results
+enum {
+    SIM_ACK = 0,
+    SIM_NAK,
+    SIM_STALL,
+    SIM_NO_RESPONSE
+};
+
+// what woke the core from SLEEP
+enum {
+    SIM_WAKE_INTERRUPT = 0,
+    SIM_WAKE_IOC,
+    SIM_WAKE_WDT,
+    SIM_WAKE_SOURCES
+};
+
+// interrupt sources that end the main loop's wait
+enum {
+    SIM_SOURCE_TMR2 = 0,
+    SIM_SOURCE_USB,
+    SIM_SOURCES
+};
+
+
+//-----------------------------------------------------------------------------------------------
+// typedefs
+//
+
+typedef void (*SIM_REPORT_CALLBACK)(const uint8_t *report, uint8_t length, uint64_t when, void *context);
+
+// a set of latency samples in instruction cycles
+typedef struct {
+    const char *name;
+    uint64_t *samples;
+    uint32_t count;
+    uint32_t size;
+} SIM_STATS;
+
+
+//-----------------------------------------------------------------------------------------------
+// core, sim_core.c
+//
+
+// cost in instruction cycles of one pass of the firmware main loop and of one interrupt
+extern uint16_t SIM_loopCycles;
+extern uint16_t SIM_isrCycles;
+
+// oscillator start-up after a wake from SLEEP
+extern uint64_t SIM_wakeCycles;
+
+void SIM_PowerOn (void);
+void SIM_Step (void);
+void SIM_Run (uint64_t cycles);
+uint64_t SIM_Now (void);
+void SIM_MainLoopBusy (uint64_t cycles);
+void SIM_SetPreemption (uint64_t cycles);
+uint32_t SIM_PreemptsMasked (void);
+uint32_t SIM_IsrEntries (bool usbMasked);
+bool SIM_Sleeping (void);
+uint64_t SIM_SleepCycles (void);
+uint32_t SIM_Wakes (uint8_t source);
+uint64_t SIM_BusyCycles (void);
+uint32_t SIM_IdleWakes (uint8_t source);
+void SIM_SetWakeLatencyStats (SIM_STATS *stats);
+
+void SIM_SetSwitches (uint8_t switches);
+uint8_t SIM_GetSwitches (void);
+void SIM_SetSwitchBank (uint8_t bank, uint8_t switches);
+uint8_t SIM_GetSwitchBank (uint8_t bank);
+bool SIM_UserLedOn (void);
+
+// high-endurance flash: row writes so far, and an erase as by the programmer
+uint32_t SIM_FlashWrites (void);
+void SIM_FlashErase (void);
+
+
+//-----------------------------------------------------------------------------------------------
+// serial interface engine, sim_sie.c
+//
+
+bool SIM_SIE_PullUp (void);
+void SIM_SIE_BusReset (void);
+void SIM_SIE_StartOfFrame (uint16_t frame);
+uint8_t SIM_SIE_Setup (uint8_t address, const uint8_t *packet);
+uint8_t SIM_SIE_Out (uint8_t address, uint8_t ep, uint8_t toggle, const uint8_t *data, uint8_t length);
+uint8_t SIM_SIE_In (uint8_t address, uint8_t ep, uint8_t *toggle, uint8_t *data, uint8_t *length);
+void SIM_SIE_Sync (void);
+void SIM_SIE_Resume (void);
+bool SIM_SIE_ResumeSignalling (void);
+bool SIM_SIE_InArmed (uint8_t ep, const uint8_t **data, uint8_t *length);
+
+
+//-----------------------------------------------------------------------------------------------
+// USB host, sim_host.c
+//
+
+void SIM_HostAttach (void);
+void SIM_HostService (void);
+bool SIM_HostIsConfigured (void);
+bool SIM_HostWaitConfigured (uint64_t timeout);
+const uint8_t *SIM_HostDescriptor (uint8_t type, uint16_t *length);
+void SIM_HostSetReportCallback (SIM_REPORT_CALLBACK callback, void *context);
+void SIM_HostPauseIn (bool paused);
+void SIM_HostSetFrameOffset (int32_t ppm);
+bool SIM_HostSuspend (bool remoteWakeup);
+void SIM_HostResume (void);
+bool SIM_HostIsSuspended (void);
+uint32_t SIM_HostRemoteWakeups (void);
+uint16_t SIM_HostFrameNumber (void);
+bool SIM_HostSendReport (const uint8_t *report, uint8_t length);
+bool SIM_HostControlTransfer (const uint8_t *setup, uint8_t *data, uint16_t *length, uint64_t timeout);
+
+
+//-----------------------------------------------------------------------------------------------
+// benchmark helpers, sim_bench.c
+//
+
+void SIM_Seed (uint32_t seed);
+uint32_t SIM_Random (void);
+uint64_t SIM_RandomCycles (uint64_t min, uint64_t max);
+
+void SIM_StatsInit (SIM_STATS *stats, const char *name, uint32_t size);
+void SIM_StatsFree (SIM_STATS *stats);
+void SIM_StatsAdd (SIM_STATS *stats, uint64_t cycles);
+uint64_t SIM_StatsPercentile (SIM_STATS *stats, uint8_t percent);
+void SIM_StatsPrintHeader (void);
+void SIM_StatsPrint (SIM_STATS *stats);
+
+
+//-----------------------------------------------------------------------------------------------
+// firmware entry points
+//
+
+void FIRMWARE_main (void);
+void SYS_InterruptHigh (void);
+
+#endif //SIM_H
@@ -0,0 +1,129 @@
+//-----------------------------------------------------------------------------------------------
+// sim_bench.c -- repeatable random numbers and latency statistics for the benchmarks
+//
+
+//-----------------------------------------------------------------------------------------------
+// includes
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "sim.h"
+
+
+//-----------------------------------------------------------------------------------------------
+// globals
+//
+
+static uint32_t randomState = 1;
+
+
+//-----------------------------------------------------------------------------------------------
+// random numbers, xorshift32 so every run with the same seed replays the same edges
+//
+
+void SIM_Seed (uint32_t seed)
+{
+    randomState = seed ? seed : 1;
+}
+
+
+uint32_t SIM_Random (void)
+{
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 17;
+    randomState ^= randomState << 5;
+    return randomState;
+}
+
+
+uint64_t SIM_RandomCycles (uint64_t min, uint64_t max)
+{
+    return min + (((uint64_t)SIM_Random () << 32) | SIM_Random ()) % (max - min + 1);
+}
+
+
+//-----------------------------------------------------------------------------------------------
+// statistics
+//
+
+static int CompareSamples (const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+
+void SIM_StatsInit (SIM_STATS *stats, const char *name, uint32_t size)
+{
+    stats->name = name;
+    stats->samples = calloc (size, sizeof (uint64_t));
+    stats->count = 0;
+    stats->size = size;
+
+    if (!stats->samples) {
+        fprintf (stderr, "sim: out of memory for %u samples\n", size);
+        exit (1);
+    }
+}
+
+
+void SIM_StatsFree (SIM_STATS *stats)
+{
+    free (stats->samples);
+    stats->samples = NULL;
+    stats->count = stats->size = 0;
+}
+
+
+void SIM_StatsAdd (SIM_STATS *stats, uint64_t cycles)
+{
+    if (stats->count < stats->size) {
+        stats->samples[stats->count++] = cycles;
+    }
+}
+
+
+// nearest-rank percentile; sorts the samples in place
+uint64_t SIM_StatsPercentile (SIM_STATS *stats, uint8_t percent)
+{
+    uint32_t rank;
+
+    if (stats->count == 0) {
+        return 0;
+    }
+
+    qsort (stats->samples, stats->count, sizeof (uint64_t), CompareSamples);
+
+    rank = ((uint64_t)stats->count * percent + 99) / 100;
+    if (rank == 0) {
+        rank = 1;
+    }
+    return stats->samples[rank - 1];
+}
+
+
+void SIM_StatsPrintHeader (void)
+{
+    printf ("%-28s %8s %9s %9s %9s %9s %9s\n", "stage", "samples", "min ms", "p50 ms", "p99 ms", "max ms", "mean ms");
+}
+
+
+void SIM_StatsPrint (SIM_STATS *stats)
+{
+    uint64_t sum = 0;
+    uint32_t i;
+
+    for (i = 0; i < stats->count; i++) {
+        sum += stats->samples[i];
+    }
+
+    printf ("%-28s %8u %9.3f %9.3f %9.3f %9.3f %9.3f\n", stats->name, stats->count,
+            (double)SIM_StatsPercentile (stats, 0) / SIM_MS(1),
+            (double)SIM_StatsPercentile (stats, 50) / SIM_MS(1),
+            (double)SIM_StatsPercentile (stats, 99) / SIM_MS(1),
+            (double)SIM_StatsPercentile (stats, 100) / SIM_MS(1),
+            stats->count ? (double)sum / stats->count / SIM_MS(1) : 0.0);
+}
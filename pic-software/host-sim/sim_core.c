@@ -0,0 +1,647 @@
+//-----------------------------------------------------------------------------------------------
+// sim_core.c -- simulated clock, firmware coroutine, TMR2, GPIO and interrupt dispatch
+//
+// A chain of seven 74HC165s sits behind RC0-RC2, switch banks 1 to 7. The firmware's pin
+// wiggling takes no simulated time, so it reaches the chain through the SYSTEM_ShiftLoad()
+// and SYSTEM_ShiftClock() hooks in system.h; each acts only with its pin set as an output.
+//
+// SLEEP parks the firmware coroutine until an enabled peripheral interrupt flag (with PEIE),
+// an interrupt-on-change flag (with IOCIE) or the software-enabled watchdog wakes it, with
+// GIE either way, then holds it for the oscillator start-up time. TMR2 stops while asleep.
+// The watchdog is only modelled as a sleep timer; the firmware never leaves it running awake.
+//
+// SYSTEM_Idle() parks the firmware the same way until an interrupt has run, so a main loop
+// that waits for its interrupts only costs a pass when it has work. Time the firmware is
+// neither waiting nor asleep counts as busy.
+//
+// The high-endurance flash row behind SYSTEM_FlashRead() and SYSTEM_FlashWrite() starts
+// erased and keeps what was written over SIM_PowerOn(). A write holds the firmware up for the
+// erase and the write with interrupts off, as the part's stalled CPU does.
+//
+
+//-----------------------------------------------------------------------------------------------
+// includes
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucontext.h>
+
+#include <xc.h>
+
+#include "sim.h"
+
+
+//-----------------------------------------------------------------------------------------------
+// defines
+//
+
+#define FIRMWARE_STACK_SIZE (256 * 1024)
+
+// an interrupt source the firmware never clears would otherwise spin the simulator forever
+#define MAX_NESTED_ISRS 16
+
+// watchdog clock, the 31 kHz LFINTOSC; WDTPS 0 divides it by 32
+#define LFINTOSC_HZ     31000UL
+
+// high-endurance flash row, and the CPU stall of a row erase and write, 2 ms each
+#define FLASH_ROW_WORDS 32
+#define FLASH_WRITE_CYCLES SIM_MS(4)
+
+
+//-----------------------------------------------------------------------------------------------
+// typedefs
+//
+
+typedef struct {
+    uint16_t port;
+    uint8_t mask;
+} SIM_PIN;
+
+
+//-----------------------------------------------------------------------------------------------
+// globals
+//
+
+volatile uint8_t SIM_SFR[SIM_SFR_SIZE];
+
+uint16_t SIM_loopCycles = 120;
+uint16_t SIM_isrCycles = 150;
+
+// time from a wake-up event until the core runs again; the part waits for HFINTOSC and the
+// 3x PLL to lock, taken here as 2 ms, an assumed worst case
+uint64_t SIM_wakeCycles = SIM_MS(2);
+
+static uint64_t now;
+
+// the main loop is held up by a long task until this time
+static uint64_t mainLoopBusyUntil;
+
+static ucontext_t simContext;
+static ucontext_t firmwareContext;
+static uint8_t firmwareStack[FIRMWARE_STACK_SIZE];
+
+// pin levels driven onto PORTA..PORTC from outside the chip
+static uint8_t pinsA, pinsB, pinsC;
+static uint8_t switches;
+
+// 74HC165 chain: switches by bank, bank 0 unused, what SH/LD last latched and how many bits
+// CLK has moved out of QH since
+static uint8_t chainSwitches[SIM_SWITCH_BANKS];
+static uint8_t chainLatched[SIM_SWITCH_BANKS];
+static uint16_t chainBit;
+
+// wait for an interrupt: parked, the wait just ended, busy time, wakes by source and the
+// optional wake latency samples
+static bool waiting;
+static bool woken;
+static uint64_t busyCycles;
+static uint32_t idleWakes[SIM_SOURCES];
+static SIM_STATS *wakeLatency;
+
+// sleep state, watchdog timeout while asleep (0 = watchdog off) and accounting
+static bool sleeping;
+static uint64_t wdtTimeout;
+static uint64_t sleepCycles;
+static uint32_t wakes[SIM_WAKE_SOURCES];
+
+// TMR2 period tracking
+static uint64_t tmr1Cycles;
+static uint64_t tmr1Last;
+static uint16_t tmr1Shown;
+static bool tmr2Running;
+static uint64_t tmr2Start;
+static uint64_t tmr2Next;
+static uint8_t tmr2Shown;
+static uint8_t tmr2Control;
+
+// high-endurance flash, the low byte of each word, and the writes to it
+static uint8_t flash[FLASH_ROW_WORDS] = { [0 ... FLASH_ROW_WORDS - 1] = 0xFF };
+static uint32_t flashWrites;
+
+// SIM_SetPreemption() time, and the interrupt points that found a USB transaction waiting
+// behind the masked USB interrupt
+static uint64_t preemptCycles;
+static uint32_t preemptsMasked;
+
+// interrupt entries since power on, [0] with the USB interrupt enabled, [1] with it masked
+static uint32_t isrEntries[2];
+
+// switch inputs in report bit order, mirrors SWITCH_MAP_x in system.h; a closed
+// switch pulls its pin low against the weak pull-up
+static const SIM_PIN switchPins[8] = {
+    { 0x00E, 1 << 3 },  // bit 0, SW8, RC3
+    { 0x00E, 1 << 6 },  // bit 1, SW7, RC6
+    { 0x00E, 1 << 7 },  // bit 2, SW6, RC7
+    { 0x00D, 1 << 7 },  // bit 3, SW5, RB7
+    { 0x00E, 1 << 4 },  // bit 4, SW4, RC4
+    { 0x00E, 1 << 5 },  // bit 5, SW3, RC5
+    { 0x00C, 1 << 4 },  // bit 6, SW2, RA4
+    { 0x00C, 1 << 5 },  // bit 7, SW1, RA5
+};
+
+
+//-----------------------------------------------------------------------------------------------
+// firmware hooks
+//
+
+// system.h routes SYSTEM_Tasks() here in HOST_SIM builds: the end of every main loop pass
+// hands control back to the simulator
+void SYSTEM_Tasks (void)
+{
+    // the pass that ends a wait for an interrupt has its slice already
+    if (woken) {
+        woken = false;
+        return;
+    }
+    swapcontext (&firmwareContext, &simContext);
+}
+
+
+void SYSTEM_Idle (void)
+{
+    waiting = true;
+    swapcontext (&firmwareContext, &simContext);
+}
+
+
+void SIM_Sleep (void)
+{
+    sleeping = true;
+    wdtTimeout = WDTCONbits.SWDTEN ? now + ((SIM_FCY << (WDTCONbits.WDTPS + 5)) / LFINTOSC_HZ) : 0;
+    swapcontext (&firmwareContext, &simContext);
+}
+
+
+void SIM_Delay (unsigned long cycles)
+{
+    mainLoopBusyUntil = now + cycles;
+    swapcontext (&firmwareContext, &simContext);
+}
+
+
+void SYSTEM_FlashRead (uint8_t *data, uint8_t length)
+{
+    memcpy (data, flash, length);
+}
+
+
+void SYSTEM_FlashWrite (const uint8_t *data, uint8_t length)
+{
+    uint8_t gie = INTCONbits.GIE;
+
+    memset (flash, 0xFF, sizeof (flash));
+    memcpy (flash, data, length);
+    flashWrites++;
+
+    INTCONbits.GIE = 0;
+    SIM_Delay (FLASH_WRITE_CYCLES);
+    INTCONbits.GIE = gie;
+}
+
+
+// QH onto RC0: input H of each register first, a closed switch reads low. Past the last
+// register the serial input is tied high
+static void ChainOutput (void)
+{
+    uint8_t bank = 1 + chainBit / 8;
+    bool closed = bank < SIM_SWITCH_BANKS && (chainLatched[bank] & (0x80 >> (chainBit % 8)));
+
+    pinsC = closed ? (pinsC & ~0x01) : (pinsC | 0x01);
+    PORTC = pinsC;
+}
+
+
+void SYSTEM_ShiftLoad (void)
+{
+    if (TRISCbits.TRISC2 == 0) {
+        memcpy (chainLatched, chainSwitches, sizeof (chainLatched));
+        chainBit = 0;
+        ChainOutput ();
+    }
+}
+
+
+void SYSTEM_ShiftClock (void)
+{
+    if (TRISCbits.TRISC1 == 0 && chainBit < SIM_SWITCH_BANKS * 8) {
+        chainBit++;
+        ChainOutput ();
+    }
+}
+
+
+static void FirmwareEntry (void)
+{
+    FIRMWARE_main ();
+
+    fprintf (stderr, "sim: firmware main() returned\n");
+    exit (1);
+}
+
+
+//-----------------------------------------------------------------------------------------------
+// peripherals
+//
+
+// pins change on the edges the switches make, posting interrupt-on-change flags
+static void DrivePins (void)
+{
+    IOCAF |= (pinsA & ~PORTA & IOCAP) | (~pinsA & PORTA & IOCAN);
+    IOCBF |= (pinsB & ~PORTB & IOCBP) | (~pinsB & PORTB & IOCBN);
+
+    PORTA = pinsA;
+    PORTB = pinsB;
+    PORTC = pinsC;
+}
+
+
+// TMR1 on Fosc/4 only, the instruction cycle counter the firmware times its interrupts with.
+// It moves at step and interrupt granularity like everything else here: the firmware's own
+// code takes no simulated time, so what it measures between two reads in one interrupt is 0
+static void Tmr1Service (void)
+{
+    static const uint8_t prescale[4] = { 1, 2, 4, 8 };
+    uint64_t ps = prescale[T1CONbits.T1CKPS];
+    uint16_t count = ((uint16_t)TMR1H << 8) | TMR1L;
+
+    if (count != tmr1Shown) {
+        tmr1Cycles = count * ps;
+    }
+    if (T1CONbits.TMR1ON && T1CONbits.TMR1CS == 0 && !sleeping) {
+        tmr1Cycles += now - tmr1Last;
+    }
+    tmr1Last = now;
+
+    count = (uint16_t)(tmr1Cycles / ps);
+    TMR1H = count >> 8;
+    TMR1L = count & 0xFF;
+    tmr1Shown = count;
+}
+
+
+static uint64_t Tmr2Prescale (void)
+{
+    static const uint8_t prescale[4] = { 1, 4, 16, 64 };
+    return prescale[T2CONbits.T2CKPS];
+}
+
+
+static void Tmr2Service (void)
+{
+    uint64_t tick;
+
+    if (!T2CONbits.TMR2ON || sleeping) {
+        tmr2Running = false;
+        return;
+    }
+
+    tick = Tmr2Prescale () * ((uint64_t)PR2 + 1);
+
+    if (!tmr2Running) {
+        tmr2Running = true;
+        tmr2Start = now;
+        tmr2Next = now + tick * (T2CONbits.T2OUTPS + 1);
+    } else if (TMR2 != tmr2Shown || T2CON != tmr2Control) {
+        // the firmware wrote TMR2 or T2CON, either of which clears the prescaler and
+        // postscaler; a write of the value the register already had changes nothing worth
+        // modelling
+        tmr2Start = now - TMR2 * Tmr2Prescale ();
+        tmr2Next = now + Tmr2Prescale () * ((uint64_t)PR2 + 1 - TMR2) + tick * T2CONbits.T2OUTPS;
+    }
+
+    while (now >= tmr2Next) {
+        PIR1bits.TMR2IF = 1;
+        tmr2Next += tick * (T2CONbits.T2OUTPS + 1);
+    }
+
+    TMR2 = ((now - tmr2Start) / Tmr2Prescale ()) % ((uint64_t)PR2 + 1);
+    tmr2Shown = TMR2;
+    tmr2Control = T2CON;
+}
+
+
+static bool InterruptPending (void)
+{
+    if (!INTCONbits.GIE || !INTCONbits.PEIE) {
+        return false;
+    }
+    if (PIE1bits.TMR2IE && PIR1bits.TMR2IF) {
+        return true;
+    }
+    if (PIE2bits.USBIE && PIR2bits.USBIF) {
+        return true;
+    }
+    return false;
+}
+
+
+// a sleeping core wakes on any enabled interrupt flag, GIE or not
+static void SleepService (void)
+{
+    uint8_t source;
+
+    INTCONbits.IOCIF = (IOCAF | IOCBF) ? 1 : 0;
+
+    if (INTCONbits.PEIE && ((PIE1 & PIR1) || (PIE2 & PIR2))) {
+        source = SIM_WAKE_INTERRUPT;
+    } else if (INTCONbits.IOCIE && INTCONbits.IOCIF) {
+        source = SIM_WAKE_IOC;
+    } else if (wdtTimeout && now >= wdtTimeout) {
+        source = SIM_WAKE_WDT;
+    } else {
+        sleepCycles += SIM_loopCycles;
+        return;
+    }
+
+    sleeping = false;
+    wakes[source]++;
+    mainLoopBusyUntil = now + SIM_wakeCycles;
+}
+
+
+static void Interrupts (void)
+{
+    uint64_t entry = now;
+    uint8_t i;
+
+    SIM_SIE_Sync ();
+
+    // a waiting main loop wakes after the interrupts pending now have run
+    if (waiting && InterruptPending ()) {
+        if (PIE1bits.TMR2IE && PIR1bits.TMR2IF) {
+            idleWakes[SIM_SOURCE_TMR2]++;
+        }
+        if (PIE2bits.USBIE && PIR2bits.USBIF) {
+            idleWakes[SIM_SOURCE_USB]++;
+        }
+        waiting = false;
+        woken = true;
+    }
+
+    for (i = 0; i < MAX_NESTED_ISRS && InterruptPending (); i++) {
+        INTCONbits.GIE = 0;
+        isrEntries[PIE2bits.USBIE ? 0 : 1]++;
+        SYS_InterruptHigh ();
+        INTCONbits.GIE = 1;
+        Tmr2Service ();
+        now += SIM_isrCycles;
+        Tmr1Service ();
+        SIM_SIE_Sync ();
+    }
+
+    // the firmware carries on at the start of the next step
+    if (woken && wakeLatency) {
+        SIM_StatsAdd (wakeLatency, now - entry);
+    }
+}
+
+
+//-----------------------------------------------------------------------------------------------
+// interrupt points
+//
+
+// The Makefile links with --wrap=USBGet1msTickCount, so the firmware's own calls land here;
+// main.c makes them while it stamps a switch change with the USB interrupt masked. Interrupts
+// are otherwise only taken between main loop passes. With SIM_SetPreemption() each call first
+// lets that much time pass as if the pass were interrupted right there: TMR2 runs, the host
+// may send its next packet and every interrupt the firmware has enabled is taken.
+uint32_t __real_USBGet1msTickCount (void);
+
+uint32_t __wrap_USBGet1msTickCount (void)
+{
+    if (preemptCycles) {
+        now += preemptCycles;
+        Tmr2Service ();
+        SIM_HostService ();
+        SIM_SIE_Sync ();
+        if (UIRbits.TRNIF && !PIE2bits.USBIE) {
+            preemptsMasked++;
+        }
+        Interrupts ();
+    }
+    return __real_USBGet1msTickCount ();
+}
+
+
+//-----------------------------------------------------------------------------------------------
+// core interface
+//
+
+void SIM_PowerOn (void)
+{
+    memset ((void *)SIM_SFR, 0, sizeof (SIM_SFR));
+
+    // power-on reset values that matter to the firmware
+    TRISA = 0xFF;
+    TRISB = 0xF0;
+    TRISC = 0xFF;
+    ANSELA = 0x17;
+    ANSELB = 0x30;
+    ANSELC = 0xCF;
+    PR2 = 0xFF;
+
+    now = 0;
+    mainLoopBusyUntil = 0;
+    tmr1Cycles = 0;
+    tmr1Last = 0;
+    tmr1Shown = 0;
+    tmr2Running = false;
+    sleeping = false;
+    sleepCycles = 0;
+    memset (wakes, 0, sizeof (wakes));
+    waiting = false;
+    woken = false;
+    busyCycles = 0;
+    memset (idleWakes, 0, sizeof (idleWakes));
+    memset (isrEntries, 0, sizeof (isrEntries));
+
+    pinsA = pinsB = pinsC = 0xFF;
+    switches = 0;
+    memset (chainSwitches, 0, sizeof (chainSwitches));
+    memset (chainLatched, 0, sizeof (chainLatched));
+    chainBit = 0;
+    DrivePins ();
+
+    getcontext (&firmwareContext);
+    firmwareContext.uc_stack.ss_sp = firmwareStack;
+    firmwareContext.uc_stack.ss_size = sizeof (firmwareStack);
+    firmwareContext.uc_link = NULL;
+    makecontext (&firmwareContext, FirmwareEntry, 0);
+
+    // run the firmware's initialisation up to its first main loop pass
+    SIM_Step ();
+}
+
+
+void SIM_Step (void)
+{
+    if (!sleeping && !waiting) {
+        if (now >= mainLoopBusyUntil) {
+            swapcontext (&simContext, &firmwareContext);
+        }
+        busyCycles += SIM_loopCycles;
+    }
+    now += SIM_loopCycles;
+
+    Tmr1Service ();
+    Tmr2Service ();
+    SIM_HostService ();
+    Interrupts ();
+
+    if (sleeping) {
+        SleepService ();
+    }
+}
+
+
+void SIM_Run (uint64_t cycles)
+{
+    uint64_t end = now + cycles;
+
+    while (now < end) {
+        SIM_Step ();
+    }
+}
+
+
+// keep the firmware's main loop from coming round for the given time, as if one pass ran a
+// long task; interrupts are still taken
+void SIM_MainLoopBusy (uint64_t cycles)
+{
+    mainLoopBusyUntil = now + cycles;
+}
+
+
+uint64_t SIM_Now (void)
+{
+    return now;
+}
+
+
+// turn every firmware call to USBGet1msTickCount() into an interrupt point that lets the
+// given time pass, 0 turns them off again
+void SIM_SetPreemption (uint64_t cycles)
+{
+    preemptCycles = cycles;
+    preemptsMasked = 0;
+}
+
+
+// interrupt points since SIM_SetPreemption() that found a USB transaction waiting behind the
+// masked USB interrupt
+uint32_t SIM_PreemptsMasked (void)
+{
+    return preemptsMasked;
+}
+
+
+// SYS_InterruptHigh() calls since power on taken with the USB interrupt masked, or enabled
+uint32_t SIM_IsrEntries (bool usbMasked)
+{
+    return isrEntries[usbMasked ? 1 : 0];
+}
+
+
+bool SIM_Sleeping (void)
+{
+    return sleeping;
+}
+
+
+// time spent asleep and wake-ups by source since power on
+uint64_t SIM_SleepCycles (void)
+{
+    return sleepCycles;
+}
+
+
+uint32_t SIM_Wakes (uint8_t source)
+{
+    return (source < SIM_WAKE_SOURCES) ? wakes[source] : 0;
+}
+
+
+// time the firmware has been running since power on, and how often the main loop's wait
+// for an interrupt was ended by each source; both may end one wait
+uint64_t SIM_BusyCycles (void)
+{
+    return busyCycles;
+}
+
+
+uint32_t SIM_IdleWakes (uint8_t source)
+{
+    return (source < SIM_SOURCES) ? idleWakes[source] : 0;
+}
+
+
+// collect the time from the interrupt that ends a wait to the main loop pass, NULL to stop
+void SIM_SetWakeLatencyStats (SIM_STATS *stats)
+{
+    wakeLatency = stats;
+}
+
+
+void SIM_SetSwitches (uint8_t on)
+{
+    uint8_t i;
+
+    switches = on;
+    for (i = 0; i < 8; i++) {
+        uint8_t *pins = (switchPins[i].port == 0x00C) ? &pinsA :
+                        (switchPins[i].port == 0x00D) ? &pinsB : &pinsC;
+        if (on & (1 << i)) {
+            *pins &= ~switchPins[i].mask;
+        } else {
+            *pins |= switchPins[i].mask;
+        }
+    }
+    DrivePins ();
+}
+
+
+uint8_t SIM_GetSwitches (void)
+{
+    return switches;
+}
+
+
+// bank 0 is SIM_SetSwitches(), the rest go on the 74HC165 chain and are seen on its next load
+void SIM_SetSwitchBank (uint8_t bank, uint8_t on)
+{
+    if (bank == 0) {
+        SIM_SetSwitches (on);
+    } else if (bank < SIM_SWITCH_BANKS) {
+        chainSwitches[bank] = on;
+    }
+}
+
+
+uint8_t SIM_GetSwitchBank (uint8_t bank)
+{
+    if (bank == 0) {
+        return switches;
+    }
+    return (bank < SIM_SWITCH_BANKS) ? chainSwitches[bank] : 0;
+}
+
+
+uint32_t SIM_FlashWrites (void)
+{
+    return flashWrites;
+}
+
+
+void SIM_FlashErase (void)
+{
+    memset (flash, 0xFF, sizeof (flash));
+}
+
+
+bool SIM_UserLedOn (void)
+{
+    // the LED on RB5 is active low
+    return LATBbits.LATB5 == 0;
+}
@@ -0,0 +1,558 @@
+//-----------------------------------------------------------------------------------------------
+// sim_host.c -- USB host controller model
+//
+// Drives the SIE model the way a full-speed host would: bus reset, 1 ms frames with a SOF,
+// the periodic schedule (interrupt IN and OUT on the HID endpoint, bInterval 1) at the start
+// of every frame, and control transfers in the remaining bus time. Attaching runs the same
+// enumeration sequence the Linux usbhid stack issues.
+//
+// A suspended bus carries nothing at all, not even SOFs. The host resumes it with 20 ms of
+// resume signalling, either on its own or when it sees the device drive remote wakeup, and
+// waits out the 10 ms resume recovery time before it schedules transactions again.
+//
+
+//-----------------------------------------------------------------------------------------------
+// includes
+//
+
+#include <string.h>
+
+#include "sim.h"
+
+
+//-----------------------------------------------------------------------------------------------
+// defines
+//
+
+#define EP0_SIZE            64
+#define HID_EP              1
+#define DEVICE_ADDRESS      1
+
+// usbhid waits for the D+ pull-up to be stable for 100 ms before it resets the port
+#define DEBOUNCE_CYCLES     SIM_MS(100)
+#define RESET_CYCLES        SIM_MS(10)
+#define SET_ADDRESS_CYCLES  SIM_MS(2)
+#define RESUME_CYCLES       SIM_MS(20)
+#define RECOVERY_CYCLES     SIM_MS(10)
+
+#define DESCRIPTOR_DEVICE   1
+#define DESCRIPTOR_CONFIG   2
+#define DESCRIPTOR_REPORT   0x22
+
+enum {
+    HOST_DETACHED = 0,
+    HOST_CONNECTING,
+    HOST_RESETTING,
+    HOST_ENUMERATING,
+    HOST_CONFIGURED,
+    HOST_FAILED
+};
+
+enum {
+    CTRL_IDLE = 0,
+    CTRL_SETUP,
+    CTRL_DATA_IN,
+    CTRL_DATA_OUT,
+    CTRL_STATUS_IN,
+    CTRL_STATUS_OUT,
+    CTRL_DONE,
+    CTRL_FAILED
+};
+
+
+//-----------------------------------------------------------------------------------------------
+// typedefs
+//
+
+typedef struct {
+    uint8_t setup[8];
+    uint8_t *data;
+    uint16_t length;
+    uint16_t actual;
+    uint8_t stage;
+    uint8_t toggle;
+} SIM_CONTROL;
+
+typedef struct {
+    uint8_t setup[8];
+    uint8_t *buffer;
+    uint16_t *length;
+} SIM_ENUM_STEP;
+
+
+//-----------------------------------------------------------------------------------------------
+// globals
+//
+
+static uint8_t hostState = HOST_DETACHED;
+static uint8_t address;
+static uint64_t waitUntil;
+
+static uint64_t nextFrame;
+static uint64_t frameEpoch;
+static uint32_t framesSinceEpoch;
+static uint16_t frameNumber;
+
+static SIM_CONTROL control;
+static uint8_t enumStep;
+
+static uint8_t deviceDescriptor[18];
+static uint16_t deviceDescriptorLength;
+static uint8_t configDescriptor[255];
+static uint16_t configDescriptorLength;
+static uint8_t reportDescriptor[255];
+static uint16_t reportDescriptorLength;
+
+static bool suspended;
+static uint64_t resumeUntil;
+static uint64_t periodicAfter;
+static uint32_t remoteWakeups;
+
+static bool inPaused;
+static uint8_t inToggle;
+static uint8_t outToggle;
+static uint8_t outReport[64];
+static uint8_t outReportLength;
+static bool outReportPending;
+
+// frame clock offset from the device's clock in ppm, SIM_HostSetFrameOffset()
+static int32_t framePpm;
+
+static SIM_REPORT_CALLBACK reportCallback;
+static void *reportContext;
+
+// the request sequence usbhid issues for a single-interface HID device
+static const SIM_ENUM_STEP enumSteps[] = {
+    { { 0x80, 0x06, 0x00, DESCRIPTOR_DEVICE, 0x00, 0x00, 0x40, 0x00 }, deviceDescriptor, &deviceDescriptorLength },
+    { { 0x00, 0x05, DEVICE_ADDRESS, 0x00, 0x00, 0x00, 0x00, 0x00 }, NULL, NULL },
+    { { 0x80, 0x06, 0x00, DESCRIPTOR_DEVICE, 0x00, 0x00, 0x12, 0x00 }, deviceDescriptor, &deviceDescriptorLength },
+    { { 0x80, 0x06, 0x00, DESCRIPTOR_CONFIG, 0x00, 0x00, 0x09, 0x00 }, configDescriptor, &configDescriptorLength },
+    { { 0x80, 0x06, 0x00, DESCRIPTOR_CONFIG, 0x00, 0x00, 0xFF, 0x00 }, configDescriptor, &configDescriptorLength },
+    { { 0x00, 0x09, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00 }, NULL, NULL },
+    { { 0x21, 0x0A, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }, NULL, NULL },
+    { { 0x81, 0x06, 0x00, DESCRIPTOR_REPORT, 0x00, 0x00, 0xFF, 0x00 }, reportDescriptor, &reportDescriptorLength },
+};
+
+#define ENUM_STEPS (sizeof (enumSteps) / sizeof (enumSteps[0]))
+
+
+//-----------------------------------------------------------------------------------------------
+// control transfers
+//
+
+static void ControlStart (const uint8_t *setup, uint8_t *data, uint16_t length)
+{
+    memcpy (control.setup, setup, 8);
+    control.data = data;
+    control.length = length;
+    control.actual = 0;
+    control.toggle = 0;
+    control.stage = CTRL_SETUP;
+}
+
+
+// one transaction of the current control transfer
+static void ControlService (void)
+{
+    uint8_t buffer[EP0_SIZE];
+    uint8_t toggle, length, result;
+    uint16_t chunk;
+
+    switch (control.stage) {
+        case CTRL_SETUP:
+            result = SIM_SIE_Setup (address, control.setup);
+            if (result == SIM_ACK) {
+                control.toggle = 1;
+                if (control.length == 0) {
+                    control.stage = CTRL_STATUS_IN;
+                } else if (control.setup[0] & 0x80) {
+                    control.stage = CTRL_DATA_IN;
+                } else {
+                    control.stage = CTRL_DATA_OUT;
+                }
+            }
+            break;
+
+        case CTRL_DATA_IN:
+            result = SIM_SIE_In (address, 0, &toggle, buffer, &length);
+            if (result == SIM_STALL) {
+                control.stage = CTRL_FAILED;
+            } else if (result == SIM_ACK && toggle == control.toggle) {
+                control.toggle ^= 1;
+                chunk = control.length - control.actual;
+                if (length < chunk) {
+                    chunk = length;
+                }
+                memcpy (control.data + control.actual, buffer, chunk);
+                control.actual += chunk;
+                if (length < EP0_SIZE || control.actual >= control.length) {
+                    control.stage = CTRL_STATUS_OUT;
+                }
+            }
+            break;
+
+        case CTRL_DATA_OUT:
+            chunk = control.length - control.actual;
+            if (chunk > EP0_SIZE) {
+                chunk = EP0_SIZE;
+            }
+            result = SIM_SIE_Out (address, 0, control.toggle, control.data + control.actual, chunk);
+            if (result == SIM_STALL) {
+                control.stage = CTRL_FAILED;
+            } else if (result == SIM_ACK) {
+                control.toggle ^= 1;
+                control.actual += chunk;
+                if (control.actual >= control.length) {
+                    control.stage = CTRL_STATUS_IN;
+                }
+            }
+            break;
+
+        case CTRL_STATUS_IN:
+            result = SIM_SIE_In (address, 0, &toggle, buffer, &length);
+            if (result == SIM_STALL) {
+                control.stage = CTRL_FAILED;
+            } else if (result == SIM_ACK) {
+                control.stage = CTRL_DONE;
+            }
+            break;
+
+        case CTRL_STATUS_OUT:
+            result = SIM_SIE_Out (address, 0, 1, NULL, 0);
+            if (result == SIM_STALL) {
+                control.stage = CTRL_FAILED;
+            } else if (result == SIM_ACK) {
+                control.stage = CTRL_DONE;
+            }
+            break;
+    }
+}
+
+
+//-----------------------------------------------------------------------------------------------
+// enumeration
+//
+
+static void EnumStart (uint8_t step)
+{
+    const SIM_ENUM_STEP *s = &enumSteps[step];
+    uint16_t length = s->setup[6] | (s->setup[7] << 8);
+
+    enumStep = step;
+    ControlStart (s->setup, s->buffer, s->buffer ? length : 0);
+}
+
+
+static void EnumService (void)
+{
+    const SIM_ENUM_STEP *s = &enumSteps[enumStep];
+
+    if (control.stage == CTRL_FAILED) {
+        hostState = HOST_FAILED;
+        return;
+    }
+    if (control.stage != CTRL_DONE) {
+        return;
+    }
+
+    if (s->length) {
+        *s->length = control.actual;
+    }
+
+    // SET_ADDRESS takes effect after its status stage; give the device its recovery time
+    if (s->setup[1] == 0x05) {
+        address = s->setup[2];
+        waitUntil = SIM_Now () + SET_ADDRESS_CYCLES;
+    }
+
+    if (enumStep + 1 < ENUM_STEPS) {
+        EnumStart (enumStep + 1);
+    } else {
+        control.stage = CTRL_IDLE;
+        hostState = HOST_CONFIGURED;
+    }
+}
+
+
+//-----------------------------------------------------------------------------------------------
+// periodic schedule
+//
+
+static void PeriodicService (void)
+{
+    uint8_t report[64];
+    uint8_t toggle, length;
+
+    if (!inPaused && SIM_SIE_In (address, HID_EP, &toggle, report, &length) == SIM_ACK) {
+        // a toggle mismatch means the host missed our ACK and this is a retransmission
+        if (toggle == inToggle) {
+            inToggle ^= 1;
+            if (reportCallback) {
+                reportCallback (report, length, SIM_Now (), reportContext);
+            }
+        }
+    }
+
+    if (outReportPending) {
+        if (SIM_SIE_Out (address, HID_EP, outToggle, outReport, outReportLength) == SIM_ACK) {
+            outToggle ^= 1;
+            outReportPending = false;
+        }
+    }
+}
+
+
+//-----------------------------------------------------------------------------------------------
+// frames
+//
+
+// the host's 1 ms frames run on its own clock from t on
+static void FramesStart (uint64_t t)
+{
+    frameEpoch = t;
+    framesSinceEpoch = 0;
+    nextFrame = t;
+}
+
+
+//-----------------------------------------------------------------------------------------------
+// suspend and resume
+//
+
+static void SuspendService (uint64_t t)
+{
+    if (resumeUntil == 0) {
+        // remote wakeup: the host takes over the K state the device starts
+        if (SIM_SIE_ResumeSignalling ()) {
+            remoteWakeups++;
+            resumeUntil = t + RESUME_CYCLES;
+        }
+        return;
+    }
+
+    if (t < resumeUntil) {
+        SIM_SIE_Resume ();
+        return;
+    }
+
+    // SOFs start with the end of resume, transactions after the recovery time
+    suspended = false;
+    resumeUntil = 0;
+    FramesStart (t);
+    waitUntil = t + RECOVERY_CYCLES;
+    periodicAfter = t + RECOVERY_CYCLES;
+}
+
+
+//-----------------------------------------------------------------------------------------------
+// host interface
+//
+
+void SIM_HostAttach (void)
+{
+    address = 0;
+    inPaused = false;
+    inToggle = 0;
+    outToggle = 0;
+    outReportPending = false;
+    control.stage = CTRL_IDLE;
+    suspended = false;
+    resumeUntil = 0;
+    periodicAfter = 0;
+    remoteWakeups = 0;
+
+    hostState = HOST_CONNECTING;
+    waitUntil = 0;
+}
+
+
+void SIM_HostService (void)
+{
+    uint64_t t = SIM_Now ();
+
+    if (hostState == HOST_CONNECTING) {
+        // the port debounce restarts whenever the pull-up is not there
+        if (!SIM_SIE_PullUp ()) {
+            waitUntil = 0;
+        } else if (waitUntil == 0) {
+            waitUntil = t + DEBOUNCE_CYCLES;
+        } else if (t >= waitUntil) {
+            hostState = HOST_RESETTING;
+            waitUntil = t + RESET_CYCLES;
+            SIM_SIE_BusReset ();
+        }
+        return;
+    }
+
+    if (hostState == HOST_DETACHED || hostState == HOST_RESETTING) {
+        if (hostState == HOST_RESETTING && t >= waitUntil) {
+            hostState = HOST_ENUMERATING;
+            FramesStart (t);
+            frameNumber = 0;
+            EnumStart (0);
+        }
+        return;
+    }
+
+    if (suspended) {
+        SuspendService (t);
+        return;
+    }
+
+    if (t >= nextFrame) {
+        framesSinceEpoch++;
+        nextFrame = frameEpoch + framesSinceEpoch * (SIM_MS(1) * (1000000 + framePpm)) / 1000000;
+        frameNumber = (frameNumber + 1) & 0x7FF;
+        SIM_SIE_StartOfFrame (frameNumber);
+
+        if (hostState == HOST_CONFIGURED && t >= periodicAfter) {
+            PeriodicService ();
+        }
+    }
+
+    if (t < waitUntil) {
+        return;
+    }
+
+    if (control.stage != CTRL_IDLE && control.stage != CTRL_DONE && control.stage != CTRL_FAILED) {
+        ControlService ();
+    }
+    if (hostState == HOST_ENUMERATING) {
+        EnumService ();
+    }
+}
+
+
+bool SIM_HostIsConfigured (void)
+{
+    return hostState == HOST_CONFIGURED;
+}
+
+
+bool SIM_HostWaitConfigured (uint64_t timeout)
+{
+    uint64_t end = SIM_Now () + timeout;
+
+    while (SIM_Now () < end && hostState != HOST_CONFIGURED && hostState != HOST_FAILED) {
+        SIM_Step ();
+    }
+    return hostState == HOST_CONFIGURED;
+}
+
+
+const uint8_t *SIM_HostDescriptor (uint8_t type, uint16_t *length)
+{
+    switch (type) {
+        case DESCRIPTOR_DEVICE: *length = deviceDescriptorLength; return deviceDescriptor;
+        case DESCRIPTOR_CONFIG: *length = configDescriptorLength; return configDescriptor;
+        case DESCRIPTOR_REPORT: *length = reportDescriptorLength; return reportDescriptor;
+    }
+    *length = 0;
+    return NULL;
+}
+
+
+void SIM_HostSetReportCallback (SIM_REPORT_CALLBACK callback, void *context)
+{
+    reportCallback = callback;
+    reportContext = context;
+}
+
+
+// stop or restart polling the interrupt IN endpoint, like a host whose periodic schedule
+// is held off
+void SIM_HostPauseIn (bool paused)
+{
+    inPaused = paused;
+}
+
+
+// enable or disable remote wakeup with SET_FEATURE / CLEAR_FEATURE DEVICE_REMOTE_WAKEUP, as
+// Linux does before it autosuspends a device, then stop all bus traffic
+bool SIM_HostSuspend (bool remoteWakeup)
+{
+    const uint8_t setup[8] = { 0x00, remoteWakeup ? 0x03 : 0x01, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00 };
+    uint16_t length = 0;
+
+    if (!SIM_HostControlTransfer (setup, NULL, &length, SIM_MS(100))) {
+        return false;
+    }
+    suspended = true;
+    resumeUntil = 0;
+    return true;
+}
+
+
+// run the host's frame clock off from the device's by ppm, so the phase between the USB
+// frame and anything the firmware times on its own moves over a run; takes effect with
+// the next frame
+void SIM_HostSetFrameOffset (int32_t ppm)
+{
+    framePpm = ppm;
+    frameEpoch = nextFrame;
+    framesSinceEpoch = 0;
+}
+
+
+// host initiated resume
+void SIM_HostResume (void)
+{
+    if (suspended && resumeUntil == 0) {
+        resumeUntil = SIM_Now () + RESUME_CYCLES;
+    }
+}
+
+
+// true until a resume has finished
+bool SIM_HostIsSuspended (void)
+{
+    return suspended;
+}
+
+
+uint32_t SIM_HostRemoteWakeups (void)
+{
+    return remoteWakeups;
+}
+
+
+// number of the last SOF the host sent
+uint16_t SIM_HostFrameNumber (void)
+{
+    return frameNumber;
+}
+
+
+bool SIM_HostSendReport (const uint8_t *report, uint8_t length)
+{
+    if (hostState != HOST_CONFIGURED || outReportPending || length > sizeof (outReport)) {
+        return false;
+    }
+    memcpy (outReport, report, length);
+    outReportLength = length;
+    outReportPending = true;
+    return true;
+}
+
+
+bool SIM_HostControlTransfer (const uint8_t *setup, uint8_t *data, uint16_t *length, uint64_t timeout)
+{
+    uint64_t end = SIM_Now () + timeout;
+
+    if (hostState != HOST_CONFIGURED || control.stage != CTRL_IDLE) {
+        return false;
+    }
+
+    ControlStart (setup, data, *length);
+    while (SIM_Now () < end && control.stage != CTRL_DONE && control.stage != CTRL_FAILED) {
+        SIM_Step ();
+    }
+
+    *length = control.actual;
+    if (control.stage != CTRL_DONE) {
+        control.stage = CTRL_IDLE;
+        return false;
+    }
+    control.stage = CTRL_IDLE;
+    return true;
+}
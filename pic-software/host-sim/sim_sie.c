@@ -0,0 +1,318 @@
+//-----------------------------------------------------------------------------------------------
+// sim_sie.c -- model of the PIC16F1459 USB serial interface engine
+//
+// Works on the firmware's own buffer descriptor table in dual-port RAM the way the hardware
+// does: a token is accepted only if the CPU has handed the BD to the SIE (UOWN), data moves
+// to or from the buffer at BDnADR, the SIE writes back the PID and byte count, returns the
+// BD to the CPU and posts the transaction to the 4-deep USTAT FIFO behind UIR.TRNIF.
+// Compiled with the firmware flags so BDT_ENTRY has the on-chip layout.
+//
+
+//-----------------------------------------------------------------------------------------------
+// includes
+//
+
+#include <string.h>
+
+#include "usb.h"
+
+#include "sim.h"
+
+
+//-----------------------------------------------------------------------------------------------
+// defines
+//
+
+#define USTAT_FIFO_DEPTH    4
+
+// bus idle time before the SIE flags IDLEIF
+#define IDLE_DETECT_CYCLES  SIM_MS(3)
+
+#define DIR_OUT 0
+#define DIR_IN  1
+
+
+//-----------------------------------------------------------------------------------------------
+// globals
+//
+
+extern volatile BDT_ENTRY BDT[BDT_NUM_ENTRIES];
+
+// hardware ping-pong buffer pointer per endpoint and direction
+static uint8_t ppbi[USB_MAX_EP_NUMBER + 1][2];
+
+// USTAT FIFO, the head entry is visible in USTAT while TRNIF is set
+static uint8_t ustatFifo[USTAT_FIFO_DEPTH];
+static uint8_t ustatCount;
+static bool ustatPosted;
+
+// bus activity tracking for IDLEIF / ACTVIF
+static uint64_t lastActivity;
+static bool idleFlagged;
+
+
+//-----------------------------------------------------------------------------------------------
+// local functions
+//
+
+static void BusActivity (void)
+{
+    lastActivity = SIM_Now ();
+    if (idleFlagged) {
+        idleFlagged = false;
+        UIRbits.ACTVIF = 1;
+    }
+}
+
+
+static bool Addressed (uint8_t address, uint8_t ep)
+{
+    if (!UCONbits.USBEN || UCONbits.SUSPND) {
+        return false;
+    }
+    if (address != (UADDR & 0x7F) || ep > USB_MAX_EP_NUMBER) {
+        return false;
+    }
+    return true;
+}
+
+
+// pick the BD the SIE would use next. The ping-pong pointer normally decides, but the SIE
+// cannot see the firmware pulse UCON.PPBRST, so when only one of the pair is armed that one
+// wins and the pointer resynchronises to it.
+static volatile BDT_ENTRY *SelectBD (uint8_t ep, uint8_t dir)
+{
+    volatile BDT_ENTRY *even = &BDT[(ep << 2) | (dir << 1)];
+    volatile BDT_ENTRY *odd = even + 1;
+
+    if (even->STAT.UOWN && !odd->STAT.UOWN) {
+        ppbi[ep][dir] = 0;
+    } else if (odd->STAT.UOWN && !even->STAT.UOWN) {
+        ppbi[ep][dir] = 1;
+    }
+
+    return ppbi[ep][dir] ? odd : even;
+}
+
+
+static void Complete (volatile BDT_ENTRY *bd, uint8_t ep, uint8_t dir, uint8_t pid, uint8_t count)
+{
+    uint8_t pp = ppbi[ep][dir];
+
+    bd->CNT = count;
+    bd->STAT.Val = (bd->STAT.Val & _DTSMASK) | (pid << 2);
+    ppbi[ep][dir] ^= 1;
+
+    ustatFifo[ustatCount++] = (ep << 3) | (dir << 2) | (pp << 1);
+    SIM_SIE_Sync ();
+}
+
+
+static uint8_t Stall (uint8_t ep)
+{
+    UIRbits.STALLIF = 1;
+    if (ep == 0) {
+        UEP0bits.EPSTALL = 1;
+    }
+    SIM_SIE_Sync ();
+    return SIM_STALL;
+}
+
+
+//-----------------------------------------------------------------------------------------------
+// SIE interface
+//
+
+// the device is visible on the bus once the module is on with its D+ pull-up enabled
+bool SIM_SIE_PullUp (void)
+{
+    return UCONbits.USBEN && UCFGbits.UPUEN;
+}
+
+
+void SIM_SIE_BusReset (void)
+{
+    BusActivity ();
+
+    memset (ppbi, 0, sizeof (ppbi));
+    ustatCount = 0;
+    ustatPosted = false;
+    UIRbits.TRNIF = 0;
+
+    if (UCONbits.USBEN) {
+        UIRbits.URSTIF = 1;
+    }
+    SIM_SIE_Sync ();
+}
+
+
+void SIM_SIE_StartOfFrame (uint16_t frame)
+{
+    BusActivity ();
+
+    if (UCONbits.USBEN && !UCONbits.SUSPND) {
+        UFRML = frame & 0xFF;
+        UFRMH = (frame >> 8) & 0x07;
+        UIRbits.SOFIF = 1;
+    }
+    SIM_SIE_Sync ();
+}
+
+
+uint8_t SIM_SIE_Setup (uint8_t address, const uint8_t *packet)
+{
+    volatile BDT_ENTRY *bd;
+    uint8_t *buffer;
+
+    BusActivity ();
+
+    if (!Addressed (address, 0) || !(UEP0 & USB_OUT_ENABLED) || (UEP0 & USB_DISALLOW_SETUP)) {
+        return SIM_NO_RESPONSE;
+    }
+    if (UCONbits.PKTDIS || ustatCount == USTAT_FIFO_DEPTH) {
+        return SIM_NAK;
+    }
+
+    bd = SelectBD (0, DIR_OUT);
+    if (!bd->STAT.UOWN) {
+        return SIM_NAK;
+    }
+
+    buffer = SIM_DPRAM (bd->ADR);
+    memcpy (buffer, packet, 8);
+
+    // the SIE halts token processing after a SETUP until the firmware clears PKTDIS
+    UCONbits.PKTDIS = 1;
+
+    Complete (bd, 0, DIR_OUT, PID_SETUP, 8);
+    return SIM_ACK;
+}
+
+
+uint8_t SIM_SIE_Out (uint8_t address, uint8_t ep, uint8_t toggle, const uint8_t *data, uint8_t length)
+{
+    volatile BDT_ENTRY *bd;
+    uint8_t count;
+
+    BusActivity ();
+
+    if (!Addressed (address, ep) || !((&UEP0)[ep] & USB_OUT_ENABLED)) {
+        return SIM_NO_RESPONSE;
+    }
+    if (UCONbits.PKTDIS || ustatCount == USTAT_FIFO_DEPTH) {
+        return SIM_NAK;
+    }
+
+    bd = SelectBD (ep, DIR_OUT);
+    if (!bd->STAT.UOWN) {
+        return SIM_NAK;
+    }
+    if (bd->STAT.BSTALL) {
+        return Stall (ep);
+    }
+
+    // data toggle mismatch: the packet is a retry the firmware already has, ACK and drop it
+    if (bd->STAT.DTSEN && (bd->STAT.DTS != (toggle & 1))) {
+        return SIM_ACK;
+    }
+
+    count = (length < bd->CNT) ? length : bd->CNT;
+    memcpy (SIM_DPRAM (bd->ADR), data, count);
+
+    Complete (bd, ep, DIR_OUT, PID_OUT, count);
+    return SIM_ACK;
+}
+
+
+uint8_t SIM_SIE_In (uint8_t address, uint8_t ep, uint8_t *toggle, uint8_t *data, uint8_t *length)
+{
+    volatile BDT_ENTRY *bd;
+
+    BusActivity ();
+
+    if (!Addressed (address, ep) || !((&UEP0)[ep] & USB_IN_ENABLED)) {
+        return SIM_NO_RESPONSE;
+    }
+    if (UCONbits.PKTDIS || ustatCount == USTAT_FIFO_DEPTH) {
+        return SIM_NAK;
+    }
+
+    bd = SelectBD (ep, DIR_IN);
+    if (!bd->STAT.UOWN) {
+        return SIM_NAK;
+    }
+    if (bd->STAT.BSTALL) {
+        return Stall (ep);
+    }
+
+    *toggle = bd->STAT.DTS;
+    *length = bd->CNT;
+    memcpy (data, SIM_DPRAM (bd->ADR), bd->CNT);
+
+    Complete (bd, ep, DIR_IN, PID_IN, bd->CNT);
+    return SIM_ACK;
+}
+
+
+// called by the core after every firmware slice: retires the USTAT entry the firmware has
+// acknowledged by clearing TRNIF, posts the next one, runs idle detection and folds the
+// enabled UIR/UEIR flags into PIR2.USBIF
+void SIM_SIE_Sync (void)
+{
+    if (ustatPosted && !UIRbits.TRNIF) {
+        ustatPosted = false;
+        ustatCount--;
+        memmove (&ustatFifo[0], &ustatFifo[1], ustatCount);
+    }
+    if (!ustatPosted && ustatCount) {
+        ustatPosted = true;
+        USTAT = ustatFifo[0];
+        UIRbits.TRNIF = 1;
+    }
+
+    if (UCONbits.USBEN && !idleFlagged && (SIM_Now () - lastActivity) >= IDLE_DETECT_CYCLES) {
+        idleFlagged = true;
+        UIRbits.IDLEIF = 1;
+    }
+
+    UIRbits.UERRIF = (UEIR & UEIE) ? 1 : 0;
+    if ((UIR & UIE) != 0) {
+        PIR2bits.USBIF = 1;
+    }
+}
+
+
+// the host drives resume (K state) on the bus: activity that wakes a suspended SIE
+void SIM_SIE_Resume (void)
+{
+    BusActivity ();
+    SIM_SIE_Sync ();
+}
+
+
+// true while the firmware drives remote wakeup signalling with UCON.RESUME
+bool SIM_SIE_ResumeSignalling (void)
+{
+    return UCONbits.USBEN && UCONbits.RESUME;
+}
+
+
+// true if the firmware has handed an IN buffer of the endpoint to the SIE, i.e. the next IN
+// token will be answered with data; returns the buffer the SIE would send first
+bool SIM_SIE_InArmed (uint8_t ep, const uint8_t **data, uint8_t *length)
+{
+    volatile BDT_ENTRY *bd;
+
+    if (ep > USB_MAX_EP_NUMBER) {
+        return false;
+    }
+
+    bd = SelectBD (ep, DIR_IN);
+    if (!bd->STAT.UOWN) {
+        return false;
+    }
+
+    *data = SIM_DPRAM (bd->ADR);
+    *length = bd->CNT;
+    return true;
+}
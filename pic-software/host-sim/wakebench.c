@@ -0,0 +1,281 @@
+//-----------------------------------------------------------------------------------------------
+// wakebench.c -- USB suspend sleep and remote wakeup benchmark
+//
+// usage: wakebench [wakes [seed [startup_us]]]
+//
+// Suspends the bus and measures how much of the time the firmware spends asleep, with all
+// switches open and with all of them closed, and turns that into an estimated suspend
+// current. The currents per state below are assumptions, not datasheet or board
+// measurements, so the estimate only shows where the current goes; check it on the board.
+// The oscillator start-up after each wake counts as awake time and is an assumption too,
+// startup_us overrides the simulator's default.
+//
+// Then flips one random switch at a random time into each of a number of suspends with
+// remote wakeup enabled and measures from the switch edge to remote wakeup signalling and
+// to the host receiving the report. Switches on interrupt-on-change pins wake the core at
+// once, the others are seen on the next watchdog wake. Finally checks that with remote
+// wakeup disabled a change does not wake the host and is reported once the host resumes.
+//
+
+//-----------------------------------------------------------------------------------------------
+// includes
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "sim.h"
+
+
+//-----------------------------------------------------------------------------------------------
+// defines
+//
+
+#define DEFAULT_WAKES       200
+#define DEFAULT_SEED        1
+
+#define REPORT_ID_SWITCHES  0x01
+
+// SW1 RA5, SW2 RA4, SW5 RB7 have interrupt-on-change, the rest are on PORTC
+#define IOC_SWITCHES        (SIM_SWITCH(1) | SIM_SWITCH(2) | SIM_SWITCH(5))
+
+#define IDLE_TIME           SIM_MS(10000)
+#define WAKE_TIMEOUT        SIM_MS(200)
+
+// assumed supply currents in uA: the core running at 48 MHz with the USB module on, the
+// core asleep with the watchdog running and the USB module suspended, the host's 15 k
+// pull-down on D+ against the 1.5 k pull-up, and a weak pull-up into a closed switch
+#define RUN_UA              7000.0
+#define SLEEP_UA            5.0
+#define DPLUS_UA            200.0
+#define PULLUP_UA           100.0
+
+
+//-----------------------------------------------------------------------------------------------
+// globals
+//
+
+static uint32_t reports;
+static uint8_t lastSwitches;
+static uint64_t lastReportTime;
+
+
+//-----------------------------------------------------------------------------------------------
+// functions
+//
+
+static void ReportReceived (const uint8_t *report, uint8_t length, uint64_t when, void *context)
+{
+    if (length >= 2 && report[0] == REPORT_ID_SWITCHES) {
+        lastSwitches = report[1];
+        lastReportTime = when;
+        reports++;
+    }
+}
+
+
+static uint8_t ClosedSwitches (uint8_t switches)
+{
+    uint8_t n = 0;
+
+    for (; switches; switches &= switches - 1) {
+        n++;
+    }
+    return n;
+}
+
+
+// suspend with the switches still for IDLE_TIME and print the sleep accounting and the
+// current estimate; returns false if the host could not suspend the bus
+static bool IdleSuspend (const char *name, uint8_t switches)
+{
+    uint64_t start, slept;
+    uint32_t wdt, ioc, irq;
+    double asleep, current;
+
+    SIM_SetSwitches (switches);
+    SIM_Run (SIM_MS(20));
+    if (!SIM_HostSuspend (true)) {
+        return false;
+    }
+
+    // the stack suspends after 3 ms of idle bus, count from there
+    SIM_Run (SIM_MS(10));
+    start = SIM_Now ();
+    slept = SIM_SleepCycles ();
+    wdt = SIM_Wakes (SIM_WAKE_WDT);
+    ioc = SIM_Wakes (SIM_WAKE_IOC);
+    irq = SIM_Wakes (SIM_WAKE_INTERRUPT);
+    SIM_Run (IDLE_TIME);
+
+    asleep = (double)(SIM_SleepCycles () - slept) / (SIM_Now () - start);
+    current = asleep * SLEEP_UA + (1.0 - asleep) * RUN_UA + DPLUS_UA +
+              ClosedSwitches (switches) * PULLUP_UA;
+    printf ("%-22s %7.3f %% asleep, wakes/s watchdog %.1f IOC %.1f interrupt %.1f, ~%.0f uA\n",
+            name, asleep * 100.0,
+            (SIM_Wakes (SIM_WAKE_WDT) - wdt) * (double)SIM_MS(1000) / IDLE_TIME,
+            (SIM_Wakes (SIM_WAKE_IOC) - ioc) * (double)SIM_MS(1000) / IDLE_TIME,
+            (SIM_Wakes (SIM_WAKE_INTERRUPT) - irq) * (double)SIM_MS(1000) / IDLE_TIME, current);
+
+    SIM_HostResume ();
+    while (SIM_HostIsSuspended ()) {
+        SIM_Step ();
+    }
+    SIM_Run (SIM_MS(20));
+    return true;
+}
+
+
+// flip one switch during a suspend with remote wakeup enabled; returns false if the host
+// was never woken or never got the report
+static bool RemoteWakeup (SIM_STATS *toResume, SIM_STATS *toReport)
+{
+    uint8_t switches, bit, c;
+    uint32_t seen, wakeups;
+    uint64_t edge, resume = 0;
+
+    if (!SIM_HostSuspend (true)) {
+        return false;
+    }
+    SIM_Run (SIM_RandomCycles (SIM_MS(10), SIM_MS(100)));
+
+    bit = 1 << (SIM_Random () & 7);
+    switches = SIM_GetSwitches () ^ bit;
+    seen = reports;
+    wakeups = SIM_HostRemoteWakeups ();
+    SIM_SetSwitches (switches);
+    edge = SIM_Now ();
+
+    while (reports == seen && SIM_Now () - edge < WAKE_TIMEOUT) {
+        SIM_Step ();
+        if (resume == 0 && SIM_HostRemoteWakeups () != wakeups) {
+            resume = SIM_Now ();
+        }
+    }
+    if (reports == seen || resume == 0 || lastSwitches != switches) {
+        return false;
+    }
+
+    c = (bit & IOC_SWITCHES) ? 0 : 1;
+    SIM_StatsAdd (&toResume[c], resume - edge);
+    SIM_StatsAdd (&toReport[c], lastReportTime - edge);
+    SIM_Run (SIM_MS(20));
+    return true;
+}
+
+
+// with remote wakeup disabled a change must wait for the host to resume the bus; returns
+// the number of errors
+static int NoRemoteWakeup (void)
+{
+    uint8_t switches = SIM_GetSwitches () ^ SIM_SWITCH(1);
+    uint32_t seen, wakeups;
+    uint64_t resumed;
+    int errors = 0;
+
+    if (!SIM_HostSuspend (false)) {
+        printf ("remote wakeup disabled: suspend failed\n");
+        return 1;
+    }
+    SIM_Run (SIM_MS(50));
+
+    seen = reports;
+    wakeups = SIM_HostRemoteWakeups ();
+    SIM_SetSwitches (switches);
+    SIM_Run (SIM_MS(500));
+    if (reports != seen || SIM_HostRemoteWakeups () != wakeups) {
+        printf ("remote wakeup disabled: the stick woke the host\n");
+        errors++;
+    }
+
+    SIM_HostResume ();
+    resumed = SIM_Now ();
+    while (reports == seen && SIM_Now () - resumed < WAKE_TIMEOUT) {
+        SIM_Step ();
+    }
+    if (reports == seen || lastSwitches != switches) {
+        printf ("remote wakeup disabled: change not reported after the host resumed\n");
+        errors++;
+    } else {
+        printf ("remote wakeup disabled: no wakeup, change reported %.3f ms after the host "
+                "started resume\n", (double)(lastReportTime - resumed) / SIM_MS(1));
+    }
+    SIM_Run (SIM_MS(20));
+    return errors;
+}
+
+
+int main (int argc, char *argv[])
+{
+    static const uint8_t refresh[2] = { 0x02, 0x55 };
+    SIM_STATS toResume[2], toReport[2];
+    uint32_t wakes = (argc > 1) ? strtoul (argv[1], NULL, 0) : DEFAULT_WAKES;
+    uint32_t seed = (argc > 2) ? strtoul (argv[2], NULL, 0) : DEFAULT_SEED;
+    uint32_t i, lost = 0;
+    int errors = 0;
+    uint8_t c;
+
+    if (argc > 3) {
+        SIM_wakeCycles = SIM_US(strtoul (argv[3], NULL, 0));
+    }
+
+    SIM_Seed (seed);
+    SIM_StatsInit (&toResume[0], "IOC switch to resume", wakes);
+    SIM_StatsInit (&toResume[1], "polled switch to resume", wakes);
+    SIM_StatsInit (&toReport[0], "IOC switch to report", wakes);
+    SIM_StatsInit (&toReport[1], "polled switch to report", wakes);
+
+    SIM_PowerOn ();
+    SIM_HostAttach ();
+    if (!SIM_HostWaitConfigured (SIM_MS(1000))) {
+        fprintf (stderr, "wakebench: enumeration failed\n");
+        return 1;
+    }
+    SIM_HostSetReportCallback (ReportReceived, NULL);
+    SIM_HostSendReport (refresh, sizeof (refresh));
+    SIM_Run (SIM_MS(20));
+
+    printf ("suspended %.0f s, oscillator start-up %.3f ms, model estimate from assumed currents:\n"
+            "run %.0f uA, sleep %.0f uA, D+ %.0f uA, %.0f uA per closed switch\n\n",
+            (double)IDLE_TIME / SIM_MS(1000), (double)SIM_wakeCycles / SIM_MS(1), RUN_UA,
+            SLEEP_UA, DPLUS_UA, PULLUP_UA);
+    if (!IdleSuspend ("switches open", 0x00) || !IdleSuspend ("switches closed", 0xFF)) {
+        fprintf (stderr, "wakebench: suspend failed\n");
+        return 1;
+    }
+    SIM_SetSwitches (0x00);
+    SIM_Run (SIM_MS(20));
+
+    for (i = 0; i < wakes; i++) {
+        if (!RemoteWakeup (toResume, toReport)) {
+            lost++;
+            SIM_HostResume ();
+            while (SIM_HostIsSuspended ()) {
+                SIM_Step ();
+            }
+            SIM_Run (SIM_MS(20));
+        }
+    }
+
+    printf ("\n%u remote wakeups, seed %u, %.1f s simulated\n", wakes, seed,
+            (double)SIM_Now () / SIM_MS(1000));
+    printf ("time from the switch edge to remote wakeup signalling and to the host having the "
+            "report\n\n");
+    SIM_StatsPrintHeader ();
+    for (c = 0; c < 2; c++) {
+        SIM_StatsPrint (&toResume[c]);
+    }
+    for (c = 0; c < 2; c++) {
+        SIM_StatsPrint (&toReport[c]);
+        SIM_StatsFree (&toResume[c]);
+        SIM_StatsFree (&toReport[c]);
+    }
+    if (lost) {
+        printf ("\n%u changes never woke the host\n", lost);
+    }
+
+    printf ("\n");
+    errors += NoRemoteWakeup ();
+
+    return (lost || errors) ? 1 : 0;
+}
@@ -0,0 +1,261 @@
+//-----------------------------------------------------------------------------------------------
+// wide_test.c -- checks the wide switch reports of the 74HC165 expansion chain
+//
+// usage: wide_test [changes [seed]]
+//
+// Built against the firmware with SWITCH_BYTES > 1. The report descriptor must have the
+// configured length and every report ID 1 SWITCH_REPORT_SIZE bytes. Changes spread over all
+// the switch bytes at once must come as one report with every byte right, and so must random
+// single switch changes in any byte. GET_REPORT for input report 1 and feature report 3 must
+// carry the same bytes at their offsets. A glitch on an expansion switch shorter than a tick
+// must be debounced away, a register past SWITCH_BYTES must be ignored, and an expansion
+// switch, which has no interrupt-on-change, must still wake a suspended host.
+//
+// Compiled with the firmware flags so it sees SWITCH_BYTES and the report sizes.
+//
+
+//-----------------------------------------------------------------------------------------------
+// includes
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "system.h"
+
+#include "sim.h"
+
+
+//-----------------------------------------------------------------------------------------------
+// defines
+//
+
+#define DEFAULT_CHANGES     200
+#define DEFAULT_SEED        1
+
+#define REPORT_ID_SWITCHES  0x01
+#define REPORT_ID_STATE     0x03
+
+// long enough for every change to pass the debounce and reach the host
+#define SETTLE              SIM_MS(20)
+
+#define WAKE_TIMEOUT        SIM_MS(200)
+
+
+//-----------------------------------------------------------------------------------------------
+// globals
+//
+
+static uint32_t reports, badLength;
+static uint8_t lastReport[SWITCH_REPORT_SIZE];
+
+
+//-----------------------------------------------------------------------------------------------
+// functions
+//
+
+static void ReportReceived (const uint8_t *report, uint8_t length, uint64_t when, void *context)
+{
+    if (length >= 1 && report[0] == REPORT_ID_SWITCHES) {
+        if (length != SWITCH_REPORT_SIZE) {
+            badLength++;
+            return;
+        }
+        memcpy (lastReport, report, length);
+        reports++;
+    }
+}
+
+
+static void SetSwitches (const uint8_t switches[SWITCH_BYTES])
+{
+    uint8_t i;
+
+    for (i = 0; i < SWITCH_BYTES; i++) {
+        SIM_SetSwitchBank (i, switches[i]);
+    }
+}
+
+
+static void PrintSwitches (const uint8_t switches[SWITCH_BYTES])
+{
+    uint8_t i;
+
+    for (i = 0; i < SWITCH_BYTES; i++) {
+        printf ("%02X", switches[i]);
+    }
+}
+
+
+// set the switches, let them settle and check that exactly one report with them came;
+// returns the number of errors
+static int Change (const char *name, const uint8_t switches[SWITCH_BYTES])
+{
+    uint32_t seen = reports;
+
+    SetSwitches (switches);
+    SIM_Run (SETTLE);
+
+    if (reports != seen + 1 || memcmp (&lastReport[1], switches, SWITCH_BYTES) != 0) {
+        printf ("%s: %u reports, last ", name, reports - seen);
+        PrintSwitches (&lastReport[1]);
+        printf (", expected one with ");
+        PrintSwitches (switches);
+        printf ("\n");
+        return 1;
+    }
+    return 0;
+}
+
+
+// GET_REPORT and check the switch bytes and the sequence number; returns the number of errors
+static int GetReport (const char *name, uint8_t type, uint8_t reportId, uint16_t size,
+                      const uint8_t switches[SWITCH_BYTES])
+{
+    const uint8_t setup[8] = { 0xA1, 0x01, reportId, type, 0x00, 0x00, (uint8_t)size, 0x00 };
+    uint8_t data[64];
+    uint16_t length = size;
+
+    if (!SIM_HostControlTransfer (setup, data, &length, SIM_MS(100))) {
+        printf ("%s: GET_REPORT failed\n", name);
+        return 1;
+    }
+    if (length != size || data[0] != reportId || memcmp (&data[1], switches, SWITCH_BYTES) != 0 ||
+            data[SWITCH_BYTES + 3] != lastReport[SWITCH_BYTES + 3]) {
+        printf ("%s: %u bytes, switches ", name, length);
+        PrintSwitches (&data[1]);
+        printf (" sequence %u, expected %u bytes, switches ", data[SWITCH_BYTES + 3], size);
+        PrintSwitches (switches);
+        printf (" sequence %u\n", lastReport[SWITCH_BYTES + 3]);
+        return 1;
+    }
+    return 0;
+}
+
+
+// flip a switch in the last expansion byte while suspended with remote wakeup enabled;
+// returns the number of errors
+static int RemoteWakeup (uint8_t switches[SWITCH_BYTES])
+{
+    uint32_t seen, wakeups;
+    uint64_t edge;
+
+    if (!SIM_HostSuspend (true)) {
+        printf ("remote wakeup: suspend failed\n");
+        return 1;
+    }
+    SIM_Run (SIM_MS(50));
+
+    switches[SWITCH_BYTES - 1] ^= SIM_SWITCH(8);
+    seen = reports;
+    wakeups = SIM_HostRemoteWakeups ();
+    SetSwitches (switches);
+    edge = SIM_Now ();
+    while (reports == seen && SIM_Now () - edge < WAKE_TIMEOUT) {
+        SIM_Step ();
+    }
+
+    if (SIM_HostRemoteWakeups () == wakeups || reports == seen ||
+            memcmp (&lastReport[1], switches, SWITCH_BYTES) != 0) {
+        printf ("remote wakeup: expansion switch did not wake the host with its report\n");
+        return 1;
+    }
+    printf ("remote wakeup: expansion switch reported %.3f ms after the edge\n",
+            (double)(SIM_Now () - edge) / SIM_MS(1));
+    SIM_Run (SETTLE);
+    return 0;
+}
+
+
+int main (int argc, char *argv[])
+{
+    static const uint8_t refresh[2] = { 0x02, 0x55 };
+#if DEBOUNCE_SAMPLES == DEBOUNCE_ADAPTIVE
+    static const uint8_t fixedDepth[3] = { 0x02, 0x44, DEBOUNCE_ADAPT_START };
+#endif
+    uint8_t switches[SWITCH_BYTES];
+    uint32_t changes = (argc > 1) ? strtoul (argv[1], NULL, 0) : DEFAULT_CHANGES;
+    uint32_t seed = (argc > 2) ? strtoul (argv[2], NULL, 0) : DEFAULT_SEED;
+    uint32_t i, seen;
+    uint16_t length;
+    char name[32];
+    int errors = 0;
+    uint8_t b;
+
+    SIM_Seed (seed);
+    SIM_PowerOn ();
+    SIM_HostAttach ();
+    if (!SIM_HostWaitConfigured (SIM_MS(1000))) {
+        fprintf (stderr, "wide_test: enumeration failed\n");
+        return 1;
+    }
+#if DEBOUNCE_SAMPLES == DEBOUNCE_ADAPTIVE
+    // learned depths differ from switch to switch and would let a change of several switches
+    // out over several reports; these checks want one depth for all
+    SIM_HostSendReport (fixedDepth, sizeof (fixedDepth));
+    SIM_Run (SIM_MS(30));
+#endif
+    SIM_HostSetReportCallback (ReportReceived, NULL);
+    SIM_HostSendReport (refresh, sizeof (refresh));
+    SIM_Run (SETTLE);
+
+    printf ("%u switch bytes, %u byte reports, seed %u\n", SWITCH_BYTES, SWITCH_REPORT_SIZE, seed);
+
+    SIM_HostDescriptor (0x22, &length);
+    if (length != HID_RPT01_SIZE) {
+        printf ("report descriptor is %u bytes, expected %u\n", length, HID_RPT01_SIZE);
+        errors++;
+    }
+
+    // every byte at once, each its own pattern
+    for (b = 0; b < SWITCH_BYTES; b++) {
+        switches[b] = 0x11 * (b + 1);
+    }
+    errors += Change ("all bytes", switches);
+    memset (switches, 0, sizeof (switches));
+    errors += Change ("all bytes open", switches);
+
+    // one random switch in a random byte, then a random pattern over all of them
+    for (i = 0; i < changes; i++) {
+        if (i & 1) {
+            for (b = 0; b < SWITCH_BYTES; b++) {
+                switches[b] = SIM_Random ();
+            }
+            snprintf (name, sizeof (name), "change %u, all bytes", i);
+        } else {
+            b = SIM_Random () % SWITCH_BYTES;
+            switches[b] ^= SIM_SWITCH(1 + (SIM_Random () & 7));
+            snprintf (name, sizeof (name), "change %u, byte %u", i, b);
+        }
+        errors += Change (name, switches);
+    }
+
+    errors += GetReport ("GET_REPORT input 1", 0x01, REPORT_ID_SWITCHES, SWITCH_REPORT_SIZE, switches);
+    errors += GetReport ("GET_REPORT feature 3", 0x03, REPORT_ID_STATE, STATE_REPORT_SIZE, switches);
+
+    // a glitch seen by one sample at most, and the registers past the configured ones
+    seen = reports;
+    SIM_SetSwitchBank (SWITCH_BYTES - 1, switches[SWITCH_BYTES - 1] ^ SIM_SWITCH(1));
+    SIM_Run (SIM_US(900));
+    SIM_SetSwitchBank (SWITCH_BYTES - 1, switches[SWITCH_BYTES - 1]);
+    if (SWITCH_BYTES < SIM_SWITCH_BANKS) {
+        SIM_SetSwitchBank (SWITCH_BYTES, 0xFF);
+    }
+    SIM_Run (SETTLE);
+    if (reports != seen) {
+        printf ("glitch: %u reports for a glitch and switches past the chain\n", reports - seen);
+        errors++;
+    }
+
+    errors += RemoteWakeup (switches);
+
+    if (badLength) {
+        printf ("%u switch reports of the wrong length\n", badLength);
+        errors++;
+    }
+
+    printf ("%u changes, %u reports\n", changes, reports);
+    printf ("%s\n", errors ? "FAIL" : "PASS");
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,244 @@
+//-----------------------------------------------------------------------------------------------
+// xc.h -- host stand-in for the XC8 device header when building the firmware as a Linux
+// process. The PIC16F1459 special function registers are modelled as one byte array indexed
+// by the real SFR addresses so code that does pointer arithmetic on registers (&UEP0 + ep,
+// &UEP1 in DisableNonZeroEndpoints) sees the same layout as on the part. The simulator in
+// sim_core.c and sim_sie.c plays the role of the peripherals behind those registers.
+//
+
+#ifndef SIM_XC_H
+#define SIM_XC_H
+
+#include <stdint.h>
+
+// usb_device.c redefines uintptr_t as a 16-bit type for XC8 unless it is already a macro;
+// host pointers are 64 bits wide so keep the real type
+#define uintptr_t uintptr_t
+
+// interrupt functions are plain functions called by the simulator
+#define __interrupt()
+
+// objects placed with __at() all land in the .dpram section, which the Makefile links at
+// SIM_DPRAM_HOST_BASE + 0x2000 so that ConvertToPhysicalAddress() yields 0x2000+ addresses
+#define __at(a) __attribute__((section(".dpram")))
+
+// host address of dual-port RAM address 0x0000; must match --section-start in the Makefile.
+// usb_hal_pic16f1.h uses it to turn BDnADR values back into pointers
+#define SIM_DPRAM_HOST_BASE 0x20000000UL
+
+#define NOP()
+#define CLRWDT()
+
+// SLEEP hands control back to the simulator until a wake-up source fires, __delay_ms()
+// holds the main loop for that long with interrupts still running
+void SIM_Sleep (void);
+void SIM_Delay (unsigned long cycles);
+#define SLEEP()             SIM_Sleep ()
+#define __delay_ms(ms)      SIM_Delay ((unsigned long)(ms) * (_XTAL_FREQ / 4000UL))
+
+
+//-----------------------------------------------------------------------------------------------
+// SFR file
+//
+
+#define SIM_SFR_SIZE 0x1000
+
+extern volatile uint8_t SIM_SFR[SIM_SFR_SIZE];
+
+#define SIM_REG(addr)          (SIM_SFR[(addr)])
+#define SIM_REGBITS(type,addr) (*(volatile type *)&SIM_SFR[(addr)])
+
+// core and bank 0
+#define INTCON      SIM_REG(0x00B)
+#define PORTA       SIM_REG(0x00C)
+#define PORTB       SIM_REG(0x00D)
+#define PORTC       SIM_REG(0x00E)
+#define PIR1        SIM_REG(0x011)
+#define PIR2        SIM_REG(0x012)
+#define TMR1L       SIM_REG(0x016)
+#define TMR1H       SIM_REG(0x017)
+#define T1CON       SIM_REG(0x018)
+#define TMR2        SIM_REG(0x01A)
+#define PR2         SIM_REG(0x01B)
+#define T2CON       SIM_REG(0x01C)
+
+// bank 1
+#define TRISA       SIM_REG(0x08C)
+#define TRISB       SIM_REG(0x08D)
+#define TRISC       SIM_REG(0x08E)
+#define PIE1        SIM_REG(0x091)
+#define PIE2        SIM_REG(0x092)
+#define WDTCON      SIM_REG(0x097)
+#define OSCCON      SIM_REG(0x099)
+
+// bank 2
+#define LATA        SIM_REG(0x10C)
+#define LATB        SIM_REG(0x10D)
+#define LATC        SIM_REG(0x10E)
+
+// bank 3
+#define ANSELA      SIM_REG(0x18C)
+#define ANSELB      SIM_REG(0x18D)
+#define ANSELC      SIM_REG(0x18E)
+
+// bank 4
+#define WPUA        SIM_REG(0x20C)
+#define WPUB        SIM_REG(0x20D)
+
+// bank 7
+#define IOCAP       SIM_REG(0x391)
+#define IOCAN       SIM_REG(0x392)
+#define IOCAF       SIM_REG(0x393)
+#define IOCBP       SIM_REG(0x394)
+#define IOCBN       SIM_REG(0x395)
+#define IOCBF       SIM_REG(0x396)
+#define ACTCON      SIM_REG(0x39B)
+
+// bank 29, USB module
+#define UCON        SIM_REG(0xE8E)
+#define USTAT       SIM_REG(0xE8F)
+#define UIR         SIM_REG(0xE90)
+#define UCFG        SIM_REG(0xE91)
+#define UIE         SIM_REG(0xE92)
+#define UEIR        SIM_REG(0xE93)
+#define UFRMH       SIM_REG(0xE94)
+#define UFRML       SIM_REG(0xE95)
+#define UADDR       SIM_REG(0xE96)
+#define UEIE        SIM_REG(0xE97)
+#define UEP0        SIM_REG(0xE98)
+#define UEP1        SIM_REG(0xE99)
+#define UEP2        SIM_REG(0xE9A)
+#define UEP3        SIM_REG(0xE9B)
+#define UEP4        SIM_REG(0xE9C)
+#define UEP5        SIM_REG(0xE9D)
+#define UEP6        SIM_REG(0xE9E)
+#define UEP7        SIM_REG(0xE9F)
+
+
+//-----------------------------------------------------------------------------------------------
+// bit views, uint8_t bitfields so every view is exactly one register wide
+//
+
+typedef struct {
+    uint8_t IOCIF:1, INTF:1, TMR0IF:1, IOCIE:1, INTE:1, TMR0IE:1, PEIE:1, GIE:1;
+} INTCONbits_t;
+
+typedef struct {
+    uint8_t RA0:1, RA1:1, RA2:1, RA3:1, RA4:1, RA5:1, RA6:1, RA7:1;
+} PORTAbits_t;
+
+typedef struct {
+    uint8_t RB0:1, RB1:1, RB2:1, RB3:1, RB4:1, RB5:1, RB6:1, RB7:1;
+} PORTBbits_t;
+
+typedef struct {
+    uint8_t RC0:1, RC1:1, RC2:1, RC3:1, RC4:1, RC5:1, RC6:1, RC7:1;
+} PORTCbits_t;
+
+typedef struct {
+    uint8_t TMR1IF:1, TMR2IF:1, :1, SSP1IF:1, TXIF:1, RCIF:1, ADIF:1, TMR1GIF:1;
+} PIR1bits_t;
+
+typedef struct {
+    uint8_t :1, ACTIF:1, USBIF:1, BCL1IF:1, :1, C1IF:1, C2IF:1, OSFIF:1;
+} PIR2bits_t;
+
+typedef struct {
+    uint8_t TMR1IE:1, TMR2IE:1, :1, SSP1IE:1, TXIE:1, RCIE:1, ADIE:1, TMR1GIE:1;
+} PIE1bits_t;
+
+typedef struct {
+    uint8_t :1, ACTIE:1, USBIE:1, BCL1IE:1, :1, C1IE:1, C2IE:1, OSFIE:1;
+} PIE2bits_t;
+
+typedef struct {
+    uint8_t TMR1ON:1, :1, T1SYNC:1, T1OSCEN:1, T1CKPS:2, TMR1CS:2;
+} T1CONbits_t;
+
+typedef struct {
+    uint8_t T2CKPS:2, TMR2ON:1, T2OUTPS:4, :1;
+} T2CONbits_t;
+
+typedef struct {
+    uint8_t SWDTEN:1, WDTPS:5, :2;
+} WDTCONbits_t;
+
+typedef struct {
+    uint8_t TRISA0:1, TRISA1:1, TRISA2:1, TRISA3:1, TRISA4:1, TRISA5:1, TRISA6:1, TRISA7:1;
+} TRISAbits_t;
+
+typedef struct {
+    uint8_t TRISB0:1, TRISB1:1, TRISB2:1, TRISB3:1, TRISB4:1, TRISB5:1, TRISB6:1, TRISB7:1;
+} TRISBbits_t;
+
+typedef struct {
+    uint8_t TRISC0:1, TRISC1:1, TRISC2:1, TRISC3:1, TRISC4:1, TRISC5:1, TRISC6:1, TRISC7:1;
+} TRISCbits_t;
+
+typedef struct {
+    uint8_t LATA0:1, LATA1:1, LATA2:1, LATA3:1, LATA4:1, LATA5:1, LATA6:1, LATA7:1;
+} LATAbits_t;
+
+typedef struct {
+    uint8_t LATB0:1, LATB1:1, LATB2:1, LATB3:1, LATB4:1, LATB5:1, LATB6:1, LATB7:1;
+} LATBbits_t;
+
+typedef struct {
+    uint8_t LATC0:1, LATC1:1, LATC2:1, LATC3:1, LATC4:1, LATC5:1, LATC6:1, LATC7:1;
+} LATCbits_t;
+
+typedef struct {
+    uint8_t WPUB0:1, WPUB1:1, WPUB2:1, WPUB3:1, WPUB4:1, WPUB5:1, WPUB6:1, WPUB7:1;
+} WPUBbits_t;
+
+typedef struct {
+    uint8_t :1, SUSPND:1, RESUME:1, USBEN:1, PKTDIS:1, SE0:1, PPBRST:1, :1;
+} UCONbits_t;
+
+typedef struct {
+    uint8_t :1, PPBI:1, DIR:1, ENDP:4, :1;
+} USTATbits_t;
+
+typedef struct {
+    uint8_t URSTIF:1, UERRIF:1, ACTVIF:1, TRNIF:1, IDLEIF:1, STALLIF:1, SOFIF:1, :1;
+} UIRbits_t;
+
+typedef struct {
+    uint8_t URSTIE:1, UERRIE:1, ACTVIE:1, TRNIE:1, IDLEIE:1, STALLIE:1, SOFIE:1, :1;
+} UIEbits_t;
+
+typedef struct {
+    uint8_t PPB:2, FSEN:1, UTRDIS:1, UPUEN:1, :2, UTEYE:1;
+} UCFGbits_t;
+
+typedef struct {
+    uint8_t EPSTALL:1, EPINEN:1, EPOUTEN:1, EPCONDIS:1, EPHSHK:1, :3;
+} UEPbits_t;
+
+#define INTCONbits  SIM_REGBITS(INTCONbits_t, 0x00B)
+#define PORTAbits   SIM_REGBITS(PORTAbits_t,  0x00C)
+#define PORTBbits   SIM_REGBITS(PORTBbits_t,  0x00D)
+#define PORTCbits   SIM_REGBITS(PORTCbits_t,  0x00E)
+#define PIR1bits    SIM_REGBITS(PIR1bits_t,   0x011)
+#define PIR2bits    SIM_REGBITS(PIR2bits_t,   0x012)
+#define T1CONbits   SIM_REGBITS(T1CONbits_t,  0x018)
+#define T2CONbits   SIM_REGBITS(T2CONbits_t,  0x01C)
+#define TRISAbits   SIM_REGBITS(TRISAbits_t,  0x08C)
+#define TRISBbits   SIM_REGBITS(TRISBbits_t,  0x08D)
+#define TRISCbits   SIM_REGBITS(TRISCbits_t,  0x08E)
+#define PIE1bits    SIM_REGBITS(PIE1bits_t,   0x091)
+#define PIE2bits    SIM_REGBITS(PIE2bits_t,   0x092)
+#define WDTCONbits  SIM_REGBITS(WDTCONbits_t, 0x097)
+#define LATAbits    SIM_REGBITS(LATAbits_t,   0x10C)
+#define LATBbits    SIM_REGBITS(LATBbits_t,   0x10D)
+#define LATCbits    SIM_REGBITS(LATCbits_t,   0x10E)
+#define WPUBbits    SIM_REGBITS(WPUBbits_t,   0x20D)
+#define UCONbits    SIM_REGBITS(UCONbits_t,   0xE8E)
+#define USTATbits   SIM_REGBITS(USTATbits_t,  0xE8F)
+#define UIRbits     SIM_REGBITS(UIRbits_t,    0xE90)
+#define UCFGbits    SIM_REGBITS(UCFGbits_t,   0xE91)
+#define UIEbits     SIM_REGBITS(UIEbits_t,    0xE92)
+#define UEP0bits    SIM_REGBITS(UEPbits_t,    0xE98)
+#define UEP1bits    SIM_REGBITS(UEPbits_t,    0xE99)
+
+#endif //SIM_XC_H
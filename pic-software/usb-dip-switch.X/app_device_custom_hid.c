@@ -25,6 +25,8 @@ please contact mla_licensing@microchip.com
 
 #include "system.h"
 
+#include "app_device_custom_hid.h"
+
 
 /** VARIABLES ******************************************************/
 /* Some processors have a limited range of RAM addresses where the USB module
@@ -36,27 +38,101 @@ please contact mla_licensing@microchip.com
     #if defined(COMPILER_MPLAB_C18)
         #pragma udata HID_CUSTOM_OUT_DATA_BUFFER = HID_CUSTOM_OUT_DATA_BUFFER_ADDRESS
         unsigned char ReceivedDataBuffer[64];
+        #pragma udata HID_CUSTOM_IN_QUEUE = HID_CUSTOM_IN_QUEUE_ADDRESS
+        volatile SWITCH_RECORD reportQueue[REPORT_QUEUE_SIZE];
         #pragma udata HID_CUSTOM_IN_DATA_BUFFER = HID_CUSTOM_IN_DATA_BUFFER_ADDRESS
-        unsigned char ToSendDataBuffer[64];
+        SWITCH_RECORD refreshReport;
         #pragma udata
 
     #elif defined(__XC8)
         unsigned char ReceivedDataBuffer[64] HID_CUSTOM_OUT_DATA_BUFFER_ADDRESS;
-        unsigned char ToSendDataBuffer[64] HID_CUSTOM_IN_DATA_BUFFER_ADDRESS;
+        volatile SWITCH_RECORD reportQueue[REPORT_QUEUE_SIZE] HID_CUSTOM_IN_QUEUE_ADDRESS;
+        SWITCH_RECORD refreshReport HID_CUSTOM_IN_DATA_BUFFER_ADDRESS;
+    #endif
+
+    // the queue must fit the 112 bytes of linear RAM between its address and the refresh
+    // answer, which SWITCH_BYTES > 1 does with half as many records
+    #if (REPORT_QUEUE_SIZE * SWITCH_REPORT_SIZE > 0x70)
+        #error "report queue overlaps the refresh report in USB RAM"
     #endif
 #else
     unsigned char ReceivedDataBuffer[64];
-    unsigned char ToSendDataBuffer[64];
+    volatile SWITCH_RECORD reportQueue[REPORT_QUEUE_SIZE];
+    SWITCH_RECORD refreshReport;
 #endif
 
 volatile USB_HANDLE USBOutHandle;    
-volatile USB_HANDLE USBInHandle;
 
-extern volatile uint8_t usbReportNeeded;
-extern volatile uint8_t usbReportData[0];
-extern volatile uint8_t hostRequestedUsbReport;
+// one handle per even / odd IN BD and what the BD carries; usbInNext follows the stack's
+// pBDTEntryIn[] ping-pong pointer, which moves to the other BD each time HIDTxPacket() arms one
+volatile USB_HANDLE USBInHandle[2];
+uint8_t usbInContent[2];
+uint8_t usbInNext;
+
+// next queued record to hand to the SIE; records from reportQueueTail up to here are in
+// flight and keep their queue slots until the host has them
+uint8_t reportQueueArmed;
+
+extern volatile uint8_t reportQueueHead;
+extern volatile uint8_t reportQueueTail;
+extern uint8_t switchStates[SWITCH_BYTES];
+extern uint8_t switchSequence;
+extern uint16_t switchTimestamp;
+extern uint16_t switchFrame;
+extern volatile uint8_t reportQueueDrops;
+extern uint8_t idleRate;
+extern uint16_t idleStart;
+extern uint8_t settleWindow;
+extern uint8_t settleForce;
+
+// host asked for the current state with report ID 2 / 0x55, or the heartbeat is due
+uint8_t refreshRequested;
+
+// GET_REPORT answers, copied into the EP0 buffer by the stack as the data stage goes out;
+// feature reports 4, 5 and 7 take turns in one buffer, EP0 carries one transfer at a time
+uint8_t getReportData[STATE_REPORT_SIZE];
+#if (ISR_REPORT_SIZE > LOOP_REPORT_SIZE)
+#define STATS_REPORT_SIZE ISR_REPORT_SIZE
+#else
+#define STATS_REPORT_SIZE LOOP_REPORT_SIZE
+#endif
+#if (BOUNCE_REPORT_SIZE > STATS_REPORT_SIZE)
+uint8_t statsReportData[BOUNCE_REPORT_SIZE];
+#else
+uint8_t statsReportData[STATS_REPORT_SIZE];
+#endif
+
+// resume signalling went out for the changes waiting in the queue; the host is not woken
+// again until it has taken one of them
+uint8_t remoteWakeupSent;
 
 /** DEFINITIONS ****************************************************/
+enum {
+    IN_BD_IDLE = 0,
+    IN_BD_RECORD,
+    IN_BD_REFRESH
+};
+
+// GET_REPORT wValue high byte
+#define HID_REPORT_TYPE_INPUT   0x01
+#define HID_REPORT_TYPE_FEATURE 0x03
+
+#define REPORT_ID_SWITCHES      0x01
+#define REPORT_ID_COMMAND       0x02
+#define REPORT_ID_STATE         0x03
+#define REPORT_ID_ISR_STATS     0x04
+#define REPORT_ID_LOOP_STATS    0x05
+#define REPORT_ID_SETTINGS      0x06
+#define REPORT_ID_BOUNCE_STATS  0x07
+
+// report ID 2 commands, the second byte is the argument
+#define COMMAND_REFRESH         0x55
+#define COMMAND_HEARTBEAT       0x49
+#define COMMAND_SETTLE          0x53
+#define COMMAND_SETTLE_NOW      0x46
+#define COMMAND_TICK            0x54
+#define COMMAND_DEBOUNCE        0x44
+#define COMMAND_SAMPLING        0x50
 
 /** FUNCTIONS ******************************************************/
 
@@ -76,7 +152,21 @@ void APP_DeviceCustomHIDInitialize()
 {
     //initialize the variable holding the handle for the last
     // transmission
-    USBInHandle = 0;
+    USBInHandle[0] = 0;
+    USBInHandle[1] = 0;
+    usbInContent[0] = IN_BD_IDLE;
+    usbInContent[1] = IN_BD_IDLE;
+    usbInNext = 0;
+
+    // records in flight when the bus was reset are sent again
+    reportQueueArmed = reportQueueTail;
+    refreshRequested = false;
+    remoteWakeupSent = false;
+
+    // a new configuration starts with the heartbeat off until the host asks for one, and
+    // with the built-in settle window
+    idleRate = 0;
+    settleWindow = SETTLE_MS;
 
     //enable the HID endpoint
     USBEnableEndpoint(CUSTOM_DEVICE_HID_EP, USB_IN_ENABLED|USB_OUT_ENABLED|USB_HANDSHAKE_ENABLED|USB_DISALLOW_SETUP);
@@ -101,6 +191,9 @@ void APP_DeviceCustomHIDInitialize()
 ********************************************************************/
 void APP_DeviceCustomHIDTasks()
 {   
+    uint8_t i;
+    uint8_t *report;
+
     /* If the USB device isn't configured yet, we can't really do anything
      * else since we don't have a host to talk to.  So jump back to the
      * top of the while loop. */
@@ -115,6 +208,14 @@ void APP_DeviceCustomHIDTasks()
      * thus just continue back to the start of the while loop. */
     if( USBIsDeviceSuspended()== true )
     {
+        // a change the host has not taken yet wakes it, if it enabled remote wakeup
+        // with SET_FEATURE before suspending the bus
+        if ((reportQueueHead != reportQueueTail) && (remoteWakeupSent == false) &&
+            (USBIsBusSuspended() == true) && (USBGetRemoteWakeupStatus() == true))
+        {
+            remoteWakeupSent = true;
+            USBCBSendResume();
+        }
         return;
     }
     
@@ -122,9 +223,32 @@ void APP_DeviceCustomHIDTasks()
     if(HIDRxHandleBusy(USBOutHandle) == false)
     {   
         // check report ID
-        if (ReceivedDataBuffer[0] == 2) {
-            if (ReceivedDataBuffer[1] == 0x55) {
-                hostRequestedUsbReport = true;
+        if (ReceivedDataBuffer[0] == REPORT_ID_COMMAND) {
+            if (ReceivedDataBuffer[1] == COMMAND_REFRESH) {
+                // answered below from the state debounced on the last tick instead of
+                // waiting for the next one
+                refreshRequested = true;
+            } else if (ReceivedDataBuffer[1] == COMMAND_HEARTBEAT) {
+                // SET_IDLE for hosts whose HID driver keeps the control pipe to itself,
+                // same 4 ms units
+                idleRate = ReceivedDataBuffer[2];
+            } else if (ReceivedDataBuffer[1] == COMMAND_SETTLE) {
+                // settle window in ms, 0 = report every change at once
+                settleWindow = ReceivedDataBuffer[2];
+            } else if (ReceivedDataBuffer[1] == COMMAND_SETTLE_NOW) {
+                // the change in its settle window goes out on the next tick
+                settleForce = true;
+            } else if (ReceivedDataBuffer[1] == COMMAND_TICK) {
+                // tick in TICK_UNIT_US, kept over a power cycle; out of range is ignored
+                SetSampleSettings(ReceivedDataBuffer[2], sampleSettings.debounceSamples);
+            } else if (ReceivedDataBuffer[1] == COMMAND_DEBOUNCE) {
+                // consecutive samples to debounce, 0 = each switch its own learned depth,
+                // kept like the tick
+                SetSampleSettings(sampleSettings.tickUnits, ReceivedDataBuffer[2]);
+            } else if (ReceivedDataBuffer[1] == COMMAND_SAMPLING) {
+                // both at once, the tick in the high nibble and the depth in the low one, so
+                // changing both costs one flash write instead of two
+                SetSampleSettings(ReceivedDataBuffer[2] >> 4, ReceivedDataBuffer[2] & 0x0F);
             }
         }
         
@@ -133,13 +257,201 @@ void APP_DeviceCustomHIDTasks()
         USBOutHandle = HIDRxPacket(CUSTOM_DEVICE_HID_EP, (uint8_t*)&ReceivedDataBuffer[0], 64);
     }
     
-    if (usbReportNeeded) {
-        if (!HIDTxHandleBusy(USBInHandle)) {
-            usbReportNeeded = false;
-            ToSendDataBuffer[0] = 0x01; // report ID
-            ToSendDataBuffer[1] = usbReportData[0];
-            //Prepare the USB module to send the data packet to the host
-            USBInHandle = HIDTxPacket(CUSTOM_DEVICE_HID_EP, (uint8_t*)&ToSendDataBuffer[0],2);
+    // retire finished IN transfers. Records complete in the order they were armed, so each
+    // finished record hands its queue slot back to the sampler by moving the tail on
+    for (i = 0; i < 2; i++) {
+        if (usbInContent[i] != IN_BD_IDLE && !HIDTxHandleBusy(USBInHandle[i])) {
+            if (usbInContent[i] == IN_BD_RECORD) {
+                reportQueueTail++;
+                remoteWakeupSent = false;
+            }
+            usbInContent[i] = IN_BD_IDLE;
+        }
+    }
+
+    // drain queued changes oldest first, then answer a refresh request. A queued record
+    // also answers a refresh: the newest state is always queued behind it, so a separate
+    // reply is only needed when nothing was queued. Both the even and the odd BD are kept
+    // armed, so while the host takes one report the next is already waiting for the
+    // following frame, even if the main loop is slow to come round again. Records are sent
+    // from where the sampler wrote them, arming a BD is the whole handoff
+    while (usbInContent[usbInNext] == IN_BD_IDLE) {
+        if (reportQueueArmed != reportQueueHead) {
+            report = (uint8_t*)&reportQueue[reportQueueArmed & REPORT_QUEUE_MASK];
+            reportQueueArmed++;
+            usbInContent[usbInNext] = IN_BD_RECORD;
+            refreshRequested = false;
+        } else if (refreshRequested && usbInContent[usbInNext ^ 1] != IN_BD_REFRESH) {
+            // the current state with the sequence and timestamp of the change that produced
+            // it, so a repeated sequence number tells the host nothing new happened
+            refreshRequested = false;
+            refreshReport.reportId = 0x01;
+            memcpy(refreshReport.switches, switchStates, SWITCH_BYTES);
+            refreshReport.timestamp = switchTimestamp;
+            refreshReport.sequence = switchSequence;
+            refreshReport.frame = switchFrame;
+            report = (uint8_t*)&refreshReport;
+            usbInContent[usbInNext] = IN_BD_REFRESH;
+        } else {
+            break;
         }
+
+        //Prepare the USB module to send the data packet to the host
+        USBInHandle[usbInNext] = HIDTxPacket(CUSTOM_DEVICE_HID_EP, report, SWITCH_REPORT_SIZE);
+        usbInNext ^= 1;
+
+        // any switch report restarts the heartbeat's idle duration
+        idleStart = (uint16_t)USBGet1msTickCount();
     }
-}
\ No newline at end of file
+}
+
+/*********************************************************************
+* Function: void USBHIDCBGetReportHandler(void);
+*
+* Overview: Answers GET_REPORT on EP0 from the state debounced on the
+*   last tick, a synchronous read in one control transfer with no
+*   interrupt OUT request and IN reply. Input report 1 is the switch
+*   report as the interrupt endpoint sends it. Feature report 3 has
+*   the report queue drop count after the sequence number and the
+*   frame number last, where older hosts do not look. Feature report
+*   4 is a snapshot of the interrupt accounting, see ISR_STATS in
+*   system.h; taking it clears the maxima so each read shows the
+*   worst case since the one before. Feature report 5 does the same
+*   for the main loop timing, LOOP_STATS in system.h. Feature report
+*   6 has the settle window and the sampling settings. Feature report
+*   7 is a snapshot of the bounce learning, BOUNCE_STATS in system.h.
+*   Anything else is left unclaimed and the stack stalls it.
+*
+* PreCondition: Called from USBCheckHIDRequest() in the USB interrupt;
+*   main.c updates the state with the USB interrupt masked, and
+*   SYS_InterruptHigh() leaves the stack alone while it is.
+*
+* Input: None
+*
+* Output: None
+*
+********************************************************************/
+void USBHIDCBGetReportHandler()
+{
+    uint8_t length;
+    uint8_t i;
+
+    if (SetupPkt.W_Value.byte.HB == HID_REPORT_TYPE_FEATURE && SetupPkt.W_Value.byte.LB == REPORT_ID_ISR_STATS) {
+        // the accounting is only written from the interrupt this runs in
+        statsReportData[0] = REPORT_ID_ISR_STATS;
+        memcpy(&statsReportData[1], (const void*)isrStats, ISR_REPORT_SIZE - 1);
+        for (i = 0; i < ISR_STATS_COUNT; i++) {
+            isrStats[i].maxCycles = 0;
+        }
+        USBEP0SendRAMPtr(statsReportData, ISR_REPORT_SIZE, USB_EP0_INCLUDE_ZERO);
+        return;
+    }
+
+    if (SetupPkt.W_Value.byte.HB == HID_REPORT_TYPE_FEATURE && SetupPkt.W_Value.byte.LB == REPORT_ID_LOOP_STATS) {
+        // the tick interrupt writes the tick counts, main.c the rest with this one masked
+        statsReportData[0] = REPORT_ID_LOOP_STATS;
+        memcpy(&statsReportData[1], (const void*)&loopStats, LOOP_REPORT_SIZE - 1);
+        loopStats.pickupMax = 0;
+        loopStats.passMax = 0;
+        USBEP0SendRAMPtr(statsReportData, LOOP_REPORT_SIZE, USB_EP0_INCLUDE_ZERO);
+        return;
+    }
+
+    if (SetupPkt.W_Value.byte.HB == HID_REPORT_TYPE_FEATURE && SetupPkt.W_Value.byte.LB == REPORT_ID_BOUNCE_STATS) {
+        // main.c writes it with this interrupt masked
+        statsReportData[0] = REPORT_ID_BOUNCE_STATS;
+        memcpy(&statsReportData[1], (const void*)&bounceStats, BOUNCE_REPORT_SIZE - 1);
+        USBEP0SendRAMPtr(statsReportData, BOUNCE_REPORT_SIZE, USB_EP0_INCLUDE_ZERO);
+        return;
+    }
+
+    if (SetupPkt.W_Value.byte.HB == HID_REPORT_TYPE_FEATURE && SetupPkt.W_Value.byte.LB == REPORT_ID_SETTINGS) {
+        getReportData[0] = REPORT_ID_SETTINGS;
+        getReportData[1] = settleWindow;
+        getReportData[2] = sampleSettings.tickUnits;
+        getReportData[3] = sampleSettings.debounceSamples;
+        USBEP0SendRAMPtr(getReportData, SETTINGS_REPORT_SIZE, USB_EP0_INCLUDE_ZERO);
+        return;
+    }
+
+    // offsets past the switch bytes
+    if (SetupPkt.W_Value.byte.HB == HID_REPORT_TYPE_INPUT && SetupPkt.W_Value.byte.LB == REPORT_ID_SWITCHES) {
+        getReportData[SWITCH_BYTES + 4] = (uint8_t)switchFrame;
+        getReportData[SWITCH_BYTES + 5] = (uint8_t)(switchFrame >> 8);
+        length = SWITCH_REPORT_SIZE;
+    } else if (SetupPkt.W_Value.byte.HB == HID_REPORT_TYPE_FEATURE && SetupPkt.W_Value.byte.LB == REPORT_ID_STATE) {
+        getReportData[SWITCH_BYTES + 4] = reportQueueDrops;
+        getReportData[SWITCH_BYTES + 5] = (uint8_t)switchFrame;
+        getReportData[SWITCH_BYTES + 6] = (uint8_t)(switchFrame >> 8);
+        length = STATE_REPORT_SIZE;
+    } else {
+        return;
+    }
+
+    getReportData[0] = SetupPkt.W_Value.byte.LB;
+    memcpy(&getReportData[1], switchStates, SWITCH_BYTES);
+    getReportData[SWITCH_BYTES + 1] = (uint8_t)switchTimestamp;
+    getReportData[SWITCH_BYTES + 2] = (uint8_t)(switchTimestamp >> 8);
+    getReportData[SWITCH_BYTES + 3] = switchSequence;
+
+    USBEP0SendRAMPtr(getReportData, length, USB_EP0_INCLUDE_ZERO);
+}
+
+/*********************************************************************
+* Function: void USBHIDCBSetIdleRateHandler(uint8_t reportId, uint8_t newIdleRate);
+*
+* Overview: Takes the idle duration from a HID SET_IDLE request for
+*   report 1, or for all reports, as the heartbeat period. While it
+*   is not 0 the current switch report is repeated whenever no
+*   report has gone out for newIdleRate * 4 ms, so a quiet stick
+*   still shows the host it is alive.
+*
+* PreCondition: Called from USBCheckHIDRequest() in the USB interrupt.
+*
+* Input: reportId - report ID from the request, 0 for all reports
+*        newIdleRate - idle duration in 4 ms units, 0 = indefinite
+*
+* Output: None
+*
+********************************************************************/
+void USBHIDCBSetIdleRateHandler(uint8_t reportId, uint8_t newIdleRate)
+{
+    if (reportId == 0 || reportId == REPORT_ID_SWITCHES) {
+        idleRate = newIdleRate;
+    }
+}
+
+/*********************************************************************
+* Function: void USBCBSendResume(void);
+*
+* Overview: Sends USB remote wakeup signalling. Takes the SIE out of
+*   suspend, waits out the 5 ms of bus idle the USB spec requires
+*   before a remote wakeup (the stack suspends after 3 ms), then
+*   drives resume (K state) for 2 ms, inside the spec's 1 to 15 ms.
+*   The host answers with its own 20 ms of resume signalling, which
+*   raises ACTVIF and brings the stack out of suspend as a host
+*   resume does. USB interrupts stay masked throughout so an IDLEIF
+*   cannot suspend the SIE again while it is driving resume.
+*
+* PreCondition: The bus is suspended and the host has enabled remote
+*   wakeup; blocks the main loop for about 4 ms.
+*
+* Input: None
+*
+* Output: None
+*
+********************************************************************/
+void USBCBSendResume(void)
+{
+    USBMaskInterrupts();
+
+    USBSuspendControl = 0;
+    USBBusIsSuspended = false;
+    __delay_ms(2);
+
+    USBResumeControl = 1;
+    __delay_ms(2);
+    USBResumeControl = 0;
+
+    USBUnmaskInterrupts();
+}
@@ -62,3 +62,50 @@ void APP_DeviceCustomHIDStart(void);
 *
 ********************************************************************/
 void APP_DeviceCustomHIDTasks(void);
+
+/*********************************************************************
+* Function: void USBHIDCBGetReportHandler(void);
+*
+* Overview: Answers a HID GET_REPORT request on EP0 for input report 1
+*   or feature report 3 with the current debounced state.
+*
+* PreCondition: Called from USBCheckHIDRequest() while a GET_REPORT
+*   SETUP packet is being handled.
+*
+* Input: None
+*
+* Output: None
+*
+********************************************************************/
+void USBHIDCBGetReportHandler(void);
+
+/*********************************************************************
+* Function: void USBHIDCBSetIdleRateHandler(uint8_t reportId, uint8_t newIdleRate);
+*
+* Overview: Sets the heartbeat period from a HID SET_IDLE request.
+*
+* PreCondition: Called from USBCheckHIDRequest() while a SET_IDLE
+*   SETUP packet is being handled.
+*
+* Input: reportId - report ID from the request, 0 for all reports
+*        newIdleRate - idle duration in 4 ms units, 0 = indefinite
+*
+* Output: None
+*
+********************************************************************/
+void USBHIDCBSetIdleRateHandler(uint8_t reportId, uint8_t newIdleRate);
+
+/*********************************************************************
+* Function: void USBCBSendResume(void);
+*
+* Overview: Sends USB remote wakeup signalling to the host.
+*
+* PreCondition: USBIsBusSuspended() and USBGetRemoteWakeupStatus()
+*   are both true.
+*
+* Input: None
+*
+* Output: None
+*
+********************************************************************/
+void USBCBSendResume(void);
@@ -22,12 +22,18 @@ please contact mla_licensing@microchip.com
 
 #define FIXED_ADDRESS_MEMORY
 
+// IN reports are sent straight from the report queue, 16 x 7 bytes filling 0x20A0-0x210F,
+// or with SWITCH_BYTES > 1 8 records of up to 14 bytes; the refresh answer, as long as one
+// record, follows it at 0x2110, still inside the dual-port RAM
+
 #if(__XC8_VERSION < 2000)
     #define HID_CUSTOM_OUT_DATA_BUFFER_ADDRESS @0x2050
-    #define HID_CUSTOM_IN_DATA_BUFFER_ADDRESS @0x20A0
+    #define HID_CUSTOM_IN_QUEUE_ADDRESS @0x20A0
+    #define HID_CUSTOM_IN_DATA_BUFFER_ADDRESS @0x2110
 #else
     #define HID_CUSTOM_OUT_DATA_BUFFER_ADDRESS __at(0x2050)
-    #define HID_CUSTOM_IN_DATA_BUFFER_ADDRESS __at(0x20A0)
+    #define HID_CUSTOM_IN_QUEUE_ADDRESS __at(0x20A0)
+    #define HID_CUSTOM_IN_DATA_BUFFER_ADDRESS __at(0x2110)
 #endif
 
 #endif //FIXED_MEMORY_ADDRESS
\ No newline at end of file
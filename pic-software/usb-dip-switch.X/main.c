@@ -2,6 +2,8 @@
 // includes
 //
 
+#include <string.h>
+
 #include "system.h"
 
 #include "usb.h"
@@ -21,6 +23,33 @@ enum {
 };
 
 
+// port nibble to report bits permutation tables, generated from SWITCH_MAP_x in system.h;
+// the other nibble's pins are read as high (switch open) so they contribute nothing
+#define NIBBLE_LO(map, n) ((uint8_t)(map(0xF0 | (n))))
+#define NIBBLE_HI(map, n) ((uint8_t)(map(((n) << 4) | 0x0F)))
+#define NIBBLE_TABLE(entry, map) { \
+    entry(map, 0x0), entry(map, 0x1), entry(map, 0x2), entry(map, 0x3), \
+    entry(map, 0x4), entry(map, 0x5), entry(map, 0x6), entry(map, 0x7), \
+    entry(map, 0x8), entry(map, 0x9), entry(map, 0xA), entry(map, 0xB), \
+    entry(map, 0xC), entry(map, 0xD), entry(map, 0xE), entry(map, 0xF) }
+
+// SampleSwitches() only looks up the nibbles that carry switches on this board
+#if (SWITCH_MAP_A(0xF0) != 0) || (SWITCH_MAP_B(0xF0) != 0)
+#error "a switch on RA0-3 or RB0-3 needs its nibble table in SampleSwitches()"
+#endif
+
+// watchdog period while asleep in USB suspend, 1:1024 of the 31 kHz LFINTOSC = 32 ms: how
+// often the switches without interrupt-on-change are looked at. Not needed when every
+// switch pin has IOC and there is no 74HC165 chain
+#define WDT_SLEEP_PERIOD (0x05 << 1)
+#define WDT_SLEEP_POLL   ((SWITCH_POLLED != 0) || (SWITCH_BYTES > 1))
+
+// sampling settings in high-endurance flash: SETTINGS_MAGIC, the tick, the debounce samples
+// and the two's complement of their sum
+#define SETTINGS_MAGIC   0xA5
+#define SETTINGS_LENGTH  4
+
+
 //-----------------------------------------------------------------------------------------------
 // typedefs
 //
@@ -30,31 +59,109 @@ enum {
 // prototypes
 //
 
-uint8_t ProcessButton (uint8_t which, uint8_t sw);
+void SampleSwitches (uint8_t *sample);
+bool DebounceSwitches (const uint8_t *sample);
+bool SwitchesDiffer (const uint8_t *a, const uint8_t *b);
+bool ReportQueuePush (const uint8_t *switches, uint8_t sequence, uint16_t timestamp, uint16_t frame);
+void SleepWhileSuspended (void);
+void LoopStatsAdd (volatile uint16_t *histogram, volatile uint16_t *max, uint16_t cycles);
+void LoadSampleSettings (void);
+void BounceTrack (uint8_t i, uint8_t delta, uint8_t toggle);
+void BounceLearn (uint8_t s, uint8_t bounce);
+void SetSwitchBounce (uint8_t s, uint8_t bounce);
+void BounceRestart (bool relearn);
 
 
 //-----------------------------------------------------------------------------------------------
 // globals
 //
 
-// flag from timer isr to main to execute 250 Hz / 4 ms tick
-volatile uint8_t flag250 = 0;  
+// flag from timer isr to main to execute the tick, 1 ms unless the host set another
+volatile uint8_t flagTick = 0;  
 
-// 1.5 second period led timer counter
-uint16_t ledTimer = 0;
+// flag to main to run the USB tasks, from the USB isr or from the tick when it leaves a
+// record or a heartbeat for them
+volatile uint8_t flagUsb = 0;
 
-// local variables for deciding to make a USB report or not
-uint8_t reportNeeded;
-uint8_t thisUsbReportData[1];
-uint8_t lastUsbReportData[1];
+// main loop timing, read by the host as feature report 5. tickStamp is TMR1 at the latest
+// tick interrupt, tickStampValid false until there is one to time the next tick against
+volatile LOOP_STATS loopStats;
+volatile uint16_t tickStamp;
+volatile uint8_t tickStampValid;
 
-// variables used to communicate report to USB ISR
-volatile uint8_t usbReportNeeded = false;
-volatile uint8_t usbReportData[1];
-volatile uint8_t hostRequestedUsbReport = false;
+// tick period and debounce depth in use, and the tick in TMR1 cycles for the lost tick
+// count; tickCycles is only written with the tick interrupt off
+SAMPLE_SETTINGS sampleSettings;
+uint16_t tickCycles;
+
+// 1.5 second period led timer counter, in TICK_UNIT_US so it keeps time at any tick
+#define LED_MS(ms) ((uint16_t)(ms) * TICK_UNITS_PER_MS)
+uint16_t ledTimer = 0;
 
-// button debounce states
-uint8_t buttonStates[8];
+// local variables for deciding to make a USB report or not; lastUsbReportData is the last
+// state queued for the host, droppedUsbReportData the last one the full queue turned away
+uint8_t thisUsbReportData[SWITCH_BYTES];
+uint8_t lastUsbReportData[SWITCH_BYTES];
+uint8_t droppedUsbReportData[SWITCH_BYTES];
+
+// single producer, single consumer queue of switch changes from the sampler to
+// APP_DeviceCustomHIDTasks(); only the sampler writes the head, only the USB task the tail.
+// The records live in USB RAM, see app_device_custom_hid.c
+extern volatile SWITCH_RECORD reportQueue[REPORT_QUEUE_SIZE];
+volatile uint8_t reportQueueHead;
+volatile uint8_t reportQueueTail;
+volatile uint8_t reportQueueDrops;
+
+// sequence number, USB 1 ms tick count and frame number of the newest settled change; the
+// sequence counts every change, queued or not, so the host sees a gap for each one it missed
+uint8_t switchSequence;
+uint16_t switchTimestamp;
+uint16_t switchFrame;
+
+// settle window: its length in ms, how long the debounced switches have been still while
+// they differ from switchStates in TICK_UNIT_US, and the host's request to let the change
+// through now. settleWindow and settleForce are written by the USB task in the main loop
+uint8_t settleWindow;
+uint16_t settleTime;
+uint8_t settleForce;
+
+// heartbeat: the SET_IDLE duration in 4 ms units, 0 = only report changes, and the USB 1 ms
+// tick count when the last switch report was armed. idleRate is written from the USB
+// interrupt, a single byte the tick reads in one go
+uint8_t idleRate;
+uint16_t idleStart;
+extern uint8_t refreshRequested;
+
+// switch port permutation tables
+const uint8_t switchMapAHi[16] = NIBBLE_TABLE(NIBBLE_HI, SWITCH_MAP_A);
+const uint8_t switchMapBHi[16] = NIBBLE_TABLE(NIBBLE_HI, SWITCH_MAP_B);
+const uint8_t switchMapCLo[16] = NIBBLE_TABLE(NIBBLE_LO, SWITCH_MAP_C);
+const uint8_t switchMapCHi[16] = NIBBLE_TABLE(NIBBLE_HI, SWITCH_MAP_C);
+
+// debounced switch states and vertical debounce counter, one bit per switch in report
+// bit order; bit n of byte b of the counter planes holds the count of consecutive samples of
+// that switch that disagree with its debounced state, and of the depth planes its debounce
+// samples less one. switchStates is what the host sees, the debounced states once they have
+// been still for the settle window
+uint8_t debounceStates[SWITCH_BYTES];
+uint8_t switchStates[SWITCH_BYTES];
+uint8_t debounceCount0[SWITCH_BYTES];
+uint8_t debounceCount1[SWITCH_BYTES];
+uint8_t debounceCount2[SWITCH_BYTES];
+uint8_t debounceDepth0[SWITCH_BYTES];
+uint8_t debounceDepth1[SWITCH_BYTES];
+uint8_t debounceDepth2[SWITCH_BYTES];
+
+// bounce learning, read by the host as feature report 7. bounceActive has the switches in a
+// transition, from their first disagreeing sample to the change or to the glitch running
+// out, bounceTiming those and the ones that changed less than BOUNCE_WINDOW ticks ago, and
+// bounceAge the ticks since either began. bounceQuiet counts a switch's changes in a row
+// that bounced less than it has learned
+volatile BOUNCE_STATS bounceStats;
+uint8_t bounceActive[SWITCH_BYTES];
+uint8_t bounceTiming[SWITCH_BYTES];
+uint8_t bounceAge[SWITCH_COUNT];
+uint8_t bounceQuiet[SWITCH_COUNT];
 
 
 //-----------------------------------------------------------------------------------------------
@@ -65,6 +172,8 @@ MAIN_RETURN main(void)
 {
     uint8_t i;
     uint8_t newUsbState;
+    uint8_t sample[SWITCH_BYTES];
+    uint16_t passStart, passEnd, pickup;
     
     SYSTEM_Initialize(SYSTEM_STATE_USB_START);
 
@@ -96,29 +205,72 @@ MAIN_RETURN main(void)
     TRISCbits.TRISC6 = 1;
     TRISCbits.TRISC3 = 1;
 #endif
+
+#if (SWITCH_BYTES > 1)
+    // 74HC165 chain: SH/LD idles high (shift), CLK low, QH in
+    SHIFT_LOAD = 1;
+    SHIFT_CLOCK = 0;
+    TRISCbits.TRISC2 = 0;
+    TRISCbits.TRISC1 = 0;
+    TRISCbits.TRISC0 = 1;
+#endif
     
     // configure USB
     USBDeviceInit();
     USBDeviceAttach();
     
-    // configure TMR2
+    // configure TMR1 and TMR2, the tick from the settings in flash
+    LoadSampleSettings ();
+    TMR1_Initialize ();
     TMR2_Initialize ();
 
-    // zero button states
-	for (i = 0; i < 8; i++) {
-		buttonStates[i] = 0;
-	}
+    // zero switch states
+    for (i = 0; i < SWITCH_BYTES; i++) {
+        debounceStates[i] = 0;
+        switchStates[i] = 0;
+        debounceCount0[i] = 0;
+        debounceCount1[i] = 0;
+        debounceCount2[i] = 0;
+    }
+    for (i = 0; i < BOUNCE_HIST_BINS; i++) {
+        bounceStats.histogram[i] = 0;
+    }
+    BounceRestart (true);
     
     // usb reporting variables
-    reportNeeded = false;
-    usbReportNeeded = false;
-    for (i = 0; i < 1; i++) {
+    reportQueueHead = 0;
+    reportQueueTail = 0;
+    reportQueueDrops = 0;
+    switchSequence = 0;
+    switchTimestamp = 0;
+    switchFrame = 0;
+    settleWindow = SETTLE_MS;
+    settleTime = 0;
+    settleForce = false;
+    idleRate = 0;
+    idleStart = 0;
+    for (i = 0; i < SWITCH_BYTES; i++) {
         thisUsbReportData[i] = 0;
         lastUsbReportData[i] = 0;
-        usbReportData[i] = 0;
+        droppedUsbReportData[i] = 0;
     }
 
     while(1) {
+#if defined(USB_INTERRUPT)
+        // all the main loop's work comes from the TMR2 tick and the USB interrupt, so wait
+        // for one of them. The PIC16F1459 has no idle mode and SLEEP stops the clock the
+        // SIE runs from, so the wait is a tight spin on the flags; an interrupt's work is
+        // picked up within a few cycles of its return rather than after whatever was left
+        // of a full pass
+        while (flagTick == 0 && flagUsb == 0) {
+            SYSTEM_Idle();
+        }
+        flagUsb = 0;
+#endif
+
+        // the pass is timed from here, the wait for an interrupt before it is not
+        TMR1_READ(passStart);
+
         SYSTEM_Tasks();
 
         #if defined(USB_POLLING)
@@ -139,12 +291,22 @@ MAIN_RETURN main(void)
 
         //Application specific tasks
         APP_DeviceCustomHIDTasks();
+
+        // nothing to do while the bus is suspended but watch the switches, asleep
+        if (USBIsDeviceSuspended() == true) {
+            SleepWhileSuspended ();
+        }
         
         
-        // run 200 Hz tasks
-        if (flag250) {
+        // run the tick's tasks
+        if (flagTick) {
             // clear flag
-            flag250 = 0;
+            flagTick = 0;
+
+            // from the tick interrupt to here; the stamp only moves again on the next tick,
+            // and a pass still this far back when that comes is an overrun anyway
+            TMR1_READ(pickup);
+            pickup -= tickStamp;
             
             // get current USB state
             if (USBIsDeviceSuspended() == true) {
@@ -155,101 +317,527 @@ MAIN_RETURN main(void)
                 newUsbState = USB_CONNECTED;
             }
             
-            // blink led
-            if (ledTimer == 0) {
+            // blink led, once powered, twice connected, three times configured; the timer
+            // moves a tick at a time, so each blink is a span of it rather than one count
+            if (ledTimer < LED_MS(144)) {
                 USER_LED = LED_ON;
-            } else if (ledTimer == 36) {
+            } else if (ledTimer < LED_MS(288)) {
                 USER_LED = LED_OFF;
-            } else if ((ledTimer == 72) && (newUsbState >= USB_CONNECTED)) {
-                USER_LED = LED_ON;
-            } else if (ledTimer == 108) {
+            } else if (ledTimer < LED_MS(432)) {
+                USER_LED = (newUsbState >= USB_CONNECTED) ? LED_ON : LED_OFF;
+            } else if (ledTimer < LED_MS(576)) {
                 USER_LED = LED_OFF;
-            } else if ((ledTimer == 144) && (newUsbState >= USB_CONFIGURED)) {
-                USER_LED = LED_ON;
-            } else if (ledTimer == 180) {
+            } else if (ledTimer < LED_MS(720)) {
+                USER_LED = (newUsbState >= USB_CONFIGURED) ? LED_ON : LED_OFF;
+            } else {
                 USER_LED = LED_OFF;
             }
             
-            // increment led timer counter, 1.5 second period
-            if (++ledTimer >= 375) {
+            // advance led timer counter, 1.5 second period
+            ledTimer += sampleSettings.tickUnits;
+            if (ledTimer >= LED_MS(1500)) {
                 ledTimer = 0;
             }
 
-			// clear USB report data
-			for (i = 0; i < 1; i++) {
-				thisUsbReportData[i] = 0;
+			// sample and debounce all switches at once. A change is held until no switch has
+			// changed for the settle window, or the host asks for it, then becomes the state
+			// the host sees and is stamped. GET_REPORT is answered from the USB interrupt,
+			// keep it from seeing new switch states without their sequence number and
+			// timestamp, nor the loop statistics half updated
+			SampleSwitches (sample);
+			USBMaskInterrupts ();
+			LoopStatsAdd (loopStats.pickup, &loopStats.pickupMax, pickup);
+			if (DebounceSwitches (sample)) {
+				settleTime = 0;
 			}
-
-			// sample and process buttons
-#ifdef DEV_BOARD        
-			thisUsbReportData[0] |= ProcessButton (6, SW2);
-#else
-			thisUsbReportData[0] |= ProcessButton (7, SW1);
-			thisUsbReportData[0] |= ProcessButton (6, SW2);
-			thisUsbReportData[0] |= ProcessButton (5, SW3);
-			thisUsbReportData[0] |= ProcessButton (4, SW4);
-			thisUsbReportData[0] |= ProcessButton (3, SW5);
-			thisUsbReportData[0] |= ProcessButton (2, SW6);
-			thisUsbReportData[0] |= ProcessButton (1, SW7);
-			thisUsbReportData[0] |= ProcessButton (0, SW8);
-#endif
-
-			// check if report needed
-            reportNeeded = false;
-            if (hostRequestedUsbReport) {
-                hostRequestedUsbReport = false;
-                reportNeeded = true;
-            }
-            if (thisUsbReportData[0] != lastUsbReportData[0]) {
-                reportNeeded = true;
-            }
-
-			// save key presses for the next time around
-			lastUsbReportData[0] = thisUsbReportData[0];
-
-			// send report to USB code
-			if (reportNeeded) {                
-				usbReportNeeded = true;
-				for (i = 0; i < 1; i++) {
-					usbReportData[i] = thisUsbReportData[i];
+			if (SwitchesDiffer (debounceStates, switchStates)) {
+				if (settleTime >= (uint16_t)settleWindow * TICK_UNITS_PER_MS || settleForce) {
+					memcpy (switchStates, debounceStates, SWITCH_BYTES);
+					switchSequence++;
+					switchTimestamp = (uint16_t)USBGet1msTickCount ();
+					switchFrame = usbFrameNumber;
+				} else {
+					settleTime += sampleSettings.tickUnits;
 				}
 			}
+			settleForce = false;
+			USBUnmaskInterrupts ();
+			memcpy (thisUsbReportData, switchStates, SWITCH_BYTES);
+
+			// queue a change record; if the queue is full the change stays pending and is
+			// retried on the next tick, and the transition it replaced is counted as dropped
+            if (SwitchesDiffer (thisUsbReportData, lastUsbReportData)) {
+                if (ReportQueuePush (thisUsbReportData, switchSequence, switchTimestamp, switchFrame)) {
+                    memcpy (lastUsbReportData, thisUsbReportData, SWITCH_BYTES);
+                    flagUsb = 1;
+                } else if (SwitchesDiffer (thisUsbReportData, droppedUsbReportData)) {
+                    memcpy (droppedUsbReportData, thisUsbReportData, SWITCH_BYTES);
+                    if (reportQueueDrops != 0xFF) {
+                        reportQueueDrops++;
+                    }
+                }
+            }
+
+            // repeat the current report once the host has gone the idle duration without
+            // one, through the refresh path so it carries the sequence number of the last
+            // change and the host can tell it from a new one
+            if (idleRate != 0 && (uint16_t)((uint16_t)USBGet1msTickCount () - idleStart) >= ((uint16_t)idleRate << 2)) {
+                refreshRequested = true;
+                flagUsb = 1;
+            }
         }        
+
+        TMR1_READ(passEnd);
+        USBMaskInterrupts ();
+        LoopStatsAdd (loopStats.pass, &loopStats.passMax, passEnd - passStart);
+        USBUnmaskInterrupts ();
     }
 }
 
 
+// free-running instruction cycle counter for the interrupt accounting: Fosc/4, 1:1, no
+// interrupt; it wraps every 5.46 ms, far longer than any one interrupt
+void TMR1_Initialize (void)
+{
+    T1CON = 0x00;
+    TMR1H = 0;
+    TMR1L = 0;
+    T1CONbits.TMR1ON = 1;
+}
+
+
 void TMR2_Initialize (void)
 {
     PR2 = TMR2_PERIOD;
     TMR2 = 0x00;
     PIR1bits.TMR2IF = 0;
+    TMR2_SetTick (sampleSettings.tickUnits);
+}
+
+
+// the tick in TMR2 periods, through the postscaler. A write to T2CON clears the postscaler,
+// so the first tick at the new rate comes a full tick after what is left of the period;
+// the gap to it is neither tick, so the lost tick count skips it
+void TMR2_SetTick (uint8_t units)
+{
+    PIE1bits.TMR2IE = 0;
+    T2CON = TMR2_CONTROL | TMR2_POSTSCALE(units);
+    tickCycles = units * TICK_UNIT_CYCLES;
+    tickStampValid = false;
     PIE1bits.TMR2IE = 1;
-    T2CON = 0x5E;
 }
 
 
+// a tick that finds the one before still untaken is an overrun of the main loop. A tick
+// interrupt held off past the next TMR2 match, by USB servicing or with interrupts
+// disabled, loses that match altogether, which only shows as a gap of more than one period
+// since the tick before; TMR1 wraps after 5.46 ms, two and a half of the slowest ticks and
+// longer than anything but a flash write holds one off. With SWITCH_SAMPLE_SOF the first SOF
+// after a reset or resume can stretch one gap by up to a period as it moves the tick, and
+// counts one tick lost
 void TMR2_InterruptHandler (void)
 {
+    uint16_t now, gap;
+
     PIR1bits.TMR2IF = 0;
-    flag250 = 1;
+    TMR1_READ(now);
+
+    if (flagTick) {
+        loopStats.overruns++;
+    }
+    if (tickStampValid) {
+        for (gap = now - tickStamp; gap > tickCycles + tickCycles / 2; gap -= tickCycles) {
+            loopStats.lostTicks++;
+        }
+    }
+    tickStamp = now;
+    tickStampValid = true;
+
+    flagTick = 1;
+}
+
+
+// append a change record to the report queue, false if the queue is full. The record is
+// written in place in USB RAM, ready for the SIE, before the head moves so the consumer
+// never sees a half-written entry.
+bool ReportQueuePush (const uint8_t *switches, uint8_t sequence, uint16_t timestamp, uint16_t frame)
+{
+    uint8_t head, i;
+
+    head = reportQueueHead;
+    if ((uint8_t)(head - reportQueueTail) >= REPORT_QUEUE_SIZE) {
+        return false;
+    }
+
+    reportQueue[head & REPORT_QUEUE_MASK].reportId = 0x01;
+    for (i = 0; i < SWITCH_BYTES; i++) {
+        reportQueue[head & REPORT_QUEUE_MASK].switches[i] = switches[i];
+    }
+    reportQueue[head & REPORT_QUEUE_MASK].timestamp = timestamp;
+    reportQueue[head & REPORT_QUEUE_MASK].sequence = sequence;
+    reportQueue[head & REPORT_QUEUE_MASK].frame = frame;
+    reportQueueHead = head + 1;
+
+    return true;
+}
+
+
+// sleep until the bus resumes or a switch moves. Only once every change is debounced, settled
+// and queued: a switch that disagrees with its debounced state, a change in its settle
+// window, or one still waiting for room in the queue, keeps the tick running; a debounce
+// count cut short by sleep would have been reset by the agreeing sample anyway. IOC pins
+// wake the core on either edge, the rest are compared on each watchdog wake. Interrupts are
+// off while asleep, a USB interrupt that wakes the core is taken once they are back on.
+void SleepWhileSuspended (void)
+{
+    uint8_t sample[SWITCH_BYTES];
+    uint8_t i;
+
+    SampleSwitches (sample);
+    if (SwitchesDiffer (switchStates, lastUsbReportData) || SwitchesDiffer (debounceStates, switchStates) ||
+            SwitchesDiffer (sample, debounceStates)) {
+        return;
+    }
+
+    USER_LED = LED_OFF;
+
+    // the sleep can last any time, the next transition is no bounce of the last change
+    for (i = 0; i < SWITCH_BYTES; i++) {
+        bounceActive[i] = 0;
+        bounceTiming[i] = 0;
+    }
+
+    // TMR2 stops in sleep, a pending tick must not wake the core straight away
+    INTCONbits.GIE = 0;
+    PIE1bits.TMR2IE = 0;
+    INTCONbits.IOCIE = 1;
+#if (WDT_SLEEP_POLL)
+    WDTCON = WDT_SLEEP_PERIOD | 0x01;
+#endif
+
+    while (1) {
+        // clear before looking, an edge after the comparison makes SLEEP return at once
+        IOCAF = 0;
+        IOCBF = 0;
+        if (USBIsDeviceSuspended() == false || PIR2bits.USBIF == 1) {
+            break;
+        }
+        SampleSwitches (sample);
+        if (SwitchesDiffer (sample, debounceStates)) {
+            break;
+        }
+        SLEEP ();
+        NOP ();
+    }
+
+#if (WDT_SLEEP_POLL)
+    WDTCON = WDT_SLEEP_PERIOD;
+#endif
+    INTCONbits.IOCIE = 0;
+    PIR1bits.TMR2IF = 0;
+    tickStampValid = false;
+    PIE1bits.TMR2IE = 1;
+    INTCONbits.GIE = 1;
 }
 
 
-uint8_t ProcessButton (uint8_t which, uint8_t sw)
+// latch each switch port once, and the 74HC165 chain's inputs right after, so all switches
+// come from the same instant, then map the pins to report bit order through the nibble
+// tables, no per-switch branches or shifts. The chain then shifts out a bit at a time, each
+// register's input H first
+void SampleSwitches (uint8_t *sample)
 {
-	uint8_t state;
+    uint8_t a, b, c;
+#if (SWITCH_BYTES > 1)
+    uint8_t i, bit, bits;
+#endif
+
+    a = PORTA;
+    b = PORTB;
+    c = PORTC;
+#if (SWITCH_BYTES > 1)
+    SYSTEM_ShiftLoad ();
+#endif
+
+    sample[0] = switchMapAHi[a >> 4] | switchMapBHi[b >> 4] | switchMapCLo[c & 0x0F] | switchMapCHi[c >> 4];
+
+#if (SWITCH_BYTES > 1)
+    for (i = 1; i < SWITCH_BYTES; i++) {
+        bits = 0;
+        for (bit = 0; bit < 8; bit++) {
+            bits <<= 1;
+            if (SHIFT_DATA == 0) {
+                bits |= 1;
+            }
+            SYSTEM_ShiftClock ();
+        }
+        sample[i] = bits;
+    }
+#endif
+}
+
+
+// vertical counter debounce: a switch changes state once its depth of consecutive samples
+// disagree with its current state, any agreeing sample restarts its count. Eight switches at
+// a time are handled in parallel with a few byte-wide logic operations: the three counter
+// planes count 0 to 7 per switch, and a switch toggles when its count already holds one
+// sample less than its depth, matched against its bits of the depth planes, so every switch
+// can have a depth of its own at no extra cost. With 2 samples this is the same as the old
+// per-switch 4-state ProcessButton() machine. Switches in or just past a transition then go
+// to the bounce learning. Returns true if any debounced state changed.
+bool DebounceSwitches (const uint8_t *sample)
+{
+    uint8_t i, delta, toggle, changed;
+
+    changed = 0;
+    for (i = 0; i < SWITCH_BYTES; i++) {
+        delta = sample[i] ^ debounceStates[i];
+
+        toggle = delta & ~(debounceCount0[i] ^ debounceDepth0[i]) &
+                 ~(debounceCount1[i] ^ debounceDepth1[i]) & ~(debounceCount2[i] ^ debounceDepth2[i]);
+        debounceCount2[i] = (debounceCount2[i] ^ (debounceCount1[i] & debounceCount0[i])) & delta & ~toggle;
+        debounceCount1[i] = (debounceCount1[i] ^ debounceCount0[i]) & delta & ~toggle;
+        debounceCount0[i] = ~debounceCount0[i] & delta & ~toggle;
+
+        debounceStates[i] ^= toggle;
+        changed |= toggle;
+
+        if ((delta | bounceTiming[i]) != 0) {
+            BounceTrack (i, delta, toggle);
+        }
+    }
+
+    return changed != 0;
+}
+
+
+// bounce timing for the switches of report byte i, from the tick's disagreeing and changed
+// bits; only switches in or just past a transition get here, so a still stick pays one test
+// per byte. A transition's bounce is its ticks from the first disagreeing sample to the
+// start of the run of depth samples that changed the switch. One that starts within
+// BOUNCE_WINDOW ticks of the last change means that change came from a stretch of bounce
+// the depth was too short for, so the learned bounce is raised to at least that depth
+void BounceTrack (uint8_t i, uint8_t delta, uint8_t toggle)
+{
+    uint8_t mask, s, age, depth;
+
+    s = i << 3;
+    for (mask = 0x80; mask != 0; mask >>= 1, s++) {
+        if (((delta | bounceTiming[i]) & mask) == 0) {
+            continue;
+        }
+        age = bounceAge[s];
+
+        if ((bounceActive[i] & mask) == 0) {
+            if ((delta & mask) == 0) {
+                // still after a change, timed until past the window
+                if (++age >= BOUNCE_WINDOW) {
+                    bounceTiming[i] &= ~mask;
+                }
+                bounceAge[s] = age;
+                continue;
+            }
+            if (bounceTiming[i] & mask) {
+                if ((bounceStats.switches[s] & 0x0F) < (bounceStats.switches[s] >> 4)) {
+                    SetSwitchBounce (s, bounceStats.switches[s] >> 4);
+                }
+                bounceQuiet[s] = 0;
+            }
+            bounceActive[i] |= mask;
+            bounceTiming[i] |= mask;
+            age = 0;
+        }
+
+        // a transition picked up with its count already under way, after a glitch ran out,
+        // can change before its age reaches the depth
+        age++;
+        if (toggle & mask) {
+            depth = bounceStats.switches[s] >> 4;
+            BounceLearn (s, (age > depth) ? age - depth : 0);
+            bounceActive[i] &= ~mask;
+            age = 0;
+        } else if (age >= BOUNCE_WINDOW) {
+            bounceActive[i] &= ~mask;
+            bounceTiming[i] &= ~mask;
+        }
+        bounceAge[s] = age;
+    }
+}
+
+
+// one change's bounce in ticks: counted in the histogram in TICK_UNIT_US, then a longer
+// bounce than the switch has learned is taken at once and a shorter one only once
+// BOUNCE_DECAY_EDGES changes in a row have all been shorter, a tick at a time
+void BounceLearn (uint8_t s, uint8_t bounce)
+{
+    uint8_t bin, learned;
+    uint16_t units;
+
+    units = (uint16_t)bounce * sampleSettings.tickUnits;
+    bin = 0;
+    if (units != 0) {
+        for (bin = 1, units >>= 1; units != 0 && bin < BOUNCE_HIST_BINS - 1; bin++) {
+            units >>= 1;
+        }
+    }
+    bounceStats.histogram[bin]++;
+
+    learned = bounceStats.switches[s] & 0x0F;
+    if (bounce > learned) {
+        bounceQuiet[s] = 0;
+        SetSwitchBounce (s, bounce);
+    } else if (bounce == learned) {
+        bounceQuiet[s] = 0;
+    } else if (++bounceQuiet[s] >= BOUNCE_DECAY_EDGES) {
+        bounceQuiet[s] = 0;
+        SetSwitchBounce (s, learned - 1);
+    }
+}
+
+
+// a switch's learned bounce and the depth that goes with it, into its report byte and its
+// bits of the depth planes. Only called where its count is 0 or about to be, the new depth
+// never finds a count already past its match
+void SetSwitchBounce (uint8_t s, uint8_t bounce)
+{
+    uint8_t i, mask, depth;
+
+    if (bounce > 0x0F) {
+        bounce = 0x0F;
+    }
+    if (sampleSettings.debounceSamples != DEBOUNCE_ADAPTIVE) {
+        depth = sampleSettings.debounceSamples;
+    } else if (bounce < DEBOUNCE_ADAPT_MIN - 1) {
+        depth = DEBOUNCE_ADAPT_MIN;
+    } else if (bounce > DEBOUNCE_SAMPLES_MAX - 1) {
+        depth = DEBOUNCE_SAMPLES_MAX;
+    } else {
+        depth = bounce + 1;
+    }
+    bounceStats.switches[s] = (uint8_t)(depth << 4) | bounce;
+
+    i = s >> 3;
+    mask = 0x80 >> (s & 7);
+    depth--;
+    debounceDepth0[i] = (depth & 1) ? (debounceDepth0[i] | mask) : (debounceDepth0[i] & ~mask);
+    debounceDepth1[i] = (depth & 2) ? (debounceDepth1[i] | mask) : (debounceDepth1[i] & ~mask);
+    debounceDepth2[i] = (depth & 4) ? (debounceDepth2[i] | mask) : (debounceDepth2[i] & ~mask);
+}
+
+
+// every switch's depth afresh from the settings, and with relearn its bounce back to what
+// gives DEBOUNCE_ADAPT_START; transitions under way are forgotten. The counts must be 0
+void BounceRestart (bool relearn)
+{
+    uint8_t s;
 
-	state = buttonStates[which];
+    for (s = 0; s < SWITCH_BYTES; s++) {
+        bounceActive[s] = 0;
+        bounceTiming[s] = 0;
+    }
+    for (s = 0; s < SWITCH_COUNT; s++) {
+        if (relearn) {
+            bounceQuiet[s] = 0;
+            SetSwitchBounce (s, DEBOUNCE_ADAPT_START - 1);
+        } else {
+            SetSwitchBounce (s, bounceStats.switches[s] & 0x0F);
+        }
+    }
+}
 
-	switch (state) {
-		case 0: state = sw ? 1 : 0; break;
-		case 1: state = sw ? 2 : 0; break;
-		case 2: state = sw ? 2 : 3; break;
-		case 3: state = sw ? 2 : 0; break;
-	}
 
-	buttonStates[which] = state;
+// compare two switch sets as one word: the differences of all bytes ORed together and one
+// test at the end, no branch per byte
+bool SwitchesDiffer (const uint8_t *a, const uint8_t *b)
+{
+    uint8_t i, diff;
+
+    diff = 0;
+    for (i = 0; i < SWITCH_BYTES; i++) {
+        diff |= a[i] ^ b[i];
+    }
+
+    return diff != 0;
+}
+
+
+// count a time in one of the loopStats histograms and keep its maximum; called with the USB
+// interrupt masked, GET_REPORT for feature report 5 clears the maximum from there
+void LoopStatsAdd (volatile uint16_t *histogram, volatile uint16_t *max, uint16_t cycles)
+{
+    uint8_t bin;
+    uint16_t c;
+
+    c = cycles >> LOOP_HIST_SHIFT;
+    for (bin = 0; c != 0 && bin < LOOP_HIST_BINS - 1; bin++) {
+        c >>= 1;
+    }
+    histogram[bin]++;
+
+    if (cycles > *max) {
+        *max = cycles;
+    }
+}
+
+
+// the settings the host last set, or the build's defaults if flash holds none: erased,
+// written by other firmware, or cut short by a power loss
+void LoadSampleSettings (void)
+{
+    uint8_t data[SETTINGS_LENGTH];
+
+    SYSTEM_FlashRead (data, SETTINGS_LENGTH);
+    if (data[0] == SETTINGS_MAGIC && (uint8_t)(data[0] + data[1] + data[2] + data[3]) == 0 &&
+            data[1] >= 1 && data[1] <= TICK_UNITS_MAX &&
+            data[2] <= DEBOUNCE_SAMPLES_MAX) {
+        sampleSettings.tickUnits = data[1];
+        sampleSettings.debounceSamples = data[2];
+    } else {
+        sampleSettings.tickUnits = TICK_UNITS;
+        sampleSettings.debounceSamples = DEBOUNCE_SAMPLES;
+    }
+}
+
+
+// new settings restart every switch's count, one held over from another depth could run
+// past its match, and a new tick restarts the bounce learning, its ticks are no longer the
+// same length. The row is only rewritten when something changed, a host setting the same
+// values on every start costs no flash endurance and no stall
+bool SetSampleSettings (uint8_t tickUnits, uint8_t debounceSamples)
+{
+    uint8_t data[SETTINGS_LENGTH];
+    uint8_t i;
+    bool relearn;
+
+    if (tickUnits < 1 || tickUnits > TICK_UNITS_MAX || debounceSamples > DEBOUNCE_SAMPLES_MAX) {
+        return false;
+    }
+    if (tickUnits == sampleSettings.tickUnits && debounceSamples == sampleSettings.debounceSamples) {
+        return true;
+    }
+
+    relearn = tickUnits != sampleSettings.tickUnits;
+    if (relearn) {
+        sampleSettings.tickUnits = tickUnits;
+        TMR2_SetTick (tickUnits);
+    }
+    sampleSettings.debounceSamples = debounceSamples;
+
+    // feature report 7 is answered from the USB interrupt
+    USBMaskInterrupts ();
+    for (i = 0; i < SWITCH_BYTES; i++) {
+        debounceCount0[i] = 0;
+        debounceCount1[i] = 0;
+        debounceCount2[i] = 0;
+    }
+    BounceRestart (relearn);
+    USBUnmaskInterrupts ();
+
+    data[0] = SETTINGS_MAGIC;
+    data[1] = tickUnits;
+    data[2] = debounceSamples;
+    data[3] = (uint8_t)-(data[0] + data[1] + data[2]);
+    SYSTEM_FlashWrite (data, SETTINGS_LENGTH);
 
-	return (state & 2) ? (1 << which) : 0;
+    return true;
 }
@@ -26,7 +26,7 @@ please contact mla_licensing@microchip.com
 #if defined (USE_INTERNAL_OSC)	    // Define this in system.h if using the HFINTOSC for USB operation
     // CONFIG1
     #pragma config FOSC = INTOSC    // Oscillator Selection Bits (INTOSC oscillator: I/O function on CLKIN pin)
-    #pragma config WDTE = OFF       // Watchdog Timer Enable (WDT disabled)
+    #pragma config WDTE = SWDTEN    // Watchdog Timer Enable (WDT controlled by the SWDTEN bit in the WDTCON register)
     #pragma config PWRTE = OFF      // Power-up Timer Enable (PWRT disabled)
     #pragma config MCLRE = OFF      // MCLR Pin Function Select (MCLR/VPP pin function is digital input)
     #pragma config CP = OFF         // Flash Program Memory Code Protection (Program memory code protection is disabled)
@@ -48,7 +48,7 @@ please contact mla_licensing@microchip.com
 #else
     // CONFIG1
     #pragma config FOSC = HS        // Oscillator Selection Bits (HS Oscillator, High-speed crystal/resonator connected between OSC1 and OSC2 pins)
-    #pragma config WDTE = OFF       // Watchdog Timer Enable (WDT disabled)
+    #pragma config WDTE = SWDTEN    // Watchdog Timer Enable (WDT controlled by the SWDTEN bit in the WDTCON register)
     #pragma config PWRTE = OFF      // Power-up Timer Enable (PWRT disabled)
     #pragma config MCLRE = OFF      // MCLR Pin Function Select (MCLR/VPP pin function is digital input)
     #pragma config CP = OFF         // Flash Program Memory Code Protection (Program memory code protection is disabled)
@@ -94,28 +94,183 @@ void SYSTEM_Initialize( SYSTEM_STATE state )
             break;
             
         case SYSTEM_STATE_USB_SUSPEND: 
+            // edge detection on the switch pins that have it, both directions, so a
+            // switch change can wake the core; main.c sleeps while the bus is suspended
+            IOCAP = SWITCH_IOC_A;
+            IOCAN = SWITCH_IOC_A;
+            IOCBP = SWITCH_IOC_B;
+            IOCBN = SWITCH_IOC_B;
+            IOCAF = 0;
+            IOCBF = 0;
             break;
             
         case SYSTEM_STATE_USB_RESUME:
+            IOCAP = 0;
+            IOCAN = 0;
+            IOCBP = 0;
+            IOCBN = 0;
             break;
     }
 }
 
+#if !defined(HOST_SIM)
+/*********************************************************************
+* Function: void SYSTEM_FlashRead(uint8_t *data, uint8_t length)
+*
+* Overview: Reads the low bytes of the words from HEF_ADDRESS on.
+*
+* PreCondition: None
+*
+* Input:  data - where the bytes go, length - how many
+*
+* Output: None
+*
+********************************************************************/
+void SYSTEM_FlashRead(uint8_t *data, uint8_t length)
+{
+    uint8_t i;
+
+    PMCON1bits.CFGS = 0;
+    PMADRH = HEF_ADDRESS >> 8;
+    for (i = 0; i < length; i++)
+    {
+        PMADRL = (uint8_t)(HEF_ADDRESS + i);
+        PMCON1bits.RD = 1;
+        NOP();
+        NOP();
+        data[i] = PMDATL;
+    }
+}
+
+// the unlock sequence and the start of the erase or write, which stalls the CPU until done
+static void FlashUnlock(void)
+{
+    PMCON2 = 0x55;
+    PMCON2 = 0xAA;
+    PMCON1bits.WR = 1;
+    NOP();
+    NOP();
+}
+
+/*********************************************************************
+* Function: void SYSTEM_FlashWrite(const uint8_t *data, uint8_t length)
+*
+* Overview: Erases the row at HEF_ADDRESS and programs the bytes into
+*   the low bytes of its first words, the rest left erased. Interrupts
+*   are off from the unlock sequences to the end of the write.
+*
+* PreCondition: length 1 to HEF_ROW_WORDS
+*
+* Input:  data - the bytes, length - how many
+*
+* Output: None
+*
+********************************************************************/
+void SYSTEM_FlashWrite(const uint8_t *data, uint8_t length)
+{
+    uint8_t i, gie;
+
+    gie = INTCONbits.GIE;
+    INTCONbits.GIE = 0;
+
+    PMCON1bits.CFGS = 0;
+    PMADRH = HEF_ADDRESS >> 8;
+    PMADRL = (uint8_t)HEF_ADDRESS;
+    PMCON1bits.FREE = 1;
+    PMCON1bits.WREN = 1;
+    FlashUnlock();
+
+    // load the write latches; the last one, with LWLO clear, writes the row
+    PMCON1bits.LWLO = 1;
+    for (i = 0; i < length; i++)
+    {
+        PMADRL = (uint8_t)(HEF_ADDRESS + i);
+        PMDATH = 0x00;
+        PMDATL = data[i];
+        if (i == length - 1)
+        {
+            PMCON1bits.LWLO = 0;
+        }
+        FlashUnlock();
+    }
+
+    PMCON1bits.WREN = 0;
+    INTCONbits.GIE = gie;
+}
+#endif
+
 #if(__XC8_VERSION < 2000)
     #define INTERRUPT interrupt
 #else
     #define INTERRUPT __interrupt()
 #endif
+
+// interrupt accounting, read by the host as feature report 4
+volatile ISR_STATS isrStats[ISR_STATS_COUNT];
+
+static void IsrAccount(uint8_t source, uint16_t cycles)
+{
+    isrStats[source].count++;
+    isrStats[source].cycles += cycles;
+    if (cycles > isrStats[source].maxCycles)
+    {
+        isrStats[source].maxCycles = cycles;
+    }
+}
 			
 void INTERRUPT SYS_InterruptHigh(void)
 {
+    uint16_t entry, usbDone, tmr2Done;
+    uint8_t tickPending, tickCount;
+
+    // TMR2 restarts from 0 on the match that raises TMR2IF, so its count at entry is how long
+    // a pending tick has waited; read it before an SOF can reload it
+    TMR1_READ(entry);
+    tickPending = PIR1bits.TMR2IF;
+    tickCount = TMR2;
+
     #if defined(USB_INTERRUPT)
-        USBDeviceTasks();
+        // a USB event may leave work for APP_DeviceCustomHIDTasks(). USBDeviceTasks() runs
+        // on every entry while the USB interrupt is enabled, also those only the tick
+        // caused, and is accounted to each apart. USBMaskInterrupts() has to hold off all USB
+        // servicing, GET_REPORT included, so a tick taken while it is in force skips it
+        if (PIE2bits.USBIE == 1 && PIR2bits.USBIF == 1)
+        {
+            flagUsb = 1;
+            USBDeviceTasks();
+            TMR1_READ(usbDone);
+            IsrAccount(ISR_STATS_USB, usbDone - entry);
+        }
+        else if (PIE2bits.USBIE == 1)
+        {
+            USBDeviceTasks();
+            TMR1_READ(usbDone);
+            IsrAccount(ISR_STATS_USB_IDLE, usbDone - entry);
+        }
+        else
+        {
+            usbDone = entry;
+        }
+    #else
+        usbDone = entry;
     #endif
 
     if (PIE1bits.TMR2IE == 1 && PIR1bits.TMR2IF == 1)
     {
+        // from the TMR2 match to the handler, in cycles at 16 per TMR2 count; a tick raised
+        // while USB was being serviced has waited for what TMR2 has counted since
+        if (tickPending)
+        {
+            IsrAccount(ISR_STATS_TICK_LATENCY, ((uint16_t)tickCount << 4) + (usbDone - entry));
+        }
+        else
+        {
+            IsrAccount(ISR_STATS_TICK_LATENCY, (uint16_t)TMR2 << 4);
+        }
+
         TMR2_InterruptHandler();
+        TMR1_READ(tmr2Done);
+        IsrAccount(ISR_STATS_TMR2, tmr2Done - usbDone);
     }
 }
 
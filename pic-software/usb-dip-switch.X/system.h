@@ -27,16 +27,197 @@ please contact mla_licensing@microchip.com
 
 #include "fixed_address_memory.h"
 
+// SWITCH_BYTES, the report width, is set with the report descriptor options
+#include "usb_config.h"
+
 #define USE_INTERNAL_OSC
 
 #define MAIN_RETURN void
 
-// 250 Hz timer 2 period value
-// dec2hex(12e6/16/12/250-1)
-#define TMR2_PERIOD 0xF9
+// Fosc for __delay_ms(), 48 MHz from either oscillator set-up in system.c
+#define _XTAL_FREQ 48000000
+
+// timer 2 tick, prescale 1:16 and a 200 us period, dec2hex(12e6/16/5000-1); the postscaler
+// makes the tick TICK_UNITS periods, 1 to TICK_UNITS_MAX = 0.2 to 2 ms. The host can change
+// it with the report ID 2 / 0x54 command and the stick keeps it in high-endurance flash, see
+// SAMPLE_SETTINGS below; TICK_UNITS is the default, 1 kHz. The 2 ms limit keeps a few ticks
+// inside TMR1's 5.46 ms wrap for the lost tick count
+#define TICK_UNIT_US     200
+#define TMR2_PERIOD      0x95
+#define TMR2_CONTROL     0x06
+#define TMR2_POSTSCALE(units) (((units) - 1) << 3)
+#ifndef TICK_UNITS
+#define TICK_UNITS       5
+#endif
+#define TICK_UNITS_MAX   10
+#define TICK_UNITS_PER_MS (1000 / TICK_UNIT_US)
+#if (TICK_UNITS < 1) || (TICK_UNITS > TICK_UNITS_MAX)
+#error "TICK_UNITS must be 1 to TICK_UNITS_MAX"
+#endif
+
+// default tick rate, and instruction cycles per TMR2 period, what TMR1 counts in one
+#define TICK_HZ          (1000000 / (TICK_UNIT_US * TICK_UNITS))
+#define TICK_UNIT_CYCLES ((uint16_t)(_XTAL_FREQ / 4 / 1000000 * TICK_UNIT_US))
+
+// SOF-synchronised sampling: every USB start-of-frame reloads TMR2 so the tick, and with it
+// the switch sample, lands SOF_SAMPLE_LEAD_US before the next SOF and the change is in the
+// IN endpoint just ahead of the host's poll in the following frame. Sampling on the SOF
+// itself would miss the poll of that frame. Without SOFs (bus suspended or not yet reset),
+// or with the host's tick set to anything but 1 ms, TMR2 keeps the tick going on its own
+// clock.
+#ifndef SWITCH_SAMPLE_SOF
+#define SWITCH_SAMPLE_SOF 0
+#endif
+#define SOF_SAMPLE_LEAD_US 100
+
+// TMR2 counts at Fosc/4/16 = 750 kHz and a 1 ms tick is five periods of it; a write to TMR2
+// also clears the postscaler, so loading lead * 0.75 puts the next tick 1000 - lead us on
+#define SOF_TMR2_RELOAD ((SOF_SAMPLE_LEAD_US * 3) / 4)
+#if (SOF_TMR2_RELOAD > TMR2_PERIOD)
+#error "SOF_SAMPLE_LEAD_US must be shorter than one TMR2 period"
+#endif
+
+// consecutive equal samples before a switch changes state, 1 to DEBOUNCE_SAMPLES_MAX, or
+// DEBOUNCE_ADAPTIVE to give each switch a depth of its own, see BOUNCE_STATS below. The
+// default; the host can change it with the report ID 2 / 0x44 command like the tick
+#ifndef DEBOUNCE_SAMPLES
+#define DEBOUNCE_SAMPLES 4
+#endif
+#define DEBOUNCE_SAMPLES_MAX 8
+#define DEBOUNCE_ADAPTIVE 0
+#if (DEBOUNCE_SAMPLES < 0) || (DEBOUNCE_SAMPLES > DEBOUNCE_SAMPLES_MAX)
+#error "DEBOUNCE_SAMPLES must be DEBOUNCE_ADAPTIVE or 1 to DEBOUNCE_SAMPLES_MAX"
+#endif
+
+// adaptive debounce: each switch's depth is one sample more than the longest bounce it has
+// shown lately, never below DEBOUNCE_ADAPT_MIN so a one-sample glitch is still rejected and
+// never above DEBOUNCE_SAMPLES_MAX. A switch starts at DEBOUNCE_ADAPT_START samples at power
+// on and whenever the tick changes. Its bounce is learned in ticks, see BounceLearn() in
+// main.c: a longer bounce takes over at once, a shorter one only after BOUNCE_DECAY_EDGES
+// changes in a row all bounced less, and a switch that starts another change within
+// BOUNCE_WINDOW ticks of the last one was taken too early, so its depth goes up past the
+// depth that let it through. A transition that goes BOUNCE_WINDOW ticks without a change is
+// a glitch and teaches nothing
+#define DEBOUNCE_ADAPT_MIN   2
+#define DEBOUNCE_ADAPT_START 4
+#define BOUNCE_WINDOW        32
+#define BOUNCE_DECAY_EDGES   8
+
+// settle window in ms, 0 to 255: a debounced change is only reported once the switches have
+// all been still for this long, so several switches flipped together make one report. 0
+// reports each change on the tick that debounced it. The host can change it with the report
+// ID 2 / 0x53 command and read it in feature report 6; a new configuration goes back to this
+#ifndef SETTLE_MS
+#define SETTLE_MS 0
+#endif
+
+// switches past the stick's own eight, SWITCH_BYTES > 1: a chain of 74HC165 parallel-in
+// shift registers, one per report byte after the first. SH/LD on RC2, CLK on RC1 and QH of
+// the register nearest the PIC on RC0. That register is report byte 1: its input H, which
+// QH shows first, is SW9 in bit 7 and input A is SW16 in bit 0, and so on down the chain.
+// Each switch pulls its register input low against a pull-up, closed = set bit as for the
+// stick's own. The chain has no interrupt-on-change, so while USB is suspended it is polled
+// with the watchdog timer like the PORTC switches
+#if (SWITCH_BYTES < 1) || (SWITCH_BYTES > 8)
+#error "SWITCH_BYTES must be 1 to 8"
+#endif
+#define SHIFT_LOAD  LATCbits.LATC2
+#define SHIFT_CLOCK LATCbits.LATC1
+#define SHIFT_DATA  PORTCbits.RC0
+
+// switch inputs: report bit of each port pin, bit 7 = SW1 ... bit 0 = SW8. A closed switch
+// pulls its pin low against the weak pull-up, so a low pin gives a set bit. main.c builds its
+// port to report permutation tables from these at compile time.
+#define SWITCH_PIN(v, pin, bit) ((((v) >> (pin)) & 1) ? 0 : (1 << (bit)))
+
+// port pins that carry a switch, from the same maps
+#define SWITCH_PIN_USED(map, pin) ((map(0xFF ^ (1 << (pin))) != 0) ? (1 << (pin)) : 0)
+#define SWITCH_PINS(map) (SWITCH_PIN_USED(map, 0) | SWITCH_PIN_USED(map, 1) | \
+                          SWITCH_PIN_USED(map, 2) | SWITCH_PIN_USED(map, 3) | \
+                          SWITCH_PIN_USED(map, 4) | SWITCH_PIN_USED(map, 5) | \
+                          SWITCH_PIN_USED(map, 6) | SWITCH_PIN_USED(map, 7))
+
+// pins with interrupt-on-change, which can wake the core from sleep; PORTC has none, so
+// switches there are polled with the watchdog timer while USB is suspended
+#define IOC_PINS_A 0x3B
+#define IOC_PINS_B 0xF0
+#define SWITCH_IOC_A (SWITCH_PINS(SWITCH_MAP_A) & IOC_PINS_A)
+#define SWITCH_IOC_B (SWITCH_PINS(SWITCH_MAP_B) & IOC_PINS_B)
+#define SWITCH_POLLED ((SWITCH_PINS(SWITCH_MAP_A) & ~IOC_PINS_A) | \
+                       (SWITCH_PINS(SWITCH_MAP_B) & ~IOC_PINS_B) | SWITCH_PINS(SWITCH_MAP_C))
+
+// switch change records queued by the sampler in main.c for the IN endpoint; a power of
+// two so the free-running head and tail indices wrap cleanly. Wider records leave room in
+// USB RAM for half as many
+#if (SWITCH_BYTES == 1)
+#define REPORT_QUEUE_SIZE 16
+#else
+#define REPORT_QUEUE_SIZE 8
+#endif
+#define REPORT_QUEUE_MASK (REPORT_QUEUE_SIZE - 1)
+
+// a record is report ID 1 exactly as it goes on the wire, so the queue in USB RAM is handed
+// to the SIE in place: report ID, switches, timestamp (little endian), sequence, frame
+// (little endian). The timestamp counts SOFs on the stick and stops while the bus is
+// suspended; the frame number is the host's own frame counter, so the host can place the
+// change on its clock to within a frame
+typedef struct {
+    uint8_t reportId;
+    uint8_t switches[SWITCH_BYTES];
+    uint16_t timestamp;     // USB 1 ms tick count when the change was debounced
+    uint8_t sequence;       // debounced change count, gaps are changes the full queue dropped
+    uint16_t frame;         // 11-bit USB frame number when the change was debounced
+} SWITCH_RECORD;
+
+#define SWITCH_REPORT_SIZE (6 + SWITCH_BYTES)
+
+// feature report 3: the switch report up to the sequence number, the queue drop count, the
+// frame
+#define STATE_REPORT_SIZE (7 + SWITCH_BYTES)
+
+// feature report 6: the settle window in ms, the tick in TICK_UNIT_US, the debounce samples
+#define SETTINGS_REPORT_SIZE 4
+
+// bounce learning, read by the host as feature report 7. histogram[] counts the bounce of
+// every debounced change, the time from the first sample that disagreed with the old state
+// to the start of the run that was taken: bin 0 no bounce, bin n below 2^n TICK_UNIT_US,
+// the last bin 12.8 ms and up. switches[] has a byte per switch, SW1 first, with the
+// debounce samples in use in the high nibble and the learned bounce in ticks, saturating
+// at 15, in the low nibble; in fixed depth mode the bounce is still learned but the depth
+// is the host's. The counts wrap, take differences; main.c updates it all with the USB
+// interrupt masked
+#define SWITCH_COUNT     (SWITCH_BYTES * 8)
+#define BOUNCE_HIST_BINS 8
+
+typedef struct {
+    uint16_t histogram[BOUNCE_HIST_BINS];
+    uint8_t switches[SWITCH_COUNT];
+} BOUNCE_STATS;
+
+// feature report 7: report ID and bounceStats as it is in RAM, little endian
+#define BOUNCE_REPORT_SIZE (1 + BOUNCE_HIST_BINS * 2 + SWITCH_COUNT)
+
+extern volatile BOUNCE_STATS bounceStats;
+
+// sampling settings the host can change with report ID 2 / 0x54 and 0x44, or both in one
+// write with 0x50. main.c keeps them in the first row of high-endurance flash and loads
+// them at power-on, falling back to TICK_UNITS and DEBOUNCE_SAMPLES while the row holds
+// nothing valid
+typedef struct {
+    uint8_t tickUnits;          // tick period in TICK_UNIT_US, 1 to TICK_UNITS_MAX
+    uint8_t debounceSamples;    // 1 to DEBOUNCE_SAMPLES_MAX, or DEBOUNCE_ADAPTIVE
+} SAMPLE_SETTINGS;
+
+extern SAMPLE_SETTINGS sampleSettings;
+
+// take new settings from the host, false if either is out of range; applied at once and
+// written to flash if they changed. Called from the main loop
+bool SetSampleSettings (uint8_t tickUnits, uint8_t debounceSamples);
 
 #ifdef DEV_BOARD
-#define SW2      (PORTCbits.RC5 ? 0 : 1)
+#define SWITCH_MAP_A(v) 0
+#define SWITCH_MAP_B(v) 0
+#define SWITCH_MAP_C(v) (SWITCH_PIN(v, 5, 6))
 #define USER_LED LATCbits.LATC3
 #define LED_ON 1
 #define LED_OFF 0
@@ -44,14 +225,14 @@ please contact mla_licensing@microchip.com
 
 // GPIO input pins
 #define PB1      (PORTBbits.RB6 ? 0 : 1)
-#define SW1      (PORTAbits.RA5 ? 0 : 1)
-#define SW2      (PORTAbits.RA4 ? 0 : 1)
-#define SW3      (PORTCbits.RC5 ? 0 : 1)
-#define SW4      (PORTCbits.RC4 ? 0 : 1)
-#define SW5      (PORTBbits.RB7 ? 0 : 1)
-#define SW6      (PORTCbits.RC7 ? 0 : 1)
-#define SW7      (PORTCbits.RC6 ? 0 : 1)
-#define SW8      (PORTCbits.RC3 ? 0 : 1)
+
+// SW1 RA5, SW2 RA4
+#define SWITCH_MAP_A(v) (SWITCH_PIN(v, 5, 7) | SWITCH_PIN(v, 4, 6))
+// SW5 RB7
+#define SWITCH_MAP_B(v) (SWITCH_PIN(v, 7, 3))
+// SW3 RC5, SW4 RC4, SW6 RC7, SW7 RC6, SW8 RC3
+#define SWITCH_MAP_C(v) (SWITCH_PIN(v, 5, 5) | SWITCH_PIN(v, 4, 4) | SWITCH_PIN(v, 7, 2) | \
+                         SWITCH_PIN(v, 6, 1) | SWITCH_PIN(v, 3, 0))
 
 // GPIO output pins
 #define USER_LED LATBbits.LATB5
@@ -96,10 +277,147 @@ void SYSTEM_Initialize( SYSTEM_STATE state );
 * Output: None
 *
 ********************************************************************/
-//void SYSTEM_Tasks(void);
+#if defined(HOST_SIM)
+// host simulator: the end of each main loop pass yields to the simulated peripherals
+void SYSTEM_Tasks(void);
+#else
 #define SYSTEM_Tasks()
+#endif
 
+/*********************************************************************
+* Function: void SYSTEM_ShiftLoad(void), void SYSTEM_ShiftClock(void)
+*
+* Overview: Latch the 74HC165 chain's inputs with a low pulse on SH/LD,
+*           move the chain one bit towards QH with a rising edge on CLK.
+*           One instruction cycle each, over the 74HC165's 20 ns minimum
+*
+* PreCondition: SWITCH_BYTES > 1, pins set up by main()
+*
+* Input: None
+*
+* Output: None
+*
+********************************************************************/
+#if defined(HOST_SIM)
+// host simulator: the chain behind the pins is modelled there
+void SYSTEM_ShiftLoad(void);
+void SYSTEM_ShiftClock(void);
+#else
+#define SYSTEM_ShiftLoad()  do { SHIFT_LOAD = 0; SHIFT_LOAD = 1; } while (0)
+#define SYSTEM_ShiftClock() do { SHIFT_CLOCK = 1; SHIFT_CLOCK = 0; } while (0)
+#endif
+
+/*********************************************************************
+* Function: void SYSTEM_FlashRead(uint8_t *data, uint8_t length),
+*           void SYSTEM_FlashWrite(const uint8_t *data, uint8_t length)
+*
+* Overview: Read and rewrite the first row of high-endurance flash,
+*           one byte in the low byte of each word from HEF_ADDRESS.
+*           A write erases the row and programs it; the CPU stalls
+*           for about 2 ms each, no interrupt is serviced meanwhile
+*           and the SIE NAKs the host. Good for 100k writes
+*
+* PreCondition: length at most HEF_ROW_WORDS
+*
+* Input: data - the bytes, length - how many
+*
+* Output: None
+*
+********************************************************************/
+#define HEF_ADDRESS   0x1F80
+#define HEF_ROW_WORDS 32
+
+// in system.c; the host simulator has its own, whose flash keeps its contents over a power
+// cycle
+void SYSTEM_FlashRead(uint8_t *data, uint8_t length);
+void SYSTEM_FlashWrite(const uint8_t *data, uint8_t length);
+
+/*********************************************************************
+* Function: void SYSTEM_Idle(void)
+*
+* Overview: One turn of the main loop's wait for an interrupt
+*
+* PreCondition: None
+*
+* Input: None
+*
+* Output: None
+*
+********************************************************************/
+#if defined(HOST_SIM)
+// host simulator: parks the main loop until an interrupt has run
+void SYSTEM_Idle(void);
+#else
+#define SYSTEM_Idle()
+#endif
+
+void TMR1_Initialize (void);
 void TMR2_Initialize (void);
+void TMR2_SetTick (uint8_t units);
 void TMR2_InterruptHandler (void);
 
+// interrupt accounting in SYS_InterruptHigh(), per source: how often it was serviced, the
+// instruction cycles spent on it, counted by TMR1 at Fosc/4, and the most at once. USB is
+// USBDeviceTasks() on an entry with a USB interrupt pending, USB_IDLE the same call on an
+// entry only the tick caused. TICK_LATENCY is not time spent in the handler but how long
+// each tick waited from the TMR2 match until its handler ran, which only TMR2's own count
+// can tell, so it wraps at one TMR2 period (200 us). The counts and cycle sums wrap, take
+// differences; reading feature report 4 clears the maxima
+typedef struct {
+    uint32_t count;
+    uint32_t cycles;
+    uint16_t maxCycles;
+} ISR_STATS;
+
+enum {
+    ISR_STATS_USB,
+    ISR_STATS_USB_IDLE,
+    ISR_STATS_TMR2,
+    ISR_STATS_TICK_LATENCY,
+    ISR_STATS_COUNT
+};
+
+// feature report 4: report ID and isrStats[] as they are in RAM, little endian
+#define ISR_REPORT_SIZE (1 + ISR_STATS_COUNT * 10)
+
+extern volatile ISR_STATS isrStats[ISR_STATS_COUNT];
+
+// main loop timing, from TMR1 like the interrupt accounting. overruns counts ticks that came
+// while the main loop still had the one before to take, lostTicks the TMR2 matches that
+// never raised an interrupt of their own because the one before was still pending; either
+// way a sample was skipped. pickup[] is a histogram of the time from each tick's
+// interrupt to the main loop taking it, pass[] of the time each main loop pass ran, waits
+// for an interrupt not counted and interrupts taken meanwhile counted. Bin n holds times
+// below 128 << n cycles, the last bin everything longer, 683 us and up. All counts wrap, take
+// differences; reading feature report 5 clears the maxima
+#define LOOP_HIST_BINS  8
+#define LOOP_HIST_SHIFT 7
+
+typedef struct {
+    uint16_t overruns;
+    uint16_t lostTicks;
+    uint16_t pickupMax;
+    uint16_t passMax;
+    uint16_t pickup[LOOP_HIST_BINS];
+    uint16_t pass[LOOP_HIST_BINS];
+} LOOP_STATS;
+
+// feature report 5: report ID and loopStats as it is in RAM, little endian
+#define LOOP_REPORT_SIZE (1 + 8 + LOOP_HIST_BINS * 4)
+
+extern volatile LOOP_STATS loopStats;
+
+// TMR1 counts instruction cycles; re-read if the high byte moved while the low byte was read
+#define TMR1_READ(t) do { \
+        uint8_t hi_; \
+        do { hi_ = TMR1H; (t) = ((uint16_t)hi_ << 8) | TMR1L; } while (hi_ != TMR1H); \
+    } while (0)
+
+// set by the interrupt handlers, cleared by the main loop when it takes the work
+extern volatile uint8_t flagTick;
+extern volatile uint8_t flagUsb;
+
+// frame number of the latest SOF, from the USB interrupt; read it with USB interrupts masked
+extern volatile uint16_t usbFrameNumber;
+
 #endif //SYSTEM_H
@@ -329,7 +329,12 @@ typedef union _POINTER
 /*****************************************************************************/
 
 #define ConvertToPhysicalAddress(a) (((uint16_t)(a)) & 0x7FFF)
-#define ConvertToVirtualAddress(a)  ((void *)(a))
+#if defined(HOST_SIM)
+    //host simulator: dual-port RAM lives at SIM_DPRAM_HOST_BASE in the process (see xc.h)
+    #define ConvertToVirtualAddress(a)  ((void *)(SIM_DPRAM_HOST_BASE | (uint16_t)(a)))
+#else
+    #define ConvertToVirtualAddress(a)  ((void *)(a))
+#endif
 #define USBClearUSBInterrupt() PIR2bits.USBIF = 0;
 #if defined(USB_INTERRUPT)
     #define USBMaskInterrupts() {PIE2bits.USBIE = 0;}
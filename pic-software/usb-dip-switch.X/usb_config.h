@@ -167,7 +167,42 @@ please contact mla_licensing@microchip.com
 #define HID_INT_OUT_EP_SIZE     3
 #define HID_INT_IN_EP_SIZE      3
 #define HID_NUM_OF_DSC          1
-#define HID_RPT01_SIZE          38
+
+// how hid_rpt01 in usb_descriptors.c declares the switch byte of report ID 1: 0 = one vendor
+// page byte, read through hidraw only; 1 = eight Button page bits in a Generic Desktop keypad
+// collection, which the kernel's hid-input driver also delivers as one EV_KEY per switch.
+// The report bytes on the wire are the same either way
+#ifndef SWITCH_DESCRIPTOR_EVDEV
+#define SWITCH_DESCRIPTOR_EVDEV 0
+#endif
+
+// switch bytes in report ID 1 and feature report 3, 1 to 8: the stick's own eight switches
+// and one byte per 74HC165 on the expansion chain, see system.h. Only the first byte is
+// keys with SWITCH_DESCRIPTOR_EVDEV, the rest reach the host through hidraw
+#ifndef SWITCH_BYTES
+#define SWITCH_BYTES 1
+#endif
+
+// the expansion bytes add their items to report 1 and feature reports 3 and 7
+#if (SWITCH_BYTES == 1)
+#define HID_RPT01_WIDE_SIZE     0
+#elif (SWITCH_DESCRIPTOR_EVDEV)
+#define HID_RPT01_WIDE_SIZE     25
+#else
+#define HID_RPT01_WIDE_SIZE     22
+#endif
+
+#if (SWITCH_DESCRIPTOR_EVDEV)
+#define HID_RPT01_SIZE          (190 + HID_RPT01_WIDE_SIZE)
+#else
+#define HID_RPT01_SIZE          (171 + HID_RPT01_WIDE_SIZE)
+#endif
+
+// answer GET_REPORT on EP0 from app_device_custom_hid.c
+#define USER_GET_REPORT_HANDLER USBHIDCBGetReportHandler
+
+// SET_IDLE sets the heartbeat period, see app_device_custom_hid.c
+#define USB_DEVICE_HID_IDLE_RATE_CALLBACK(reportID, newIdleRate) USBHIDCBSetIdleRateHandler(reportID, newIdleRate)
 
 /** DEFINITIONS ****************************************************/
 
@@ -176,7 +176,7 @@ const uint8_t configDescriptor1[]={
     1,                      // Number of interfaces in this cfg
     1,                      // Index value of this configuration
     0,                      // Configuration string index
-    _DEFAULT | _SELF,               // Attributes, see usb_device.h
+    _DEFAULT | _SELF | _RWU,        // Attributes, see usb_device.h
     50,                     // Max power consumption (2X mA)
 							
     /* Interface Descriptor */
@@ -239,10 +239,82 @@ sizeof(sd003),USB_DESCRIPTOR_STRING,
 {'0','0','0','0','-','0','0','0','0','-','0','0','0','2'
 }};
 
+// items for the expansion switch bytes with SWITCH_BYTES > 1, straight after the stick's
+// own switch byte, so the switches stay one array on the wire; empty otherwise. The host
+// emulator's copy of hid_rpt01 only takes plain byte lines, the one-byte stick
+#if (SWITCH_BYTES > 1)
+#define SWITCH_WIDE_INPUT \
+		0x09, 0x08,        /* Usage (0x08) -- expansion switch bytes, SW9 on */ \
+		0x95, SWITCH_BYTES - 1,  /* Report Count */ \
+		0x81, 0x02,        /* Input (Data,Var,Abs) */ \
+		0x95, 0x01,        /* Report Count (1) */
+#define SWITCH_WIDE_INPUT_EVDEV \
+		0x09, 0x08,        /* Usage (0x08) -- expansion switch bytes, hidraw only */ \
+		0x75, 0x08,        /* Report Size (8) */ \
+		0x26, 0xFF, 0x00,  /* Logical Maximum (255) */ \
+		0x95, SWITCH_BYTES - 1,  /* Report Count */ \
+		0x81, 0x03,        /* Input (Const,Var,Abs) */
+#define SWITCH_WIDE_FEATURE \
+		0x09, 0x08,        /* Usage (0x08) -- expansion switch bytes */ \
+		0x95, SWITCH_BYTES - 1,  /* Report Count */ \
+		0xB1, 0x02,        /* Feature (Data,Var,Abs) */ \
+		0x95, 0x01,        /* Report Count (1) */
+#define SWITCH_WIDE_BOUNCE \
+		0x09, 0x0A,        /* Usage (0x0A) -- bounce bytes of SW9 on */ \
+		0x95, (SWITCH_BYTES - 1) * 8,  /* Report Count */ \
+		0xB1, 0x02,        /* Feature (Data,Var,Abs) */
+#else
+#define SWITCH_WIDE_INPUT
+#define SWITCH_WIDE_INPUT_EVDEV
+#define SWITCH_WIDE_FEATURE
+#define SWITCH_WIDE_BOUNCE
+#endif
+
 //Class specific descriptor - HID 
 const struct{uint8_t report[HID_RPT01_SIZE];}hid_rpt01={
 {
 
+#if (SWITCH_DESCRIPTOR_EVDEV)
+		// hid-input only binds to Generic Desktop style collections. A keypad with Button
+		// page usages gives BTN_0 = SW1 ... BTN_7 = SW8 and no keyboard keys, so desktops do
+		// not take the stick for a keyboard. Bit 0 is the first usage, hence SW8 first. The
+		// timestamp and sequence are marked constant so hid-input skips them; hidraw still
+		// sees every byte
+		0x05, 0x01,        // Usage Page (Generic Desktop Ctrls)
+		0x09, 0x07,        // Usage (Keypad)
+		0xA1, 0x01,        // Collection (Application)
+
+		0x85, 0x01,        //   Report ID (1)
+		0x05, 0x09,        //   Usage Page (Button)
+		0x09, 0x08,        //   Usage (Button 8) -- SW8, bit 0
+		0x09, 0x07,        //   Usage (Button 7)
+		0x09, 0x06,        //   Usage (Button 6)
+		0x09, 0x05,        //   Usage (Button 5)
+		0x09, 0x04,        //   Usage (Button 4)
+		0x09, 0x03,        //   Usage (Button 3)
+		0x09, 0x02,        //   Usage (Button 2)
+		0x09, 0x01,        //   Usage (Button 1) -- SW1, bit 7
+		0x15, 0x00,        //   Logical Minimum (0)
+		0x25, 0x01,        //   Logical Maximum (1)
+		0x75, 0x01,        //   Report Size (1)
+		0x95, 0x08,        //   Report Count (8)
+		0x81, 0x02,        //   Input (Data,Var,Abs,No Wrap,Linear,Preferred State,No Null Position,Non-volatile)
+		0x06, 0x00, 0xFF,  //   Usage Page (Vendor Defined 0xFF00)
+		SWITCH_WIDE_INPUT_EVDEV
+		0x95, 0x01,        //   Report Count (1)
+		0x09, 0x02,        //   Usage (0x02) -- 1 ms USB tick count when the change was debounced
+		0x75, 0x10,        //   Report Size (16)
+		0x27, 0xFF, 0xFF, 0x00, 0x00,  //   Logical Maximum (65535)
+		0x81, 0x03,        //   Input (Const,Var,Abs,No Wrap,Linear,Preferred State,No Null Position,Non-volatile)
+		0x09, 0x03,        //   Usage (0x03) -- sequence number, counts debounced changes
+		0x75, 0x08,        //   Report Size (8)
+		0x26, 0xFF, 0x00,  //   Logical Maximum (255)
+		0x81, 0x03,        //   Input (Const,Var,Abs,No Wrap,Linear,Preferred State,No Null Position,Non-volatile)
+		0x09, 0x05,        //   Usage (0x05) -- USB frame number when the change was debounced
+		0x75, 0x10,        //   Report Size (16)
+		0x26, 0xFF, 0x07,  //   Logical Maximum (2047)
+		0x81, 0x03,        //   Input (Const,Var,Abs,No Wrap,Linear,Preferred State,No Null Position,Non-volatile)
+#else
 		0x06, 0x00, 0xFF,  // Usage Page (Vendor Defined 0xFF00)
 		0x09, 0x01,        // Usage (0x01)
 		0xA1, 0x01,        // Collection (Application)
@@ -254,18 +326,86 @@ const struct{uint8_t report[HID_RPT01_SIZE];}hid_rpt01={
 		0x15, 0x00,        //   Logical Minimum (0)
 		0x09, 0x01,        //   Usage (0x01)
 		0x81, 0x02,        //   Input (Data,Var,Abs,No Wrap,Linear,Preferred State,No Null Position,Non-volatile)
+		SWITCH_WIDE_INPUT
+		0x09, 0x02,        //   Usage (0x02) -- 1 ms USB tick count when the change was debounced
+		0x75, 0x10,        //   Report Size (16)
+		0x27, 0xFF, 0xFF, 0x00, 0x00,  //   Logical Maximum (65535)
+		0x81, 0x02,        //   Input (Data,Var,Abs,No Wrap,Linear,Preferred State,No Null Position,Non-volatile)
+		0x09, 0x03,        //   Usage (0x03) -- sequence number, counts debounced changes
+		0x75, 0x08,        //   Report Size (8)
+		0x26, 0xFF, 0x00,  //   Logical Maximum (255)
+		0x81, 0x02,        //   Input (Data,Var,Abs,No Wrap,Linear,Preferred State,No Null Position,Non-volatile)
+		0x09, 0x05,        //   Usage (0x05) -- USB frame number when the change was debounced
+		0x75, 0x10,        //   Report Size (16)
+		0x26, 0xFF, 0x07,  //   Logical Maximum (2047)
+		0x81, 0x02,        //   Input (Data,Var,Abs,No Wrap,Linear,Preferred State,No Null Position,Non-volatile)
+#endif
+
+		0x85, 0x03,        //   Report ID (3) -- state feature report, read with GET_REPORT
+		0x95, 0x01,        //   Report Count (1)
+		0x75, 0x08,        //   Report Size (8)
+		0x26, 0xFF, 0x00,  //   Logical Maximum (255)
+		0x15, 0x00,        //   Logical Minimum (0)
+		0x09, 0x01,        //   Usage (0x01) -- debounced switches
+		0xB1, 0x02,        //   Feature (Data,Var,Abs,No Wrap,Linear,Preferred State,No Null Position,Non-volatile)
+		SWITCH_WIDE_FEATURE
+		0x09, 0x02,        //   Usage (0x02) -- 1 ms USB tick count of the last change
+		0x75, 0x10,        //   Report Size (16)
+		0x27, 0xFF, 0xFF, 0x00, 0x00,  //   Logical Maximum (65535)
+		0xB1, 0x02,        //   Feature (Data,Var,Abs,No Wrap,Linear,Preferred State,No Null Position,Non-volatile)
+		0x09, 0x03,        //   Usage (0x03) -- sequence number of the last change
+		0x75, 0x08,        //   Report Size (8)
+		0x26, 0xFF, 0x00,  //   Logical Maximum (255)
+		0xB1, 0x02,        //   Feature (Data,Var,Abs,No Wrap,Linear,Preferred State,No Null Position,Non-volatile)
+		0x09, 0x04,        //   Usage (0x04) -- changes the full report queue dropped, saturating
+		0xB1, 0x02,        //   Feature (Data,Var,Abs,No Wrap,Linear,Preferred State,No Null Position,Non-volatile)
+		0x09, 0x05,        //   Usage (0x05) -- USB frame number of the last change
+		0x75, 0x10,        //   Report Size (16)
+		0x26, 0xFF, 0x07,  //   Logical Maximum (2047)
+		0xB1, 0x02,        //   Feature (Data,Var,Abs,No Wrap,Linear,Preferred State,No Null Position,Non-volatile)
+
+		0x85, 0x04,        //   Report ID (4) -- interrupt accounting feature report, ISR_STATS in system.h
+		0x09, 0x06,        //   Usage (0x06)
+		0x75, 0x08,        //   Report Size (8)
+		0x95, 0x28,        //   Report Count (40)
+		0x26, 0xFF, 0x00,  //   Logical Maximum (255)
+		0xB1, 0x02,        //   Feature (Data,Var,Abs,No Wrap,Linear,Preferred State,No Null Position,Non-volatile)
+
+		0x85, 0x05,        //   Report ID (5) -- main loop timing feature report, LOOP_STATS in system.h
+		0x09, 0x07,        //   Usage (0x07)
+		0x75, 0x08,        //   Report Size (8)
+		0x95, 0x28,        //   Report Count (40)
+		0x26, 0xFF, 0x00,  //   Logical Maximum (255)
+		0xB1, 0x02,        //   Feature (Data,Var,Abs,No Wrap,Linear,Preferred State,No Null Position,Non-volatile)
+
+		0x85, 0x06,        //   Report ID (6) -- settings feature report, settle window in ms, tick in 200 us, debounce samples
+		0x09, 0x09,        //   Usage (0x09)
+		0x75, 0x08,        //   Report Size (8)
+		0x95, 0x03,        //   Report Count (3)
+		0x26, 0xFF, 0x00,  //   Logical Maximum (255)
+		0xB1, 0x02,        //   Feature (Data,Var,Abs,No Wrap,Linear,Preferred State,No Null Position,Non-volatile)
+
+		0x85, 0x07,        //   Report ID (7) -- bounce learning feature report, BOUNCE_STATS in system.h
+		0x09, 0x0A,        //   Usage (0x0A) -- bounce histogram, then a depth and bounce byte per switch
+		0x75, 0x08,        //   Report Size (8)
+		0x95, 0x18,        //   Report Count (24)
+		0x26, 0xFF, 0x00,  //   Logical Maximum (255)
+		0xB1, 0x02,        //   Feature (Data,Var,Abs,No Wrap,Linear,Preferred State,No Null Position,Non-volatile)
+		SWITCH_WIDE_BOUNCE
 
 		0x85, 0x02,        //   Report ID (2)
 		0x95, 0x01,        //   Report Count (1)
 		0x75, 0x08,        //   Report Size (8)
 		0x26, 0xFF, 0x00,  //   Logical Maximum (255)
 		0x15, 0x00,        //   Logical Minimum (0)
-		0x09, 0x01,        //   Usage (0x01)
+		0x09, 0x01,        //   Usage (0x01) -- command, 0x55 refresh, 0x49 heartbeat, 0x53 settle window, 0x46 settle now, 0x54 tick, 0x44 debounce, 0x50 both
+		0x91, 0x02,        //   Output (Data,Var,Abs,No Wrap,Linear,Preferred State,No Null Position)
+		0x09, 0x02,        //   Usage (0x02) -- argument, heartbeat in 4 ms units, settle window in ms, tick in 200 us or debounce samples, 0 adaptive, or tick << 4 | samples
 		0x91, 0x02,        //   Output (Data,Var,Abs,No Wrap,Linear,Preferred State,No Null Position)
 
 		0xC0              // End Collection
 
-		// 38 bytes
+		// 171 bytes, 190 with SWITCH_DESCRIPTOR_EVDEV, HID_RPT01_WIDE_SIZE more with SWITCH_BYTES > 1
 }};                  
 
 
@@ -26,6 +26,10 @@ please contact mla_licensing@microchip.com
 #include "app_device_custom_hid.h"
 
 
+// frame number of the latest SOF, taken while the SIE cannot change it under us
+volatile uint16_t usbFrameNumber;
+
+
 /*******************************************************************
  * Function:        bool USER_USB_CALLBACK_EVENT_HANDLER(
  *                        USB_EVENT event, void *pdata, uint16_t size)
@@ -55,6 +59,15 @@ bool USER_USB_CALLBACK_EVENT_HANDLER(USB_EVENT event, void *pdata, uint16_t size
             break;
 
         case EVENT_SOF:
+            usbFrameNumber = ((uint16_t)UFRMH << 8) | UFRML;
+#if (SWITCH_SAMPLE_SOF)
+            // lock the sampling tick to the frame, see system.h; only a 1 ms tick has one
+            // sample per frame to lock
+            if (sampleSettings.tickUnits == TICK_UNITS_PER_MS)
+            {
+                TMR2 = SOF_TMR2_RELOAD;
+            }
+#endif
             break;
 
         case EVENT_SUSPEND: